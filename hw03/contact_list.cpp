@@ -9,15 +9,19 @@ using namespace contact_list;
 
 bool contact_list::add(storage& contacts, std::string_view name, number_t number)
 {
-    std::vector<std::string>::iterator name_iter = std::find(contacts.names.begin(), contacts.names.end(), std::string(name));
-    if (name.empty() || name_iter != contacts.names.end())
+    if (name.empty() || contacts.name_slots.contains(name))
     {
         // empty name provided or duplicate name provided
         return false;
     }
 
+    size_t slot = contacts.names.size();
     contacts.numbers.push_back(number);
     contacts.names.push_back(std::string(name));
+
+    contacts.name_slots.emplace(contacts.names.back(), slot);
+    // a number shared by several contacts leads to the first of them
+    contacts.number_slots.try_emplace(number, slot);
     return true;
 }
 
@@ -28,15 +32,10 @@ size_t contact_list::size(const storage& contacts)
 
 number_t contact_list::get_number_by_name(storage& contacts, std::string_view name)
 {
-
-    std::string name_conver = std::string(name);
-    for (size_t i = 0; i < contacts.names.size(); ++i)
+    auto found = contacts.name_slots.find(name);
+    if (found != contacts.name_slots.end())
     {
-        // find index of matching name
-        if (name_conver == contacts.names[i])
-        {
-            return contacts.numbers[i];
-        }
+        return contacts.numbers[found->second];
     }
 
     // No contact of give name was found in the contacts list
@@ -57,51 +56,87 @@ std::string contact_list::to_string(const storage& contacts)
 
 bool contact_list::remove(storage& contacts, std::string_view name)
 {
-    std::vector<std::string>::iterator name_iter = std::find(contacts.names.begin(), contacts.names.end(), std::string(name));
-    if (name_iter != contacts.names.end())
+    auto found = contacts.name_slots.find(name);
+    if (found == contacts.name_slots.end())
     {
-        // calculate the index of the iterator
-        size_t offset = name_iter - contacts.names.begin();
-        contacts.names.erase(name_iter);
-        contacts.numbers.erase(contacts.numbers.begin() + offset);
+        // requested name was not part of the list
+        return false;
+    }
 
-        return true;
+    size_t slot = found->second;
+    number_t number = contacts.numbers[slot];
+    contacts.name_slots.erase(found);
+    contacts.names.erase(contacts.names.begin() + slot);
+    contacts.numbers.erase(contacts.numbers.begin() + slot);
+
+    // the contacts behind the removed one moved down by one slot,
+    // so are the index entries that lead to them
+    for (size_t moved = slot; moved < contacts.names.size(); ++moved)
+    {
+        contacts.name_slots.find(contacts.names[moved])->second = moved;
+        auto first = contacts.number_slots.find(contacts.numbers[moved]);
+        if (first->second == moved + 1)
+        {
+            first->second = moved;
+        }
     }
 
-    // requested name was not part of the list
-    return false;
+    // if the removed contact was the first with its number, the number
+    // now leads to the next contact with it, if there is one
+    auto by_number = contacts.number_slots.find(number);
+    if (by_number->second == slot)
+    {
+        auto next = std::find(contacts.numbers.begin() + slot, contacts.numbers.end(), number);
+        if (next == contacts.numbers.end())
+        {
+            contacts.number_slots.erase(by_number);
+        }
+        else
+        {
+            by_number->second = next - contacts.numbers.begin();
+        }
+    }
+
+    return true;
 }
 
 void contact_list::sort(storage& contacts)
 {
-    std::vector<std::pair<std::string, number_t>> zipped_contacts;
-
-    // zip contacts together
-    for (size_t i = 0; i < contacts.names.size(); ++i)
+    // sort the slots by name - names are unique, so this is the order of (name, number)
+    std::vector<size_t> order(contacts.names.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&contacts](size_t a, size_t b) {
+        return contacts.names[a] < contacts.names[b];
+    });
+
+    // move the contacts into that order, without copying the names
+    std::vector<std::string> names;
+    std::vector<number_t> numbers;
+    names.reserve(order.size());
+    numbers.reserve(order.size());
+    for (size_t slot : order)
     {
-        zipped_contacts.push_back(std::make_pair(contacts.names[i], contacts.numbers[i]));
+        names.push_back(std::move(contacts.names[slot]));
+        numbers.push_back(contacts.numbers[slot]);
     }
+    contacts.names = std::move(names);
+    contacts.numbers = std::move(numbers);
 
-    // sort by name - std::sort already has lexographic implemented
-    std::sort(zipped_contacts.begin(), zipped_contacts.end());
-
-    // unzup contacts and apply changes to original data structure
-    for (size_t i = 0; i < contacts.names.size(); ++i)
+    // the keys of the indexes stay the same, only their slots change.
+    // going backwards leaves each number with its first slot.
+    for (size_t slot = contacts.names.size(); slot-- > 0;)
     {
-        contacts.names[i] = zipped_contacts[i].first;
-        contacts.numbers[i] = zipped_contacts[i].second;
+        contacts.name_slots.find(contacts.names[slot])->second = slot;
+        contacts.number_slots.find(contacts.numbers[slot])->second = slot;
     }
 }
 
 std::string contact_list::get_name_by_number(storage& contacts, number_t number)
 {
-    for (size_t i = 0; i < contacts.numbers.size(); ++i)
+    auto found = contacts.number_slots.find(number);
+    if (found != contacts.number_slots.end())
     {
-        // find index of matching number 
-        if (number == contacts.numbers[i])
-        {
-            return contacts.names[i];
-        }
+        return contacts.names[found->second];
     }
 
     // No contact of give name was found in the contacts list
@@ -1,8 +1,10 @@
 #pragma once
 
 #include <cstdint>
+#include <functional>
 #include <string>
 #include <string_view>
+#include <unordered_map>
 #include <vector>
 #include <iomanip>
 
@@ -19,16 +21,41 @@ namespace contact_list {
 using number_t = int64_t;
 
 
+/**
+ * hash of the names in the index, which also takes a `std::string_view`.
+ * so a name can be looked up without creating a temporary `std::string`.
+ */
+struct name_hash {
+    using is_transparent = void;
+
+    size_t operator()(std::string_view name) const {
+        return std::hash<std::string_view>{}(name);
+    }
+};
+
+
 /**
  * stores contacts by saving names and numbers.
  * be careful - these vectors have to be kept in sync!
  *
+ * the two indexes find the slot of a contact in the vectors by its name
+ * or number, so lookups don't have to scan them. they are kept in sync
+ * with the vectors by all the functions below. removing a contact keeps
+ * the order of the others, so the slots behind it move down by one.
+ * that's why `remove` stays linear, unlike the lookups.
+ *
  * you may adjust this struct to store the data differently, or add index structures, ...
  * this is fine as long as the API of the functions below remains the same.
  */
 struct storage {
     std::vector<number_t> numbers;
     std::vector<std::string> names;
+
+    /** the slot of each name */
+    std::unordered_map<std::string, size_t, name_hash, std::equal_to<>> name_slots;
+
+    /** the slot of the first contact with each number, numbers may be shared */
+    std::unordered_map<number_t, size_t> number_slots;
 };
 
 
@@ -62,6 +89,8 @@ std::string to_string(const storage& contacts);
 
 /**
  * Remove a contact by name from the contact list.
+ * The other contacts keep their order, so this takes time linear in the
+ * number of contacts behind the removed one.
  */
 bool remove(storage& contacts, std::string_view name);
 
@@ -0,0 +1,312 @@
+#include "analysis.h"
+
+#include <algorithm>
+
+
+namespace vm {
+
+stack_effect get_stack_effect(opcode op) {
+    switch (op) {
+    case opcode::PRINT:      return {1, 0, 0};
+    case opcode::LOAD_CONST: return {0, 0, 1};
+    case opcode::EXIT:       return {1, 0, 0};
+    case opcode::POP:        return {1, 1, 0};
+    case opcode::ADD:        return {2, 2, 1};
+    case opcode::DIV:        return {2, 2, 1};
+    case opcode::EQ:         return {2, 2, 1};
+    case opcode::NEQ:        return {2, 2, 1};
+    case opcode::DUP:        return {1, 0, 1};
+    case opcode::JMP:        return {0, 0, 0};
+    case opcode::JMPZ:       return {1, 1, 0};
+    case opcode::WRITE:      return {1, 0, 0};
+    case opcode::WRITE_CHAR: return {1, 0, 0};
+    case opcode::LOAD:       return {1, 1, 1};
+    case opcode::STORE:      return {2, 2, 0};
+    case opcode::MEMCPY:     return {3, 3, 0};
+    case opcode::MEMSET:     return {3, 3, 0};
+    case opcode::MEMSUM:     return {2, 2, 1};
+    case opcode::MEMGROW:    return {1, 1, 1};
+    case opcode::CALL:       return {0, 0, 0};
+    case opcode::RET:        return {0, 0, 0};
+    case opcode::TAIL_CALL:  return {0, 0, 0};
+    case opcode::SPAWN:      return {0, 0, 1};
+    case opcode::JOIN:       return {1, 1, 1};
+    case opcode::ADD_IMM:    return {1, 1, 1};
+    case opcode::DIV_IMM:    return {1, 1, 1};
+    case opcode::EQ_IMM:     return {1, 1, 1};
+    case opcode::NEQ_IMM:    return {1, 1, 1};
+    case opcode::JMP_EQ:     return {2, 2, 0};
+    case opcode::JMP_NEQ:    return {2, 2, 0};
+    case opcode::DUP_JMPZ:   return {1, 0, 0};
+    case opcode::WRITE_IMM:  return {0, 0, 0};
+    case opcode::WRITE_CHAR_IMM: return {0, 0, 0};
+    case opcode::CUSTOM:     return {0, 0, 0};
+    }
+    return {0, 0, 0};
+}
+
+
+bool accesses_memory(opcode op) {
+    switch (op) {
+    case opcode::LOAD:
+    case opcode::STORE:
+    case opcode::MEMCPY:
+    case opcode::MEMSET:
+    case opcode::MEMSUM:
+    case opcode::MEMGROW:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+bool is_call(opcode op) {
+    return op == opcode::CALL or op == opcode::RET or op == opcode::TAIL_CALL;
+}
+
+
+bool is_task(opcode op) {
+    return op == opcode::SPAWN or op == opcode::JOIN;
+}
+
+
+bool code_analysis::is_stack_safe(size_t pc) const {
+    if (this->min_depth[pc] == unreachable) {
+        return false;
+    }
+    stack_effect effect = get_stack_effect(this->opcodes[pc]);
+    if (this->min_depth[pc] < effect.needs) {
+        return false;
+    }
+    if (effect.pushes > effect.pops and this->max_growth[pc] == unbounded) {
+        return false;
+    }
+    return true;
+}
+
+
+bool verify(const std::vector<opcode>& opcodes, const code_t& code) {
+    const size_t code_size = code.size();
+
+    auto in_program = [&](item_t target) {
+        return target >= 0 and static_cast<size_t>(target) < code_size;
+    };
+
+    for (size_t pc = 0; pc < code_size; pc++) {
+        const item_t next = static_cast<item_t>(pc + 1);
+        const item_t arg = code[pc].second;
+
+        switch (opcodes[pc]) {
+        case opcode::EXIT:
+        case opcode::CUSTOM:
+            break;
+        case opcode::RET:
+            // the return address is checked when running, it may come
+            // from a call of another program
+            break;
+        case opcode::JMP:
+        case opcode::CALL:
+        case opcode::TAIL_CALL:
+            // a call returns to the next pc through RET, which checks it
+            if (not in_program(arg)) {
+                return false;
+            }
+            break;
+        case opcode::JMPZ:
+        case opcode::JMP_EQ:
+        case opcode::JMP_NEQ:
+        case opcode::DUP_JMPZ:
+            if (not in_program(arg) or not in_program(next)) {
+                return false;
+            }
+            break;
+        default:
+            if (not in_program(next)) {
+                return false;
+            }
+            break;
+        }
+    }
+    return true;
+}
+
+
+code_analysis analyze(const vm_state& vm, const code_t& code) {
+    const size_t code_size = code.size();
+
+    code_analysis result;
+    result.opcodes.reserve(code_size);
+    for (const auto& [op_id, arg] : code) {
+        opcode op = opcode::CUSTOM;
+        if (op_id < vm.instructions->opcodes.size()) {
+            op = vm.instructions->opcodes[op_id];
+        }
+        result.opcodes.push_back(op);
+    }
+
+    result.verified = verify(result.opcodes, code);
+
+    result.min_depth.assign(code_size, code_analysis::unreachable);
+    result.max_growth.assign(code_size, 0);
+    if (code_size == 0) {
+        return result;
+    }
+
+    std::vector<size_t> worklist;
+    std::vector<bool> queued(code_size, false);
+
+    // merge the bounds of a control flow edge from `from` into its target
+    auto propagate = [&](size_t from, item_t target, size_t depth, ptrdiff_t growth) {
+        if (target < 0 or static_cast<size_t>(target) >= code_size) {
+            // this edge segfaults
+            return;
+        }
+        size_t pc = static_cast<size_t>(target);
+
+        // every loop has an edge back to a pc that isn't after it. if such
+        // an edge changes a bound, it goes straight to its limit, instead of
+        // going around the loop once for each item it may push or pop.
+        const bool back_edge = pc <= from;
+
+        bool changed = false;
+        if (result.min_depth[pc] == code_analysis::unreachable) {
+            result.min_depth[pc] = depth;
+            result.max_growth[pc] = growth;
+            changed = true;
+        }
+        else {
+            if (depth < result.min_depth[pc]) {
+                result.min_depth[pc] = back_edge ? 0 : depth;
+                changed = true;
+            }
+            if (growth > result.max_growth[pc]) {
+                result.max_growth[pc] = back_edge ? code_analysis::unbounded : growth;
+                changed = true;
+            }
+        }
+
+        if (changed and not queued[pc]) {
+            queued[pc] = true;
+            worklist.push_back(pc);
+        }
+    };
+
+    propagate(0, 0, 0, 0);
+
+    while (not worklist.empty()) {
+        size_t pc = worklist.back();
+        worklist.pop_back();
+        queued[pc] = false;
+
+        const opcode op = result.opcodes[pc];
+        const item_t next = static_cast<item_t>(pc + 1);
+
+        if (op == opcode::CUSTOM) {
+            // we know nothing about the stack afterwards.
+            // where it jumps to has to be checked when running.
+            propagate(pc, next, 0, code_analysis::unbounded);
+            continue;
+        }
+
+        // if the instruction doesn't throw, at least `needs` items were there.
+        stack_effect effect = get_stack_effect(op);
+        size_t depth = std::max(result.min_depth[pc], effect.needs) - effect.pops + effect.pushes;
+
+        ptrdiff_t growth = result.max_growth[pc];
+        if (growth != code_analysis::unbounded) {
+            growth += static_cast<ptrdiff_t>(effect.pushes) - static_cast<ptrdiff_t>(effect.pops);
+        }
+
+        const item_t arg = code[pc].second;
+        switch (op) {
+        case opcode::EXIT:
+        case opcode::RET:
+            // the return points are covered by their calls
+            break;
+        case opcode::JMP:
+        case opcode::TAIL_CALL:
+            propagate(pc, arg, depth, growth);
+            break;
+        case opcode::CALL:
+            // the subroutine may leave any number of items when it returns
+            propagate(pc, arg, depth, growth);
+            propagate(pc, next, 0, code_analysis::unbounded);
+            break;
+        case opcode::SPAWN:
+            // the child starts at the next pc too, with the copied items
+            propagate(pc, next, depth, growth);
+            propagate(pc, next, 0, code_analysis::unbounded);
+            break;
+        case opcode::JMPZ:
+        case opcode::JMP_EQ:
+        case opcode::JMP_NEQ:
+        case opcode::DUP_JMPZ:
+            propagate(pc, next, depth, growth);
+            propagate(pc, arg, depth, growth);
+            break;
+        default:
+            propagate(pc, next, depth, growth);
+            break;
+        }
+    }
+
+    // the deepest point is either when entering or after an instruction
+    for (size_t pc = 0; pc < code_size; pc++) {
+        if (result.min_depth[pc] == code_analysis::unreachable) {
+            continue;
+        }
+        ptrdiff_t growth = result.max_growth[pc];
+        if (growth == code_analysis::unbounded) {
+            result.stack_bounded = false;
+            continue;
+        }
+        stack_effect effect = get_stack_effect(result.opcodes[pc]);
+        ptrdiff_t after = growth + static_cast<ptrdiff_t>(effect.pushes) - static_cast<ptrdiff_t>(effect.pops);
+        result.max_stack_depth = std::max({result.max_stack_depth, growth, after});
+    }
+
+    return result;
+}
+
+
+const code_analysis* usable_analysis(const vm_state& vm, const code_t& code) {
+    const code_analysis* analysis = code.get_analysis().get();
+    if (analysis == nullptr or analysis->opcodes.size() != code.size()) {
+        return nullptr;
+    }
+
+    for (size_t pc = 0; pc < code.size(); pc++) {
+        op_id_t op_id = code[pc].first;
+        opcode op = opcode::CUSTOM;
+        if (op_id < vm.instructions->opcodes.size()) {
+            op = vm.instructions->opcodes[op_id];
+        }
+        if (op != analysis->opcodes[pc]) {
+            return nullptr;
+        }
+    }
+    return analysis;
+}
+
+
+bool enter_analyzed(vm_state& vm, const code_analysis& analysis, size_t pc) {
+    if (pc >= analysis.min_depth.size()) {
+        return false;
+    }
+
+    size_t depth = vm.stack.size();
+    if (analysis.min_depth[pc] == code_analysis::unreachable or
+        depth < analysis.min_depth[pc]) {
+        return false;
+    }
+
+    ptrdiff_t growth = analysis.max_growth[pc];
+    if (growth != code_analysis::unbounded) {
+        size_t remaining = static_cast<size_t>(analysis.max_stack_depth - growth);
+        vm.stack.reserve(depth + remaining);
+    }
+    return true;
+}
+
+} // namespace vm
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+#include "vm.h"
+
+
+namespace vm {
+
+/**
+ * how a built-in instruction changes the stack.
+ */
+struct stack_effect {
+    /** number of items that have to be on the stack for the instruction */
+    size_t needs;
+    /** number of items removed */
+    size_t pops;
+    /** number of items added */
+    size_t pushes;
+};
+
+
+/**
+ * get the stack effect of a built-in opcode.
+ * custom instructions have an unknown effect and report all zeros.
+ */
+stack_effect get_stack_effect(opcode op);
+
+
+/**
+ * does the opcode work on the vm's linear memory?
+ */
+bool accesses_memory(opcode op);
+
+
+/**
+ * is the opcode one of the subroutine instructions CALL, RET and TAIL_CALL?
+ */
+bool is_call(opcode op);
+
+
+/**
+ * is the opcode one of the task instructions SPAWN and JOIN?
+ */
+bool is_task(opcode op);
+
+
+/**
+ * results of the static analysis of a program, see `analyze`.
+ *
+ * the analysis follows all control flow edges from pc 0 and computes bounds
+ * for the stack depth when entering each instruction. these hold no matter
+ * how many items were on the stack when the program was started.
+ */
+struct code_analysis {
+    /** `min_depth` of instructions that are not reachable from pc 0 */
+    static constexpr size_t unreachable = std::numeric_limits<size_t>::max();
+
+    /** `max_growth` of instructions after which the stack can grow without limit */
+    static constexpr ptrdiff_t unbounded = std::numeric_limits<ptrdiff_t>::max();
+
+    /** the opcode of each instruction, as resolved by the analyzed vm */
+    std::vector<opcode> opcodes;
+
+    /** lower bound of the stack depth when entering each instruction */
+    std::vector<size_t> min_depth;
+
+    /**
+     * upper bound of how much the stack has grown since the program start
+     * when entering each instruction. negative if it has shrunk.
+     */
+    std::vector<ptrdiff_t> max_growth;
+
+    /**
+     * the maximum stack growth over all instructions with a bounded `max_growth`.
+     * the stack needs at most this many items more than at program start.
+     */
+    ptrdiff_t max_stack_depth = 0;
+
+    /** if false, some loop can grow the stack without limit */
+    bool stack_bounded = true;
+
+    /**
+     * true if all jump targets and fall-through edges of built-in
+     * instructions stay inside the program.
+     * then only the entry pc and the pc after custom instructions
+     * need to be bounds checked when running.
+     */
+    bool verified = false;
+
+    /**
+     * can the instruction at pc run without checking the stack for
+     * underflow and capacity?
+     */
+    bool is_stack_safe(size_t pc) const;
+};
+
+
+/**
+ * check that no built-in instruction of the program can continue outside
+ * of it, i.e. that the program can't segfault except through custom
+ * instructions or a bad entry pc.
+ *
+ * @param opcodes: the resolved opcode of each instruction
+ * @param code: the program to check
+ */
+bool verify(const std::vector<opcode>& opcodes, const code_t& code);
+
+
+/**
+ * compute the stack depth bounds of all instructions of a program,
+ * and verify its control flow edges.
+ *
+ * custom instructions may change the stack and pc arbitrarily, so the
+ * analysis assumes nothing about the stack after them. the same goes for
+ * the return point after a CALL, as subroutines may leave any number of items,
+ * and the instruction after a SPAWN, where the child starts with its own stack.
+ *
+ * @param vm: the vm which resolves the op ids to built-in opcodes
+ * @param code: the program to analyze
+ */
+code_analysis analyze(const vm_state& vm, const code_t& code);
+
+
+/**
+ * get the analysis attached to the code if it fits the vm it is run on.
+ * returns nullptr if there is none or the vm resolves an op id differently.
+ */
+const code_analysis* usable_analysis(const vm_state& vm, const code_t& code);
+
+
+/**
+ * can the analysis bounds be relied on when execution is at `pc` with
+ * the current stack depth? if so, reserve the stack capacity they need.
+ *
+ * this is the case when the program was started, and when custom
+ * instructions may have changed the stack or pc.
+ */
+bool enter_analyzed(vm_state& vm, const code_analysis& analysis, size_t pc);
+
+} // namespace vm
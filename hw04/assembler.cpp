@@ -0,0 +1,338 @@
+#include "assembler.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <istream>
+#include <memory>
+#include <new>
+#include <span>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include "analysis.h"
+
+#if defined(__unix__)
+#define VM_ASSEMBLE_FD 1
+#include <unistd.h>
+#endif
+
+
+namespace vm {
+
+namespace {
+
+bool is_blank(char c) {
+    return c == ' ' or c == '\t' or c == '\r';
+}
+
+
+/**
+ * lexes one line of the program text, without copying any of it.
+ */
+class line_lexer {
+public:
+    line_lexer(std::string_view line, size_t line_number)
+        : line{line}, line_number{line_number} {}
+
+    /** the next whitespace-separated word, empty at the end of the line */
+    std::string_view next_word() {
+        while (this->pos < this->line.size() and is_blank(this->line[this->pos])) {
+            this->pos++;
+        }
+        this->word_start = this->pos;
+        while (this->pos < this->line.size() and not is_blank(this->line[this->pos])) {
+            this->pos++;
+        }
+        return this->line.substr(this->word_start, this->pos - this->word_start);
+    }
+
+    /** the error, located at the start of the last word */
+    assembly_error error(const std::string& message) const {
+        return assembly_error{message, this->line_number, this->word_start + 1};
+    }
+
+    /** the line number, from 1 */
+    size_t line_index() const { return this->line_number; }
+
+    /** where the last word starts, from 1 */
+    size_t column() const { return this->word_start + 1; }
+
+private:
+    std::string_view line;
+    size_t line_number;
+    size_t pos = 0;
+    size_t word_start = 0;
+};
+
+
+/**
+ * is the word the name of a label? they start like C identifiers, so they
+ * can't be confused with numbers, except for the `inf` and `nan` of
+ * floating point items, which are numbers.
+ */
+template <typename T>
+bool is_label(std::string_view word) {
+    const char first = word.empty() ? '\0' : word.front();
+    if (not ((first >= 'a' and first <= 'z') or (first >= 'A' and first <= 'Z') or
+             first == '_' or first == '.')) {
+        return false;
+    }
+    if constexpr (std::is_floating_point_v<T>) {
+        T number{0};
+        auto [end, error] = std::from_chars(word.data(), word.data() + word.size(), number);
+        return error == std::errc::invalid_argument or end != word.data() + word.size();
+    }
+    return true;
+}
+
+
+/**
+ * parse an instruction argument. the whole word has to be a number.
+ */
+template <typename T>
+T parse_argument(std::string_view word, const line_lexer& lexer) {
+    const char* first = word.data();
+    const char* last = word.data() + word.size();
+    if (first != last and *first == '+') {
+        // from_chars doesn't take the sign, std::stoll did
+        first++;
+    }
+
+    T argument{0};
+    auto [end, error] = std::from_chars(first, last, argument);
+    if (error == std::errc::result_out_of_range) {
+        throw lexer.error(std::string{"argument out of range: "} + std::string{word});
+    }
+    if (error != std::errc{} or end != last) {
+        throw lexer.error(std::string{"invalid argument: "} + std::string{word});
+    }
+    return argument;
+}
+
+} // namespace
+
+
+template <vm_item T>
+void basic_program_assembler<T>::feed(std::string_view chunk) {
+    auto find_newline = [](std::string_view text) {
+        return static_cast<const char*>(std::memchr(text.data(), '\n', text.size()));
+    };
+
+    if (not this->partial.empty()) {
+        // complete the line the last chunk started
+        const char* newline = find_newline(chunk);
+        if (newline == nullptr) {
+            this->partial.append(chunk);
+            return;
+        }
+        const size_t rest = static_cast<size_t>(newline - chunk.data());
+        this->partial.append(chunk.substr(0, rest));
+        this->assemble_line(this->partial);
+        this->partial.clear();
+        chunk.remove_prefix(rest + 1);
+    }
+
+    // the lines right from the chunk, then keep the unfinished one
+    while (not chunk.empty()) {
+        const char* newline = find_newline(chunk);
+        if (newline == nullptr) {
+            this->partial.assign(chunk);
+            return;
+        }
+        const size_t line_length = static_cast<size_t>(newline - chunk.data());
+        this->assemble_line(chunk.substr(0, line_length));
+        chunk.remove_prefix(line_length + 1);
+    }
+}
+
+
+template <vm_item T>
+void basic_program_assembler<T>::assemble_line(std::string_view line) {
+    this->line_number++;
+    line_lexer lexer{line, this->line_number};
+
+    std::string_view op_name = lexer.next_word();
+    if (not op_name.empty() and op_name.back() == ':') {
+        // a label for the next instruction, which may be on this line
+        std::string_view label = op_name.substr(0, op_name.size() - 1);
+        if (not is_label<T>(label)) {
+            throw lexer.error(std::string{"invalid label: "} + std::string{label});
+        }
+        if (not this->labels.emplace(label, this->op_count).second) {
+            throw lexer.error(std::string{"duplicate label: "} + std::string{label});
+        }
+        op_name = lexer.next_word();
+    }
+    if (op_name.empty()) {
+        // blank line
+        return;
+    }
+
+    // look up instruction id, without a temporary std::string key
+    auto find_op_id = this->vm.instructions->ids.find(op_name);
+    if (find_op_id == std::end(this->vm.instructions->ids)) {
+        throw lexer.error(std::string{"unknown instruction: "} + std::string{op_name});
+    }
+    op_id_t op_id = find_op_id->second;
+
+    // only support instruction and one argument
+    T argument{0};
+    std::string_view word = lexer.next_word();
+    if (not word.empty()) {
+        if (is_label<T>(word)) {
+            // resolved at the end, the label may be defined further down
+            this->label_uses.push_back({this->op_count, std::string{word}, lexer.line_index(),
+                                        lexer.column()});
+        }
+        else {
+            argument = parse_argument<T>(word, lexer);
+        }
+
+        if (not lexer.next_word().empty()) {
+            throw lexer.error("more than one instruction argument");
+        }
+    }
+
+    if (this->op_count == this->op_capacity) {
+        this->reserve(std::max<size_t>(this->op_capacity * 2, 64));
+    }
+    new (&this->ops[this->op_count]) basic_op<T>{op_id, argument};
+    this->op_count++;
+}
+
+
+template <vm_item T>
+void basic_program_assembler<T>::reserve(size_t count) {
+    // the instructions are moved by realloc, without running their
+    // constructors. only the assignment of std::pair isn't trivial.
+    static_assert(std::is_trivially_copy_constructible_v<basic_op<T>> and
+                  std::is_trivially_destructible_v<basic_op<T>>);
+
+    if (count <= this->op_capacity) {
+        return;
+    }
+    void* memory = std::realloc(static_cast<void*>(this->ops.get()), count * sizeof(basic_op<T>));
+    if (memory == nullptr) {
+        throw std::bad_alloc{};
+    }
+    (void)this->ops.release();
+    this->ops.reset(static_cast<basic_op<T>*>(memory));
+    this->op_capacity = count;
+}
+
+
+template <vm_item T>
+basic_code<T> basic_program_assembler<T>::finish() {
+    if (not this->partial.empty()) {
+        // the last line has no newline
+        this->assemble_line(this->partial);
+        this->partial.clear();
+    }
+
+    for (const label_use& use : this->label_uses) {
+        auto found = this->labels.find(use.name);
+        if (found == std::end(this->labels)) {
+            throw assembly_error{"unknown label: " + use.name, use.line, use.column};
+        }
+        this->ops[use.pc].second = static_cast<T>(found->second);
+    }
+    this->labels.clear();
+    this->label_uses.clear();
+    this->line_number = 0;
+
+    const size_t count = std::exchange(this->op_count, 0);
+    this->op_capacity = 0;
+    if (count == 0) {
+        this->ops.reset();
+        return basic_code<T>{};
+    }
+
+    // give the spare capacity back, shrinking keeps the memory in place
+    if (void* memory = std::realloc(static_cast<void*>(this->ops.get()), count * sizeof(basic_op<T>))) {
+        (void)this->ops.release();
+        this->ops.reset(static_cast<basic_op<T>*>(memory));
+    }
+    const basic_op<T>* instructions = this->ops.get();
+    std::shared_ptr<const void> storage{this->ops.release(), free_memory{}};
+    basic_code<T> code{std::move(storage), std::span<const basic_op<T>>{instructions, count}};
+
+    if constexpr (std::is_same_v<T, item_t>) {
+        if (this->with_analysis) {
+            // so run can skip the stack checks the analysis proves unneeded
+            code.set_analysis(std::make_shared<code_analysis>(analyze(this->vm, code)));
+        }
+    }
+
+    return code;
+}
+
+template class basic_program_assembler<int32_t>;
+template class basic_program_assembler<int64_t>;
+template class basic_program_assembler<double>;
+
+
+template <vm_item T>
+basic_code<T> assemble(const basic_vm_state<T>& state, std::string_view input_program) {
+    basic_program_assembler<T> assembler{state};
+    // a guess from the size, instead of counting the lines in another pass.
+    // short instructions take about 16 characters, or the vector grows.
+    assembler.reserve(input_program.size() / 16 + 1);
+    assembler.feed(input_program);
+    return assembler.finish();
+}
+
+template basic_code<int32_t> assemble<int32_t>(const basic_vm_state<int32_t>&, std::string_view);
+template basic_code<int64_t> assemble<int64_t>(const basic_vm_state<int64_t>&, std::string_view);
+template basic_code<double> assemble<double>(const basic_vm_state<double>&, std::string_view);
+
+
+code_t assemble(const vm_state& state, std::string_view input_program) {
+    return assemble<item_t>(state, input_program);
+}
+
+
+code_t assemble(const vm_state& state, std::istream& input, size_t chunk_size, bool with_analysis) {
+    program_assembler assembler{state, with_analysis};
+    std::string chunk(std::max<size_t>(chunk_size, 1), '\0');
+    while (input) {
+        input.read(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+        assembler.feed({chunk.data(), static_cast<size_t>(input.gcount())});
+    }
+    if (input.bad()) {
+        throw std::ios_base::failure{"reading the program failed"};
+    }
+    return assembler.finish();
+}
+
+
+code_t assemble_fd(const vm_state& state, int fd, size_t chunk_size, bool with_analysis) {
+    program_assembler assembler{state, with_analysis};
+#ifdef VM_ASSEMBLE_FD
+    std::string chunk(std::max<size_t>(chunk_size, 1), '\0');
+    while (true) {
+        ssize_t count = ::read(fd, chunk.data(), chunk.size());
+        if (count < 0) {
+            int error = errno;
+            if (error == EINTR) {
+                continue;
+            }
+            throw std::system_error{error, std::generic_category(), "reading the program failed"};
+        }
+        if (count == 0) {
+            break;
+        }
+        assembler.feed({chunk.data(), static_cast<size_t>(count)});
+    }
+#else
+    (void)fd;
+    (void)chunk_size;
+    throw std::system_error{std::make_error_code(std::errc::function_not_supported),
+                            "reading the program failed"};
+#endif
+    return assembler.finish();
+}
+
+} // namespace vm
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "vm.h"
+
+
+namespace vm {
+
+/**
+ * assembles a program text that arrives in chunks, e.g. read from a file,
+ * so the whole text never has to be in memory.
+ *
+ * the complete lines of each chunk are assembled right away, only a line
+ * that continues in the next chunk is kept until then. besides the
+ * instructions, the assembler keeps the labels and their uses, which are
+ * resolved by `finish`. see `assemble` for the syntax.
+ *
+ * the instructions are kept in memory from `std::realloc`, which large
+ * buffers grow by remapping their pages instead of copying them, e.g.
+ * with glibc. `finish` shrinks it to the instructions and the code keeps
+ * it, so the code needs no more memory than its instructions.
+ *
+ * the vm has to outlive the assembler.
+ */
+template <vm_item T>
+class basic_program_assembler {
+public:
+    /**
+     * @param with_analysis: whether `finish` attaches a `code_analysis`,
+     *                       which takes about as much memory as the code
+     */
+    explicit basic_program_assembler(const basic_vm_state<T>& vm, bool with_analysis = true)
+        : vm{vm}, with_analysis{with_analysis} {}
+
+    /**
+     * assemble the lines the chunk completes.
+     * throws `assembly_error` for the first invalid line.
+     */
+    void feed(std::string_view chunk);
+
+    /**
+     * assemble the last line, resolve the labels and analyze the program
+     * if wanted. the assembler is empty afterwards.
+     *
+     * @return the assembled code
+     */
+    basic_code<T> finish();
+
+    /** make room for the instructions, if their number is known up front */
+    void reserve(size_t count);
+
+    /** number of instructions assembled so far */
+    size_t size() const { return this->op_count; }
+
+private:
+    /** a label used as instruction argument, resolved by `finish` */
+    struct label_use {
+        size_t pc;
+        std::string name;
+        size_t line;
+        size_t column;
+    };
+
+    struct free_memory {
+        void operator()(void* memory) const { std::free(memory); }
+    };
+
+    void assemble_line(std::string_view line);
+
+    const basic_vm_state<T>& vm;
+    bool with_analysis;
+
+    std::unique_ptr<basic_op<T>[], free_memory> ops;
+    size_t op_count = 0;
+    size_t op_capacity = 0;
+    std::unordered_map<std::string, size_t, string_hash, std::equal_to<>> labels;
+    std::vector<label_use> label_uses;
+
+    /** the start of a line that continues in the next chunk */
+    std::string partial;
+    size_t line_number = 0;
+};
+
+using program_assembler = basic_program_assembler<item_t>;
+
+
+/**
+ * assemble a program text read from a stream, in chunks of `chunk_size`.
+ * throws `std::ios_base::failure` if reading fails.
+ *
+ * the code is analyzed like by `assemble` of a string, which takes
+ * about 17 bytes per instruction. without `with_analysis`, the peak
+ * memory stays close to the size of the code, but `run` then checks the
+ * stack for every instruction, and the registers, native and tracing
+ * tiers interpret the code. `set_analysis` can attach one later.
+ */
+code_t assemble(const vm_state& vm, std::istream& input, size_t chunk_size = 64 * 1024,
+                bool with_analysis = true);
+
+
+/**
+ * assemble a program text read from a file descriptor until its end,
+ * in chunks of `chunk_size`. the descriptor is not closed.
+ * throws `std::system_error` if reading fails.
+ * like for streams, the code is analyzed unless `with_analysis` is false.
+ */
+code_t assemble_fd(const vm_state& vm, int fd, size_t chunk_size = 64 * 1024,
+                   bool with_analysis = true);
+
+} // namespace vm
@@ -0,0 +1,50 @@
+#include "batch.h"
+
+#include <utility>
+
+
+namespace vm {
+
+std::vector<batch_result> run_batch(work_pool& pool, const std::vector<batch_job>& jobs,
+                                    std::shared_ptr<const instruction_set> instructions) {
+    std::vector<batch_result> results(jobs.size());
+
+    // one vm per worker, so the buffers are reused across jobs
+    std::vector<vm_state> contexts;
+    contexts.reserve(pool.size());
+    for (size_t i = 0; i < pool.size(); i++) {
+        contexts.push_back(create_vm(instructions));
+    }
+
+    pool.parallel_for(jobs.size(), [&](size_t worker, size_t index) {
+        vm_state& state = contexts[worker];
+        const batch_job& job = jobs[index];
+        batch_result& result = results[index];
+
+        state.reset();
+        for (item_t item : job.input) {
+            state.stack.push(item);
+        }
+
+        try {
+            auto [value, output] = run(state, job.code);
+            result.value = value;
+            result.output = std::move(output);
+        }
+        catch (...) {
+            result.error = std::current_exception();
+        }
+    });
+
+    return results;
+}
+
+
+std::vector<batch_result> run_batch(const std::vector<batch_job>& jobs,
+                                    std::shared_ptr<const instruction_set> instructions,
+                                    size_t threads) {
+    work_pool pool{threads};
+    return run_batch(pool, jobs, std::move(instructions));
+}
+
+} // namespace vm
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "pool.h"
+#include "vm.h"
+
+
+namespace vm {
+
+/**
+ * one program to run in a batch.
+ */
+struct batch_job {
+    code_t code;
+
+    /** pushed onto the stack before the program starts, the last item on top */
+    std::vector<item_t> input;
+};
+
+
+/**
+ * what running a job resulted in.
+ */
+struct batch_result {
+    /** the top stack item when the program stopped */
+    item_t value = 0;
+
+    /** the output of the WRITE instructions */
+    std::string output;
+
+    /** the exception the program threw, nullptr if it didn't */
+    std::exception_ptr error;
+
+    /** get the value, or rethrow the exception of the job */
+    item_t get() const {
+        if (this->error) {
+            std::rethrow_exception(this->error);
+        }
+        return this->value;
+    }
+};
+
+
+/**
+ * run many independent programs in parallel.
+ *
+ * each worker of the pool reuses one vm, and with it the stack and
+ * output buffers, for all the jobs it runs.
+ *
+ * @param pool: the threads to run the jobs on
+ * @param jobs: the programs, assembled for `instructions`
+ * @param instructions: the instruction set of the vms that run the jobs
+ *
+ * @return the results, in the order of the jobs
+ */
+std::vector<batch_result> run_batch(work_pool& pool, const std::vector<batch_job>& jobs,
+                                    std::shared_ptr<const instruction_set> instructions = builtin_instructions());
+
+
+/**
+ * run many independent programs in parallel, on a pool that is only
+ * created for them, see above.
+ *
+ * @param threads: number of threads to run on, 0 for one per hardware thread
+ */
+std::vector<batch_result> run_batch(const std::vector<batch_job>& jobs,
+                                    std::shared_ptr<const instruction_set> instructions = builtin_instructions(),
+                                    size_t threads = 0);
+
+} // namespace vm
@@ -0,0 +1,816 @@
+#include "hw04.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <thread>
+#include <vector>
+
+
+namespace {
+
+/** number of calls to the global `operator new` so far */
+std::atomic<uint64_t> allocation_count{0};
+
+} // namespace
+
+
+// count the allocations, so the benchmarks can report them per run.
+// not inlined, so the compiler doesn't see new'd memory being freed.
+
+[[gnu::noinline]] void* operator new(size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* memory = std::malloc(size == 0 ? 1 : size)) {
+        return memory;
+    }
+    throw std::bad_alloc{};
+}
+
+[[gnu::noinline]] void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+[[gnu::noinline]] void operator delete(void* memory, size_t) noexcept {
+    std::free(memory);
+}
+
+
+namespace vm {
+
+/**
+ * run `body` and return how many seconds it took.
+ */
+template <typename Body>
+double measure(Body&& body) {
+    auto start = std::chrono::steady_clock::now();
+    body();
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+    return duration.count();
+}
+
+
+/**
+ * what the suite measured for one workload.
+ */
+struct measurement {
+    std::string name;
+    /** executed instructions, or assembled lines, per run */
+    uint64_t operations;
+    /** time of the fastest run */
+    double seconds;
+    /** calls to `operator new` per run */
+    double allocations;
+
+    double ns_per_op() const {
+        return this->seconds * 1e9 / static_cast<double>(this->operations);
+    }
+
+    double ops_per_second() const {
+        return static_cast<double>(this->operations) / this->seconds;
+    }
+};
+
+
+/**
+ * run `body` `runs` times, and measure the fastest run
+ * and the allocations of all of them.
+ */
+template <typename Body>
+measurement measure_runs(std::string name, uint64_t operations, int runs, Body&& body) {
+    measurement result{std::move(name), operations, std::numeric_limits<double>::max(), 0};
+    const uint64_t allocated = allocation_count.load(std::memory_order_relaxed);
+    for (int i = 0; i < runs; i++) {
+        result.seconds = std::min(result.seconds, measure(body));
+    }
+    const uint64_t total = allocation_count.load(std::memory_order_relaxed) - allocated;
+    result.allocations = static_cast<double>(total) / runs;
+    return result;
+}
+
+
+/**
+ * the canonical workloads of the suite.
+ */
+struct workload {
+    const char* name;
+    const char* program;
+};
+
+const workload suite_workloads[] = {
+    {"countdown", "LOAD_CONST 20000000\nDUP\nJMPZ 6\nLOAD_CONST -1\nADD\nJMP 1\nEXIT\n"},
+
+    // fib(91) 20000 times, a and b are kept at memory 0 and 1
+    {"fibonacci",
+     "LOAD_CONST 1\nMEMGROW\nPOP\n"
+     "LOAD_CONST 20000\n"
+     "DUP\nJMPZ 32\n"
+     "LOAD_CONST 0\nLOAD_CONST 0\nSTORE\nLOAD_CONST 1\nLOAD_CONST 1\nSTORE\n"
+     "LOAD_CONST 90\n"
+     "DUP\nJMPZ 28\n"
+     "LOAD_CONST 0\nLOAD\nLOAD_CONST 1\nLOAD\nDUP\nLOAD_CONST 0\nSTORE\n"
+     "ADD\nLOAD_CONST 1\nSTORE\n"
+     "LOAD_CONST -1\nADD\nJMP 13\n"
+     "POP\nLOAD_CONST -1\nADD\nJMP 4\n"
+     "LOAD_CONST 1\nLOAD\nEXIT\n"},
+
+    // counts the primes below 262144: composites are marked with their
+    // own value, the current prime is at memory 262144, the count after it
+    {"sieve",
+     "LOAD_CONST 513\nMEMGROW\nPOP\n"
+     "LOAD_CONST 2\n"
+     "DUP\nLOAD_CONST 262144\nNEQ\nJMPZ 40\n"
+     "DUP\nLOAD\nJMPZ 12\nJMP 37\n"
+     "DUP\nLOAD_CONST 262144\nSTORE\n"
+     "LOAD_CONST 262145\nLOAD\nLOAD_CONST 1\nADD\nLOAD_CONST 262145\nSTORE\n"
+     "DUP\nDUP\nADD\n"
+     "DUP\nLOAD_CONST 262144\nDIV\nJMPZ 29\nJMP 36\n"
+     "DUP\nDUP\nSTORE\nLOAD_CONST 262144\nLOAD\nADD\nJMP 24\n"
+     "POP\n"
+     "LOAD_CONST 1\nADD\nJMP 4\n"
+     "POP\nLOAD_CONST 262145\nLOAD\nEXIT\n"},
+
+    // numbers separated by spaces, kept by the memory sink
+    {"output",
+     "LOAD_CONST 1000000\nDUP\nJMPZ 8\nWRITE\nLOAD_CONST 32\nWRITE_CHAR\nPOP\nJMP 9\nEXIT\n"
+     "LOAD_CONST -1\nADD\nJMP 1\n"},
+};
+
+
+/**
+ * a generated assembly source with `line_count` lines of all kinds.
+ */
+std::string generate_source(size_t line_count) {
+    std::ostringstream source;
+    for (size_t line = 0; line < line_count; line++) {
+        switch (line % 6) {
+        case 0: source << "LOAD_CONST " << line * 7919 << "\n"; break;
+        case 1: source << "  DUP\n"; break;
+        case 2: source << "ADD_IMM -" << line << "\n"; break;
+        case 3: source << "JMPZ " << line / 2 << "\n"; break;
+        case 4: source << "WRITE\n"; break;
+        case 5: source << "\tPOP \n"; break;
+        }
+    }
+    return source.str();
+}
+
+
+/**
+ * run the workloads, and the assembler on a large generated source.
+ */
+std::vector<measurement> run_suite(tier execution_tier, int runs) {
+    std::vector<measurement> results;
+
+    for (const auto& [name, program] : suite_workloads) {
+        vm_state state = create_vm();
+        code_t code = optimize(state, assemble(state, program));
+
+        // count the instructions once, outside the measured runs
+        execution_profile profile;
+        run_profiled(state, code, profile);
+        uint64_t instructions = 0;
+        for (uint64_t hits : profile.hits) {
+            instructions += hits;
+        }
+
+        // warm up the buffers of the vm before measuring
+        state.reset();
+        run(state, code, execution_tier);
+        results.push_back(measure_runs(name, instructions, runs, [&] {
+            state.reset();
+            run(state, code, execution_tier);
+        }));
+    }
+
+    const size_t line_count = 300000;
+    const std::string source = generate_source(line_count);
+    vm_state state = create_vm();
+    results.push_back(measure_runs("assemble", line_count, runs, [&] {
+        assemble(state, source);
+    }));
+    // the same in chunks, as when streaming a file
+    results.push_back(measure_runs("asm_stream", line_count, runs, [&] {
+        std::istringstream input{source};
+        assemble(state, input);
+    }));
+
+    return results;
+}
+
+
+void print_suite(const std::vector<measurement>& results) {
+    std::cout << "suite:" << std::endl;
+    for (const auto& result : results) {
+        std::cout << "  " << std::left << std::setw(11) << result.name << std::right
+                  << std::setw(9) << std::fixed << std::setprecision(3) << result.seconds * 1000 << " ms"
+                  << std::setw(8) << std::setprecision(2) << result.ns_per_op() << " ns/op"
+                  << std::setw(9) << std::setprecision(1) << result.ops_per_second() / 1e6 << " Mop/s"
+                  << std::setw(9) << std::setprecision(1) << result.allocations << " allocs/run"
+                  << std::defaultfloat << std::setprecision(6) << std::endl;
+    }
+}
+
+
+/**
+ * store the results as baseline, one `name ns_per_op allocations` line each.
+ */
+void save_baseline(const std::string& path, const std::vector<measurement>& results) {
+    std::ofstream out{path};
+    if (not out) {
+        throw std::runtime_error{"can't write the baseline: " + path};
+    }
+    out << "# benchhw04 baseline: name ns/op allocations/run" << std::endl;
+    for (const auto& result : results) {
+        out << result.name << " " << result.ns_per_op() << " " << result.allocations << std::endl;
+    }
+}
+
+
+/**
+ * compare the results against a stored baseline.
+ *
+ * @param tolerance: how much slower than the baseline still passes, 0.1 is 10%
+ * @return false if a workload got slower than that, or allocates more
+ */
+bool compare_baseline(const std::string& path, const std::vector<measurement>& results,
+                      double tolerance) {
+    std::ifstream in{path};
+    if (not in) {
+        throw std::runtime_error{"can't read the baseline: " + path};
+    }
+    std::map<std::string, std::pair<double, double>> baseline;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() or line[0] == '#') {
+            continue;
+        }
+        std::istringstream fields{line};
+        std::string name;
+        double ns_per_op, allocations;
+        if (fields >> name >> ns_per_op >> allocations) {
+            baseline[name] = {ns_per_op, allocations};
+        }
+    }
+
+    bool passed = true;
+    std::cout << "against " << path << " (tolerance " << tolerance * 100 << "%):" << std::endl;
+    for (const auto& result : results) {
+        auto entry = baseline.find(result.name);
+        if (entry == std::end(baseline)) {
+            std::cout << "  " << result.name << ": not in the baseline" << std::endl;
+            continue;
+        }
+        const auto [ns_per_op, allocations] = entry->second;
+        const double ratio = result.ns_per_op() / ns_per_op;
+        const bool slower = ratio > 1 + tolerance;
+        const bool allocates = result.allocations > allocations;
+        passed = passed and not slower and not allocates;
+
+        std::cout << "  " << result.name << ": " << std::fixed << std::setprecision(2)
+                  << ratio << "x time" << std::defaultfloat << std::setprecision(6);
+        if (slower) {
+            std::cout << " REGRESSION";
+        }
+        if (allocates) {
+            std::cout << ", " << result.allocations << " allocs/run instead of "
+                      << allocations << " REGRESSION";
+        }
+        std::cout << std::endl;
+    }
+    return passed;
+}
+
+
+/**
+ * programs per second of the batch executor against a serial loop.
+ */
+void bench_batch(size_t job_count) {
+    vm_state state = create_vm();
+
+    // counts down from its input, so the jobs take different times
+    code_t code = assemble(state,
+                           "DUP\n"
+                           "JMPZ 6\n"
+                           "LOAD_CONST -1\n"
+                           "ADD\n"
+                           "JMP 0\n"
+                           "EXIT\n"
+                           "LOAD_CONST 1\n"
+                           "EXIT\n");
+
+    std::vector<batch_job> jobs;
+    jobs.reserve(job_count);
+    for (size_t i = 0; i < job_count; i++) {
+        jobs.push_back({code, {static_cast<item_t>(i % 2000)}});
+    }
+
+    double serial = measure([&] {
+        for (const auto& job : jobs) {
+            state.reset();
+            state.stack.push(job.input[0]);
+            run(state, job.code);
+        }
+    });
+    std::cout << "batch: " << job_count << " jobs" << std::endl;
+    std::cout << "  serial loop:  " << static_cast<double>(job_count) / serial << " programs/s" << std::endl;
+
+    const size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        work_pool pool{threads};
+        double parallel = measure([&] {
+            run_batch(pool, jobs);
+        });
+        std::cout << "  " << threads << " threads:" << (threads < 10 ? "    " : "   ")
+                  << static_cast<double>(job_count) / parallel << " programs/s"
+                  << " (" << serial / parallel << "x)" << std::endl;
+    }
+}
+
+
+
+/**
+ * scaling of a divide and conquer program over the workers of `run_parallel`.
+ */
+void bench_tasks(int n) {
+    vm_state state = create_vm();
+
+    // fib(n), with both recursive calls in child tasks, see `run_parallel`
+    code_t code = assemble(state,
+                           "LOAD_CONST " + std::to_string(n) + "\n"
+                           "CALL fib\n"
+                           "EXIT\n"
+                           "fib: DUP\n"
+                           "JMPZ leaf\n"
+                           "DUP\n"
+                           "LOAD_CONST 1\n"
+                           "EQ\n"
+                           "JMPZ split\n"
+                           "leaf: RET\n"
+                           "split: SPAWN 1\n"
+                           "JMPZ first\n"
+                           "SPAWN 1\n"
+                           "JMPZ second\n"
+                           "POP\n"
+                           "LOAD_CONST 1\n"
+                           "JOIN\n"
+                           "LOAD_CONST 2\n"
+                           "JOIN\n"
+                           "ADD\n"
+                           "RET\n"
+                           "first: LOAD_CONST -1\n"
+                           "ADD\n"
+                           "CALL fib\n"
+                           "EXIT\n"
+                           "second: LOAD_CONST -2\n"
+                           "ADD\n"
+                           "CALL fib\n"
+                           "EXIT\n");
+
+    // every call but the leaves spawns two tasks, 2 * (fib(n + 1) - 1) in all
+    uint64_t fib = 0;
+    uint64_t next = 1;
+    for (int i = 0; i <= n; i++) {
+        fib = std::exchange(next, fib + next);
+    }
+    const uint64_t task_count = 2 * (fib - 1);
+
+    std::cout << "tasks: fib(" << n << "), " << task_count << " tasks" << std::endl;
+    double single = 0;
+    const size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        work_pool pool{threads};
+        double parallel = measure([&] {
+            state.reset();
+            run_parallel(pool, state, code);
+        });
+        if (threads == 1) {
+            single = parallel;
+        }
+        std::cout << "  " << threads << " threads:" << (threads < 10 ? "    " : "   ")
+                  << static_cast<double>(task_count) / parallel << " tasks/s"
+                  << " (" << single / parallel << "x)" << std::endl;
+    }
+}
+
+
+/**
+ * time of the execution tiers on sample programs, best of a few runs.
+ */
+void bench_tiers() {
+    struct sample {
+        const char* name;
+        const char* program;
+    };
+    const sample samples[] = {
+        {"countdown", "LOAD_CONST 20000000\nDUP\nJMPZ 6\nLOAD_CONST -1\nADD\nJMP 1\nEXIT\n"},
+        // computes 3 * i / 2 for a counting down i, with copies of the counter
+        {"arithmetic",
+         "LOAD_CONST 0\nLOAD_CONST 5000000\n"
+         "DUP\nJMPZ 17\nDUP\nDUP\nDUP\nADD\nADD\nLOAD_CONST 2\nDIV\n"
+         "LOAD_CONST -1\nADD\nPOP\nLOAD_CONST -1\nADD\nJMP 2\nPOP\nEXIT\n"},
+        {"output", "LOAD_CONST 2000000\nDUP\nJMPZ 8\nWRITE\nLOAD_CONST 32\nWRITE_CHAR\nPOP\nJMP 9\nEXIT\nLOAD_CONST -1\nADD\nJMP 1\n"},
+    };
+    const std::pair<tier, const char*> tiers[] = {
+        {tier::stack, "stack"},
+        {tier::top_cached, "top_cached"},
+        {tier::registers, "registers"},
+        {tier::native, "native"},
+        {tier::tracing, "tracing"},
+    };
+
+    std::cout << "tiers:" << std::endl;
+    for (const auto& [name, program] : samples) {
+        vm_state state = create_vm();
+        state.output = std::make_unique<discard_sink>();
+        code_t code = optimize(state, assemble(state, program));
+
+        std::cout << "  " << name << ":" << std::endl;
+        double stack_time = 0;
+        for (const auto& [execution_tier, tier_name] : tiers) {
+            double best = std::numeric_limits<double>::max();
+            for (int i = 0; i < 3; i++) {
+                state.reset();
+                best = std::min(best, measure([&] { run(state, code, execution_tier); }));
+            }
+            if (execution_tier == tier::stack) {
+                stack_time = best;
+            }
+            std::cout << "    " << tier_name << ": " << best * 1000 << " ms"
+                      << " (" << stack_time / best << "x)" << std::endl;
+        }
+    }
+}
+
+
+
+/**
+ * variants of a program run from a warmed vm, forked from a snapshot
+ * against rerunning the setup for each of them.
+ */
+void bench_fork(size_t variant_count) {
+    vm_state state = create_vm();
+
+    // the setup counts down and exits, each variant then continues at pc 7
+    // with its own item on the stack
+    code_t code = assemble(state,
+                           "LOAD_CONST 200000\n"
+                           "DUP\n"
+                           "JMPZ 6\n"
+                           "LOAD_CONST -1\n"
+                           "ADD\n"
+                           "JMP 1\n"
+                           "EXIT\n"
+                           "ADD\n"
+                           "WRITE\n"
+                           "EXIT\n");
+    const size_t variant_pc = 7;
+
+    auto run_variant = [&](vm_state& vm, size_t variant) {
+        vm.stack.push(static_cast<item_t>(variant));
+        vm.pc = variant_pc;
+        run(vm, code);
+    };
+
+    double rerun = measure([&] {
+        for (size_t variant = 0; variant < variant_count; variant++) {
+            state.reset();
+            run(state, code);
+            run_variant(state, variant);
+        }
+    });
+
+    double forked = measure([&] {
+        state.reset();
+        run(state, code);
+        vm_snapshot warm{state};
+        for (size_t variant = 0; variant < variant_count; variant++) {
+            vm_state vm = warm.fork();
+            run_variant(vm, variant);
+        }
+    });
+
+    std::cout << "fork: " << variant_count << " variants" << std::endl;
+    std::cout << "  rerun setup:  " << rerun * 1000 << " ms" << std::endl;
+    std::cout << "  fork warmed:  " << forked * 1000 << " ms"
+              << " (" << rerun / forked << "x)" << std::endl;
+}
+
+
+
+/**
+ * summing up an array in memory with a LOAD loop against one MEMSUM.
+ */
+void bench_memory() {
+    vm_state state = create_vm();
+
+    // the loop keeps the sum in memory behind the array
+    code_t element_loop = optimize(state, assemble(state,
+                                                   "LOAD_CONST 524288\n"
+                                                   "loop: DUP\nJMPZ done\nLOAD_CONST -1\nADD\n"
+                                                   "DUP\nLOAD\nLOAD_CONST 524288\nLOAD\nADD\n"
+                                                   "LOAD_CONST 524288\nSTORE\nJMP loop\n"
+                                                   "done: LOAD_CONST 524288\nLOAD\nEXIT\n"));
+    code_t bulk = assemble(state, "LOAD_CONST 0\nLOAD_CONST 524288\nMEMSUM\nEXIT\n");
+
+    auto best_of = [&](const code_t& code) {
+        double best = std::numeric_limits<double>::max();
+        for (int i = 0; i < 3; i++) {
+            // filled, so the loads read written pages instead of the shared zeroed page
+            state.reset();
+            state.memory.grow(1025);
+            state.memory.fill(0, 1, 524288);
+            best = std::min(best, measure([&] { run(state, code); }));
+        }
+        return best;
+    };
+
+    double loop_time = best_of(element_loop);
+    double bulk_time = best_of(bulk);
+    std::cout << "memory: sum of 524288 items" << std::endl;
+    std::cout << "  LOAD loop:  " << loop_time * 1000 << " ms" << std::endl;
+    std::cout << "  MEMSUM:     " << bulk_time * 1000 << " ms"
+              << " (" << loop_time / bulk_time << "x)" << std::endl;
+}
+
+
+
+/**
+ * resubmitting the suite's programs, assembled each time
+ * against looked up in a `code_cache`.
+ */
+void bench_cache(size_t submission_count) {
+    vm_state state = create_vm();
+    code_cache cache{64};
+
+    double assembled = measure([&] {
+        for (size_t i = 0; i < submission_count; i++) {
+            assemble(state, suite_workloads[i % std::size(suite_workloads)].program);
+        }
+    });
+    double cached = measure([&] {
+        for (size_t i = 0; i < submission_count; i++) {
+            cache.get(state, suite_workloads[i % std::size(suite_workloads)].program);
+        }
+    });
+
+    std::cout << "cache: " << submission_count << " submissions" << std::endl;
+    std::cout << "  assemble:  " << assembled * 1000 << " ms" << std::endl;
+    std::cout << "  cached:    " << cached * 1000 << " ms"
+              << " (" << assembled / cached << "x, "
+              << cache.hits() << " hits, " << cache.misses() << " misses)" << std::endl;
+}
+
+
+
+/**
+ * the execution loop the vm started with: look up the action of each
+ * instruction by its op id and call it. the reference of `bench_dispatch`.
+ */
+item_t run_by_lookup(vm_state& vm, const code_t& code) {
+    while (true) {
+        const auto& [op_id, arg] = code[vm.pc];
+        vm.pc += 1;
+
+        auto action = vm.instructions->actions.find(op_id);
+        if (action == std::end(vm.instructions->actions)) {
+            throw invalid_instruction{"unknown op id: " + std::to_string(op_id)};
+        }
+        if (not action->second(vm, arg)) {
+            break;
+        }
+        if (vm.pc >= code.size()) {
+            throw vm_segfault{std::string{"Invalid instruction address."}};
+        }
+    }
+    return vm.stack.top();
+}
+
+
+/**
+ * the loop of `run` against the original lookup of each instruction's
+ * action, on a countdown of unoptimized instructions.
+ * the reference already uses today's stack, which is faster than the
+ * original one, so the speedup is rather underestimated.
+ */
+void bench_dispatch() {
+    vm_state state = create_vm();
+    const code_t code = assemble(state,
+                                 "LOAD_CONST 5000000\nDUP\nJMPZ 6\n"
+                                 "LOAD_CONST -1\nADD\nJMP 1\nEXIT\n");
+
+    auto best_of = [&](auto&& execute) {
+        double best = std::numeric_limits<double>::max();
+        for (int i = 0; i < 5; i++) {
+            state.reset();
+            best = std::min(best, measure(execute));
+        }
+        return best;
+    };
+    const double lookup = best_of([&] { run_by_lookup(state, code); });
+    const double plain = best_of([&] { run(state, code, tier::stack); });
+    const double threaded = best_of([&] { run(state, code); });
+
+    std::cout << "dispatch: countdown of 5000000" << std::endl;
+    std::cout << "  lookup:   " << lookup * 1000 << " ms" << std::endl;
+    std::cout << "  switch:   " << plain * 1000 << " ms (" << lookup / plain << "x)" << std::endl;
+    std::cout << "  run:      " << threaded * 1000 << " ms (" << lookup / threaded << "x)" << std::endl;
+}
+
+
+/**
+ * the plain execution loop against the one that keeps the top item
+ * cached, on loops of unfused arithmetic and comparison instructions.
+ */
+void bench_top_cached() {
+    struct sample {
+        const char* name;
+        const char* program;
+    };
+    const sample samples[] = {
+        // 4 * i / 3 for a counting down i
+        {"arithmetic",
+         "LOAD_CONST 5000000\nDUP\nJMPZ 14\n"
+         "DUP\nDUP\nADD\nDUP\nADD\nLOAD_CONST 3\nDIV\nPOP\n"
+         "LOAD_CONST -1\nADD\nJMP 1\nEXIT\n"},
+        // (i != 7) == (i != 7), i == i
+        {"comparison",
+         "LOAD_CONST 5000000\nDUP\nJMPZ 16\n"
+         "DUP\nLOAD_CONST 7\nNEQ\nDUP\nEQ\nPOP\nDUP\nDUP\nEQ\nPOP\n"
+         "LOAD_CONST -1\nADD\nJMP 1\nEXIT\n"},
+    };
+
+    std::cout << "top of stack caching:" << std::endl;
+    for (const auto& [name, program] : samples) {
+        vm_state state = create_vm();
+        code_t code = assemble(state, program);
+
+        double times[2];
+        const tier loops[2] = {tier::stack, tier::top_cached};
+        for (size_t loop = 0; loop < 2; loop++) {
+            times[loop] = std::numeric_limits<double>::max();
+            for (int i = 0; i < 5; i++) {
+                state.reset();
+                times[loop] = std::min(times[loop], measure([&] { run(state, code, loops[loop]); }));
+            }
+        }
+        std::cout << "  " << name << ": plain " << times[0] * 1000 << " ms, cached "
+                  << times[1] * 1000 << " ms (" << times[0] / times[1] << "x)" << std::endl;
+    }
+}
+
+
+/**
+ * the same programs in vms of different item types, all with the loop of
+ * `run_static`, so only the item type differs.
+ */
+template <typename T>
+void bench_item_type(const char* type_name) {
+    basic_vm_state<T> state = create_vm<T>();
+    const basic_code<T> countdown = assemble(state,
+                                             "LOAD_CONST 5000000\nDUP\nJMPZ 6\n"
+                                             "LOAD_CONST -1\nADD\nJMP 1\nEXIT\n");
+    // adds up 2 MiB of memory 16 times, i.e. twice as many items for 32 bit types
+    const size_t items = (size_t{2} << 20) / sizeof(T);
+    // filled first, so the sums read written pages instead of the shared zeroed page
+    std::string sums = "LOAD_CONST " + std::to_string(items / linear_memory<T>::page_size) + "\nMEMGROW\n"
+                       "LOAD_CONST 0\nLOAD_CONST 1\nLOAD_CONST " + std::to_string(items) + "\nMEMSET\n";
+    for (int i = 0; i < 16; i++) {
+        sums += "LOAD_CONST 0\nLOAD_CONST " + std::to_string(items) + "\nMEMSUM\nADD\n";
+    }
+    const basic_code<T> bulk = assemble(state, sums + "EXIT\n");
+
+    auto best_of = [&](const basic_code<T>& code) {
+        double best = std::numeric_limits<double>::max();
+        for (int i = 0; i < 5; i++) {
+            state.reset();
+            best = std::min(best, measure([&] { run_static<basic_builtin_set<T>>(state, code); }));
+        }
+        return best;
+    };
+
+    std::cout << "  " << type_name << ": countdown " << best_of(countdown) * 1000 << " ms, "
+              << "16 MEMSUM of 2 MiB " << best_of(bulk) * 1000 << " ms" << std::endl;
+}
+
+
+void bench_item_types() {
+    std::cout << "item types:" << std::endl;
+    bench_item_type<int32_t>("int32");
+    bench_item_type<int64_t>("int64");
+    bench_item_type<double>("double");
+}
+
+} // namespace vm
+
+
+/**
+ * usage: benchhw04 [options]
+ *
+ *   --suite            only run the workload suite, e.g. for regression checks
+ *   --tier name        run the suite with stack, top_cached (the default,
+ *                      as with `run`), registers, native or tracing
+ *   --runs n           measure the fastest of n runs, 5 by default
+ *   --save path        store the suite results as baseline
+ *   --compare path     compare the suite against a baseline, exits with 1
+ *                      if a workload regressed
+ *   --tolerance x      how much slower passes the comparison, 0.1 by default
+ *   --jobs n           number of batch jobs, 20000 by default
+ */
+int main(int argc, char** argv) {
+    size_t job_count = 20000;
+    bool suite_only = false;
+    vm::tier execution_tier = vm::tier::top_cached;
+    int runs = 5;
+    std::string save_path;
+    std::string compare_path;
+    double tolerance = 0.1;
+
+    const std::pair<std::string_view, vm::tier> tier_names[] = {
+        {"stack", vm::tier::stack},
+        {"top_cached", vm::tier::top_cached},
+        {"registers", vm::tier::registers},
+        {"native", vm::tier::native},
+        {"tracing", vm::tier::tracing},
+    };
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            const std::string_view option = argv[i];
+            auto value = [&] {
+                if (i + 1 >= argc) {
+                    throw std::runtime_error{"missing value of " + std::string{option}};
+                }
+                return std::string{argv[++i]};
+            };
+
+            if (option == "--suite") {
+                suite_only = true;
+            }
+            else if (option == "--tier") {
+                const std::string name = value();
+                auto found = std::find_if(std::begin(tier_names), std::end(tier_names),
+                                          [&](const auto& entry) { return entry.first == name; });
+                if (found == std::end(tier_names)) {
+                    throw std::runtime_error{"unknown tier: " + name};
+                }
+                execution_tier = found->second;
+            }
+            else if (option == "--runs") {
+                runs = std::max(1, std::stoi(value()));
+            }
+            else if (option == "--save") {
+                save_path = value();
+            }
+            else if (option == "--compare") {
+                compare_path = value();
+            }
+            else if (option == "--tolerance") {
+                tolerance = std::stod(value());
+            }
+            else if (option == "--jobs") {
+                job_count = std::stoul(value());
+            }
+            else {
+                throw std::runtime_error{"unknown option: " + std::string{option}};
+            }
+        }
+
+        const std::vector<vm::measurement> results = vm::run_suite(execution_tier, runs);
+        vm::print_suite(results);
+        if (not save_path.empty()) {
+            vm::save_baseline(save_path, results);
+        }
+        if (not compare_path.empty() and
+            not vm::compare_baseline(compare_path, results, tolerance)) {
+            return 1;
+        }
+    }
+    catch (std::exception& err) {
+        std::cerr << err.what() << std::endl;
+        return 2;
+    }
+
+    if (not suite_only) {
+        vm::bench_dispatch();
+        vm::bench_batch(job_count);
+        vm::bench_tasks(22);
+        vm::bench_tiers();
+        vm::bench_top_cached();
+        vm::bench_item_types();
+        vm::bench_fork(200);
+        vm::bench_memory();
+        vm::bench_cache(100000);
+    }
+    return 0;
+}
@@ -0,0 +1,296 @@
+#include "bytecode.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "analysis.h"
+
+#if defined(__unix__)
+#define VM_BYTECODE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+namespace vm {
+
+namespace {
+
+/**
+ * the start of each bytecode file.
+ * it is followed by the name table and the instructions.
+ */
+struct file_header {
+    char magic[4];
+    uint16_t version;
+    /** `byte_order_mark` as the saving machine stores it */
+    uint16_t byte_order;
+    uint32_t name_count;
+    uint32_t reserved;
+    /** size of the name table in bytes, including its padding */
+    uint64_t names_size;
+    uint64_t instruction_count;
+};
+
+static_assert(sizeof(file_header) == 32);
+static_assert(std::is_standard_layout_v<file_header>);
+
+/**
+ * each name table entry is the op id and the name length as `uint64_t`,
+ * then the name, padded to a multiple of `entry_alignment`.
+ */
+constexpr size_t entry_alignment = 8;
+
+/**
+ * the instructions are stored as `op_t`, starting at a multiple of this,
+ * so a mapped file can be accessed directly.
+ */
+constexpr size_t section_alignment = 16;
+
+static_assert(sizeof(op_t) == 16 and alignof(op_t) <= section_alignment);
+static_assert(std::is_standard_layout_v<op_t>);
+
+constexpr uint16_t byte_order_mark = 0x0102;
+
+
+constexpr size_t padded(size_t size, size_t alignment) {
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+
+/**
+ * reads fixed-size values from the file with bounds checks.
+ */
+class reader {
+public:
+    explicit reader(std::string_view data) : data{data} {}
+
+    template <typename T>
+    T read() {
+        T value;
+        std::memcpy(&value, this->take(sizeof(T)), sizeof(T));
+        return value;
+    }
+
+    const char* take(size_t count) {
+        if (count > this->data.size() - this->pos) {
+            throw bytecode_error{"bytecode is truncated"};
+        }
+        const char* start = this->data.data() + this->pos;
+        this->pos += count;
+        return start;
+    }
+
+    void skip_to(size_t position) {
+        if (position > this->data.size()) {
+            throw bytecode_error{"bytecode is truncated"};
+        }
+        this->pos = position;
+    }
+
+    size_t position() const { return this->pos; }
+
+private:
+    std::string_view data;
+    size_t pos = 0;
+};
+
+
+/**
+ * resolve the bytecode against the vm.
+ *
+ * if `storage` keeps `data` alive and the vm assigns the same op ids,
+ * the code refers to the instructions in `data` directly.
+ */
+code_t parse(const vm_state& vm, std::string_view data, std::shared_ptr<const void> storage) {
+    reader in{data};
+
+    const auto header = in.read<file_header>();
+    if (std::string_view{header.magic, sizeof(header.magic)} != bytecode::magic) {
+        throw bytecode_error{"not a bytecode file"};
+    }
+    if (header.version != bytecode::version) {
+        throw bytecode_error{"unsupported bytecode version: " + std::to_string(header.version)};
+    }
+    if (header.byte_order != byte_order_mark) {
+        throw bytecode_error{"bytecode was saved with a different byte order"};
+    }
+
+    const size_t names_start = in.position();
+    if (header.names_size > data.size() - names_start) {
+        throw bytecode_error{"bytecode is truncated"};
+    }
+    const size_t names_end = names_start + header.names_size;
+
+    // file op id -> op id of this vm
+    std::unordered_map<op_id_t, op_id_t> op_ids;
+    bool same_op_ids = true;
+
+    for (uint32_t i = 0; i < header.name_count; i++) {
+        const auto op_id = static_cast<op_id_t>(in.read<uint64_t>());
+        const auto length = in.read<uint64_t>();
+        if (length > names_end - std::min(names_end, in.position())) {
+            throw bytecode_error{"bytecode name table is corrupt"};
+        }
+        const std::string name{in.take(length), length};
+        in.skip_to(names_start + padded(in.position() - names_start, entry_alignment));
+
+        auto find_op_id = vm.instructions->ids.find(name);
+        if (find_op_id == std::end(vm.instructions->ids)) {
+            throw invalid_instruction{std::string{"unknown instruction: "} + name};
+        }
+        op_ids[op_id] = find_op_id->second;
+        same_op_ids = same_op_ids and op_id == find_op_id->second;
+    }
+    if (in.position() > names_end) {
+        throw bytecode_error{"bytecode name table is corrupt"};
+    }
+
+    const size_t instructions_start = names_end;
+    if (instructions_start % section_alignment != 0 or
+        header.instruction_count != (data.size() - instructions_start) / sizeof(op_t) or
+        (data.size() - instructions_start) % sizeof(op_t) != 0) {
+        throw bytecode_error{"bytecode instructions are corrupt"};
+    }
+    const size_t instruction_count = static_cast<size_t>(header.instruction_count);
+    const char* instructions = data.data() + instructions_start;
+
+    code_t code;
+    if (storage and same_op_ids and
+        reinterpret_cast<uintptr_t>(instructions) % alignof(op_t) == 0) {
+        std::span<const op_t> ops{reinterpret_cast<const op_t*>(instructions), instruction_count};
+        for (const auto& [op_id, arg] : ops) {
+            if (not op_ids.contains(op_id)) {
+                throw bytecode_error{"instruction op id is missing in the name table"};
+            }
+        }
+        code = code_t{std::move(storage), ops};
+    }
+    else {
+        std::vector<op_t> ops;
+        ops.reserve(instruction_count);
+        in.skip_to(instructions_start);
+        for (size_t i = 0; i < instruction_count; i++) {
+            const auto op_id = static_cast<op_id_t>(in.read<uint64_t>());
+            const auto arg = in.read<item_t>();
+
+            auto find_op_id = op_ids.find(op_id);
+            if (find_op_id == std::end(op_ids)) {
+                throw bytecode_error{"instruction op id is missing in the name table"};
+            }
+            ops.emplace_back(find_op_id->second, arg);
+        }
+        code = code_t{std::move(ops)};
+    }
+
+    code.set_analysis(std::make_shared<code_analysis>(analyze(vm, code)));
+    return code;
+}
+
+} // namespace
+
+
+void save_code(const vm_state& vm, const code_t& code, std::ostream& out) {
+    std::vector<op_id_t> used_op_ids;
+    for (const auto& [op_id, arg] : code) {
+        used_op_ids.push_back(op_id);
+    }
+    std::sort(used_op_ids.begin(), used_op_ids.end());
+    used_op_ids.erase(std::unique(used_op_ids.begin(), used_op_ids.end()), used_op_ids.end());
+
+    std::string names;
+    for (op_id_t op_id : used_op_ids) {
+        auto find_name = vm.instructions->names.find(op_id);
+        if (find_name == std::end(vm.instructions->names)) {
+            throw invalid_instruction{std::string{"unknown op id: "} + std::to_string(op_id)};
+        }
+        const std::string& name = find_name->second;
+
+        const uint64_t entry[2] = {static_cast<uint64_t>(op_id), name.size()};
+        names.append(reinterpret_cast<const char*>(entry), sizeof(entry));
+        names.append(name);
+        names.resize(padded(names.size(), entry_alignment), '\0');
+    }
+    names.resize(padded(sizeof(file_header) + names.size(), section_alignment) - sizeof(file_header), '\0');
+
+    file_header header{};
+    std::memcpy(header.magic, bytecode::magic.data(), sizeof(header.magic));
+    header.version = bytecode::version;
+    header.byte_order = byte_order_mark;
+    header.name_count = static_cast<uint32_t>(used_op_ids.size());
+    header.names_size = names.size();
+    header.instruction_count = code.size();
+
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(names.data(), static_cast<std::streamsize>(names.size()));
+    out.write(reinterpret_cast<const char*>(code.begin()),
+              static_cast<std::streamsize>(code.size() * sizeof(op_t)));
+    if (not out) {
+        throw bytecode_error{"writing the bytecode failed"};
+    }
+}
+
+
+void save_code(const vm_state& vm, const code_t& code, const std::string& path) {
+    std::ofstream out{path, std::ios::binary | std::ios::trunc};
+    if (not out) {
+        throw bytecode_error{"can't open for writing: " + path};
+    }
+    save_code(vm, code, out);
+}
+
+
+code_t load_code(const vm_state& vm, std::istream& in) {
+    std::string data{std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+    return parse(vm, data, nullptr);
+}
+
+
+code_t load_code(const vm_state& vm, const std::string& path) {
+#ifdef VM_BYTECODE_MMAP
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw bytecode_error{"can't open: " + path};
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 or info.st_size <= 0) {
+        close(fd);
+        throw bytecode_error{"can't read: " + path};
+    }
+    const auto size = static_cast<size_t>(info.st_size);
+    void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        throw bytecode_error{"can't map: " + path};
+    }
+
+    // unmapped once neither the code nor any copy of it uses it anymore
+    std::shared_ptr<const void> storage{mapped, [size](const void* memory) {
+        munmap(const_cast<void*>(memory), size);
+    }};
+    return parse(vm, std::string_view{static_cast<const char*>(mapped), size}, std::move(storage));
+#else
+    std::ifstream in{path, std::ios::binary};
+    if (not in) {
+        throw bytecode_error{"can't open: " + path};
+    }
+    return load_code(vm, in);
+#endif
+}
+
+
+bool is_bytecode_file(const std::string& path) {
+    std::ifstream in{path, std::ios::binary};
+    char start[bytecode::magic.size()];
+    return in.read(start, sizeof(start)) and std::string_view{start, sizeof(start)} == bytecode::magic;
+}
+
+} // namespace vm
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <iosfwd>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include "vm.h"
+
+
+namespace vm {
+
+/**
+ * binary program files, so programs don't have to be assembled again
+ * on every start.
+ *
+ * the file has a header, a table with the name of each op id the program
+ * uses, and the instructions as they are stored in `code_t`.
+ * when loading, the names are resolved against the vm. if it assigns the
+ * same op ids as the vm the file was saved with, which is the case for
+ * vms created the same way, the instructions are used right from the
+ * mapped file without copying them.
+ */
+namespace bytecode {
+
+/** the first bytes of each bytecode file */
+constexpr std::string_view magic{"VMBC", 4};
+
+/** the format version, files of other versions are rejected */
+constexpr uint16_t version = 1;
+
+} // namespace bytecode
+
+
+/**
+ * write a program in the bytecode format.
+ *
+ * @param vm: the vm the program was assembled for, which resolves the op ids to names
+ * @param code: the program to save
+ * @param out: where to write the file to, should be opened in binary mode
+ */
+void save_code(const vm_state& vm, const code_t& code, std::ostream& out);
+
+
+/**
+ * write a program to a bytecode file, see above.
+ */
+void save_code(const vm_state& vm, const code_t& code, const std::string& path);
+
+
+/**
+ * read a program in the bytecode format from a stream.
+ * the instructions are copied, use the file overload to avoid that.
+ *
+ * @param vm: which vm to resolve the instruction names with
+ * @param in: where to read the file from, should be opened in binary mode
+ *
+ * @return the program, analyzed for `vm`
+ */
+code_t load_code(const vm_state& vm, std::istream& in);
+
+
+/**
+ * map a bytecode file into memory and load the program from it.
+ * the mapping stays alive as long as the code uses it.
+ *
+ * @param vm: which vm to resolve the instruction names with
+ * @param path: the file to load
+ *
+ * @return the program, analyzed for `vm`
+ */
+code_t load_code(const vm_state& vm, const std::string& path);
+
+
+/**
+ * does the file start like a bytecode file?
+ */
+bool is_bytecode_file(const std::string& path);
+
+
+/**
+ * exception thrown when a bytecode file can't be read or written,
+ * or is not in the expected format.
+ */
+struct bytecode_error : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+} // namespace vm
@@ -0,0 +1,87 @@
+#include "cache.h"
+
+#include <algorithm>
+#include <functional>
+
+
+namespace vm {
+
+code_cache::code_cache(size_t capacity, size_t shard_count)
+    :
+    total_capacity{std::max<size_t>(capacity, 1)},
+    shards(std::clamp<size_t>(shard_count, 1, this->total_capacity)) {
+
+    // the first shards keep one more, for what doesn't divide evenly
+    const size_t share = this->total_capacity / this->shards.size();
+    const size_t rest = this->total_capacity % this->shards.size();
+    for (size_t index = 0; index < this->shards.size(); index++) {
+        this->shards[index].capacity = share + (index < rest ? 1 : 0);
+    }
+}
+
+
+code_cache::key code_cache::make_key(const vm_state& vm, std::string_view program) {
+    const instruction_set* instructions = vm.instructions.get();
+    size_t hash = std::hash<std::string_view>{}(program);
+    hash ^= std::hash<const void*>{}(instructions) + 0x9e3779b97f4a7c15 + (hash << 6) + (hash >> 2);
+    return {instructions, program, hash};
+}
+
+
+std::shared_ptr<const code_t> code_cache::get(const vm_state& vm, std::string_view program) {
+    const key lookup = make_key(vm, program);
+    // the low bits of the hash pick the bucket in the shard's index
+    shard& part = this->shards[(lookup.hash >> 24) % this->shards.size()];
+
+    {
+        std::lock_guard guard{part.lock};
+        auto found = part.index.find(lookup);
+        if (found != std::end(part.index)) {
+            part.entries.splice(part.entries.begin(), part.entries, found->second);
+            this->hit_count.fetch_add(1, std::memory_order_relaxed);
+            return found->second->code;
+        }
+    }
+
+    // assemble without holding the lock, lookups of other programs go on
+    this->miss_count.fetch_add(1, std::memory_order_relaxed);
+    auto code = std::make_shared<const code_t>(assemble(vm, program));
+
+    std::lock_guard guard{part.lock};
+    auto found = part.index.find(lookup);
+    if (found != std::end(part.index)) {
+        // another thread assembled it meanwhile, share its code
+        part.entries.splice(part.entries.begin(), part.entries, found->second);
+        return found->second->code;
+    }
+
+    part.entries.push_front({std::string{program}, vm.instructions, code, lookup.hash});
+    part.index.emplace(part.entries.front().get_key(), part.entries.begin());
+
+    if (part.entries.size() > part.capacity) {
+        part.index.erase(part.entries.back().get_key());
+        part.entries.pop_back();
+    }
+    return code;
+}
+
+
+void code_cache::clear() {
+    for (shard& part : this->shards) {
+        std::lock_guard guard{part.lock};
+        part.index.clear();
+        part.entries.clear();
+    }
+}
+
+
+size_t code_cache::size() const {
+    size_t count = 0;
+    for (const shard& part : this->shards) {
+        std::lock_guard guard{part.lock};
+        count += part.entries.size();
+    }
+    return count;
+}
+
+} // namespace vm
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "vm.h"
+
+
+namespace vm {
+
+/**
+ * a bounded cache of assembled programs, so texts that are submitted
+ * again skip the assembler.
+ *
+ * the entries are keyed by the program text and the instruction set of
+ * the vm, and the least recently used one is dropped once the cache is
+ * full. the code is shared and never modified, so it stays valid while
+ * it is used, even if it was dropped from the cache meanwhile.
+ *
+ * the cache is split into shards by the hash of the key, each with its
+ * own lock, so lookups of different programs rarely wait on each other.
+ * the program is assembled outside of the lock. each shard keeps its
+ * share of the capacity, so the least recently used entry is dropped
+ * per shard, not over the whole cache. there are at most as many shards
+ * as the capacity, and their shares add up to it.
+ */
+class code_cache {
+public:
+    /**
+     * @param capacity: how many programs are kept at most
+     * @param shard_count: how many independently locked parts the cache has
+     */
+    explicit code_cache(size_t capacity, size_t shard_count = 16);
+
+    code_cache(const code_cache&) = delete;
+    code_cache& operator=(const code_cache&) = delete;
+
+    /**
+     * get the program assembled for the vm's instruction set, assembling
+     * it if it isn't cached. errors of the assembler are not cached.
+     */
+    std::shared_ptr<const code_t> get(const vm_state& vm, std::string_view program);
+
+    /** drop all programs, the counters are kept */
+    void clear();
+
+    /** number of cached programs */
+    size_t size() const;
+
+    size_t capacity() const { return this->total_capacity; }
+
+    /** lookups that found the program */
+    uint64_t hits() const { return this->hit_count.load(std::memory_order_relaxed); }
+
+    /** lookups that had to assemble the program */
+    uint64_t misses() const { return this->miss_count.load(std::memory_order_relaxed); }
+
+private:
+    /** identifies a program, the text is owned by the entry */
+    struct key {
+        const instruction_set* instructions;
+        std::string_view text;
+        size_t hash;
+
+        bool operator==(const key& other) const {
+            return this->hash == other.hash and this->instructions == other.instructions and
+                   this->text == other.text;
+        }
+    };
+
+    struct key_hash {
+        size_t operator()(const key& entry_key) const { return entry_key.hash; }
+    };
+
+    struct entry {
+        std::string text;
+        /** keeps the set alive, so its address can't be reused for another one */
+        std::shared_ptr<const instruction_set> instructions;
+        std::shared_ptr<const code_t> code;
+        size_t hash;
+
+        key get_key() const { return {this->instructions.get(), this->text, this->hash}; }
+    };
+
+    /** part of the cache, the most recently used entry is first */
+    struct alignas(64) shard {
+        mutable std::mutex lock;
+        std::list<entry> entries;
+        std::unordered_map<key, std::list<entry>::iterator, key_hash> index;
+        /** its share of the cache's capacity */
+        size_t capacity = 0;
+    };
+
+    static key make_key(const vm_state& vm, std::string_view program);
+
+    size_t total_capacity;
+    std::vector<shard> shards;
+
+    std::atomic<uint64_t> hit_count{0};
+    std::atomic<uint64_t> miss_count{0};
+};
+
+} // namespace vm
@@ -0,0 +1,32 @@
+#pragma once
+
+
+namespace vm {
+
+/**
+ * run the program, then pass the buffered output of the vm's sink on,
+ * also if the program failed.
+ *
+ * the execution loops of all tiers end through this, so a sink gets
+ * the output of a failed run like that of a finished one.
+ */
+template <typename vm_t, typename execute_t>
+auto run_flushed(vm_t& vm, execute_t&& execute) -> decltype(execute()) {
+    decltype(execute()) result;
+    try {
+        result = execute();
+    }
+    catch (...) {
+        try {
+            vm.output->flush();
+        }
+        catch (...) {
+            // report the error of the program instead
+        }
+        throw;
+    }
+    vm.output->flush();
+    return result;
+}
+
+} // namespace vm
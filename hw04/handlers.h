@@ -0,0 +1,562 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#include "static_set.h"
+#include "tasks.h"
+#include "vm.h"
+
+
+namespace vm {
+
+/**
+ * the built-in instructions as handler types, see `static_instruction_set`.
+ * they are templates over the item type, the names without `basic_` are
+ * the handlers for `item_t`.
+ */
+namespace handlers {
+
+/** pop the top item like `vm_state::pop_top`, but inlined into the handler */
+template <typename T>
+T pop(basic_vm_state<T>& vmstate) {
+    if (vmstate.stack.empty()) [[unlikely]] {
+        throw vm_stackfail{std::string{"The stack in empty."}};
+    }
+    T top = vmstate.stack.top();
+    vmstate.stack.pop();
+    return top;
+}
+
+/** fail unless the stack has a top item */
+template <typename T>
+void require_top(basic_vm_state<T>& vmstate, const char* message = "The stack size is 0.") {
+    if (vmstate.stack.empty()) [[unlikely]] {
+        throw vm_stackfail{std::string{message}};
+    }
+}
+
+/** an item used as memory address, count or page count */
+template <typename T>
+int64_t address_of(T item) {
+    return static_cast<int64_t>(item);
+}
+
+
+template <typename T>
+struct basic_print {
+    static constexpr std::string_view name = "PRINT";
+    static constexpr opcode op = opcode::PRINT;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T) {
+        require_top(vmstate);
+        std::cout << vmstate.stack.top() << std::endl;
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_load_const {
+    static constexpr std::string_view name = "LOAD_CONST";
+    static constexpr opcode op = opcode::LOAD_CONST;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T number) {
+        vmstate.stack.push(number);
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_exit {
+    static constexpr std::string_view name = "EXIT";
+    static constexpr opcode op = opcode::EXIT;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T) {
+        require_top(vmstate, "The stack size is 0 on exit.");
+        return false;
+    }
+};
+
+template <typename T>
+struct basic_pop_top {
+    static constexpr std::string_view name = "POP";
+    static constexpr opcode op = opcode::POP;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T) {
+        pop(vmstate);
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_add {
+    static constexpr std::string_view name = "ADD";
+    static constexpr opcode op = opcode::ADD;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T) {
+        T tos = pop(vmstate);
+        T tos1 = pop(vmstate);
+        vmstate.stack.push(static_cast<T>(tos1 + tos));
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_div {
+    static constexpr std::string_view name = "DIV";
+    static constexpr opcode op = opcode::DIV;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T) {
+        T tos = pop(vmstate);
+        T tos1 = pop(vmstate);
+        if (tos == 0) {
+            throw div_by_zero{std::string{"divide by 0 error."}};
+        }
+        vmstate.stack.push(static_cast<T>(tos1 / tos));
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_eq {
+    static constexpr std::string_view name = "EQ";
+    static constexpr opcode op = opcode::EQ;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T) {
+        T tos = pop(vmstate);
+        T tos1 = pop(vmstate);
+        vmstate.stack.push(static_cast<T>(tos1 == tos));
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_neq {
+    static constexpr std::string_view name = "NEQ";
+    static constexpr opcode op = opcode::NEQ;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T) {
+        T tos = pop(vmstate);
+        T tos1 = pop(vmstate);
+        vmstate.stack.push(static_cast<T>(tos1 != tos));
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_dup {
+    static constexpr std::string_view name = "DUP";
+    static constexpr opcode op = opcode::DUP;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T) {
+        require_top(vmstate);
+        vmstate.stack.push(vmstate.stack.top());
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_jmp {
+    static constexpr std::string_view name = "JMP";
+    static constexpr opcode op = opcode::JMP;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T addr) {
+        vmstate.pc = static_cast<size_t>(addr);
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_jmpz {
+    static constexpr std::string_view name = "JMPZ";
+    static constexpr opcode op = opcode::JMPZ;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T addr) {
+        if (pop(vmstate) == 0) {
+            vmstate.pc = static_cast<size_t>(addr);
+        }
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_write {
+    static constexpr std::string_view name = "WRITE";
+    static constexpr opcode op = opcode::WRITE;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T) {
+        require_top(vmstate);
+        vmstate.output->write_number(vmstate.stack.top());
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_write_char {
+    static constexpr std::string_view name = "WRITE_CHAR";
+    static constexpr opcode op = opcode::WRITE_CHAR;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T) {
+        require_top(vmstate);
+        vmstate.output->write_char(static_cast<char>(vmstate.stack.top()));
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_load {
+    static constexpr std::string_view name = "LOAD";
+    static constexpr opcode op = opcode::LOAD;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T) {
+        T address = pop(vmstate);
+        vmstate.stack.push(vmstate.memory.load(address_of(address)));
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_store {
+    static constexpr std::string_view name = "STORE";
+    static constexpr opcode op = opcode::STORE;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T) {
+        T address = pop(vmstate);
+        T item = pop(vmstate);
+        vmstate.memory.store(address_of(address), item);
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_mem_copy {
+    static constexpr std::string_view name = "MEMCPY";
+    static constexpr opcode op = opcode::MEMCPY;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T) {
+        T count = pop(vmstate);
+        T source = pop(vmstate);
+        T target = pop(vmstate);
+        vmstate.memory.copy(address_of(target), address_of(source), address_of(count));
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_mem_set {
+    static constexpr std::string_view name = "MEMSET";
+    static constexpr opcode op = opcode::MEMSET;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T) {
+        T count = pop(vmstate);
+        T item = pop(vmstate);
+        T target = pop(vmstate);
+        vmstate.memory.fill(address_of(target), item, address_of(count));
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_mem_sum {
+    static constexpr std::string_view name = "MEMSUM";
+    static constexpr opcode op = opcode::MEMSUM;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T) {
+        T count = pop(vmstate);
+        T address = pop(vmstate);
+        vmstate.stack.push(vmstate.memory.sum(address_of(address), address_of(count)));
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_mem_grow {
+    static constexpr std::string_view name = "MEMGROW";
+    static constexpr opcode op = opcode::MEMGROW;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T) {
+        T pages = pop(vmstate);
+        vmstate.stack.push(static_cast<T>(vmstate.memory.grow(address_of(pages))));
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_call {
+    static constexpr std::string_view name = "CALL";
+    static constexpr opcode op = opcode::CALL;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T addr) {
+        // the pc is past the call already
+        if (not vmstate.calls.push(vmstate.pc)) {
+            throw vm_stackfail{std::string{"The call stack is full."}};
+        }
+        vmstate.pc = static_cast<size_t>(addr);
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_ret {
+    static constexpr std::string_view name = "RET";
+    static constexpr opcode op = opcode::RET;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T) {
+        if (vmstate.calls.empty()) {
+            throw vm_stackfail{std::string{"The call stack is empty."}};
+        }
+        vmstate.pc = vmstate.calls.pop();
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_tail_call {
+    static constexpr std::string_view name = "TAIL_CALL";
+    static constexpr opcode op = opcode::TAIL_CALL;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T addr) {
+        // the callee returns to where the current subroutine would have
+        vmstate.pc = static_cast<size_t>(addr);
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_spawn {
+    static constexpr std::string_view name = "SPAWN";
+    static constexpr opcode op = opcode::SPAWN;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T count) {
+        if constexpr (std::is_same_v<T, item_t>) {
+            spawn_task(vmstate, count);
+        }
+        else {
+            throw invalid_instruction{std::string{"SPAWN needs a vm of item_t."}};
+        }
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_join {
+    static constexpr std::string_view name = "JOIN";
+    static constexpr opcode op = opcode::JOIN;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T) {
+        if constexpr (std::is_same_v<T, item_t>) {
+            join_task(vmstate);
+        }
+        else {
+            throw invalid_instruction{std::string{"JOIN needs a vm of item_t."}};
+        }
+        return true;
+    }
+};
+
+
+// superinstructions, these are created by `optimize`.
+
+template <typename T>
+struct basic_add_imm {
+    static constexpr std::string_view name = "ADD_IMM";
+    static constexpr opcode op = opcode::ADD_IMM;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T number) {
+        T tos = pop(vmstate);
+        vmstate.stack.push(static_cast<T>(tos + number));
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_div_imm {
+    static constexpr std::string_view name = "DIV_IMM";
+    static constexpr opcode op = opcode::DIV_IMM;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T number) {
+        T tos = pop(vmstate);
+        if (number == 0) {
+            throw div_by_zero{std::string{"divide by 0 error."}};
+        }
+        vmstate.stack.push(static_cast<T>(tos / number));
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_eq_imm {
+    static constexpr std::string_view name = "EQ_IMM";
+    static constexpr opcode op = opcode::EQ_IMM;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T number) {
+        T tos = pop(vmstate);
+        vmstate.stack.push(static_cast<T>(tos == number));
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_neq_imm {
+    static constexpr std::string_view name = "NEQ_IMM";
+    static constexpr opcode op = opcode::NEQ_IMM;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T number) {
+        T tos = pop(vmstate);
+        vmstate.stack.push(static_cast<T>(tos != number));
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_jmp_eq {
+    static constexpr std::string_view name = "JMP_EQ";
+    static constexpr opcode op = opcode::JMP_EQ;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T addr) {
+        T tos = pop(vmstate);
+        T tos1 = pop(vmstate);
+        if (tos1 == tos) {
+            vmstate.pc = static_cast<size_t>(addr);
+        }
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_jmp_neq {
+    static constexpr std::string_view name = "JMP_NEQ";
+    static constexpr opcode op = opcode::JMP_NEQ;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T addr) {
+        T tos = pop(vmstate);
+        T tos1 = pop(vmstate);
+        if (tos1 != tos) {
+            vmstate.pc = static_cast<size_t>(addr);
+        }
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_dup_jmpz {
+    static constexpr std::string_view name = "DUP_JMPZ";
+    static constexpr opcode op = opcode::DUP_JMPZ;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T addr) {
+        require_top(vmstate);
+        if (vmstate.stack.top() == 0) {
+            vmstate.pc = static_cast<size_t>(addr);
+        }
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_write_imm {
+    static constexpr std::string_view name = "WRITE_IMM";
+    static constexpr opcode op = opcode::WRITE_IMM;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T number) {
+        vmstate.output->write_number(number);
+        return true;
+    }
+};
+
+template <typename T>
+struct basic_write_char_imm {
+    static constexpr std::string_view name = "WRITE_CHAR_IMM";
+    static constexpr opcode op = opcode::WRITE_CHAR_IMM;
+
+    static bool execute(basic_vm_state<T>& vmstate, const T number) {
+        vmstate.output->write_char(static_cast<char>(number));
+        return true;
+    }
+};
+
+
+
+// the handlers of the default item type
+using print = basic_print<item_t>;
+using load_const = basic_load_const<item_t>;
+using exit = basic_exit<item_t>;
+using pop_top = basic_pop_top<item_t>;
+using add = basic_add<item_t>;
+using div = basic_div<item_t>;
+using eq = basic_eq<item_t>;
+using neq = basic_neq<item_t>;
+using dup = basic_dup<item_t>;
+using jmp = basic_jmp<item_t>;
+using jmpz = basic_jmpz<item_t>;
+using write = basic_write<item_t>;
+using write_char = basic_write_char<item_t>;
+using load = basic_load<item_t>;
+using store = basic_store<item_t>;
+using mem_copy = basic_mem_copy<item_t>;
+using mem_set = basic_mem_set<item_t>;
+using mem_sum = basic_mem_sum<item_t>;
+using mem_grow = basic_mem_grow<item_t>;
+using call = basic_call<item_t>;
+using ret = basic_ret<item_t>;
+using tail_call = basic_tail_call<item_t>;
+using spawn = basic_spawn<item_t>;
+using join = basic_join<item_t>;
+using add_imm = basic_add_imm<item_t>;
+using div_imm = basic_div_imm<item_t>;
+using eq_imm = basic_eq_imm<item_t>;
+using neq_imm = basic_neq_imm<item_t>;
+using jmp_eq = basic_jmp_eq<item_t>;
+using jmp_neq = basic_jmp_neq<item_t>;
+using dup_jmpz = basic_dup_jmpz<item_t>;
+using write_imm = basic_write_imm<item_t>;
+using write_char_imm = basic_write_char_imm<item_t>;
+
+} // namespace handlers
+
+
+/**
+ * the instructions that `create_vm` provides, in the order of their op ids,
+ * for a vm with items of type T.
+ */
+template <typename T>
+using basic_builtin_set = static_instruction_set<
+    handlers::basic_print<T>,
+    handlers::basic_load_const<T>,
+    handlers::basic_exit<T>,
+    handlers::basic_pop_top<T>,
+    handlers::basic_add<T>,
+    handlers::basic_div<T>,
+    handlers::basic_eq<T>,
+    handlers::basic_neq<T>,
+    handlers::basic_dup<T>,
+    handlers::basic_jmp<T>,
+    handlers::basic_jmpz<T>,
+    handlers::basic_write<T>,
+    handlers::basic_write_char<T>,
+    handlers::basic_add_imm<T>,
+    handlers::basic_div_imm<T>,
+    handlers::basic_eq_imm<T>,
+    handlers::basic_neq_imm<T>,
+    handlers::basic_jmp_eq<T>,
+    handlers::basic_jmp_neq<T>,
+    handlers::basic_dup_jmpz<T>,
+    handlers::basic_write_imm<T>,
+    handlers::basic_write_char_imm<T>,
+    handlers::basic_load<T>,
+    handlers::basic_store<T>,
+    handlers::basic_mem_copy<T>,
+    handlers::basic_mem_set<T>,
+    handlers::basic_mem_sum<T>,
+    handlers::basic_mem_grow<T>,
+    handlers::basic_call<T>,
+    handlers::basic_ret<T>,
+    handlers::basic_tail_call<T>,
+    handlers::basic_spawn<T>,
+    handlers::basic_join<T>>;
+
+using builtin_set = basic_builtin_set<item_t>;
+
+} // namespace vm
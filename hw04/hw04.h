@@ -1,4 +1,22 @@
 #pragma once
 
 #include "vm.h"
+#include "assembler.h"
+#include "memory.h"
+#include "analysis.h"
+#include "optimize.h"
+#include "jit.h"
+#include "bytecode.h"
+#include "pool.h"
+#include "tasks.h"
+#include "batch.h"
+#include "profile.h"
+#include "sink.h"
+#include "step.h"
+#include "registers.h"
+#include "static_set.h"
+#include "handlers.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "cache.h"
 #include "util.h"
@@ -0,0 +1,1286 @@
+#include "jit.h"
+
+#include <cstddef>
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <initializer_list>
+#include <limits>
+#include <optional>
+#include <utility>
+
+#include "analysis.h"
+#include "flushed.h"
+
+#if defined(__x86_64__) and defined(__unix__)
+#define VM_JIT_X86_64 1
+#include <sys/mman.h>
+#endif
+
+
+namespace vm {
+
+namespace {
+
+#ifdef VM_JIT_X86_64
+
+/**
+ * the state the native code works on, shared with the C++ side.
+ *
+ * the top stack item lives in a register while the native code runs,
+ * and in the slot `sp` points to when it is left.
+ */
+struct jit_context {
+    /** slot of the top item, `base - 1` if the stack is empty */
+    item_t* sp;
+    /** the bottom stack slot */
+    item_t* base;
+    /** the last slot of the stack capacity */
+    item_t* limit;
+    /** the instruction the native code stopped at */
+    uint64_t pc;
+    vm_state* vm;
+    /** an exception thrown by a callback */
+    std::exception_ptr* error;
+    /** the page tables of the vm's memory, see `linear_memory::page_items` */
+    const item_t* const* pages;
+    item_t* const* owned_pages;
+    /** number of items in the memory */
+    uint64_t memory_size;
+};
+
+
+/** let the context point to the current page tables of the vm's memory */
+void sync_memory(jit_context* context) {
+    context->pages = context->vm->memory.page_items();
+    context->owned_pages = context->vm->memory.owned_page_items();
+    context->memory_size = context->vm->memory.size();
+}
+
+
+/**
+ * why the native code returned to `jit_program::run`.
+ */
+enum class jit_exit : uint32_t {
+    /** EXIT instruction */
+    exit,
+    /** the instruction at pc has to run its action */
+    step,
+    /** the stack capacity is exhausted */
+    grow,
+    stack_empty,
+    div_by_zero,
+    /** a callback has thrown */
+    error,
+};
+
+
+/**
+ * output callbacks of WRITE and WRITE_CHAR.
+ * exceptions can't unwind through the native code, so they are stored
+ * in the context, and nonzero is returned.
+ */
+uint32_t jit_write(jit_context* context, item_t value) noexcept {
+    try {
+        context->vm->output->write_number(value);
+        return 0;
+    }
+    catch (...) {
+        *context->error = std::current_exception();
+        return 1;
+    }
+}
+
+uint32_t jit_write_char(jit_context* context, item_t value) noexcept {
+    try {
+        context->vm->output->write_char(static_cast<char>(value));
+        return 0;
+    }
+    catch (...) {
+        *context->error = std::current_exception();
+        return 1;
+    }
+}
+
+
+/**
+ * callback of the memory instructions that aren't compiled inline,
+ * called with the top item in its stack slot.
+ * it pops the operands like the interpreter, also when the access fails,
+ * and reports errors like the output callbacks.
+ */
+uint32_t jit_memory(jit_context* context, item_t op) noexcept {
+    linear_memory<item_t>& memory = context->vm->memory;
+    // the top item is at sp[0]
+    item_t*& sp = context->sp;
+    try {
+        switch (static_cast<opcode>(op)) {
+        case opcode::STORE:
+            sp -= 2;
+            memory.store(sp[2], sp[1]);
+            break;
+        case opcode::MEMCPY:
+            sp -= 3;
+            memory.copy(sp[1], sp[2], sp[3]);
+            break;
+        case opcode::MEMSET:
+            sp -= 3;
+            memory.fill(sp[1], sp[2], sp[3]);
+            break;
+        case opcode::MEMSUM: {
+            sp -= 2;
+            const item_t sum = memory.sum(sp[1], sp[2]);
+            *++sp = sum;
+            break;
+        }
+        case opcode::MEMGROW:
+            *sp = memory.grow(*sp);
+            break;
+        default:
+            break;
+        }
+        sync_memory(context);
+        return 0;
+    }
+    catch (...) {
+        *context->error = std::current_exception();
+        return 1;
+    }
+}
+
+
+/**
+ * signature of the entry stub at the start of the native code:
+ * it loads the state from the context and jumps to the target address.
+ */
+using entry_fn_t = uint32_t (*)(jit_context* context, const void* target);
+
+
+/** x86-64 register numbers, as encoded in instructions */
+enum reg : uint8_t {
+    rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi,
+    r8, r9, r10, r11, r12, r13, r14, r15,
+};
+
+/** condition codes of jcc and setcc */
+enum cond : uint8_t {
+    below = 0x2,
+    above_equal = 0x3,
+    equal = 0x4,
+    not_equal = 0x5,
+};
+
+// fixed register roles of the native code. all are callee-saved,
+// so they survive the callbacks.
+constexpr reg context_reg = rbx;
+constexpr reg sp_reg = r12;
+constexpr reg tos_reg = r13;
+constexpr reg base_reg = r14;
+constexpr reg limit_reg = r15;
+
+constexpr int32_t item_size = static_cast<int32_t>(sizeof(item_t));
+
+
+constexpr bool fits_int32(item_t value) {
+    return value >= std::numeric_limits<int32_t>::min() and
+           value <= std::numeric_limits<int32_t>::max();
+}
+
+
+/**
+ * emits the machine code of the few x86-64 instructions the compiler
+ * needs. all operate on 64 bit registers unless noted otherwise.
+ */
+class assembler {
+public:
+    std::vector<uint8_t> bytes;
+
+    size_t position() const { return this->bytes.size(); }
+
+    void emit(std::initializer_list<uint8_t> code) {
+        this->bytes.insert(this->bytes.end(), code);
+    }
+
+    void emit32(uint32_t value) {
+        for (int i = 0; i < 4; i++) {
+            this->bytes.push_back(static_cast<uint8_t>(value >> (8 * i)));
+        }
+    }
+
+    void emit64(uint64_t value) {
+        this->emit32(static_cast<uint32_t>(value));
+        this->emit32(static_cast<uint32_t>(value >> 32));
+    }
+
+    /** `op reg, rm` with a register operand, or `op /digit` with `reg` = digit */
+    void op_reg(uint8_t op, uint8_t r, reg rm) {
+        this->emit({rex(r, rm), op, modrm(3, r, rm)});
+    }
+
+    /** `op reg, [base + disp]`, or `op /digit` with `reg` = digit */
+    void op_mem(uint8_t op, uint8_t r, reg base, int32_t disp) {
+        this->emit({rex(r, base), op});
+        bool short_disp = disp >= -128 and disp <= 127;
+        this->emit({modrm(short_disp ? 1 : 2, r, base)});
+        if ((base & 7) == rsp) {
+            // rsp and r12 as base need a sib byte
+            this->emit({0x24});
+        }
+        if (short_disp) {
+            this->emit({static_cast<uint8_t>(disp)});
+        }
+        else {
+            this->emit32(static_cast<uint32_t>(disp));
+        }
+    }
+
+    void mov(reg dst, reg src) { this->op_reg(0x89, src, dst); }
+    void load(reg dst, reg base, int32_t disp) { this->op_mem(0x8b, dst, base, disp); }
+    void store(reg base, int32_t disp, reg src) { this->op_mem(0x89, src, base, disp); }
+    void lea(reg dst, reg base, int32_t disp) { this->op_mem(0x8d, dst, base, disp); }
+
+    void mov_imm(reg dst, item_t value) {
+        if (fits_int32(value)) {
+            this->op_reg(0xc7, 0, dst);
+            this->emit32(static_cast<uint32_t>(value));
+        }
+        else {
+            this->emit({rex(0, dst), static_cast<uint8_t>(0xb8 + (dst & 7))});
+            this->emit64(static_cast<uint64_t>(value));
+        }
+    }
+
+    /** `mov qword [base + disp], imm32` */
+    void store_imm(reg base, int32_t disp, uint32_t value) {
+        this->op_mem(0xc7, 0, base, disp);
+        this->emit32(value);
+    }
+
+    /** `op reg, [base + index * 8]`, index can't be rsp */
+    void op_indexed(uint8_t op, uint8_t r, reg base, reg index) {
+        this->emit({static_cast<uint8_t>(rex(r, base) | ((index >> 3) << 1)), op});
+        // rbp and r13 as base need a displacement
+        const bool needs_disp = (base & 7) == rbp;
+        this->emit({modrm(needs_disp ? 1 : 0, r, rsp),
+                    static_cast<uint8_t>((3 << 6) | ((index & 7) << 3) | (base & 7))});
+        if (needs_disp) {
+            this->emit({0});
+        }
+    }
+
+    void load_indexed(reg dst, reg base, reg index) { this->op_indexed(0x8b, dst, base, index); }
+    void store_indexed(reg base, reg index, reg src) { this->op_indexed(0x89, src, base, index); }
+
+    void add(reg dst, reg src) { this->op_reg(0x01, src, dst); }
+    void add_mem(reg dst, reg base, int32_t disp) { this->op_mem(0x03, dst, base, disp); }
+    void cmp(reg a, reg b) { this->op_reg(0x39, b, a); }
+    /** `cmp a, [base + disp]` */
+    void cmp_reg_mem(reg a, reg base, int32_t disp) { this->op_mem(0x3b, a, base, disp); }
+    /** `cmp [base + disp], b` */
+    void cmp_mem(reg base, int32_t disp, reg b) { this->op_mem(0x39, b, base, disp); }
+    void test(reg a, reg b) { this->op_reg(0x85, b, a); }
+
+    void add_imm(reg dst, int32_t value) {
+        this->op_reg(0x81, 0, dst);
+        this->emit32(static_cast<uint32_t>(value));
+    }
+
+    void sub_imm(reg dst, int32_t value) {
+        this->op_reg(0x81, 5, dst);
+        this->emit32(static_cast<uint32_t>(value));
+    }
+
+    void and_imm(reg dst, int32_t value) {
+        this->op_reg(0x81, 4, dst);
+        this->emit32(static_cast<uint32_t>(value));
+    }
+
+    /** logical shift right */
+    void shr_imm(reg dst, uint8_t count) {
+        this->op_reg(0xc1, 5, dst);
+        this->emit({count});
+    }
+
+    /** rax = 0, without a rex prefix the upper half is cleared as well */
+    void zero_eax() { this->emit({0x31, 0xc0}); }
+
+    /** set al to 1 if the condition holds, else to 0 */
+    void setcc_al(cond c) { this->emit({0x0f, static_cast<uint8_t>(0x90 | c), 0xc0}); }
+
+    /** `mov eax, imm32` */
+    void mov_eax(uint32_t value) {
+        this->emit({0xb8});
+        this->emit32(value);
+    }
+
+    void test_eax() { this->emit({0x85, 0xc0}); }
+
+    /** sign extend rax into rdx, for idiv */
+    void cqo() { this->emit({0x48, 0x99}); }
+
+    /** rax = rdx:rax / divisor */
+    void idiv(reg divisor) { this->op_reg(0xf7, 7, divisor); }
+
+    void call(reg target) { this->short_reg(0xff, 2, target); }
+    void jmp(reg target) { this->short_reg(0xff, 4, target); }
+
+    void push(reg r) { this->short_op(0x50, r); }
+    void pop(reg r) { this->short_op(0x58, r); }
+    void ret() { this->emit({0xc3}); }
+
+    /** jump with a 32 bit displacement, returns where to `patch` the target */
+    size_t jmp() {
+        this->emit({0xe9});
+        return this->placeholder();
+    }
+
+    size_t jcc(cond c) {
+        this->emit({0x0f, static_cast<uint8_t>(0x80 | c)});
+        return this->placeholder();
+    }
+
+    /** let the jump displacement at `at` go to `target` */
+    void patch(size_t at, size_t target) {
+        auto displacement = static_cast<uint32_t>(
+            static_cast<int64_t>(target) - static_cast<int64_t>(at + 4));
+        for (size_t i = 0; i < 4; i++) {
+            this->bytes[at + i] = static_cast<uint8_t>(displacement >> (8 * i));
+        }
+    }
+
+private:
+    static uint8_t rex(uint8_t r, reg rm) {
+        return static_cast<uint8_t>(0x48 | ((r >> 3) << 2) | (rm >> 3));
+    }
+
+    static uint8_t modrm(uint8_t mod, uint8_t r, reg rm) {
+        return static_cast<uint8_t>((mod << 6) | ((r & 7) << 3) | (rm & 7));
+    }
+
+    /** instruction without a 64 bit operand size, only r8-r15 need a rex prefix */
+    void short_reg(uint8_t op, uint8_t r, reg rm) {
+        if (rm >= r8) {
+            this->emit({0x41});
+        }
+        this->emit({op, modrm(3, r, rm)});
+    }
+
+    void short_op(uint8_t op, reg r) {
+        if (r >= r8) {
+            this->emit({0x41});
+        }
+        this->emit({static_cast<uint8_t>(op + (r & 7))});
+    }
+
+    size_t placeholder() {
+        size_t at = this->position();
+        this->emit32(0);
+        return at;
+    }
+};
+
+
+
+
+/**
+ * translates the instructions one by one. each sequence starts and ends
+ * with the stack in the same form: the top item in `tos_reg`, and
+ * `sp_reg` pointing to the top item's slot. so the native code can be
+ * entered at any instruction.
+ *
+ * the stack checks are only emitted for instructions the analysis
+ * couldn't prove stack-safe, just like the interpreter does.
+ */
+class compiler {
+public:
+    compiler(const code_t& code, const code_analysis& analysis)
+        : code{code}, analysis{analysis} {}
+
+    /**
+     * compile the program.
+     * returns the machine code and fills in the offset of each instruction.
+     */
+    std::vector<uint8_t> compile(std::vector<uint32_t>& entries) {
+        this->entry_stub();
+        this->exit_label = this->as.position();
+        this->exit_stub();
+
+        const size_t code_size = this->code.size();
+        entries.resize(code_size);
+        for (size_t pc = 0; pc < code_size; pc++) {
+            entries[pc] = static_cast<uint32_t>(this->as.position());
+            this->instruction(pc);
+        }
+
+        // the error paths are out of line, so the fast paths stay compact
+        for (const auto& [at, pc, reason] : this->exits) {
+            this->as.patch(at, this->as.position());
+            this->leave(pc, reason);
+        }
+        for (const auto& [at, target] : this->jumps) {
+            this->as.patch(at, entries[target]);
+        }
+
+        return std::move(this->as.bytes);
+    }
+
+private:
+    /** a conditional exit, emitted after the program */
+    struct exit_site {
+        size_t at;
+        size_t pc;
+        jit_exit reason;
+    };
+
+    /** a jump to an instruction */
+    struct jump_site {
+        size_t at;
+        size_t target;
+    };
+
+    void entry_stub() {
+        // save the callee-saved registers, and keep rsp 16 byte aligned
+        // for the calls to the callbacks
+        for (reg r : {rbx, rbp, r12, r13, r14, r15}) {
+            this->as.push(r);
+        }
+        this->as.sub_imm(rsp, 8);
+
+        this->as.mov(context_reg, rdi);
+        this->as.load(sp_reg, context_reg, offsetof(jit_context, sp));
+        this->as.load(base_reg, context_reg, offsetof(jit_context, base));
+        this->as.load(limit_reg, context_reg, offsetof(jit_context, limit));
+        this->as.load(tos_reg, sp_reg, 0);
+        this->as.jmp(rsi);
+    }
+
+    void exit_stub() {
+        // the reason is in eax and the pc in the context already
+        this->as.store(sp_reg, 0, tos_reg);
+        this->as.store(context_reg, offsetof(jit_context, sp), sp_reg);
+        this->as.add_imm(rsp, 8);
+        for (reg r : {r15, r14, r13, r12, rbp, rbx}) {
+            this->as.pop(r);
+        }
+        this->as.ret();
+    }
+
+    /** return to the C++ side */
+    void leave(size_t pc, jit_exit reason) {
+        this->as.store_imm(context_reg, offsetof(jit_context, pc), static_cast<uint32_t>(pc));
+        this->as.mov_eax(static_cast<uint32_t>(reason));
+        this->as.patch(this->as.jmp(), this->exit_label);
+    }
+
+    /** return to the C++ side if the flags fulfill the condition */
+    void leave_if(cond c, size_t pc, jit_exit reason) {
+        this->exits.push_back({this->as.jcc(c), pc, reason});
+    }
+
+    void jump(item_t target) {
+        this->jumps.push_back({this->as.jmp(), static_cast<size_t>(target)});
+    }
+
+    void jump_if(cond c, item_t target) {
+        this->jumps.push_back({this->as.jcc(c), static_cast<size_t>(target)});
+    }
+
+    /** leave if fewer than `count` items are on the stack */
+    void require(size_t pc, size_t count) {
+        if (count == 1) {
+            this->as.cmp(sp_reg, base_reg);
+        }
+        else {
+            this->as.lea(rax, base_reg, static_cast<int32_t>(count - 1) * item_size);
+            this->as.cmp(sp_reg, rax);
+        }
+        this->leave_if(below, pc, jit_exit::stack_empty);
+    }
+
+    /** leave if there's no free slot for another item */
+    void make_room(size_t pc) {
+        this->as.cmp(sp_reg, limit_reg);
+        this->leave_if(above_equal, pc, jit_exit::grow);
+    }
+
+    /** move the top item to memory, to make room for a new one in `tos_reg` */
+    void spill_tos() {
+        this->as.store(sp_reg, 0, tos_reg);
+        this->as.add_imm(sp_reg, item_size);
+    }
+
+    /** drop the top item, the one below becomes the top */
+    void drop_tos() {
+        this->as.load(tos_reg, sp_reg, -item_size);
+        this->as.sub_imm(sp_reg, item_size);
+    }
+
+    /** call an output callback with the value in rsi */
+    void call_output(uint32_t (*callback)(jit_context*, item_t), size_t pc) {
+        this->as.mov(rdi, context_reg);
+        this->as.mov_imm(rax, static_cast<item_t>(reinterpret_cast<uintptr_t>(callback)));
+        this->as.call(rax);
+        this->as.test_eax();
+        this->leave_if(not_equal, pc, jit_exit::error);
+    }
+
+    /**
+     * leave for the action if the address in `tos_reg` is outside of the
+     * memory, which then fails. otherwise rax = its page, and
+     * `tos_reg` = its index in the page.
+     */
+    void memory_page(size_t pc) {
+        using memory_t = linear_memory<item_t>;
+        // negative addresses are huge unsigned ones
+        this->as.cmp_reg_mem(tos_reg, context_reg, offsetof(jit_context, memory_size));
+        this->leave_if(above_equal, pc, jit_exit::step);
+        this->as.mov(rax, tos_reg);
+        this->as.shr_imm(rax, memory_t::page_shift);
+        this->as.and_imm(tos_reg, static_cast<int32_t>(memory_t::page_size - 1));
+    }
+
+    /** call `jit_memory` for the instruction, which pops its operands */
+    void call_memory(opcode op, size_t pc) {
+        this->as.store(sp_reg, 0, tos_reg);
+        this->as.store(context_reg, offsetof(jit_context, sp), sp_reg);
+        this->as.mov(rdi, context_reg);
+        this->as.mov_imm(rsi, static_cast<item_t>(op));
+        this->as.mov_imm(rax, static_cast<item_t>(reinterpret_cast<uintptr_t>(jit_memory)));
+        this->as.call(rax);
+        this->as.load(sp_reg, context_reg, offsetof(jit_context, sp));
+        this->as.load(tos_reg, sp_reg, 0);
+        this->as.test_eax();
+        this->leave_if(not_equal, pc, jit_exit::error);
+    }
+
+    /** `tos = tos1 <cond> tos` of EQ and NEQ */
+    void compare(cond c) {
+        this->as.zero_eax();
+        this->as.cmp_mem(sp_reg, -item_size, tos_reg);
+        this->as.setcc_al(c);
+        this->as.mov(tos_reg, rax);
+        this->as.sub_imm(sp_reg, item_size);
+    }
+
+    /** `tos = tos <cond> value` of EQ_IMM and NEQ_IMM */
+    void compare_imm(cond c, item_t value) {
+        this->as.mov_imm(rcx, value);
+        this->as.zero_eax();
+        this->as.cmp(tos_reg, rcx);
+        this->as.setcc_al(c);
+        this->as.mov(tos_reg, rax);
+    }
+
+    void instruction(size_t pc) {
+        const opcode op = this->analysis.opcodes[pc];
+        const item_t arg = this->code[pc].second;
+
+        if (not this->analysis.is_stack_safe(pc)) {
+            stack_effect effect = get_stack_effect(op);
+            if (effect.needs > 0) {
+                this->require(pc, effect.needs);
+            }
+            if (effect.pushes > effect.pops) {
+                this->make_room(pc);
+            }
+        }
+
+        switch (op) {
+        case opcode::LOAD_CONST:
+            this->spill_tos();
+            this->as.mov_imm(tos_reg, arg);
+            break;
+
+        case opcode::EXIT:
+            this->leave(pc, jit_exit::exit);
+            break;
+
+        case opcode::POP:
+            this->drop_tos();
+            break;
+
+        case opcode::ADD:
+            this->as.add_mem(tos_reg, sp_reg, -item_size);
+            this->as.sub_imm(sp_reg, item_size);
+            break;
+
+        case opcode::DIV:
+            this->as.test(tos_reg, tos_reg);
+            this->leave_if(equal, pc, jit_exit::div_by_zero);
+            this->as.load(rax, sp_reg, -item_size);
+            this->as.cqo();
+            this->as.idiv(tos_reg);
+            this->as.mov(tos_reg, rax);
+            this->as.sub_imm(sp_reg, item_size);
+            break;
+
+        case opcode::EQ:
+            this->compare(equal);
+            break;
+
+        case opcode::NEQ:
+            this->compare(not_equal);
+            break;
+
+        case opcode::DUP:
+            this->spill_tos();
+            break;
+
+        case opcode::JMP:
+        case opcode::TAIL_CALL:
+            this->jump(arg);
+            break;
+
+        case opcode::JMPZ:
+            this->as.mov(rax, tos_reg);
+            this->drop_tos();
+            this->as.test(rax, rax);
+            this->jump_if(equal, arg);
+            break;
+
+        case opcode::WRITE:
+            this->as.mov(rsi, tos_reg);
+            this->call_output(jit_write, pc);
+            break;
+
+        case opcode::WRITE_CHAR:
+            this->as.mov(rsi, tos_reg);
+            this->call_output(jit_write_char, pc);
+            break;
+
+        case opcode::ADD_IMM:
+            if (fits_int32(arg)) {
+                this->as.add_imm(tos_reg, static_cast<int32_t>(arg));
+            }
+            else {
+                this->as.mov_imm(rax, arg);
+                this->as.add(tos_reg, rax);
+            }
+            break;
+
+        case opcode::DIV_IMM:
+            if (arg == 0) {
+                this->leave(pc, jit_exit::div_by_zero);
+                break;
+            }
+            this->as.mov(rax, tos_reg);
+            this->as.cqo();
+            this->as.mov_imm(rcx, arg);
+            this->as.idiv(rcx);
+            this->as.mov(tos_reg, rax);
+            break;
+
+        case opcode::EQ_IMM:
+            this->compare_imm(equal, arg);
+            break;
+
+        case opcode::NEQ_IMM:
+            this->compare_imm(not_equal, arg);
+            break;
+
+        case opcode::JMP_EQ:
+        case opcode::JMP_NEQ:
+            this->as.mov(rax, tos_reg);
+            this->as.load(rcx, sp_reg, -item_size);
+            this->as.load(tos_reg, sp_reg, -2 * item_size);
+            this->as.sub_imm(sp_reg, 2 * item_size);
+            this->as.cmp(rcx, rax);
+            this->jump_if(op == opcode::JMP_EQ ? equal : not_equal, arg);
+            break;
+
+        case opcode::DUP_JMPZ:
+            this->as.test(tos_reg, tos_reg);
+            this->jump_if(equal, arg);
+            break;
+
+        case opcode::WRITE_IMM:
+            this->as.mov_imm(rsi, arg);
+            this->call_output(jit_write, pc);
+            break;
+
+        case opcode::WRITE_CHAR_IMM:
+            this->as.mov_imm(rsi, arg);
+            this->call_output(jit_write_char, pc);
+            break;
+
+        case opcode::LOAD:
+            this->memory_page(pc);
+            this->as.load(rcx, context_reg, offsetof(jit_context, pages));
+            this->as.load_indexed(rcx, rcx, rax);
+            this->as.load_indexed(tos_reg, rcx, tos_reg);
+            break;
+
+        case opcode::STORE: {
+            // written right away if the page is the vm's own,
+            // else the callback copies it first
+            this->as.store(sp_reg, 0, tos_reg);
+            this->memory_page(pc);
+            this->as.load(rcx, context_reg, offsetof(jit_context, owned_pages));
+            this->as.load_indexed(rcx, rcx, rax);
+            this->as.test(rcx, rcx);
+            const size_t shared = this->as.jcc(equal);
+            this->as.load(rax, sp_reg, -item_size);
+            this->as.store_indexed(rcx, tos_reg, rax);
+            this->as.load(tos_reg, sp_reg, -2 * item_size);
+            this->as.sub_imm(sp_reg, 2 * item_size);
+            const size_t stored = this->as.jmp();
+
+            this->as.patch(shared, this->as.position());
+            // the callback takes the address from the stack slot
+            this->as.load(tos_reg, sp_reg, 0);
+            this->call_memory(op, pc);
+            this->as.patch(stored, this->as.position());
+            break;
+        }
+
+        case opcode::MEMCPY:
+        case opcode::MEMSET:
+        case opcode::MEMSUM:
+        case opcode::MEMGROW:
+            this->call_memory(op, pc);
+            break;
+
+        case opcode::PRINT:
+        case opcode::CALL:
+        case opcode::RET:
+        case opcode::SPAWN:
+        case opcode::JOIN:
+        case opcode::CUSTOM:
+            // these run their action on the vm state
+            this->leave(pc, jit_exit::step);
+            break;
+        }
+    }
+
+    const code_t& code;
+    const code_analysis& analysis;
+    assembler as;
+
+    size_t exit_label = 0;
+    std::vector<exit_site> exits;
+    std::vector<jump_site> jumps;
+};
+
+
+
+/**
+ * why the native code of a trace returned to `jit_trace::run`.
+ */
+enum class trace_exit : uint32_t {
+    /** a guard failed, leave through the deopt point in the context's pc */
+    guard,
+    /** the stack doesn't have the items or the capacity for another iteration */
+    enter,
+    /** an output callback has thrown, after the deopt point in the context's pc */
+    error,
+};
+
+
+/**
+ * translates a `register_trace` to machine code.
+ *
+ * the slots of the trace are addressed relative to `sp_reg`, which points
+ * to one past the top item at the start of each iteration. all values
+ * live in memory, only the guards and the loop jump are in registers.
+ */
+class trace_compiler {
+public:
+    explicit trace_compiler(const register_trace& trace)
+        : trace{trace} {}
+
+    std::vector<uint8_t> compile() {
+        for (reg r : {rbx, rbp, r12, r13, r14, r15}) {
+            this->as.push(r);
+        }
+        this->as.sub_imm(rsp, 8);
+        this->as.mov(context_reg, rdi);
+        this->as.load(sp_reg, context_reg, offsetof(jit_context, sp));
+        this->as.load(base_reg, context_reg, offsetof(jit_context, base));
+        this->as.load(limit_reg, context_reg, offsetof(jit_context, limit));
+
+        // each iteration checks the stack once for all of its slots
+        const size_t loop_start = this->as.position();
+        if (this->trace.low < 0) {
+            this->as.lea(rax, sp_reg, this->trace.low * item_size);
+            this->as.cmp(rax, base_reg);
+            this->leave_if(below, 0, trace_exit::enter);
+        }
+        if (this->trace.high > 0) {
+            this->as.lea(rax, sp_reg, (this->trace.high - 1) * item_size);
+            this->as.cmp(limit_reg, rax);
+            this->leave_if(below, 0, trace_exit::enter);
+        }
+
+        for (const auto& op : this->trace.ops) {
+            this->instruction(op, loop_start);
+        }
+
+        for (const auto& [at, deopt, reason] : this->exits) {
+            this->as.patch(at, this->as.position());
+            this->leave(deopt, reason);
+        }
+        this->exit_label = this->as.position();
+        this->as.store(context_reg, offsetof(jit_context, sp), sp_reg);
+        this->as.add_imm(rsp, 8);
+        for (reg r : {r15, r14, r13, r12, rbp, rbx}) {
+            this->as.pop(r);
+        }
+        this->as.ret();
+        for (size_t at : this->exit_jumps) {
+            this->as.patch(at, this->exit_label);
+        }
+
+        return std::move(this->as.bytes);
+    }
+
+private:
+    struct exit_site {
+        size_t at;
+        uint32_t deopt;
+        trace_exit reason;
+    };
+
+    static int32_t slot(int32_t index) {
+        return index * item_size;
+    }
+
+    void leave(uint32_t deopt, trace_exit reason) {
+        this->as.store_imm(context_reg, offsetof(jit_context, pc), deopt);
+        this->as.mov_eax(static_cast<uint32_t>(reason));
+        this->exit_jumps.push_back(this->as.jmp());
+    }
+
+    void leave_if(cond c, uint32_t deopt, trace_exit reason) {
+        this->exits.push_back({this->as.jcc(c), deopt, reason});
+    }
+
+    /** rax = the value of slot `a` */
+    void load(int32_t a) {
+        this->as.load(rax, sp_reg, slot(a));
+    }
+
+    void store(int32_t dst) {
+        this->as.store(sp_reg, slot(dst), rax);
+    }
+
+    /** rax = slot a <cond> (slot b or the immediate in rcx) */
+    void compare(cond c, int32_t a, reg b) {
+        this->as.zero_eax();
+        this->as.cmp_mem(sp_reg, slot(a), b);
+        this->as.setcc_al(c);
+    }
+
+    /** divide rax by rcx */
+    void divide() {
+        this->as.cqo();
+        this->as.idiv(rcx);
+    }
+
+    void call_output(uint32_t (*callback)(jit_context*, item_t), uint32_t deopt) {
+        this->as.mov(rdi, context_reg);
+        this->as.mov_imm(rax, static_cast<item_t>(reinterpret_cast<uintptr_t>(callback)));
+        this->as.call(rax);
+        this->as.test_eax();
+        this->leave_if(not_equal, deopt, trace_exit::error);
+    }
+
+    void instruction(const register_trace::reg_op& op, size_t loop_start) {
+        switch (static_cast<reg_opcode>(op.op)) {
+        case reg_opcode::load_imm:
+            if (fits_int32(op.imm)) {
+                this->as.store_imm(sp_reg, slot(op.dst), static_cast<uint32_t>(op.imm));
+            }
+            else {
+                this->as.mov_imm(rax, op.imm);
+                this->store(op.dst);
+            }
+            break;
+        case reg_opcode::move:
+            this->load(op.a);
+            this->store(op.dst);
+            break;
+
+        case reg_opcode::add:
+            this->load(op.a);
+            this->as.add_mem(rax, sp_reg, slot(op.b));
+            this->store(op.dst);
+            break;
+        case reg_opcode::add_imm:
+            this->load(op.a);
+            if (fits_int32(op.imm)) {
+                this->as.add_imm(rax, static_cast<int32_t>(op.imm));
+            }
+            else {
+                this->as.mov_imm(rcx, op.imm);
+                this->as.add(rax, rcx);
+            }
+            this->store(op.dst);
+            break;
+
+        case reg_opcode::div:
+            this->as.load(rcx, sp_reg, slot(op.b));
+            this->as.test(rcx, rcx);
+            this->leave_if(equal, op.target, trace_exit::guard);
+            this->load(op.a);
+            this->divide();
+            this->store(op.dst);
+            break;
+        case reg_opcode::div_imm:
+            this->as.mov_imm(rcx, op.imm);
+            this->load(op.a);
+            this->divide();
+            this->store(op.dst);
+            break;
+        case reg_opcode::imm_div:
+            this->as.load(rcx, sp_reg, slot(op.b));
+            this->as.test(rcx, rcx);
+            this->leave_if(equal, op.target, trace_exit::guard);
+            this->as.mov_imm(rax, op.imm);
+            this->divide();
+            this->store(op.dst);
+            break;
+
+        case reg_opcode::eq:
+        case reg_opcode::neq:
+            this->as.load(rcx, sp_reg, slot(op.b));
+            this->compare(static_cast<reg_opcode>(op.op) == reg_opcode::eq ? equal : not_equal, op.a, rcx);
+            this->store(op.dst);
+            break;
+        case reg_opcode::eq_imm:
+        case reg_opcode::neq_imm:
+            this->as.mov_imm(rcx, op.imm);
+            this->compare(static_cast<reg_opcode>(op.op) == reg_opcode::eq_imm ? equal : not_equal, op.a, rcx);
+            this->store(op.dst);
+            break;
+
+        case reg_opcode::write:
+            this->as.load(rsi, sp_reg, slot(op.a));
+            this->call_output(jit_write, op.target);
+            break;
+        case reg_opcode::write_imm:
+            this->as.mov_imm(rsi, op.imm);
+            this->call_output(jit_write, op.target);
+            break;
+        case reg_opcode::write_char:
+            this->as.load(rsi, sp_reg, slot(op.a));
+            this->call_output(jit_write_char, op.target);
+            break;
+        case reg_opcode::write_char_imm:
+            this->as.mov_imm(rsi, op.imm);
+            this->call_output(jit_write_char, op.target);
+            break;
+
+        case reg_opcode::guard_zero:
+        case reg_opcode::guard_nonzero:
+            this->load(op.a);
+            this->as.test(rax, rax);
+            this->leave_if(static_cast<reg_opcode>(op.op) == reg_opcode::guard_zero ? not_equal : equal,
+                           op.target, trace_exit::guard);
+            break;
+        case reg_opcode::guard_eq:
+        case reg_opcode::guard_neq:
+            this->as.load(rcx, sp_reg, slot(op.b));
+            this->as.cmp_mem(sp_reg, slot(op.a), rcx);
+            this->leave_if(static_cast<reg_opcode>(op.op) == reg_opcode::guard_eq ? not_equal : equal,
+                           op.target, trace_exit::guard);
+            break;
+        case reg_opcode::guard_eq_imm:
+        case reg_opcode::guard_neq_imm:
+            this->as.mov_imm(rcx, op.imm);
+            this->as.cmp_mem(sp_reg, slot(op.a), rcx);
+            this->leave_if(static_cast<reg_opcode>(op.op) == reg_opcode::guard_eq_imm ? not_equal : equal,
+                           op.target, trace_exit::guard);
+            break;
+
+        case reg_opcode::deopt:
+            this->leave(op.target, trace_exit::guard);
+            break;
+
+        case reg_opcode::loop:
+            if (op.dst != 0) {
+                this->as.add_imm(sp_reg, slot(op.dst));
+            }
+            this->as.patch(this->as.jmp(), loop_start);
+            break;
+
+        default:
+            // not part of traces
+            this->leave(0, trace_exit::enter);
+            break;
+        }
+    }
+
+    const register_trace& trace;
+    assembler as;
+
+    size_t exit_label = 0;
+    std::vector<exit_site> exits;
+    std::vector<size_t> exit_jumps;
+};
+
+
+/**
+ * copy machine code to memory that can be executed, nullptr if that fails.
+ */
+void* map_executable(const std::vector<uint8_t>& machine_code) {
+    // written once, then only executed
+    void* memory = mmap(nullptr, machine_code.size(), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+    std::memcpy(memory, machine_code.data(), machine_code.size());
+    if (mprotect(memory, machine_code.size(), PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, machine_code.size());
+        return nullptr;
+    }
+    return memory;
+}
+
+#endif // VM_JIT_X86_64
+
+} // namespace
+
+
+jit_program::jit_program(const vm_state& vm, code_t code)
+    : program{std::move(code)} {
+#ifdef VM_JIT_X86_64
+    const code_analysis* analysis = usable_analysis(vm, this->program);
+    if (analysis == nullptr or not analysis->verified or this->program.empty() or
+        this->program.size() > std::numeric_limits<int32_t>::max()) {
+        return;
+    }
+
+    std::vector<uint8_t> machine_code = compiler{this->program, *analysis}.compile(this->entries);
+
+    this->memory = map_executable(machine_code);
+    if (this->memory != nullptr) {
+        this->memory_size = machine_code.size();
+    }
+#else
+    (void)vm;
+#endif
+}
+
+
+jit_program::~jit_program() {
+#ifdef VM_JIT_X86_64
+    if (this->memory != nullptr) {
+        munmap(this->memory, this->memory_size);
+    }
+#endif
+}
+
+
+jit_program::jit_program(jit_program&& other) noexcept
+    : program{std::move(other.program)},
+      memory{std::exchange(other.memory, nullptr)},
+      memory_size{std::exchange(other.memory_size, 0)},
+      entries{std::move(other.entries)} {}
+
+
+jit_program& jit_program::operator=(jit_program&& other) noexcept {
+    if (this != &other) {
+        jit_program old{std::move(*this)};
+        this->program = std::move(other.program);
+        this->memory = std::exchange(other.memory, nullptr);
+        this->memory_size = std::exchange(other.memory_size, 0);
+        this->entries = std::move(other.entries);
+    }
+    return *this;
+}
+
+
+std::tuple<item_t, std::string> jit_program::run(vm_state& vm) const {
+#ifdef VM_JIT_X86_64
+    const code_analysis* analysis = nullptr;
+    if (this->memory != nullptr and not vm.debug) {
+        analysis = usable_analysis(vm, this->program);
+    }
+    if (analysis == nullptr) {
+        return vm::run(vm, this->program);
+    }
+
+    const auto enter = reinterpret_cast<entry_fn_t>(this->memory);
+    const auto* machine_code = static_cast<const uint8_t*>(this->memory);
+
+    std::exception_ptr error;
+    jit_context context{};
+    context.vm = &vm;
+    context.error = &error;
+
+    // the native code runs until EXIT, or until it leaves the code the
+    // analysis covers, then it returns nothing and the interpreter goes on
+    std::optional<item_t> result = run_flushed(vm, [&]() -> std::optional<item_t> {
+        size_t pc = vm.pc;
+        while (true) {
+            if (pc >= this->program.size()) {
+                throw vm_segfault{std::string{"Invalid instruction address."}};
+            }
+            // the native code relies on the analysis like the unchecked
+            // interpreter does, the interpreter handles everything else.
+            if (not enter_analyzed(vm, *analysis, pc)) {
+                return std::nullopt;
+            }
+
+            item_t* base = vm.stack.data();
+            sync_memory(&context);
+            context.base = base;
+            context.sp = base + vm.stack.size() - 1;
+            context.limit = base + vm.stack.capacity() - 1;
+
+            auto reason = static_cast<jit_exit>(enter(&context, machine_code + this->entries[pc]));
+
+            pc = static_cast<size_t>(context.pc);
+            vm.stack.set_size(static_cast<size_t>(context.sp - base + 1));
+            // like the interpreter, which has advanced the pc already
+            vm.pc = pc + 1;
+
+            switch (reason) {
+            case jit_exit::exit:
+                return vm.stack.top();
+
+            case jit_exit::grow:
+                vm.stack.reserve(vm.stack.capacity() * 2);
+                vm.pc = pc;
+                break;
+
+            case jit_exit::stack_empty:
+                // like popping one by one until the stack is empty
+                vm.stack.clear();
+                throw vm_stackfail{std::string{"The stack in empty."}};
+
+            case jit_exit::div_by_zero:
+                // DIV drops both operands, DIV_IMM its only one
+                vm.stack.pop();
+                if (analysis->opcodes[pc] == opcode::DIV) {
+                    vm.stack.pop();
+                }
+                throw div_by_zero{std::string{"divide by 0 error."}};
+
+            case jit_exit::error:
+                std::rethrow_exception(error);
+
+            case jit_exit::step: {
+                auto find_action = vm.instructions->actions.find(this->program[pc].first);
+                if (find_action == std::end(vm.instructions->actions)) {
+                    throw invalid_instruction{std::string{"unknown instruction at pc="} + std::to_string(pc)};
+                }
+                if (not find_action->second(vm, this->program[pc].second)) {
+                    if (vm.stack.empty()) {
+                        throw vm_stackfail{std::string{"The stack in empty."}};
+                    }
+                    return vm.stack.top();
+                }
+                break;
+            }
+            }
+            pc = vm.pc;
+        }
+    });
+    if (not result) {
+        return vm::run(vm, this->program);
+    }
+    return {*result, std::string{vm.output->view()}};
+#else
+    return vm::run(vm, this->program);
+#endif
+}
+
+
+std::tuple<item_t, std::string> run_jit(vm_state& vm, const code_t& code) {
+    return jit_program{vm, code}.run(vm);
+}
+
+
+jit_trace::jit_trace(register_trace compiled)
+    : loop{std::move(compiled)} {
+#ifdef VM_JIT_X86_64
+    std::vector<uint8_t> machine_code = trace_compiler{this->loop}.compile();
+    this->memory = map_executable(machine_code);
+    if (this->memory != nullptr) {
+        this->memory_size = machine_code.size();
+    }
+#endif
+}
+
+
+jit_trace::~jit_trace() {
+#ifdef VM_JIT_X86_64
+    if (this->memory != nullptr) {
+        munmap(this->memory, this->memory_size);
+    }
+#endif
+}
+
+
+jit_trace::jit_trace(jit_trace&& other) noexcept
+    : loop{std::move(other.loop)},
+      memory{std::exchange(other.memory, nullptr)},
+      memory_size{std::exchange(other.memory_size, 0)} {}
+
+
+jit_trace& jit_trace::operator=(jit_trace&& other) noexcept {
+    if (this != &other) {
+        jit_trace old{std::move(*this)};
+        this->loop = std::move(other.loop);
+        this->memory = std::exchange(other.memory, nullptr);
+        this->memory_size = std::exchange(other.memory_size, 0);
+    }
+    return *this;
+}
+
+
+bool jit_trace::run(vm_state& vm) const {
+#ifdef VM_JIT_X86_64
+    if (this->memory == nullptr or vm.pc != this->loop.head) {
+        return false;
+    }
+
+    // the entry is at the start of the machine code, and there is no target
+    const auto enter = reinterpret_cast<entry_fn_t>(this->memory);
+
+    std::exception_ptr error;
+    jit_context context{};
+    context.vm = &vm;
+    context.error = &error;
+
+    while (true) {
+        item_t* base = vm.stack.data();
+        context.base = base;
+        context.sp = base + vm.stack.size();
+        context.limit = base + vm.stack.capacity() - 1;
+
+        auto reason = static_cast<trace_exit>(enter(&context, nullptr));
+        item_t* fp = context.sp;
+        const auto deopt = static_cast<uint32_t>(context.pc);
+
+        switch (reason) {
+        case trace_exit::guard:
+            this->loop.restore(vm, fp, deopt);
+            return true;
+
+        case trace_exit::error:
+            // the interpreter fails after the output instruction
+            this->loop.restore(vm, fp, deopt);
+            vm.pc += 1;
+            std::rethrow_exception(error);
+
+        case trace_exit::enter:
+            vm.stack.set_size(static_cast<size_t>(fp - base));
+            if (fp + this->loop.low < base) {
+                // too few items, the interpreter reports that
+                return true;
+            }
+            vm.stack.reserve(std::max(vm.stack.capacity() * 2,
+                                      vm.stack.size() + static_cast<size_t>(this->loop.high)));
+            break;
+        }
+    }
+#else
+    (void)vm;
+    return false;
+#endif
+}
+
+} // namespace vm
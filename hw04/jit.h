@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "registers.h"
+#include "vm.h"
+
+
+namespace vm {
+
+/**
+ * a program translated to native x86-64 machine code.
+ *
+ * the built-in instructions are compiled to machine code which keeps the
+ * top stack item and the stack pointer in registers. WRITE and WRITE_CHAR
+ * call back into C++ for the output, errors leave the native code and are
+ * thrown as the usual vm exceptions by `run`.
+ *
+ * custom instructions, PRINT, the memory instructions, CALL, RET, SPAWN
+ * and JOIN also leave the native code: their action runs on the vm state,
+ * then the native code is entered again at the pc the action set.
+ *
+ * only programs with a verified analysis are compiled, see `analyze`.
+ * for others, and on platforms other than x86-64 unix, `is_native` is
+ * false and `run` interprets the program instead.
+ */
+class jit_program {
+public:
+    /**
+     * compile a program.
+     *
+     * @param vm: the vm the program was assembled and analyzed for
+     * @param code: the program, e.g. from `assemble` or `optimize`
+     */
+    jit_program(const vm_state& vm, code_t code);
+    ~jit_program();
+
+    jit_program(jit_program&& other) noexcept;
+    jit_program& operator=(jit_program&& other) noexcept;
+    jit_program(const jit_program&) = delete;
+    jit_program& operator=(const jit_program&) = delete;
+
+    /** was the program compiled to native code? */
+    bool is_native() const { return this->memory != nullptr; }
+
+    /** the program that was compiled */
+    const code_t& code() const { return this->program; }
+
+    /**
+     * run the program from `vm.pc`, with the same results, output and
+     * exceptions as `vm::run`.
+     *
+     * @param vm: a vm that resolves the op ids like the one the program
+     *            was compiled for, otherwise the program is interpreted
+     */
+    std::tuple<item_t, std::string> run(vm_state& vm) const;
+
+private:
+    code_t program;
+
+    /** the executable code, which starts with the entry stub */
+    void* memory = nullptr;
+    size_t memory_size = 0;
+
+    /** offset of each instruction's machine code in `memory` */
+    std::vector<uint32_t> entries;
+};
+
+
+/**
+ * compile the code to native code and run it, see `jit_program`.
+ */
+std::tuple<item_t, std::string> run_jit(vm_state& vm, const code_t& code);
+
+
+
+/**
+ * a loop trace compiled to native x86-64 code, see `register_trace`.
+ *
+ * the native code runs iterations of the trace on the vm's stack until a
+ * guard fails, then the vm is in the state before the instruction of the
+ * guard, so the interpreter can continue there.
+ */
+class jit_trace {
+public:
+    explicit jit_trace(register_trace compiled);
+    ~jit_trace();
+
+    jit_trace(jit_trace&& other) noexcept;
+    jit_trace& operator=(jit_trace&& other) noexcept;
+    jit_trace(const jit_trace&) = delete;
+    jit_trace& operator=(const jit_trace&) = delete;
+
+    /** was the trace compiled to native code? */
+    bool is_native() const { return this->memory != nullptr; }
+
+    /** the trace that was compiled */
+    const register_trace& trace() const { return this->loop; }
+
+    /**
+     * run the trace from its head, which `vm.pc` has to be at.
+     * the exceptions of the output are thrown like by `vm::run`.
+     *
+     * @return false if the trace wasn't run, because it isn't native
+     *         or the vm isn't at its head
+     */
+    bool run(vm_state& vm) const;
+
+private:
+    register_trace loop;
+
+    void* memory = nullptr;
+    size_t memory_size = 0;
+};
+
+} // namespace vm
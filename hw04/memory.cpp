@@ -0,0 +1,16 @@
+#include "memory.h"
+
+#include <string>
+
+#include "vm.h"
+
+
+namespace vm {
+
+void memory_fault(int64_t address, int64_t count, size_t size) {
+    throw vm_segfault{"Invalid memory access of " + std::to_string(count) +
+                      " items at " + std::to_string(address) +
+                      ", the memory has " + std::to_string(size) + " items."};
+}
+
+} // namespace vm
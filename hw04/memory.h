@@ -0,0 +1,358 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+namespace vm {
+
+/**
+ * throw the `vm_segfault` for an access outside of the memory.
+ * out of line, so the inlined bounds checks stay small.
+ */
+[[noreturn]] void memory_fault(int64_t address, int64_t count, size_t size);
+
+
+/**
+ * flat linear memory of the vm, addressed by item index from 0.
+ *
+ * it is empty at first, and grows in pages of `page_size` zeroed items,
+ * see `grow`. all accesses are bounds checked: the bulk operations check
+ * their whole range once, and then work on the plain items of each page
+ * in loops the compiler can vectorize.
+ *
+ * copies of the memory, e.g. in a `vm_snapshot`, share the pages until
+ * one of them writes to a page, which then gets its own copy of just that
+ * page. the page table is shared in groups of `group_size` pages the same
+ * way, so copying the memory costs about one pointer per group, and
+ * writing after a copy about the pages that are written.
+ * the pages that were never written all share one zeroed page.
+ *
+ * once it is written to, the memory also keeps flat tables of its pages,
+ * see `page_items`, so accesses index them instead of the groups.
+ */
+template <typename T>
+class linear_memory {
+public:
+    using value_type = T;
+    using size_type = size_t;
+
+    /** number of items per page, i.e. 4 KiB of 64 bit items */
+    static constexpr size_type page_size = 512;
+
+    /** the memory never grows beyond this many pages */
+    static constexpr size_type max_pages = size_type{1} << 16;
+
+    /** number of pages per group of the page table */
+    static constexpr size_type group_size = 64;
+
+    /** the page of an address is `address >> page_shift` */
+    static constexpr unsigned page_shift = std::countr_zero(page_size);
+    static_assert(page_size == size_type{1} << page_shift);
+
+    linear_memory() = default;
+
+    /** share the pages of the other memory */
+    linear_memory(const linear_memory& other)
+        :
+        groups{other.groups},
+        page_count{other.page_count} {
+        other.forget_tables();
+    }
+
+    linear_memory(linear_memory&& other) noexcept
+        :
+        groups{std::move(other.groups)},
+        page_count{std::exchange(other.page_count, 0)} {
+        other.forget_tables();
+    }
+
+    linear_memory& operator=(const linear_memory& other) {
+        if (this != &other) {
+            this->groups = other.groups;
+            this->page_count = other.page_count;
+            other.forget_tables();
+            this->forget_tables();
+        }
+        return *this;
+    }
+
+    linear_memory& operator=(linear_memory&& other) noexcept {
+        this->groups = std::move(other.groups);
+        this->page_count = std::exchange(other.page_count, 0);
+        other.forget_tables();
+        this->forget_tables();
+        return *this;
+    }
+
+    /** number of pages */
+    size_type pages() const { return this->page_count; }
+
+    /** number of items */
+    size_type size() const { return this->page_count * page_size; }
+
+    /**
+     * flat table with the items of each page, for code that indexes the
+     * pages itself, like the native code of `jit_program`.
+     * it is valid until the memory grows, is cleared, copied or assigned to.
+     */
+    const T* const* page_items() {
+        this->build_tables();
+        return this->read_table.data();
+    }
+
+    /**
+     * like `page_items`, but only with the pages no copy shares, which can
+     * be written to right away. the other entries are nullptr, `store`
+     * fills them in.
+     */
+    T* const* owned_page_items() {
+        this->build_tables();
+        return this->write_table.data();
+    }
+
+    /**
+     * add `count` zeroed pages at the end.
+     *
+     * @return the previous number of pages, or -1 if the memory would
+     *         exceed `max_pages`, then it stays as it is.
+     */
+    int64_t grow(int64_t count) {
+        const size_type previous = this->page_count;
+        if (count < 0 or static_cast<uint64_t>(count) > max_pages - previous) {
+            return -1;
+        }
+        const size_type total = previous + static_cast<size_type>(count);
+        if (previous % group_size != 0 and total > previous) {
+            this->own_group(previous / group_size);
+        }
+        for (size_type index = previous; index < total; index++) {
+            if (index % group_size == 0) {
+                this->groups.push_back(std::make_shared<group>());
+            }
+            this->groups.back()->pages[index % group_size] = zero_page();
+        }
+        if (not this->read_table.empty()) {
+            this->read_table.resize(total, zero_page()->items);
+            this->write_table.resize(total, nullptr);
+        }
+        this->page_count = total;
+        return static_cast<int64_t>(previous);
+    }
+
+    /** drop all pages */
+    void clear() {
+        this->forget_tables();
+        this->groups.clear();
+        this->page_count = 0;
+    }
+
+    /**
+     * check that `count` items from `address` are in the memory.
+     *
+     * @return the address as index
+     */
+    size_type check(int64_t address, int64_t count) const {
+        const uint64_t size = this->size();
+        if (address < 0 or count < 0 or static_cast<uint64_t>(address) > size or
+            static_cast<uint64_t>(count) > size - static_cast<uint64_t>(address)) [[unlikely]] {
+            memory_fault(address, count, this->size());
+        }
+        return static_cast<size_type>(address);
+    }
+
+    T load(int64_t address) const {
+        const size_type index = this->check(address, 1);
+        return this->read(index / page_size)[index % page_size];
+    }
+
+    void store(int64_t address, const T& item) {
+        const size_type index = this->check(address, 1);
+        this->write(index / page_size)[index % page_size] = item;
+    }
+
+    /** copy `count` items from `source` to `target`, the ranges may overlap */
+    void copy(int64_t target, int64_t source, int64_t count) {
+        size_type to = this->check(target, count);
+        size_type from = this->check(source, count);
+        size_type left = static_cast<size_type>(count);
+        static_assert(std::is_trivially_copyable_v<T>);
+
+        // in pieces within one page of both ranges. like memmove, the
+        // direction makes sure overlapping items are read before they
+        // are overwritten. the target page is written first, in case it
+        // is the source page and gets copied.
+        if (to <= from) {
+            while (left > 0) {
+                const size_type piece = std::min({left, page_size - to % page_size,
+                                                  page_size - from % page_size});
+                T* target_items = this->write(to / page_size) + to % page_size;
+                std::memmove(target_items, this->read(from / page_size) + from % page_size,
+                             piece * sizeof(T));
+                to += piece;
+                from += piece;
+                left -= piece;
+            }
+        }
+        else {
+            to += left;
+            from += left;
+            while (left > 0) {
+                const size_type piece = std::min({left, (to - 1) % page_size + 1,
+                                                  (from - 1) % page_size + 1});
+                to -= piece;
+                from -= piece;
+                left -= piece;
+                T* target_items = this->write(to / page_size) + to % page_size;
+                std::memmove(target_items, this->read(from / page_size) + from % page_size,
+                             piece * sizeof(T));
+            }
+        }
+    }
+
+    /** set `count` items from `target` to `item` */
+    void fill(int64_t target, const T& item, int64_t count) {
+        size_type index = this->check(target, count);
+        size_type left = static_cast<size_type>(count);
+        while (left > 0) {
+            const size_type piece = std::min(left, page_size - index % page_size);
+            T* first = this->write(index / page_size) + index % page_size;
+            for (size_type i = 0; i < piece; i++) {
+                first[i] = item;
+            }
+            index += piece;
+            left -= piece;
+        }
+    }
+
+    /**
+     * add up `count` items from `address`.
+     * integers wrap around on overflow like `ADD` does on the hardware.
+     */
+    T sum(int64_t address, int64_t count) const {
+        size_type index = this->check(address, count);
+        size_type left = static_cast<size_type>(count);
+
+        // independent lanes, so the additions don't wait on each other.
+        // there are as many as fit in 32 bytes, so narrower items are
+        // added up in more lanes of the same vector registers.
+        using sum_t = typename std::conditional_t<std::is_integral_v<T>, std::make_unsigned<T>,
+                                                  std::type_identity<T>>::type;
+        constexpr size_type lane_count = sizeof(T) < 8 ? 32 / sizeof(T) : 4;
+        sum_t lanes[lane_count] = {};
+        while (left > 0) {
+            const size_type n = std::min(left, page_size - index % page_size);
+            const T* first = this->read(index / page_size) + index % page_size;
+            size_type i = 0;
+            for (; i + lane_count <= n; i += lane_count) {
+                for (size_type lane = 0; lane < lane_count; lane++) {
+                    lanes[lane] += static_cast<sum_t>(first[i + lane]);
+                }
+            }
+            for (; i < n; i++) {
+                lanes[0] += static_cast<sum_t>(first[i]);
+            }
+            index += n;
+            left -= n;
+        }
+        sum_t total{};
+        for (size_type lane = 0; lane < lane_count; lane++) {
+            total += lanes[lane];
+        }
+        return static_cast<T>(total);
+    }
+
+private:
+    struct page {
+        T items[page_size]{};
+    };
+
+    struct group {
+        std::shared_ptr<page> pages[group_size];
+    };
+
+    /** the page of all pages that were never written, it is never written itself */
+    static const std::shared_ptr<page>& zero_page() {
+        static const std::shared_ptr<page> zero = std::make_shared<page>();
+        return zero;
+    }
+
+    const T* read(size_type index) const {
+        if (index < this->read_table.size()) {
+            return this->read_table[index];
+        }
+        return this->groups[index / group_size]->pages[index % group_size]->items;
+    }
+
+    T* write(size_type index) {
+        if (index < this->write_table.size() and this->write_table[index] != nullptr) [[likely]] {
+            return this->write_table[index];
+        }
+        return this->own_page(index);
+    }
+
+    /** the items of the page, which is copied first if it is shared */
+    T* own_page(size_type index) {
+        std::shared_ptr<page>& slot = this->own_group(index / group_size).pages[index % group_size];
+        if (slot.use_count() != 1) {
+            slot = std::make_shared<page>(*slot);
+        }
+        this->build_tables();
+        this->read_table[index] = slot->items;
+        this->write_table[index] = slot->items;
+        return slot->items;
+    }
+
+    /** fill in the tables, unless they are complete */
+    void build_tables() {
+        if (this->read_table.size() == this->page_count) {
+            return;
+        }
+        this->read_table.resize(this->page_count);
+        for (size_type index = 0; index < this->page_count; index++) {
+            this->read_table[index] = this->groups[index / group_size]->pages[index % group_size]->items;
+        }
+        // pages are only known to be owned once they are written
+        this->write_table.assign(this->page_count, nullptr);
+    }
+
+    /**
+     * the pages may be shared from now on.
+     * a memory that was never written to is left as it is, so copying it
+     * from several threads at once is fine, e.g. in `vm_snapshot::fork`.
+     */
+    void forget_tables() const {
+        if (not this->read_table.empty()) {
+            this->read_table.clear();
+            this->write_table.clear();
+        }
+    }
+
+    /** the group of the page table, which is copied first if it is shared */
+    group& own_group(size_type index) {
+        std::shared_ptr<group>& slot = this->groups[index];
+        if (slot.use_count() != 1) {
+            slot = std::make_shared<group>(*slot);
+        }
+        return *slot;
+    }
+
+    std::vector<std::shared_ptr<group>> groups;
+    size_type page_count = 0;
+
+    /**
+     * the tables of `page_items` and `owned_page_items`, empty until they
+     * are needed. they are only this memory's until the memory is copied.
+     */
+    mutable std::vector<const T*> read_table;
+    mutable std::vector<T*> write_table;
+};
+
+} // namespace vm
@@ -0,0 +1,389 @@
+#include "optimize.h"
+
+#include <array>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "analysis.h"
+
+
+namespace vm {
+
+namespace {
+
+/**
+ * an instruction with its resolved opcode, while optimizing.
+ */
+struct instruction {
+    opcode op;
+    item_t arg;
+};
+
+
+/** number of built-in opcodes */
+constexpr size_t builtin_count = static_cast<size_t>(opcode::CUSTOM);
+
+/** marks built-in opcodes the vm has no op id for */
+constexpr op_id_t no_op_id = std::numeric_limits<op_id_t>::max();
+
+
+/**
+ * does the instruction have a jump target as argument?
+ */
+bool has_target(opcode op) {
+    switch (op) {
+    case opcode::JMP:
+    case opcode::JMPZ:
+    case opcode::JMP_EQ:
+    case opcode::JMP_NEQ:
+    case opcode::DUP_JMPZ:
+    case opcode::CALL:
+    case opcode::TAIL_CALL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+/**
+ * can execution continue with the next instruction?
+ * for CALL it does when the subroutine returns.
+ */
+bool falls_through(opcode op) {
+    return op != opcode::EXIT and op != opcode::JMP and op != opcode::RET and
+           op != opcode::TAIL_CALL;
+}
+
+
+bool in_program(item_t target, size_t size) {
+    return target >= 0 and static_cast<size_t>(target) < size;
+}
+
+
+/**
+ * which instructions can be reached from pc 0?
+ */
+std::vector<bool> find_reachable(const std::vector<instruction>& program) {
+    std::vector<bool> reachable(program.size(), false);
+    std::vector<size_t> worklist;
+
+    auto visit = [&](item_t target) {
+        if (in_program(target, program.size()) and not reachable[static_cast<size_t>(target)]) {
+            reachable[static_cast<size_t>(target)] = true;
+            worklist.push_back(static_cast<size_t>(target));
+        }
+    };
+
+    visit(0);
+    while (not worklist.empty()) {
+        size_t pc = worklist.back();
+        worklist.pop_back();
+
+        const instruction& ins = program[pc];
+        if (falls_through(ins.op)) {
+            visit(static_cast<item_t>(pc + 1));
+        }
+        if (has_target(ins.op)) {
+            visit(ins.arg);
+        }
+    }
+    return reachable;
+}
+
+
+/**
+ * which instructions are jumped to?
+ * fused instruction sequences must not be entered in their middle.
+ */
+std::vector<bool> find_jump_targets(const std::vector<instruction>& program) {
+    std::vector<bool> targets(program.size(), false);
+    for (const auto& ins : program) {
+        if (has_target(ins.op) and in_program(ins.arg, program.size())) {
+            targets[static_cast<size_t>(ins.arg)] = true;
+        }
+    }
+    return targets;
+}
+
+
+/**
+ * compute `a op b` for constant folding.
+ * returns false if the operation has to stay, e.g. because it throws.
+ */
+bool fold(opcode op, item_t a, item_t b, item_t& result) {
+    // wrap around like the hardware does instead of overflowing
+    auto wrap = [](uint64_t value) { return static_cast<item_t>(value); };
+
+    switch (op) {
+    case opcode::ADD:
+        result = wrap(static_cast<uint64_t>(a) + static_cast<uint64_t>(b));
+        return true;
+    case opcode::DIV:
+        if (b == 0 or (a == std::numeric_limits<item_t>::min() and b == -1)) {
+            return false;
+        }
+        result = a / b;
+        return true;
+    case opcode::EQ:
+        result = static_cast<item_t>(a == b);
+        return true;
+    case opcode::NEQ:
+        result = static_cast<item_t>(a != b);
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+/**
+ * the operation a superinstruction with an immediate argument does,
+ * CUSTOM for anything else.
+ */
+opcode immediate_base(opcode op) {
+    switch (op) {
+    case opcode::ADD_IMM: return opcode::ADD;
+    case opcode::DIV_IMM: return opcode::DIV;
+    case opcode::EQ_IMM:  return opcode::EQ;
+    case opcode::NEQ_IMM: return opcode::NEQ;
+    default:              return opcode::CUSTOM;
+    }
+}
+
+
+/**
+ * let jumps that target an unconditional jump go to its target directly.
+ */
+bool thread_jumps(std::vector<instruction>& program) {
+    bool changed = false;
+    for (auto& ins : program) {
+        if (not has_target(ins.op)) {
+            continue;
+        }
+        // bounded, so jump cycles terminate
+        for (size_t hops = 0; hops < program.size(); hops++) {
+            if (not in_program(ins.arg, program.size())) {
+                break;
+            }
+            const instruction& target = program[static_cast<size_t>(ins.arg)];
+            if (target.op != opcode::JMP or target.arg == ins.arg) {
+                break;
+            }
+            ins.arg = target.arg;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+
+/**
+ * one round of peephole rewrites and dead code removal.
+ * returns true if the program was changed.
+ */
+bool rewrite(std::vector<instruction>& program,
+             const std::array<op_id_t, builtin_count>& op_ids) {
+    const size_t size = program.size();
+    const std::vector<bool> reachable = find_reachable(program);
+    const std::vector<bool> targets = find_jump_targets(program);
+
+    auto available = [&](opcode op) {
+        return op_ids[static_cast<size_t>(op)] != no_op_id;
+    };
+
+    // can the `count` instructions after `pc` be merged into it?
+    auto fusable = [&](size_t pc, size_t count) {
+        for (size_t k = 1; k <= count; k++) {
+            if (pc + k >= size or targets[pc + k]) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    std::vector<instruction> result;
+    result.reserve(size);
+
+    // where each old instruction ended up, for remapping the jump targets
+    std::vector<size_t> new_index(size + 1);
+    bool changed = false;
+
+    size_t pc = 0;
+    while (pc < size) {
+        new_index[pc] = result.size();
+
+        if (not reachable[pc]) {
+            changed = true;
+            pc += 1;
+            continue;
+        }
+
+        const instruction& ins = program[pc];
+        const opcode next = fusable(pc, 1) ? program[pc + 1].op : opcode::CUSTOM;
+        const opcode after_next = fusable(pc, 2) ? program[pc + 2].op : opcode::CUSTOM;
+
+        size_t consumed = 1;
+        item_t folded;
+
+        if (ins.op == opcode::LOAD_CONST and next == opcode::LOAD_CONST and
+            fold(after_next, ins.arg, program[pc + 1].arg, folded)) {
+            result.push_back({opcode::LOAD_CONST, folded});
+            consumed = 3;
+        }
+        else if (ins.op == opcode::LOAD_CONST and next != opcode::CUSTOM and
+                 fold(immediate_base(next), ins.arg, program[pc + 1].arg, folded)) {
+            result.push_back({opcode::LOAD_CONST, folded});
+            consumed = 2;
+        }
+        else if (ins.op == opcode::LOAD_CONST and next == opcode::POP) {
+            consumed = 2;
+        }
+        else if (ins.op == opcode::LOAD_CONST and next == opcode::JMPZ) {
+            if (ins.arg == 0) {
+                result.push_back({opcode::JMP, program[pc + 1].arg});
+            }
+            consumed = 2;
+        }
+        else if (ins.op == opcode::LOAD_CONST and next == opcode::DUP) {
+            // lets the constant fold with what comes next
+            result.push_back(ins);
+            result.push_back(ins);
+            consumed = 2;
+        }
+        else if (ins.op == opcode::LOAD_CONST and next == opcode::WRITE and
+                 after_next == opcode::POP and available(opcode::WRITE_IMM)) {
+            result.push_back({opcode::WRITE_IMM, ins.arg});
+            consumed = 3;
+        }
+        else if (ins.op == opcode::LOAD_CONST and next == opcode::WRITE_CHAR and
+                 after_next == opcode::POP and available(opcode::WRITE_CHAR_IMM)) {
+            result.push_back({opcode::WRITE_CHAR_IMM, ins.arg});
+            consumed = 3;
+        }
+        else if (ins.op == opcode::LOAD_CONST and next == opcode::ADD and
+                 available(opcode::ADD_IMM)) {
+            result.push_back({opcode::ADD_IMM, ins.arg});
+            consumed = 2;
+        }
+        else if (ins.op == opcode::LOAD_CONST and next == opcode::DIV and
+                 ins.arg != 0 and available(opcode::DIV_IMM)) {
+            result.push_back({opcode::DIV_IMM, ins.arg});
+            consumed = 2;
+        }
+        else if (ins.op == opcode::LOAD_CONST and next == opcode::EQ and
+                 available(opcode::EQ_IMM)) {
+            result.push_back({opcode::EQ_IMM, ins.arg});
+            consumed = 2;
+        }
+        else if (ins.op == opcode::LOAD_CONST and next == opcode::NEQ and
+                 available(opcode::NEQ_IMM)) {
+            result.push_back({opcode::NEQ_IMM, ins.arg});
+            consumed = 2;
+        }
+        else if (ins.op == opcode::ADD_IMM and next == opcode::ADD_IMM) {
+            uint64_t sum = static_cast<uint64_t>(ins.arg) + static_cast<uint64_t>(program[pc + 1].arg);
+            result.push_back({opcode::ADD_IMM, static_cast<item_t>(sum)});
+            consumed = 2;
+        }
+        else if (ins.op == opcode::EQ and next == opcode::JMPZ and
+                 available(opcode::JMP_NEQ)) {
+            result.push_back({opcode::JMP_NEQ, program[pc + 1].arg});
+            consumed = 2;
+        }
+        else if (ins.op == opcode::NEQ and next == opcode::JMPZ and
+                 available(opcode::JMP_EQ)) {
+            result.push_back({opcode::JMP_EQ, program[pc + 1].arg});
+            consumed = 2;
+        }
+        else if (ins.op == opcode::DUP and next == opcode::JMPZ and
+                 available(opcode::DUP_JMPZ)) {
+            result.push_back({opcode::DUP_JMPZ, program[pc + 1].arg});
+            consumed = 2;
+        }
+        else if (ins.op == opcode::JMP and ins.arg == static_cast<item_t>(pc + 1) and
+                 pc + 1 < size) {
+            // jump to the next instruction
+        }
+        else {
+            result.push_back(ins);
+        }
+
+        if (consumed > 1 or result.size() != new_index[pc] + 1) {
+            changed = true;
+        }
+        for (size_t k = 1; k < consumed; k++) {
+            new_index[pc + k] = new_index[pc];
+        }
+        pc += consumed;
+    }
+    new_index[size] = result.size();
+
+    // the targets still refer to the old positions
+    for (auto& ins : result) {
+        if (not has_target(ins.op)) {
+            continue;
+        }
+        if (in_program(ins.arg, size)) {
+            ins.arg = static_cast<item_t>(new_index[static_cast<size_t>(ins.arg)]);
+        }
+        else {
+            // keep it invalid, so it still segfaults
+            ins.arg = -1;
+        }
+    }
+
+    program = std::move(result);
+    return changed;
+}
+
+} // namespace
+
+
+code_t optimize(const vm_state& vm, code_t code) {
+    std::array<op_id_t, builtin_count> op_ids;
+    op_ids.fill(no_op_id);
+    for (op_id_t op_id = vm.instructions->opcodes.size(); op_id-- > 0;) {
+        opcode op = vm.instructions->opcodes[op_id];
+        if (op != opcode::CUSTOM) {
+            op_ids[static_cast<size_t>(op)] = op_id;
+        }
+    }
+
+    std::vector<instruction> program;
+    program.reserve(code.size());
+    bool has_custom = false;
+    for (const auto& [op_id, arg] : code) {
+        opcode op = opcode::CUSTOM;
+        if (op_id < vm.instructions->opcodes.size()) {
+            op = vm.instructions->opcodes[op_id];
+        }
+        has_custom = has_custom or op == opcode::CUSTOM;
+        program.push_back({op, arg});
+    }
+
+    if (has_custom) {
+        if (code.get_analysis() == nullptr) {
+            code.set_analysis(std::make_shared<code_analysis>(analyze(vm, code)));
+        }
+        return code;
+    }
+
+    // each round can enable new rewrites in the next one
+    bool changed = true;
+    while (changed) {
+        changed = thread_jumps(program);
+        changed = rewrite(program, op_ids) or changed;
+    }
+
+    code_t result;
+    result.reserve(program.size());
+    for (const auto& ins : program) {
+        result.emplace_back(op_ids[static_cast<size_t>(ins.op)], ins.arg);
+    }
+    result.set_analysis(std::make_shared<code_analysis>(analyze(vm, result)));
+    return result;
+}
+
+} // namespace vm
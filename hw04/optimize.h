@@ -0,0 +1,33 @@
+#pragma once
+
+#include "vm.h"
+
+
+namespace vm {
+
+/**
+ * rewrite a program so it runs with fewer instructions.
+ *
+ * - common instruction sequences are fused to superinstructions,
+ *   e.g. `LOAD_CONST x; ADD` becomes `ADD_IMM x`
+ * - expressions on constants are folded, e.g. `LOAD_CONST 1; LOAD_CONST 2; ADD`
+ *   becomes `LOAD_CONST 3`
+ * - instructions that can't be reached from pc 0 are removed
+ * - jumps to jumps are shortened and all jump targets are remapped,
+ *   including the ones of CALL and TAIL_CALL. a CALL still returns to the
+ *   instruction after it.
+ *
+ * the optimized program has the same results, output and exception types
+ * as the original when run from pc 0.
+ *
+ * custom instructions can set the pc to any address of the original program,
+ * so programs containing them are returned unchanged.
+ *
+ * @param vm: which vm the program was assembled for
+ * @param code: the program to optimize
+ *
+ * @return the optimized program, analyzed for `vm`
+ */
+code_t optimize(const vm_state& vm, code_t code);
+
+} // namespace vm
@@ -0,0 +1,150 @@
+#include "pool.h"
+
+#include <algorithm>
+#include <utility>
+
+
+namespace vm {
+
+work_pool::work_pool(size_t threads) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    for (size_t i = 0; i < threads; i++) {
+        this->queues.push_back(std::make_unique<range_queue>());
+    }
+    // the thread calling parallel_for is worker 0
+    for (size_t worker = 1; worker < threads; worker++) {
+        this->threads.emplace_back(&work_pool::worker_loop, this, worker);
+    }
+}
+
+
+work_pool::~work_pool() {
+    {
+        std::lock_guard guard{this->state_lock};
+        this->stopping = true;
+    }
+    this->wake.notify_all();
+    for (auto& thread : this->threads) {
+        thread.join();
+    }
+}
+
+
+void work_pool::parallel_for(size_t count, const task_t& task) {
+    if (count == 0) {
+        return;
+    }
+
+    // equal shares, the first ones get the remainder
+    const size_t workers = this->size();
+    size_t begin = 0;
+    for (size_t worker = 0; worker < workers; worker++) {
+        size_t share = count / workers + (worker < count % workers ? 1 : 0);
+        std::lock_guard guard{this->queues[worker]->lock};
+        this->queues[worker]->begin = begin;
+        this->queues[worker]->end = begin + share;
+        begin += share;
+    }
+
+    {
+        std::lock_guard guard{this->state_lock};
+        this->task = &task;
+        this->error = nullptr;
+        this->busy = workers;
+        this->generation++;
+    }
+    this->wake.notify_all();
+
+    this->work(0);
+
+    std::unique_lock guard{this->state_lock};
+    this->finished.wait(guard, [this] { return this->busy == 0; });
+    this->task = nullptr;
+
+    if (this->error) {
+        std::rethrow_exception(std::exchange(this->error, nullptr));
+    }
+}
+
+
+void work_pool::worker_loop(size_t worker) {
+    size_t seen_generation = 0;
+    while (true) {
+        {
+            std::unique_lock guard{this->state_lock};
+            this->wake.wait(guard, [&] {
+                return this->stopping or this->generation != seen_generation;
+            });
+            if (this->stopping) {
+                return;
+            }
+            seen_generation = this->generation;
+        }
+        this->work(worker);
+    }
+}
+
+
+void work_pool::work(size_t worker) {
+    size_t index;
+    while (this->take(worker, index)) {
+        try {
+            (*this->task)(worker, index);
+        }
+        catch (...) {
+            std::lock_guard guard{this->state_lock};
+            if (not this->error) {
+                this->error = std::current_exception();
+            }
+        }
+    }
+
+    std::lock_guard guard{this->state_lock};
+    this->busy -= 1;
+    if (this->busy == 0) {
+        this->finished.notify_one();
+    }
+}
+
+
+bool work_pool::take(size_t worker, size_t& index) {
+    range_queue& own = *this->queues[worker];
+    {
+        std::lock_guard guard{own.lock};
+        if (own.begin < own.end) {
+            index = own.begin++;
+            return true;
+        }
+    }
+
+    // steal the back half of the next worker that has indices left
+    const size_t workers = this->size();
+    for (size_t offset = 1; offset < workers; offset++) {
+        range_queue& victim = *this->queues[(worker + offset) % workers];
+
+        size_t begin, end;
+        {
+            std::lock_guard guard{victim.lock};
+            size_t left = victim.end - victim.begin;
+            if (left == 0) {
+                continue;
+            }
+            end = victim.end;
+            begin = end - (left + 1) / 2;
+            victim.end = begin;
+        }
+
+        // only this worker fills its own queue, and it was empty
+        std::lock_guard guard{own.lock};
+        own.begin = begin + 1;
+        own.end = end;
+        index = begin;
+        return true;
+    }
+    return false;
+}
+
+} // namespace vm
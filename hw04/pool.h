@@ -0,0 +1,86 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace vm {
+
+/**
+ * a fixed set of worker threads that process index ranges with work stealing.
+ *
+ * each worker starts with an equal share of the indices. once its share
+ * is done, it steals half of the remaining indices of another worker, so
+ * uneven work still keeps all workers busy.
+ */
+class work_pool {
+public:
+    /**
+     * type of the function run for each index.
+     * it gets the number of the worker (< `size()`) and the index.
+     */
+    using task_t = std::function<void(size_t worker, size_t index)>;
+
+    /**
+     * start the workers.
+     * @param threads: number of workers, 0 for one per hardware thread
+     */
+    explicit work_pool(size_t threads = 0);
+    ~work_pool();
+
+    work_pool(const work_pool&) = delete;
+    work_pool& operator=(const work_pool&) = delete;
+
+    /** number of workers, including the thread calling `parallel_for` */
+    size_t size() const { return this->queues.size(); }
+
+    /**
+     * run `task` for all indices in [0, count) and wait until all are done.
+     * the calling thread works as worker 0.
+     *
+     * if tasks throw, all others still run, then the first exception is rethrown.
+     * only one thread may call this at a time.
+     */
+    void parallel_for(size_t count, const task_t& task);
+
+private:
+    /** the indices a worker has yet to process */
+    struct alignas(64) range_queue {
+        std::mutex lock;
+        size_t begin = 0;
+        size_t end = 0;
+    };
+
+    /** wait for work, until the pool is destroyed */
+    void worker_loop(size_t worker);
+
+    /** process indices until none are left anywhere */
+    void work(size_t worker);
+
+    /** get the next index from the own queue, or steal some */
+    bool take(size_t worker, size_t& index);
+
+    std::vector<std::unique_ptr<range_queue>> queues;
+    std::vector<std::thread> threads;
+
+    std::mutex state_lock;
+    std::condition_variable wake;
+    std::condition_variable finished;
+
+    /** the current task, while `parallel_for` runs */
+    const task_t* task = nullptr;
+    /** incremented for each `parallel_for`, so workers see new work */
+    size_t generation = 0;
+    /** workers still busy with the current task */
+    size_t busy = 0;
+    bool stopping = false;
+    std::exception_ptr error;
+};
+
+} // namespace vm
@@ -0,0 +1,316 @@
+#include "profile.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <ostream>
+#include <sstream>
+
+
+namespace vm {
+
+namespace {
+
+/**
+ * is the instruction a jump, and does it only jump sometimes?
+ */
+bool is_jump(const vm_state& vm, op_id_t op_id, bool* conditional = nullptr) {
+    opcode op = opcode::CUSTOM;
+    if (op_id < vm.instructions->opcodes.size()) {
+        op = vm.instructions->opcodes[op_id];
+    }
+
+    bool jump_if = false;
+    switch (op) {
+    case opcode::JMP:
+        break;
+    case opcode::JMPZ:
+    case opcode::JMP_EQ:
+    case opcode::JMP_NEQ:
+    case opcode::DUP_JMPZ:
+        jump_if = true;
+        break;
+    default:
+        return false;
+    }
+
+    if (conditional != nullptr) {
+        *conditional = jump_if;
+    }
+    return true;
+}
+
+
+std::string name_of(const vm_state& vm, op_id_t op_id) {
+    auto find_name = vm.instructions->names.find(op_id);
+    if (find_name == std::end(vm.instructions->names)) {
+        return "op " + std::to_string(op_id);
+    }
+    return find_name->second;
+}
+
+
+/**
+ * the value of an execution_profile vector at pc, 0 if it wasn't measured.
+ */
+uint64_t at(const std::vector<uint64_t>& values, size_t pc) {
+    return pc < values.size() ? values[pc] : 0;
+}
+
+
+/**
+ * executions and cycles of each instruction, summed over all pcs.
+ */
+struct instruction_total {
+    std::string name;
+    uint64_t count = 0;
+    uint64_t cycles = 0;
+};
+
+
+/**
+ * sum up the profile per instruction name, the most executed first.
+ */
+std::vector<instruction_total> instruction_totals(const vm_state& vm, const code_t& code,
+                                                  const execution_profile& profile) {
+    std::map<op_id_t, instruction_total> totals;
+    for (size_t pc = 0; pc < code.size(); pc++) {
+        uint64_t hits = at(profile.hits, pc);
+        if (hits == 0) {
+            continue;
+        }
+        auto& total = totals[code[pc].first];
+        total.count += hits;
+        total.cycles += at(profile.cycles, pc);
+    }
+
+    std::vector<instruction_total> result;
+    for (auto& [op_id, total] : totals) {
+        total.name = name_of(vm, op_id);
+        result.push_back(std::move(total));
+    }
+    std::stable_sort(result.begin(), result.end(), [](const auto& a, const auto& b) {
+        return a.count > b.count;
+    });
+    return result;
+}
+
+
+/**
+ * write a string as json string literal.
+ */
+void write_json_string(std::ostream& out, std::string_view text) {
+    out << '"';
+    for (char c : text) {
+        switch (c) {
+        case '"':  out << "\\\""; break;
+        case '\\': out << "\\\\"; break;
+        case '\n': out << "\\n"; break;
+        case '\t': out << "\\t"; break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out << escaped;
+            }
+            else {
+                out << c;
+            }
+        }
+    }
+    out << '"';
+}
+
+
+/**
+ * write a string as csv field, quoted if needed.
+ */
+void write_csv_field(std::ostream& out, std::string_view text) {
+    if (text.find_first_of(",\"\n") == std::string_view::npos) {
+        out << text;
+        return;
+    }
+    out << '"';
+    for (char c : text) {
+        if (c == '"') {
+            out << '"';
+        }
+        out << c;
+    }
+    out << '"';
+}
+
+} // namespace
+
+
+std::vector<hot_loop> find_hot_loops(const vm_state& vm, const code_t& code,
+                                     const execution_profile& profile) {
+    std::vector<hot_loop> loops;
+    for (size_t pc = 0; pc < code.size(); pc++) {
+        const auto& [op_id, arg] = code[pc];
+        bool conditional;
+        if (not is_jump(vm, op_id, &conditional) or
+            arg < 0 or static_cast<size_t>(arg) > pc) {
+            continue;
+        }
+
+        uint64_t iterations = conditional ? at(profile.taken, pc) : at(profile.hits, pc);
+        if (iterations == 0) {
+            continue;
+        }
+
+        hot_loop loop{static_cast<size_t>(arg), pc, iterations, 0};
+        for (size_t body = loop.start; body <= loop.end; body++) {
+            loop.instructions += at(profile.hits, body);
+        }
+        loops.push_back(loop);
+    }
+
+    std::stable_sort(loops.begin(), loops.end(), [](const hot_loop& a, const hot_loop& b) {
+        return a.instructions > b.instructions;
+    });
+    return loops;
+}
+
+
+void write_profile_json(std::ostream& out, const vm_state& vm, const code_t& code,
+                        const execution_profile& profile) {
+    uint64_t executed = 0;
+    for (uint64_t hits : profile.hits) {
+        executed += hits;
+    }
+
+    out << "{\n  \"executed\": " << executed << ",\n";
+
+    out << "  \"instructions\": [";
+    const char* separator = "\n";
+    for (const auto& total : instruction_totals(vm, code, profile)) {
+        out << separator << "    {\"name\": ";
+        write_json_string(out, total.name);
+        out << ", \"count\": " << total.count;
+        if (profile.measure_cycles) {
+            out << ", \"cycles\": " << total.cycles;
+        }
+        out << "}";
+        separator = ",\n";
+    }
+    out << "\n  ],\n";
+
+    out << "  \"pcs\": [";
+    separator = "\n";
+    for (size_t pc = 0; pc < code.size(); pc++) {
+        uint64_t hits = at(profile.hits, pc);
+        if (hits == 0) {
+            continue;
+        }
+        const auto& [op_id, arg] = code[pc];
+        out << separator << "    {\"pc\": " << pc << ", \"name\": ";
+        write_json_string(out, name_of(vm, op_id));
+        out << ", \"arg\": " << arg << ", \"hits\": " << hits;
+        if (profile.measure_cycles) {
+            out << ", \"cycles\": " << at(profile.cycles, pc);
+        }
+        out << "}";
+        separator = ",\n";
+    }
+    out << "\n  ],\n";
+
+    out << "  \"branches\": [";
+    separator = "\n";
+    for (size_t pc = 0; pc < code.size(); pc++) {
+        bool conditional;
+        uint64_t hits = at(profile.hits, pc);
+        if (hits == 0 or not is_jump(vm, code[pc].first, &conditional) or not conditional) {
+            continue;
+        }
+        uint64_t taken = at(profile.taken, pc);
+        out << separator << "    {\"pc\": " << pc
+            << ", \"target\": " << code[pc].second
+            << ", \"taken\": " << taken
+            << ", \"not_taken\": " << hits - taken << "}";
+        separator = ",\n";
+    }
+    out << "\n  ],\n";
+
+    out << "  \"loops\": [";
+    separator = "\n";
+    for (const auto& loop : find_hot_loops(vm, code, profile)) {
+        out << separator << "    {\"start\": " << loop.start
+            << ", \"end\": " << loop.end
+            << ", \"iterations\": " << loop.iterations
+            << ", \"instructions\": " << loop.instructions << "}";
+        separator = ",\n";
+    }
+    out << "\n  ]\n}\n";
+}
+
+
+void write_profile_csv(std::ostream& out, const vm_state& vm, const code_t& code,
+                       const execution_profile& profile) {
+    out << "pc,instruction,arg,hits,taken,not_taken,cycles\n";
+    for (size_t pc = 0; pc < code.size(); pc++) {
+        const auto& [op_id, arg] = code[pc];
+        uint64_t hits = at(profile.hits, pc);
+        uint64_t taken = at(profile.taken, pc);
+
+        bool conditional = false;
+        is_jump(vm, op_id, &conditional);
+
+        out << pc << ",";
+        write_csv_field(out, name_of(vm, op_id));
+        out << "," << arg << "," << hits << ",";
+        if (conditional) {
+            out << taken << "," << hits - taken;
+        }
+        else {
+            out << ",";
+        }
+        out << ",";
+        if (profile.measure_cycles) {
+            out << at(profile.cycles, pc);
+        }
+        out << "\n";
+    }
+}
+
+
+std::string profile_summary(const vm_state& vm, const code_t& code,
+                            const execution_profile& profile, size_t count) {
+    uint64_t executed = 0;
+    for (uint64_t hits : profile.hits) {
+        executed += hits;
+    }
+    auto share = [executed](uint64_t part) {
+        return executed == 0 ? 0.0 : 100.0 * static_cast<double>(part) / static_cast<double>(executed);
+    };
+
+    std::ostringstream out;
+    out.precision(1);
+    out << std::fixed;
+    out << "executed instructions: " << executed << "\n";
+
+    out << "hottest instructions:\n";
+    auto totals = instruction_totals(vm, code, profile);
+    for (size_t i = 0; i < std::min(count, totals.size()); i++) {
+        out << "  " << totals[i].name << ": " << totals[i].count
+            << " (" << share(totals[i].count) << "%)";
+        if (profile.measure_cycles) {
+            out << ", " << totals[i].cycles << " cycles";
+        }
+        out << "\n";
+    }
+
+    out << "hottest loops:\n";
+    auto loops = find_hot_loops(vm, code, profile);
+    for (size_t i = 0; i < std::min(count, loops.size()); i++) {
+        out << "  pc " << loops[i].start << "-" << loops[i].end << ": "
+            << loops[i].iterations << " iterations, "
+            << loops[i].instructions << " instructions (" << share(loops[i].instructions) << "%)\n";
+    }
+    if (loops.empty()) {
+        out << "  none\n";
+    }
+    return out.str();
+}
+
+} // namespace vm
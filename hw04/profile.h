@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "vm.h"
+
+
+namespace vm {
+
+/**
+ * what profiled runs of a program measured, indexed by pc.
+ *
+ * passing the same profile to several runs of the same program
+ * accumulates their measurements.
+ */
+struct execution_profile {
+    /** how often each instruction was executed */
+    std::vector<uint64_t> hits;
+
+    /**
+     * how often each conditional jump (JMPZ and the jumping
+     * superinstructions) jumped. the rest of its hits fell through.
+     */
+    std::vector<uint64_t> taken;
+
+    /**
+     * cycles of the cpu time stamp counter spent in each instruction,
+     * including the dispatch to it. only measured if `measure_cycles` is set.
+     */
+    std::vector<uint64_t> cycles;
+
+    /** measure `cycles`, which costs about as much as the instructions themselves */
+    bool measure_cycles = false;
+};
+
+
+/**
+ * a loop found through the profile, see `find_hot_loops`.
+ */
+struct hot_loop {
+    /** the pc the backward jump goes to */
+    size_t start;
+    /** the pc of the backward jump */
+    size_t end;
+    /** how often the backward jump was taken */
+    uint64_t iterations;
+    /** executed instructions between `start` and `end` */
+    uint64_t instructions;
+};
+
+
+/**
+ * execute the program like `run`, and record a profile of it.
+ *
+ * the counting is compiled into a separate instance of the execution loop,
+ * so `run` itself doesn't pay for it.
+ */
+std::tuple<item_t, std::string> run_profiled(vm_state& vm, const code_t& code,
+                                             execution_profile& profile);
+
+
+/**
+ * find the loops of the program, i.e. the backward jumps, and what they
+ * executed. the loops with the most executed instructions come first.
+ */
+std::vector<hot_loop> find_hot_loops(const vm_state& vm, const code_t& code,
+                                     const execution_profile& profile);
+
+
+/**
+ * write the profile as json: totals per instruction name, the counts of
+ * each executed pc, the branch statistics, and the hot loops.
+ */
+void write_profile_json(std::ostream& out, const vm_state& vm, const code_t& code,
+                        const execution_profile& profile);
+
+
+/**
+ * write the profile as csv, one row per pc with
+ * `pc,instruction,arg,hits,taken,not_taken,cycles`.
+ */
+void write_profile_csv(std::ostream& out, const vm_state& vm, const code_t& code,
+                       const execution_profile& profile);
+
+
+/**
+ * a human-readable summary of the hottest instructions and loops.
+ *
+ * @param count: how many entries of each to list
+ */
+std::string profile_summary(const vm_state& vm, const code_t& code,
+                            const execution_profile& profile, size_t count = 5);
+
+} // namespace vm
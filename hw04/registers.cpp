@@ -0,0 +1,857 @@
+#include "registers.h"
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+
+#include "analysis.h"
+#include "flushed.h"
+
+
+namespace vm {
+
+namespace {
+
+using reg_op = register_program::reg_op;
+using deopt_point = register_program::deopt_point;
+
+constexpr uint32_t no_entry = std::numeric_limits<uint32_t>::max();
+
+
+/**
+ * compute `a op b` at translation time, false if it has to be done when running.
+ */
+bool fold(opcode op, item_t a, item_t b, item_t& result) {
+    // wrap around like the hardware does instead of overflowing
+    switch (op) {
+    case opcode::ADD:
+        result = static_cast<item_t>(static_cast<uint64_t>(a) + static_cast<uint64_t>(b));
+        return true;
+    case opcode::DIV:
+        if (b == 0 or (a == std::numeric_limits<item_t>::min() and b == -1)) {
+            return false;
+        }
+        result = a / b;
+        return true;
+    case opcode::EQ:
+        result = static_cast<item_t>(a == b);
+        return true;
+    case opcode::NEQ:
+        result = static_cast<item_t>(a != b);
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+/**
+ * where the value of a stack item is during the translation of a block.
+ */
+struct value {
+    enum class kind : uint8_t {
+        /** in the item's own slot */
+        home,
+        /** a constant, not stored anywhere yet */
+        constant,
+        /** in the slot of an item below, which stays there while this item lives */
+        copy,
+    };
+
+    kind where;
+    /** the slot of `copy` */
+    int32_t slot;
+    /** the value of `constant` */
+    item_t imm;
+};
+
+
+/**
+ * translates the basic blocks of a program one by one.
+ */
+class translator {
+public:
+    translator(const code_t& code, const code_analysis& analysis,
+               std::vector<deopt_point>& deopts, std::vector<reg_op>& deopt_moves)
+        :
+        code{code},
+        analysis{analysis},
+        deopts{deopts},
+        deopt_moves{deopt_moves} {}
+
+    /**
+     * translate the instructions in [start, end), and return them.
+     * jump targets are pcs, they are resolved once all blocks are done.
+     */
+    std::vector<reg_op> block(size_t start, size_t end) {
+        this->stack.clear();
+        this->bottom = 0;
+        this->body.clear();
+
+        for (size_t pc = start; pc < end; pc++) {
+            if (not this->instruction(pc)) {
+                // the rest of the block is never reached
+                return this->finish(start);
+            }
+        }
+        // fall through to the next block
+        this->flush();
+        if (this->top() != 0) {
+            this->emit(reg_opcode::shift, this->top(), 0, 0, 0);
+        }
+        return this->finish(start);
+    }
+
+    /**
+     * translate a recorded loop iteration into `trace.ops`, and set its
+     * slot range. false if it has instructions that can't be traced.
+     */
+    bool trace(std::span<const trace_step> steps, register_trace& trace) {
+        this->stack.clear();
+        this->bottom = 0;
+        this->body.clear();
+        int32_t high = 0;
+
+        for (const trace_step& step : steps) {
+            bool straight = true;
+            switch (this->analysis.opcodes[step.pc]) {
+            case opcode::JMP:
+                // the trace continues at the target anyway
+                continue;
+            case opcode::JMPZ:
+            case opcode::DUP_JMPZ:
+            case opcode::JMP_EQ:
+            case opcode::JMP_NEQ:
+                straight = this->guard(step);
+                break;
+            case opcode::EXIT:
+            case opcode::PRINT:
+            case opcode::LOAD:
+            case opcode::STORE:
+            case opcode::MEMCPY:
+            case opcode::MEMSET:
+            case opcode::MEMSUM:
+            case opcode::MEMGROW:
+            case opcode::CALL:
+            case opcode::RET:
+            case opcode::TAIL_CALL:
+            case opcode::SPAWN:
+            case opcode::JOIN:
+            case opcode::CUSTOM:
+                return false;
+            default:
+                straight = this->instruction(step.pc);
+                break;
+            }
+            high = std::max(high, this->top());
+            if (not straight) {
+                // it always leaves the trace here
+                break;
+            }
+        }
+        if (this->body.empty() or static_cast<reg_opcode>(this->body.back().op) != reg_opcode::deopt) {
+            this->flush();
+            this->emit(reg_opcode::loop, this->top(), 0, 0, 0);
+        }
+
+        trace.ops = std::move(this->body);
+        trace.low = this->bottom;
+        trace.high = high;
+        return true;
+    }
+
+private:
+    /**
+     * translate a conditional jump of a trace into a guard that the jump
+     * goes the recorded way. false if it never does.
+     */
+    bool guard(const trace_step& step) {
+        const opcode op = this->analysis.opcodes[step.pc];
+        // leaving the trace runs the jump again in the interpreter
+        const uint32_t deopt = this->deopt(step.pc);
+
+        if (op == opcode::JMPZ or op == opcode::DUP_JMPZ) {
+            value condition = op == opcode::JMPZ ? this->pop() : this->peek();
+            if (condition.where == value::kind::constant) {
+                return this->constant_guard((condition.imm == 0) == step.taken, deopt);
+            }
+            this->emit(step.taken ? reg_opcode::guard_zero : reg_opcode::guard_nonzero,
+                       0, this->slot(condition), 0, deopt);
+            return true;
+        }
+
+        // whether the operands are equal when the jump goes the recorded way
+        const bool equal = (op == opcode::JMP_EQ) == step.taken;
+        value b = this->pop();
+        value a = this->pop();
+        if (a.where == value::kind::constant and b.where == value::kind::constant) {
+            return this->constant_guard((a.imm == b.imm) == equal, deopt);
+        }
+        if (a.where == value::kind::constant) {
+            std::swap(a, b);
+        }
+        if (b.where == value::kind::constant) {
+            this->emit(equal ? reg_opcode::guard_eq_imm : reg_opcode::guard_neq_imm,
+                       0, this->slot(a), 0, deopt, b.imm);
+        }
+        else {
+            this->emit(equal ? reg_opcode::guard_eq : reg_opcode::guard_neq,
+                       0, this->slot(a), this->slot(b), deopt);
+        }
+        return true;
+    }
+
+    /** a guard with a known outcome */
+    bool constant_guard(bool holds, uint32_t deopt) {
+        if (not holds) {
+            this->emit(reg_opcode::deopt, 0, 0, 0, deopt);
+        }
+        return holds;
+    }
+
+    /**
+     * translate one instruction, false if the block ends with it.
+     */
+    bool instruction(size_t pc) {
+        const item_t arg = this->code[pc].second;
+        const uint32_t target = static_cast<uint32_t>(arg);
+
+        switch (this->analysis.opcodes[pc]) {
+        case opcode::LOAD_CONST:
+            this->stack.push_back({value::kind::constant, 0, arg});
+            return true;
+
+        case opcode::POP:
+            this->pop();
+            return true;
+
+        case opcode::DUP:
+            this->stack.push_back(this->peek());
+            return true;
+
+        case opcode::ADD:
+        case opcode::DIV:
+        case opcode::EQ:
+        case opcode::NEQ:
+            return this->binary(pc, this->analysis.opcodes[pc], nullptr);
+
+        case opcode::ADD_IMM:
+            return this->binary(pc, opcode::ADD, &arg);
+        case opcode::DIV_IMM:
+            return this->binary(pc, opcode::DIV, &arg);
+        case opcode::EQ_IMM:
+            return this->binary(pc, opcode::EQ, &arg);
+        case opcode::NEQ_IMM:
+            return this->binary(pc, opcode::NEQ, &arg);
+
+        case opcode::WRITE:
+            this->output(pc, reg_opcode::write, reg_opcode::write_imm, this->peek());
+            return true;
+        case opcode::WRITE_CHAR:
+            this->output(pc, reg_opcode::write_char, reg_opcode::write_char_imm, this->peek());
+            return true;
+        case opcode::PRINT:
+            this->output(pc, reg_opcode::print, reg_opcode::print_imm, this->peek());
+            return true;
+        case opcode::WRITE_IMM:
+            this->output(pc, reg_opcode::write, reg_opcode::write_imm, {value::kind::constant, 0, arg});
+            return true;
+        case opcode::WRITE_CHAR_IMM:
+            this->output(pc, reg_opcode::write_char, reg_opcode::write_char_imm, {value::kind::constant, 0, arg});
+            return true;
+
+        case opcode::EXIT: {
+            this->peek();
+            this->flush();
+            // the interpreter has advanced the pc already when exiting
+            this->emit(reg_opcode::exit, this->top(), this->top() - 1, 0, static_cast<uint32_t>(pc + 1));
+            return false;
+        }
+
+        case opcode::JMP:
+            this->flush();
+            this->emit(reg_opcode::jump, this->top(), 0, 0, target);
+            return false;
+
+        case opcode::JMPZ: {
+            value condition = this->pop();
+            this->flush();
+            if (condition.where == value::kind::constant) {
+                return this->constant_branch(condition.imm == 0, target);
+            }
+            this->emit(reg_opcode::jump_zero, this->top(), this->slot(condition), 0, target);
+            return false;
+        }
+
+        case opcode::DUP_JMPZ: {
+            value condition = this->peek();
+            this->flush();
+            if (condition.where == value::kind::constant) {
+                return this->constant_branch(condition.imm == 0, target);
+            }
+            this->emit(reg_opcode::jump_zero, this->top(), this->top() - 1, 0, target);
+            return false;
+        }
+
+        case opcode::JMP_EQ:
+        case opcode::JMP_NEQ: {
+            const bool equal = this->analysis.opcodes[pc] == opcode::JMP_EQ;
+            value b = this->pop();
+            value a = this->pop();
+            this->flush();
+            if (a.where == value::kind::constant and b.where == value::kind::constant) {
+                return this->constant_branch((a.imm == b.imm) == equal, target);
+            }
+            if (a.where == value::kind::constant) {
+                std::swap(a, b);
+            }
+            if (b.where == value::kind::constant) {
+                this->emit(equal ? reg_opcode::jump_eq_imm : reg_opcode::jump_neq_imm,
+                           this->top(), this->slot(a), 0, target, b.imm);
+            }
+            else {
+                this->emit(equal ? reg_opcode::jump_eq : reg_opcode::jump_neq,
+                           this->top(), this->slot(a), this->slot(b), target);
+            }
+            return false;
+        }
+
+        case opcode::LOAD:
+        case opcode::STORE:
+        case opcode::MEMCPY:
+        case opcode::MEMSET:
+        case opcode::MEMSUM:
+        case opcode::MEMGROW:
+        case opcode::CALL:
+        case opcode::RET:
+        case opcode::TAIL_CALL:
+        case opcode::SPAWN:
+        case opcode::JOIN:
+        case opcode::CUSTOM:
+            break;
+        }
+
+        // not translatable, which the program_translatable check prevents
+        this->emit(reg_opcode::deopt, 0, 0, 0, this->deopt(pc));
+        return false;
+    }
+
+
+    /**
+     * translate `a op b`. the operands are the top stack items,
+     * or for the `_IMM` instructions the top item and the argument.
+     */
+    bool binary(size_t pc, opcode op, const item_t* argument) {
+        // dividing can throw, which the interpreter does from the state before
+        const uint32_t deopt = op == opcode::DIV ? this->deopt(pc) : 0;
+
+        value b = argument != nullptr ? value{value::kind::constant, 0, *argument} : this->pop();
+        value a = this->pop();
+        const int32_t dst = this->top();
+
+        item_t folded;
+        if (a.where == value::kind::constant and b.where == value::kind::constant) {
+            if (fold(op, a.imm, b.imm, folded)) {
+                this->stack.push_back({value::kind::constant, 0, folded});
+                return true;
+            }
+            this->emit(reg_opcode::deopt, 0, 0, 0, deopt);
+            return false;
+        }
+
+        if (a.where == value::kind::constant and op != opcode::DIV) {
+            std::swap(a, b);
+        }
+
+        switch (op) {
+        case opcode::ADD:
+            this->emit_binary(reg_opcode::add, reg_opcode::add_imm, dst, a, b);
+            break;
+        case opcode::EQ:
+            this->emit_binary(reg_opcode::eq, reg_opcode::eq_imm, dst, a, b);
+            break;
+        case opcode::NEQ:
+            this->emit_binary(reg_opcode::neq, reg_opcode::neq_imm, dst, a, b);
+            break;
+        case opcode::DIV:
+            if (a.where == value::kind::constant) {
+                this->emit(reg_opcode::imm_div, dst, 0, this->slot(b), deopt, a.imm);
+            }
+            else if (b.where == value::kind::constant) {
+                if (b.imm == 0) {
+                    this->emit(reg_opcode::deopt, 0, 0, 0, deopt);
+                    return false;
+                }
+                this->emit(reg_opcode::div_imm, dst, this->slot(a), 0, 0, b.imm);
+            }
+            else {
+                this->emit(reg_opcode::div, dst, this->slot(a), this->slot(b), deopt);
+            }
+            break;
+        default:
+            break;
+        }
+        this->stack.push_back({value::kind::home, 0, 0});
+        return true;
+    }
+
+    void emit_binary(reg_opcode with_slot, reg_opcode with_imm, int32_t dst, value a, value b) {
+        if (b.where == value::kind::constant) {
+            this->emit(with_imm, dst, this->slot(a), 0, 0, b.imm);
+        }
+        else {
+            this->emit(with_slot, dst, this->slot(a), this->slot(b), 0);
+        }
+    }
+
+    void output(size_t pc, reg_opcode with_slot, reg_opcode with_imm, value item) {
+        const uint32_t deopt = this->deopt(pc);
+        if (item.where == value::kind::constant) {
+            this->emit(with_imm, 0, 0, 0, deopt, item.imm);
+        }
+        else {
+            this->emit(with_slot, 0, this->slot(item), 0, deopt);
+        }
+    }
+
+    /**
+     * a branch with a known condition, which ends the block.
+     */
+    bool constant_branch(bool jumps, uint32_t target) {
+        if (jumps) {
+            this->emit(reg_opcode::jump, this->top(), 0, 0, target);
+        }
+        else if (this->top() != 0) {
+            this->emit(reg_opcode::shift, this->top(), 0, 0, 0);
+        }
+        return false;
+    }
+
+    /** slot of the stack top, relative to the stack top when entering the block */
+    int32_t top() const {
+        return this->bottom + static_cast<int32_t>(this->stack.size());
+    }
+
+    /** make sure the block tracks at least `count` items */
+    void require(size_t count) {
+        while (this->stack.size() < count) {
+            // an item the block didn't push, which is in its slot
+            this->bottom -= 1;
+            this->stack.insert(this->stack.begin(), {value::kind::home, 0, 0});
+        }
+    }
+
+    /**
+     * the stack top. if it is in its slot, it is returned as a copy
+     * of that slot, so it can be used as operand.
+     */
+    value peek() {
+        this->require(1);
+        value item = this->stack.back();
+        if (item.where == value::kind::home) {
+            item = {value::kind::copy, this->top() - 1, 0};
+        }
+        return item;
+    }
+
+    value pop() {
+        value item = this->peek();
+        this->stack.pop_back();
+        return item;
+    }
+
+    /** the slot of an operand from `peek` or `pop` that isn't a constant */
+    int32_t slot(const value& item) const {
+        return item.slot;
+    }
+
+    /**
+     * the moves that put each tracked item into its slot.
+     *
+     * copies only refer to slots of items below them that are in their
+     * slot, so no move overwrites a value another one needs.
+     */
+    template <typename emit_t>
+    void moves(emit_t&& emit) const {
+        for (size_t i = 0; i < this->stack.size(); i++) {
+            const int32_t home = this->bottom + static_cast<int32_t>(i);
+            const value& item = this->stack[i];
+            if (item.where == value::kind::constant) {
+                emit(reg_op{static_cast<uint8_t>(reg_opcode::load_imm), home, 0, 0, 0, item.imm});
+            }
+            else if (item.where == value::kind::copy and item.slot != home) {
+                emit(reg_op{static_cast<uint8_t>(reg_opcode::move), home, item.slot, 0, 0, 0});
+            }
+        }
+    }
+
+    /** put all tracked items into their slots */
+    void flush() {
+        this->moves([this](const reg_op& op) { this->body.push_back(op); });
+        for (size_t i = 0; i < this->stack.size(); i++) {
+            this->stack[i] = {value::kind::home, 0, 0};
+        }
+    }
+
+    /** a deopt point for the stack as it is before the instruction at pc */
+    uint32_t deopt(size_t pc) {
+        deopt_point point{pc, static_cast<uint32_t>(this->deopt_moves.size()), 0, this->top()};
+        this->moves([this](const reg_op& op) { this->deopt_moves.push_back(op); });
+        point.move_count = static_cast<uint32_t>(this->deopt_moves.size()) - point.first_move;
+        this->deopts.push_back(point);
+        return static_cast<uint32_t>(this->deopts.size() - 1);
+    }
+
+    void emit(reg_opcode op, int32_t dst, int32_t a, int32_t b, uint32_t target, item_t imm = 0) {
+        this->body.push_back({static_cast<uint8_t>(op), dst, a, b, target, imm});
+    }
+
+    /**
+     * the block, preceded by a check for the items it expects on the stack
+     * if the analysis can't prove they are there.
+     */
+    std::vector<reg_op> finish(size_t start) {
+        const auto needs = static_cast<size_t>(-this->bottom);
+        std::vector<reg_op> result;
+        if (this->analysis.min_depth[start] < needs) {
+            deopt_point point{start, static_cast<uint32_t>(this->deopt_moves.size()), 0, 0};
+            this->deopts.push_back(point);
+            result.push_back({static_cast<uint8_t>(reg_opcode::enter), 0, static_cast<int32_t>(needs), 0,
+                              static_cast<uint32_t>(this->deopts.size() - 1), 0});
+        }
+        result.insert(result.end(), this->body.begin(), this->body.end());
+        return result;
+    }
+
+    const code_t& code;
+    const code_analysis& analysis;
+    std::vector<deopt_point>& deopts;
+    std::vector<reg_op>& deopt_moves;
+
+    /** the items the block knows about, the last one is the stack top */
+    std::vector<value> stack;
+    /** slot of `stack[0]`, negative once the block used items from before it */
+    int32_t bottom = 0;
+    /** the translated instructions */
+    std::vector<reg_op> body;
+};
+
+
+/**
+ * can the program be translated?
+ */
+bool program_translatable(const code_analysis& analysis) {
+    if (not analysis.verified or not analysis.stack_bounded) {
+        return false;
+    }
+    for (opcode op : analysis.opcodes) {
+        if (op == opcode::CUSTOM or accesses_memory(op) or is_call(op) or is_task(op)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+bool has_target(opcode op) {
+    switch (op) {
+    case opcode::JMP:
+    case opcode::JMPZ:
+    case opcode::JMP_EQ:
+    case opcode::JMP_NEQ:
+    case opcode::DUP_JMPZ:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+/**
+ * bring the stack into its state before the instruction of the deopt point.
+ */
+void restore_point(vm_state& vm, item_t* fp, const deopt_point& point,
+                   const std::vector<reg_op>& moves) {
+    for (uint32_t i = point.first_move; i < point.first_move + point.move_count; i++) {
+        const reg_op& move = moves[i];
+        if (static_cast<reg_opcode>(move.op) == reg_opcode::load_imm) {
+            fp[move.dst] = move.imm;
+        }
+        else {
+            fp[move.dst] = fp[move.a];
+        }
+    }
+    vm.stack.set_size(static_cast<size_t>(fp + point.top - vm.stack.data()));
+    vm.pc = point.pc;
+}
+
+} // namespace
+
+
+register_program::register_program(const vm_state& vm, code_t code)
+    :
+    program{std::move(code)} {
+
+    const code_analysis* analysis = usable_analysis(vm, this->program);
+    if (analysis == nullptr or not program_translatable(*analysis) or this->program.size() == 0 or
+        this->program.size() >= no_entry) {
+        return;
+    }
+
+    // the blocks start at pc 0, at jump targets and after jumps and EXIT
+    const size_t code_size = this->program.size();
+    std::vector<bool> leaders(code_size + 1, false);
+    leaders[0] = true;
+    leaders[code_size] = true;
+    for (size_t pc = 0; pc < code_size; pc++) {
+        const opcode op = analysis->opcodes[pc];
+        if (has_target(op)) {
+            leaders[static_cast<size_t>(this->program[pc].second)] = true;
+        }
+        if (has_target(op) or op == opcode::EXIT) {
+            leaders[pc + 1] = true;
+        }
+    }
+
+    translator translate{this->program, *analysis, this->deopts, this->deopt_moves};
+    this->entries.assign(code_size, no_entry);
+
+    size_t start = 0;
+    while (start < code_size) {
+        size_t end = start + 1;
+        while (not leaders[end]) {
+            end++;
+        }
+        // blocks that can't be reached are left out
+        if (analysis->min_depth[start] != code_analysis::unreachable) {
+            this->entries[start] = static_cast<uint32_t>(this->ops.size());
+            auto block = translate.block(start, end);
+            this->ops.insert(this->ops.end(), block.begin(), block.end());
+        }
+        start = end;
+    }
+
+    // jump targets are pcs so far
+    for (auto& op : this->ops) {
+        switch (static_cast<reg_opcode>(op.op)) {
+        case reg_opcode::jump:
+        case reg_opcode::jump_zero:
+        case reg_opcode::jump_eq:
+        case reg_opcode::jump_eq_imm:
+        case reg_opcode::jump_neq:
+        case reg_opcode::jump_neq_imm:
+            op.target = this->entries[op.target];
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+
+std::tuple<item_t, std::string> register_program::run(vm_state& vm) const {
+    if (not this->is_translated() or vm.debug or vm.pc >= this->entries.size() or
+        this->entries[vm.pc] == no_entry) {
+        return vm::run(vm, this->program);
+    }
+    const code_analysis* analysis = usable_analysis(vm, this->program);
+    if (analysis == nullptr or not enter_analyzed(vm, *analysis, vm.pc)) {
+        return vm::run(vm, this->program);
+    }
+
+    // the analysis reserved room for all slots the blocks use
+    item_t* const base = vm.stack.data();
+    item_t* fp = base + vm.stack.size();
+    const reg_op* const start = this->ops.data();
+    const reg_op* ip = start + this->entries[vm.pc];
+
+    // bring the stack into its state before the instruction of the deopt point
+    auto restore = [&](const deopt_point& point) {
+        restore_point(vm, fp, point, this->deopt_moves);
+    };
+
+    // runs until EXIT, then it returns no_entry and sets the result,
+    // or until a deopt point, which it returns
+    item_t result = 0;
+    auto execute = [&]() -> uint32_t {
+        while (true) {
+            const reg_op& op = *ip++;
+
+            switch (static_cast<reg_opcode>(op.op)) {
+            case reg_opcode::enter:
+                if (fp - base < op.a) [[unlikely]] {
+                    return op.target;
+                }
+                break;
+
+            case reg_opcode::load_imm:
+                fp[op.dst] = op.imm;
+                break;
+            case reg_opcode::move:
+                fp[op.dst] = fp[op.a];
+                break;
+
+            case reg_opcode::add:
+                fp[op.dst] = fp[op.a] + fp[op.b];
+                break;
+            case reg_opcode::add_imm:
+                fp[op.dst] = fp[op.a] + op.imm;
+                break;
+
+            case reg_opcode::div:
+                if (fp[op.b] == 0) [[unlikely]] {
+                    return op.target;
+                }
+                fp[op.dst] = fp[op.a] / fp[op.b];
+                break;
+            case reg_opcode::div_imm:
+                fp[op.dst] = fp[op.a] / op.imm;
+                break;
+            case reg_opcode::imm_div:
+                if (fp[op.b] == 0) [[unlikely]] {
+                    return op.target;
+                }
+                fp[op.dst] = op.imm / fp[op.b];
+                break;
+
+            case reg_opcode::eq:
+                fp[op.dst] = static_cast<item_t>(fp[op.a] == fp[op.b]);
+                break;
+            case reg_opcode::eq_imm:
+                fp[op.dst] = static_cast<item_t>(fp[op.a] == op.imm);
+                break;
+            case reg_opcode::neq:
+                fp[op.dst] = static_cast<item_t>(fp[op.a] != fp[op.b]);
+                break;
+            case reg_opcode::neq_imm:
+                fp[op.dst] = static_cast<item_t>(fp[op.a] != op.imm);
+                break;
+
+            case reg_opcode::write:
+                vm.output->write_number(fp[op.a]);
+                break;
+            case reg_opcode::write_imm:
+                vm.output->write_number(op.imm);
+                break;
+            case reg_opcode::write_char:
+                vm.output->write_char(static_cast<char>(fp[op.a]));
+                break;
+            case reg_opcode::write_char_imm:
+                vm.output->write_char(static_cast<char>(op.imm));
+                break;
+            case reg_opcode::print:
+                std::cout << fp[op.a] << std::endl;
+                break;
+            case reg_opcode::print_imm:
+                std::cout << op.imm << std::endl;
+                break;
+
+            case reg_opcode::jump:
+                fp += op.dst;
+                ip = start + op.target;
+                break;
+            case reg_opcode::jump_zero:
+                if (fp[op.a] == 0) {
+                    ip = start + op.target;
+                }
+                fp += op.dst;
+                break;
+            case reg_opcode::jump_eq:
+                if (fp[op.a] == fp[op.b]) {
+                    ip = start + op.target;
+                }
+                fp += op.dst;
+                break;
+            case reg_opcode::jump_eq_imm:
+                if (fp[op.a] == op.imm) {
+                    ip = start + op.target;
+                }
+                fp += op.dst;
+                break;
+            case reg_opcode::jump_neq:
+                if (fp[op.a] != fp[op.b]) {
+                    ip = start + op.target;
+                }
+                fp += op.dst;
+                break;
+            case reg_opcode::jump_neq_imm:
+                if (fp[op.a] != op.imm) {
+                    ip = start + op.target;
+                }
+                fp += op.dst;
+                break;
+            case reg_opcode::shift:
+                fp += op.dst;
+                break;
+
+            case reg_opcode::exit:
+                result = fp[op.a];
+                fp += op.dst;
+                vm.stack.set_size(static_cast<size_t>(fp - base));
+                vm.pc = op.target;
+                return no_entry;
+
+            case reg_opcode::deopt:
+                return op.target;
+
+            case reg_opcode::guard_zero:
+            case reg_opcode::guard_nonzero:
+            case reg_opcode::guard_eq:
+            case reg_opcode::guard_eq_imm:
+            case reg_opcode::guard_neq:
+            case reg_opcode::guard_neq_imm:
+            case reg_opcode::loop:
+                // only in traces
+                break;
+            }
+        }
+    };
+
+    const uint32_t deopt = run_flushed(vm, [&] {
+        try {
+            return execute();
+        }
+        catch (...) {
+            // only output can fail, and the interpreter fails after its instruction
+            restore(this->deopts[ip[-1].target]);
+            vm.pc += 1;
+            throw;
+        }
+    });
+
+    if (deopt == no_entry) {
+        return {result, std::string{vm.output->view()}};
+    }
+    // continue with the interpreter, which handles the instruction exactly
+    restore(this->deopts[deopt]);
+    return vm::run(vm, this->program);
+}
+
+
+std::tuple<item_t, std::string> run_registers(vm_state& vm, const code_t& code) {
+    return register_program{vm, code}.run(vm);
+}
+
+
+void register_trace::restore(vm_state& vm, item_t* fp, uint32_t deopt) const {
+    restore_point(vm, fp, this->deopts[deopt], this->deopt_moves);
+}
+
+
+std::optional<register_trace> translate_trace(const vm_state& vm, const code_t& code,
+                                              std::span<const trace_step> steps) {
+    const code_analysis* analysis = usable_analysis(vm, code);
+    if (analysis == nullptr or steps.empty()) {
+        return std::nullopt;
+    }
+
+    register_trace trace;
+    trace.head = steps.front().pc;
+    translator translate{code, *analysis, trace.deopts, trace.deopt_moves};
+    if (not translate.trace(steps, trace)) {
+        return std::nullopt;
+    }
+    return trace;
+}
+
+} // namespace vm
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "vm.h"
+
+
+namespace vm {
+
+/**
+ * the register instructions.
+ * `_imm` variants take `imm` instead of the slot `b`, `imm_` ones instead of `a`.
+ */
+enum class reg_opcode : uint8_t {
+    /** leave through deopt point `target` unless `a` items are on the stack */
+    enter,
+    /** slot dst = imm */
+    load_imm,
+    /** slot dst = slot a */
+    move,
+    add,
+    add_imm,
+    div,
+    div_imm,
+    imm_div,
+    eq,
+    eq_imm,
+    neq,
+    neq_imm,
+    write,
+    write_imm,
+    write_char,
+    write_char_imm,
+    print,
+    print_imm,
+    /** the stack top moves to slot dst, then execution continues at `target` */
+    jump,
+    jump_zero,
+    jump_eq,
+    jump_eq_imm,
+    jump_neq,
+    jump_neq_imm,
+    /** the stack top moves to slot dst, for falling through to the next block */
+    shift,
+    /** the stack top moves to slot dst, the program exits with slot a */
+    exit,
+    /** leave through deopt point `target` */
+    deopt,
+
+    // only in traces, see `translate_trace`
+
+    /** leave through deopt point `target` unless slot a is 0 */
+    guard_zero,
+    guard_nonzero,
+    /** leave through deopt point `target` unless slot a == b */
+    guard_eq,
+    guard_eq_imm,
+    guard_neq,
+    guard_neq_imm,
+    /** the stack top moves to slot dst, then the trace starts over */
+    loop,
+};
+
+
+/**
+ * a program translated to instructions on registers.
+ *
+ * each basic block is translated on its own. the stack slots the block
+ * uses, relative to the stack top when entering it, become its registers,
+ * so e.g. `ADD` reads and writes fixed slots instead of moving a stack
+ * pointer. constants and copies from `LOAD_CONST` and `DUP` are tracked
+ * during the translation, so they cost nothing until they are used, and
+ * become immediate operands of the instructions using them. only at the
+ * end of the block, the stack is brought into the state the stack
+ * instructions would have left it in.
+ *
+ * whenever the translation can't reproduce the exact behavior, e.g. a
+ * division by zero or a possible stack underflow, the stack is brought
+ * into its state before that instruction, and `vm::run` continues.
+ *
+ * only programs with a verified analysis that bounds the stack and
+ * without custom, memory, subroutine or task instructions are translated, see
+ * `analyze`. for others, `is_translated` is false and `run` interprets
+ * the stack instructions.
+ */
+class register_program {
+public:
+    /**
+     * translate a program.
+     *
+     * @param vm: the vm the program was assembled and analyzed for
+     * @param code: the program, e.g. from `assemble` or `optimize`
+     */
+    register_program(const vm_state& vm, code_t code);
+
+    /** was the program translated? */
+    bool is_translated() const { return not this->ops.empty(); }
+
+    /** the program that was translated */
+    const code_t& code() const { return this->program; }
+
+    /** number of register instructions, for comparison with the program size */
+    size_t size() const { return this->ops.size(); }
+
+    /**
+     * run the program from `vm.pc`, with the same results, output and
+     * exceptions as `vm::run`.
+     *
+     * @param vm: a vm that resolves the op ids like the one the program
+     *            was translated for, otherwise the program is interpreted
+     */
+    std::tuple<item_t, std::string> run(vm_state& vm) const;
+
+    /** one register instruction, its operands are slots relative to the block's stack top */
+    struct reg_op {
+        uint8_t op;
+        /** destination slot, or for jumps and exits the stack top afterwards */
+        int32_t dst;
+        int32_t a;
+        int32_t b;
+        /** jump target in `ops`, or the `deopt_point` of instructions that can fail */
+        uint32_t target;
+        item_t imm;
+    };
+
+    /** how to leave the translated program before an instruction */
+    struct deopt_point {
+        /** the pc of the instruction */
+        size_t pc;
+        /** the moves in `deopt_moves` that restore the stack */
+        uint32_t first_move;
+        uint32_t move_count;
+        /** the stack top before the instruction */
+        int32_t top;
+    };
+
+private:
+    code_t program;
+
+    std::vector<reg_op> ops;
+    std::vector<deopt_point> deopts;
+    std::vector<reg_op> deopt_moves;
+
+    /** where in `ops` each pc starts, `no_entry` if it doesn't start a block */
+    std::vector<uint32_t> entries;
+};
+
+
+/**
+ * translate the code to register instructions and run them, see `register_program`.
+ */
+std::tuple<item_t, std::string> run_registers(vm_state& vm, const code_t& code);
+
+
+/**
+ * one executed instruction of a recorded trace.
+ */
+struct trace_step {
+    size_t pc;
+    /** for conditional jumps, whether the jump was taken */
+    bool taken;
+};
+
+
+/**
+ * one iteration of a loop, translated to register instructions.
+ *
+ * unlike a `register_program` block, the trace runs across jumps: the
+ * conditional ones become guards, which leave the trace when the jump
+ * goes the other way than when it was recorded. so constants and copies
+ * are tracked through the whole iteration, and the stack is only brought
+ * into shape when the iteration ends with `reg_opcode::loop`.
+ */
+struct register_trace {
+    using reg_op = register_program::reg_op;
+    using deopt_point = register_program::deopt_point;
+
+    /** the pc the trace starts at */
+    size_t head = 0;
+
+    std::vector<reg_op> ops;
+    std::vector<deopt_point> deopts;
+    std::vector<reg_op> deopt_moves;
+
+    /**
+     * the lowest slot the trace uses, and one past the highest one,
+     * relative to the stack top at the start of an iteration.
+     * each iteration needs the items and the capacity for them.
+     */
+    int32_t low = 0;
+    int32_t high = 0;
+
+    /**
+     * leave the trace through a deopt point: put the stack and the pc
+     * into the state before its instruction.
+     *
+     * @param fp: the stack top at the start of the current iteration
+     */
+    void restore(vm_state& vm, item_t* fp, uint32_t deopt) const;
+};
+
+
+/**
+ * translate a loop iteration that was recorded at `steps.front().pc`,
+ * and ends where it started.
+ * nothing is returned if it contains instructions that can't be traced,
+ * which are EXIT, PRINT, custom, memory, subroutine and task instructions.
+ */
+std::optional<register_trace> translate_trace(const vm_state& vm, const code_t& code,
+                                              std::span<const trace_step> steps);
+
+} // namespace vm
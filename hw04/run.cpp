@@ -1,7 +1,9 @@
 #include "hw04.h"
 #include "vm.h"
 
+#include <fstream>
 #include <iostream>
+#include <string>
 
 
 namespace vm {
@@ -55,10 +57,110 @@ void test_vm() {
     }
 }
 
+
+/**
+ * assemble a program file. the text is streamed, so it's never in memory as a whole.
+ */
+code_t assemble_file(const vm_state& state, const std::string& path) {
+    std::ifstream in{path, std::ios::binary};
+    if (not in) {
+        throw std::runtime_error{"can't open: " + path};
+    }
+    return assemble(state, in);
+}
+
+
+/**
+ * assemble a program and save it as bytecode, so it can be loaded
+ * without assembling it again.
+ */
+void compile_file(const std::string& input, const std::string& output) {
+    vm_state state = create_vm();
+    code_t code = assemble_file(state, input);
+    save_code(state, code, output);
+    std::cout << "compiled " << code.size() << " instructions to " << output << std::endl;
+}
+
+
+/**
+ * run an assembly or bytecode program.
+ */
+void run_file(const std::string& path) {
+    vm_state state = create_vm();
+    code_t code = is_bytecode_file(path) ? load_code(state, path)
+                                         : assemble_file(state, path);
+
+    const auto& [exit_state, return_text] = run(state, code);
+    if (return_text.size()) {
+        std::cout << return_text << std::endl;
+    }
+    std::cout << "vm result: " << exit_state << std::endl;
+}
+
+
+
+/**
+ * run a program with profiling, then print the program's output and
+ * the profile, as summary or in a machine-readable format.
+ */
+void profile_file(const std::string& path, const std::string& format) {
+    vm_state state = create_vm();
+    code_t code = is_bytecode_file(path) ? load_code(state, path)
+                                         : assemble_file(state, path);
+
+    execution_profile profile;
+    profile.measure_cycles = true;
+    const auto& [exit_state, return_text] = run_profiled(state, code, profile);
+    if (return_text.size()) {
+        std::cerr << return_text << std::endl;
+    }
+    std::cerr << "vm result: " << exit_state << std::endl;
+
+    if (format == "json") {
+        write_profile_json(std::cout, state, code, profile);
+    }
+    else if (format == "csv") {
+        write_profile_csv(std::cout, state, code, profile);
+    }
+    else {
+        std::cout << profile_summary(state, code, profile);
+    }
+}
+
 } // namespace vm
 
 
-int main() {
-    vm::test_vm();
+/**
+ * without arguments, the test code is run. otherwise:
+ *
+ *   runhw04 compile <program.asm> <program.vmbc>
+ *   runhw04 run <program.asm or program.vmbc>
+ *   runhw04 profile <program> [summary|json|csv]
+ */
+int main(int argc, char** argv) {
+    const std::vector<std::string> args(argv + 1, argv + argc);
+
+    try {
+        if (args.empty()) {
+            vm::test_vm();
+        }
+        else if (args.size() == 3 and args[0] == "compile") {
+            vm::compile_file(args[1], args[2]);
+        }
+        else if (args.size() == 2 and args[0] == "run") {
+            vm::run_file(args[1]);
+        }
+        else if ((args.size() == 2 or args.size() == 3) and args[0] == "profile") {
+            vm::profile_file(args[1], args.size() == 3 ? args[2] : "summary");
+        }
+        else {
+            std::cerr << "usage: " << argv[0] << " [compile <program.asm> <program.vmbc> | run <program> | profile <program> [summary|json|csv]]" << std::endl;
+            return 2;
+        }
+    }
+    catch (std::exception& err) {
+        std::cerr << "error: " << err.what() << std::endl;
+        return 1;
+    }
     return 0;
 }
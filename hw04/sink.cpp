@@ -0,0 +1,125 @@
+#include "sink.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#if defined(__unix__)
+#define VM_SINK_FD 1
+#include <unistd.h>
+#endif
+
+
+namespace vm {
+
+void output_sink::write(std::string_view text) {
+    while (not text.empty()) {
+        if (this->cursor == this->end) {
+            this->overflow(1);
+        }
+        size_t count = std::min(text.size(), static_cast<size_t>(this->end - this->cursor));
+        std::memcpy(this->cursor, text.data(), count);
+        this->cursor += count;
+        text.remove_prefix(count);
+    }
+}
+
+
+memory_sink::memory_sink(size_t capacity) {
+    if (capacity > 0) {
+        this->buffer = std::make_unique<char[]>(capacity);
+        this->begin = this->cursor = this->buffer.get();
+        this->end = this->begin + capacity;
+    }
+}
+
+
+std::string_view memory_sink::view() const {
+    return {this->begin, static_cast<size_t>(this->cursor - this->begin)};
+}
+
+
+void memory_sink::clear() {
+    this->cursor = this->begin;
+}
+
+
+void memory_sink::overflow(size_t size) {
+    const size_t used = static_cast<size_t>(this->cursor - this->begin);
+    const size_t capacity = static_cast<size_t>(this->end - this->begin);
+    const size_t new_capacity = std::max({capacity * 2, used + size, size_t{4096}});
+
+    auto bigger = std::make_unique<char[]>(new_capacity);
+    if (used > 0) {
+        std::memcpy(bigger.get(), this->begin, used);
+    }
+    this->buffer = std::move(bigger);
+    this->begin = this->buffer.get();
+    this->cursor = this->begin + used;
+    this->end = this->begin + new_capacity;
+}
+
+
+fd_sink::fd_sink(int fd, size_t block_size)
+    :
+    fd{fd} {
+#ifndef VM_SINK_FD
+    throw std::runtime_error{"file descriptor output is not supported on this platform"};
+#endif
+    block_size = std::max(block_size, max_number_length);
+    this->buffer = std::make_unique<char[]>(block_size);
+    this->begin = this->cursor = this->buffer.get();
+    this->end = this->begin + block_size;
+}
+
+
+fd_sink::~fd_sink() {
+    try {
+        this->flush();
+    }
+    catch (...) {
+        // the output is lost, but destructors can't report it
+    }
+}
+
+
+void fd_sink::flush() {
+#ifdef VM_SINK_FD
+    const char* data = this->begin;
+    while (data < this->cursor) {
+        ssize_t written = ::write(this->fd, data, static_cast<size_t>(this->cursor - data));
+        if (written < 0) {
+            int error = errno;
+            if (error == EINTR) {
+                continue;
+            }
+            // drop the block, so the next write doesn't fail on it again
+            this->cursor = this->begin;
+            throw std::system_error{error, std::generic_category(), "writing the output failed"};
+        }
+        data += written;
+    }
+#endif
+    this->cursor = this->begin;
+}
+
+
+void fd_sink::overflow(size_t) {
+    // the block size is at least max_number_length, so any write fits after this
+    this->flush();
+}
+
+
+discard_sink::discard_sink() {
+    this->begin = this->cursor = this->buffer;
+    this->end = this->buffer + sizeof(this->buffer);
+}
+
+
+void discard_sink::overflow(size_t) {
+    this->cursor = this->begin;
+}
+
+} // namespace vm
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <charconv>
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include <system_error>
+
+
+namespace vm {
+
+/**
+ * where WRITE and WRITE_CHAR put their output.
+ *
+ * the text is formatted with `std::to_chars` right into the buffer of the
+ * sink, so writing only calls into the sink when the buffer is full.
+ * what happens with a full buffer, and with the text when the run ends,
+ * depends on the sink.
+ */
+class output_sink {
+public:
+    virtual ~output_sink() = default;
+
+    output_sink(const output_sink&) = delete;
+    output_sink& operator=(const output_sink&) = delete;
+
+    /** most characters `write_number` can produce */
+    static constexpr size_t max_number_length = 32;
+
+    /** append the decimal text of a number */
+    template <typename T>
+    void write_number(T value) {
+        auto [written_end, error] = std::to_chars(this->cursor, this->end, value);
+        if (error != std::errc{}) [[unlikely]] {
+            this->overflow(max_number_length);
+            written_end = std::to_chars(this->cursor, this->end, value).ptr;
+        }
+        this->cursor = written_end;
+    }
+
+    /** append a single character */
+    void write_char(char value) {
+        if (this->cursor == this->end) [[unlikely]] {
+            this->overflow(1);
+        }
+        *this->cursor++ = value;
+    }
+
+    /** append text */
+    void write(std::string_view text);
+
+    /**
+     * the output the sink keeps in memory, empty if it passes the output on.
+     * it is valid until the next write or `clear`.
+     */
+    virtual std::string_view view() const { return {}; }
+
+    /** pass buffered output on, called when a run ends */
+    virtual void flush() {}
+
+    /** forget the output kept in memory, to start another run */
+    virtual void clear() {}
+
+protected:
+    output_sink() = default;
+
+    /**
+     * called when the buffer has less than `size` characters left.
+     * it has to make room for at least `size` more.
+     */
+    virtual void overflow(size_t size) = 0;
+
+    /** the buffer the sink writes to */
+    char* begin = nullptr;
+    /** the next character to write */
+    char* cursor = nullptr;
+    /** end of the buffer */
+    char* end = nullptr;
+};
+
+
+/**
+ * keeps all output in a buffer that grows as needed.
+ * this is the sink of each new vm.
+ */
+class memory_sink : public output_sink {
+public:
+    /**
+     * @param capacity: characters to allocate right away, so runs
+     *                  with less output never allocate
+     */
+    explicit memory_sink(size_t capacity = 0);
+
+    std::string_view view() const override;
+    void clear() override;
+
+protected:
+    void overflow(size_t size) override;
+
+private:
+    std::unique_ptr<char[]> buffer;
+};
+
+
+/**
+ * writes the output to a file descriptor, in blocks of the buffer size.
+ * nothing is kept, so programs can produce more output than fits in memory.
+ */
+class fd_sink : public output_sink {
+public:
+    /**
+     * @param fd: where to write to, it is not closed by the sink
+     * @param block_size: how many characters to collect for one write
+     */
+    explicit fd_sink(int fd, size_t block_size = 64 * 1024);
+    ~fd_sink() override;
+
+    void flush() override;
+
+protected:
+    void overflow(size_t size) override;
+
+private:
+    int fd;
+    std::unique_ptr<char[]> buffer;
+};
+
+
+/**
+ * drops all output, but still formats it, which is useful
+ * to measure the execution without the cost of the output.
+ */
+class discard_sink : public output_sink {
+public:
+    discard_sink();
+
+protected:
+    void overflow(size_t size) override;
+
+private:
+    char buffer[1024];
+};
+
+} // namespace vm
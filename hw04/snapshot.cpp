@@ -0,0 +1,57 @@
+#include "snapshot.h"
+
+#include <algorithm>
+
+
+namespace vm {
+
+vm_snapshot::vm_snapshot(const vm_state& vm)
+    :
+    position{vm.pc},
+    item_count{vm.stack.size()},
+    pages{vm.memory},
+    frames{std::make_shared<const std::vector<size_t>>(vm.calls.view().begin(), vm.calls.view().end())},
+    call_depth{vm.calls.max_depth()},
+    text{std::make_shared<const std::string>(vm.output->view())},
+    instructions{vm.instructions},
+    debug{vm.debug} {
+
+    if (this->item_count > 0) {
+        auto copy = std::make_shared<item_t[]>(this->item_count);
+        std::copy(vm.stack.data(), vm.stack.data() + this->item_count, copy.get());
+        this->items = std::move(copy);
+    }
+}
+
+
+void vm_snapshot::restore(vm_state& vm) const {
+    vm.pc = this->position;
+
+    vm.stack.clear();
+    vm.stack.reserve(this->item_count);
+    std::copy(this->items.get(), this->items.get() + this->item_count, vm.stack.data());
+    vm.stack.set_size(this->item_count);
+
+    vm.memory = this->pages;
+
+    if (not vm.calls.assign(*this->frames)) {
+        // the vm's call stack is shallower than the captured one
+        vm.calls = call_stack{this->call_depth};
+        vm.calls.assign(*this->frames);
+    }
+
+    vm.output->clear();
+    vm.output->write(*this->text);
+}
+
+
+vm_state vm_snapshot::fork() const {
+    vm_state vm = create_vm(this->instructions, this->debug);
+    if (vm.calls.max_depth() != this->call_depth) {
+        vm.calls = call_stack{this->call_depth};
+    }
+    this->restore(vm);
+    return vm;
+}
+
+} // namespace vm
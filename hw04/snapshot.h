@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "vm.h"
+
+
+namespace vm {
+
+/**
+ * the execution state of a vm at one point: its pc, stack, memory, calls
+ * and output.
+ *
+ * a snapshot is immutable, so copies of it share its items and output,
+ * and taking or copying one never touches the vm again. restoring it, or
+ * forking a new vm from it, copies only the live stack items and the
+ * output the vm kept in memory. the memory pages are shared with the vm
+ * until either writes to them, see `linear_memory`.
+ *
+ * this way a vm can run a setup prefix once, and then many variants
+ * start from its end:
+ *
+ *   run_steps(vm, code, {.fuel = prefix_length});
+ *   vm_snapshot warm{vm};
+ *   for (...) { vm_state variant = warm.fork(); ... }
+ *
+ * output that a sink already passed on, e.g. from `fd_sink`, isn't part
+ * of the snapshot, restoring only continues writing after it.
+ */
+class vm_snapshot {
+public:
+    /** capture the current state of the vm */
+    explicit vm_snapshot(const vm_state& vm);
+
+    /**
+     * put the vm back into the captured state.
+     * the vm keeps its sink and its instruction set.
+     */
+    void restore(vm_state& vm) const;
+
+    /**
+     * create a vm in the captured state, with the instruction set of the
+     * captured vm and a memory sink for its output.
+     */
+    vm_state fork() const;
+
+    size_t pc() const { return this->position; }
+
+    /** the stack items, the last one is the top */
+    std::span<const item_t> stack() const { return {this->items.get(), this->item_count}; }
+
+    /** the linear memory, which shares its pages with the vm */
+    const linear_memory<item_t>& memory() const { return this->pages; }
+
+    /** the return addresses of the calls, the innermost one is last */
+    std::span<const size_t> calls() const { return *this->frames; }
+
+    /** the output the vm kept in memory */
+    std::string_view output() const { return *this->text; }
+
+private:
+    size_t position;
+    size_t item_count;
+    std::shared_ptr<const item_t[]> items;
+    linear_memory<item_t> pages;
+    std::shared_ptr<const std::vector<size_t>> frames;
+    size_t call_depth;
+    std::shared_ptr<const std::string> text;
+    std::shared_ptr<const instruction_set> instructions;
+    bool debug;
+};
+
+} // namespace vm
@@ -0,0 +1,203 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <utility>
+
+
+namespace vm {
+
+/**
+ * contiguous operand stack of the vm.
+ *
+ * it has the interface of `std::stack`, but all items live in one
+ * preallocated block of memory. `push` only reallocates when the capacity
+ * is exhausted, so the execution loop can reserve the capacity up front
+ * and then work on the raw slots through `data()`.
+ *
+ * the storage has one scratch slot below the bottom item, `data()[-1]`.
+ * code that keeps the top item in a register can always spill it to the
+ * slot above the one below it, even when the stack is empty.
+ */
+template <typename T>
+class operand_stack {
+public:
+    using value_type = T;
+    using size_type = size_t;
+
+    /**
+     * number of items that are preallocated for a fresh stack.
+     */
+    static constexpr size_type initial_capacity = 256;
+
+    operand_stack()
+        : _capacity{initial_capacity},
+          _data{std::make_unique<T[]>(initial_capacity + 1)} {}
+
+    operand_stack(const operand_stack& other)
+        : _size{other._size},
+          _capacity{other._capacity},
+          _data{std::make_unique<T[]>(other._capacity + 1)} {
+        std::copy(other.slots(), other.slots() + other._size, this->slots());
+    }
+
+    operand_stack(operand_stack&& other) noexcept
+        : _size{std::exchange(other._size, 0)},
+          _capacity{std::exchange(other._capacity, 0)},
+          _data{std::move(other._data)} {}
+
+    operand_stack& operator=(const operand_stack& other) {
+        if (this != &other) {
+            operand_stack copy{other};
+            *this = std::move(copy);
+        }
+        return *this;
+    }
+
+    operand_stack& operator=(operand_stack&& other) noexcept {
+        _size = std::exchange(other._size, 0);
+        _capacity = std::exchange(other._capacity, 0);
+        _data = std::move(other._data);
+        return *this;
+    }
+
+    /** add an item on top, growing the storage if needed */
+    void push(const T& item) {
+        if (_size == _capacity) [[unlikely]] {
+            // the item may be one of ours, e.g. `push(top())`,
+            // so it is copied before its storage is freed
+            T copy = item;
+            reserve(std::max<size_type>(_capacity * 2, initial_capacity));
+            this->slots()[_size++] = std::move(copy);
+            return;
+        }
+        this->slots()[_size++] = item;
+    }
+
+    /** remove the top item. the stack must not be empty. */
+    void pop() { _size -= 1; }
+
+    /** the top item. the stack must not be empty. */
+    T& top() { return this->slots()[_size - 1]; }
+    const T& top() const { return this->slots()[_size - 1]; }
+
+    size_type size() const { return _size; }
+    bool empty() const { return _size == 0; }
+    size_type capacity() const { return _capacity; }
+
+    /** remove all items, but keep the storage */
+    void clear() { _size = 0; }
+
+    /**
+     * make sure at least `count` items fit without reallocation.
+     * invalidates pointers obtained from `data()` if the storage grows.
+     */
+    void reserve(size_type count) {
+        if (count <= _capacity) {
+            return;
+        }
+        auto grown = std::make_unique<T[]>(count + 1);
+        std::copy(this->slots(), this->slots() + _size, grown.get() + 1);
+        _data = std::move(grown);
+        _capacity = count;
+    }
+
+    /** the bottom-most slot of the storage */
+    T* data() { return this->slots(); }
+    const T* data() const { return this->slots(); }
+
+    /**
+     * set the number of live items after writing slots through `data()`.
+     * `count` must not exceed the capacity.
+     */
+    void set_size(size_type count) { _size = count; }
+
+private:
+    /** the bottom-most slot, after the scratch slot */
+    T* slots() const { return _data ? _data.get() + 1 : nullptr; }
+
+    size_type _size = 0;
+    size_type _capacity = 0;
+    std::unique_ptr<T[]> _data;
+};
+
+
+/**
+ * return addresses of the subroutines the vm is in, see `opcode::CALL`.
+ *
+ * it is separate from the operand stack, so subroutines can take and
+ * return any number of items on it. the storage for `max_depth` frames is
+ * allocated up front and never grows: a call beyond it fails, so runaway
+ * recursion stops early instead of exhausting the memory.
+ */
+class call_stack {
+public:
+    using value_type = size_t;
+    using size_type = size_t;
+
+    /** number of frames of a default call stack */
+    static constexpr size_type default_depth = 1024;
+
+    explicit call_stack(size_type max_depth = default_depth)
+        : _max_depth{max_depth},
+          _data{std::make_unique<size_t[]>(max_depth)} {}
+
+    call_stack(call_stack&& other) noexcept
+        : _size{std::exchange(other._size, 0)},
+          _max_depth{std::exchange(other._max_depth, 0)},
+          _data{std::move(other._data)} {}
+
+    call_stack& operator=(call_stack&& other) noexcept {
+        _size = std::exchange(other._size, 0);
+        _max_depth = std::exchange(other._max_depth, 0);
+        _data = std::move(other._data);
+        return *this;
+    }
+
+    /**
+     * enter a subroutine, which returns to `return_address`.
+     * @return false if the stack is full, then it stays as it is.
+     */
+    bool push(size_t return_address) {
+        if (_size == _max_depth) [[unlikely]] {
+            return false;
+        }
+        _data[_size++] = return_address;
+        return true;
+    }
+
+    /** leave the innermost subroutine. the stack must not be empty. */
+    size_t pop() { return _data[--_size]; }
+
+    size_type size() const { return _size; }
+    bool empty() const { return _size == 0; }
+    size_type max_depth() const { return _max_depth; }
+
+    /** leave all subroutines, but keep the storage */
+    void clear() { _size = 0; }
+
+    /** the return addresses, the innermost one is last */
+    std::span<const size_t> view() const { return {_data.get(), _size}; }
+
+    /**
+     * replace the return addresses.
+     * @return false if they don't fit, then the stack stays as it is.
+     */
+    bool assign(std::span<const size_t> frames) {
+        if (frames.size() > _max_depth) {
+            return false;
+        }
+        std::copy(frames.begin(), frames.end(), _data.get());
+        _size = frames.size();
+        return true;
+    }
+
+private:
+    size_type _size = 0;
+    size_type _max_depth;
+    std::unique_ptr<size_t[]> _data;
+};
+
+} // namespace vm
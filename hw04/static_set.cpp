@@ -0,0 +1,19 @@
+#include "static_set.h"
+
+
+namespace vm {
+
+template <vm_item T>
+bool run_extension(basic_vm_state<T>& vm, op_id_t op_id, T arg) {
+    auto find_action = vm.instructions->actions.find(op_id);
+    if (find_action == std::end(vm.instructions->actions)) {
+        throw invalid_instruction{std::string{"unknown instruction at pc="} + std::to_string(vm.pc - 1)};
+    }
+    return find_action->second(vm, arg);
+}
+
+template bool run_extension<int32_t>(basic_vm_state<int32_t>&, op_id_t, int32_t);
+template bool run_extension<int64_t>(basic_vm_state<int64_t>&, op_id_t, int64_t);
+template bool run_extension<double>(basic_vm_state<double>&, op_id_t, double);
+
+} // namespace vm
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+
+#include "flushed.h"
+#include "vm.h"
+
+
+namespace vm {
+
+/**
+ * run an instruction that isn't part of a `static_instruction_set`,
+ * i.e. one registered at runtime with `register_instruction`.
+ *
+ * @return whether the vm keeps running, like the action
+ */
+template <vm_item T>
+bool run_extension(basic_vm_state<T>& vm, op_id_t op_id, T arg);
+
+
+/** the item type of a handler, deduced from its `execute` */
+template <typename T>
+T handler_item(bool (*)(basic_vm_state<T>&, T));
+
+template <typename handler_t>
+using handler_item_t = decltype(handler_item(&handler_t::execute));
+
+
+/**
+ * an instruction set that is known at compile time.
+ *
+ * each handler is a type with
+ *   static constexpr std::string_view name;
+ *   static bool execute(vm_state& vm, item_t arg);
+ * and optionally `static constexpr opcode op`, if it implements that
+ * built-in instruction exactly, so `run` and `analyze` know it too.
+ * the handlers may all take `basic_vm_state<T>` and items of another
+ * type T instead, see `basic_builtin_set`.
+ *
+ * the handlers get the op ids 0, 1, ... in the order of the list, so the
+ * ids are constants, and `run_static` dispatches them with a `switch` in
+ * which the handlers are inlined. instructions registered to a vm at
+ * runtime get the ids after them, and run through their action.
+ */
+template <typename... handler_ts>
+struct static_instruction_set {
+    /** the type of the items of the vms that run the set */
+    using item_type = handler_item_t<std::tuple_element_t<0, std::tuple<handler_ts...>>>;
+    static_assert((std::is_same_v<handler_item_t<handler_ts>, item_type> and ...),
+                  "all handlers need the same item type");
+
+    using vm_type = basic_vm_state<item_type>;
+    using instruction_set_type = basic_instruction_set<item_type>;
+
+    /** number of handlers */
+    static constexpr size_t size = sizeof...(handler_ts);
+
+    /** how many handlers the `switch` of `execute` has cases for */
+    static constexpr size_t max_size = 64;
+    static_assert(size <= max_size, "too many handlers for the dispatch switch");
+
+    /** the handler with the given op id */
+    template <op_id_t op_id>
+    using handler = std::tuple_element_t<op_id, std::tuple<handler_ts...>>;
+
+    /** instruction names, indexed by op id */
+    static constexpr std::array<std::string_view, size> names{handler_ts::name...};
+
+    /** op id of an instruction name, `size` if there is no such instruction */
+    static constexpr op_id_t id_of(std::string_view name) {
+        for (op_id_t op_id = 0; op_id < size; op_id++) {
+            if (names[op_id] == name) {
+                return op_id;
+            }
+        }
+        return size;
+    }
+
+    /**
+     * the instruction set of the vms that run this set,
+     * built once and shared like `builtin_instructions`.
+     */
+    static std::shared_ptr<const instruction_set_type> instructions() {
+        static const std::shared_ptr<const instruction_set_type> shared = [] {
+            auto set = std::make_shared<instruction_set_type>();
+            (add_handler<handler_ts>(*set), ...);
+            return set;
+        }();
+        return shared;
+    }
+
+    /**
+     * does the vm's instruction set start with this set's instructions?
+     * it may have more, which were registered at runtime.
+     */
+    static bool matches(const instruction_set_type& instructions) {
+        if (instructions.next_op_id < size) {
+            return false;
+        }
+        for (op_id_t op_id = 0; op_id < size; op_id++) {
+            auto name = instructions.names.find(op_id);
+            if (name == std::end(instructions.names) or name->second != names[op_id]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * execute one instruction.
+     *
+     * @return whether the vm keeps running
+     */
+    static bool execute(op_id_t op_id, vm_type& vm, item_type arg) {
+        switch (op_id) {
+#define VM_STATIC_CASE(id)                                              \
+        case id:                                                        \
+            if constexpr (id < size) {                                  \
+                return handler<id>::execute(vm, arg);                   \
+            }                                                           \
+            break;
+
+        VM_STATIC_CASE(0)  VM_STATIC_CASE(1)  VM_STATIC_CASE(2)  VM_STATIC_CASE(3)
+        VM_STATIC_CASE(4)  VM_STATIC_CASE(5)  VM_STATIC_CASE(6)  VM_STATIC_CASE(7)
+        VM_STATIC_CASE(8)  VM_STATIC_CASE(9)  VM_STATIC_CASE(10) VM_STATIC_CASE(11)
+        VM_STATIC_CASE(12) VM_STATIC_CASE(13) VM_STATIC_CASE(14) VM_STATIC_CASE(15)
+        VM_STATIC_CASE(16) VM_STATIC_CASE(17) VM_STATIC_CASE(18) VM_STATIC_CASE(19)
+        VM_STATIC_CASE(20) VM_STATIC_CASE(21) VM_STATIC_CASE(22) VM_STATIC_CASE(23)
+        VM_STATIC_CASE(24) VM_STATIC_CASE(25) VM_STATIC_CASE(26) VM_STATIC_CASE(27)
+        VM_STATIC_CASE(28) VM_STATIC_CASE(29) VM_STATIC_CASE(30) VM_STATIC_CASE(31)
+        VM_STATIC_CASE(32) VM_STATIC_CASE(33) VM_STATIC_CASE(34) VM_STATIC_CASE(35)
+        VM_STATIC_CASE(36) VM_STATIC_CASE(37) VM_STATIC_CASE(38) VM_STATIC_CASE(39)
+        VM_STATIC_CASE(40) VM_STATIC_CASE(41) VM_STATIC_CASE(42) VM_STATIC_CASE(43)
+        VM_STATIC_CASE(44) VM_STATIC_CASE(45) VM_STATIC_CASE(46) VM_STATIC_CASE(47)
+        VM_STATIC_CASE(48) VM_STATIC_CASE(49) VM_STATIC_CASE(50) VM_STATIC_CASE(51)
+        VM_STATIC_CASE(52) VM_STATIC_CASE(53) VM_STATIC_CASE(54) VM_STATIC_CASE(55)
+        VM_STATIC_CASE(56) VM_STATIC_CASE(57) VM_STATIC_CASE(58) VM_STATIC_CASE(59)
+        VM_STATIC_CASE(60) VM_STATIC_CASE(61) VM_STATIC_CASE(62) VM_STATIC_CASE(63)
+
+#undef VM_STATIC_CASE
+        default:
+            break;
+        }
+        return run_extension(vm, op_id, arg);
+    }
+
+private:
+    template <typename added_t>
+    static void add_handler(instruction_set_type& instructions) {
+        const op_id_t op_id = instructions.next_op_id;
+        register_instruction<item_type>(instructions, added_t::name, &added_t::execute);
+        if constexpr (requires { added_t::op; }) {
+            instructions.opcodes[op_id] = added_t::op;
+        }
+    }
+};
+
+
+/**
+ * create a vm that knows the instructions of the set.
+ * more can be registered with `register_instruction`.
+ */
+template <typename set_t>
+    requires requires { set_t::instructions(); }
+typename set_t::vm_type create_vm(bool debug = false) {
+    typename set_t::vm_type vm{set_t::instructions()};
+    vm.debug = debug;
+    return vm;
+}
+
+
+/**
+ * execute the given vm instructions like `run`, with a loop that is
+ * compiled for the instruction set, see `static_instruction_set`.
+ *
+ * if the vm's instruction set doesn't start with the set, e.g. because it
+ * wasn't created with `create_vm<set_t>`, the program is run with `run`.
+ */
+template <typename set_t>
+std::tuple<typename set_t::item_type, std::string>
+run_static(typename set_t::vm_type& vm, const basic_code<typename set_t::item_type>& code) {
+    if (vm.debug or not set_t::matches(*vm.instructions)) {
+        return run(vm, code);
+    }
+
+    const auto program = code.instructions();
+    typename set_t::item_type result = run_flushed(vm, [&] {
+        while (true) {
+            if (vm.pc >= program.size()) [[unlikely]] {
+                throw vm_segfault{std::string{"Invalid instruction address."}};
+            }
+            const auto& [op_id, arg] = program[vm.pc];
+
+            // the handlers may overwrite the advanced pc
+            vm.pc += 1;
+            if (not set_t::execute(op_id, vm, arg)) {
+                break;
+            }
+        }
+        if (vm.stack.empty()) {
+            throw vm_stackfail{std::string{"The stack in empty."}};
+        }
+        return vm.stack.top();
+    });
+    return {result, std::string{vm.output->view()}};
+}
+
+} // namespace vm
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <memory>
+
+#include "vm.h"
+
+
+namespace vm {
+
+/**
+ * how much a `run_steps` call may execute before it suspends the program.
+ */
+struct run_budget {
+    using clock = std::chrono::steady_clock;
+
+    static constexpr uint64_t unlimited = std::numeric_limits<uint64_t>::max();
+
+    /** the most instructions to execute */
+    uint64_t fuel = unlimited;
+
+    /**
+     * when to suspend the program.
+     * it is checked about every `deadline_interval` instructions, so a run
+     * may end that many instructions after the deadline.
+     */
+    clock::time_point deadline = clock::time_point::max();
+
+    /** how many instructions run between two checks of the clock */
+    static constexpr uint64_t deadline_interval = 4096;
+};
+
+
+/**
+ * did `run_steps` finish the program?
+ */
+enum class run_status {
+    /** the program has stopped, e.g. with EXIT */
+    exited,
+    /** the budget ran out, `run_steps` continues the program */
+    suspended,
+};
+
+
+/**
+ * what a `run_steps` call did.
+ */
+struct step_result {
+    run_status status;
+    /** the top stack item when the program exited, 0 if it was suspended */
+    item_t value;
+    /** how many instructions were executed by this call */
+    uint64_t executed;
+};
+
+
+/**
+ * execute the program like `run`, but stop once the budget is used up.
+ *
+ * a suspended program is continued by calling this again with the same
+ * vm and code, as its pc and stack are kept in the vm. so many programs
+ * can take turns on one thread, each with its own vm.
+ * the output is in `vm.output`, and flushed whenever the call returns.
+ *
+ * the fuel is mostly charged on taken jumps only, and the clock is read
+ * every `run_budget::deadline_interval` instructions, so the execution is
+ * about as fast as with `run`. only the last instructions of the fuel,
+ * about as many as the program has, are charged one by one.
+ *
+ * each call decodes the program first, which takes about as long as
+ * executing it once. a `stepped_program` keeps it decoded instead.
+ */
+step_result run_steps(vm_state& vm, const code_t& code, const run_budget& budget);
+
+
+// the decoded instructions, see vm.cpp
+struct decoded_program;
+
+
+/**
+ * a program decoded once for running it in steps, like with `run_steps`.
+ * so continuing it only costs the budget checks, no matter how large
+ * the program is, and many programs can take turns in short slices:
+ *
+ *   vm::stepped_program program{vm, code};
+ *   while (program.run(vm, {.fuel = 1000}).status == vm::run_status::suspended) {
+ *       // run the others
+ *   }
+ *
+ * the decoded program is kept until the stack leaves what the analysis
+ * covers, e.g. after a custom instruction, then it is decoded once more
+ * with all stack checks.
+ */
+class stepped_program {
+public:
+    /**
+     * decode a program.
+     *
+     * @param vm: the vm the program was assembled and analyzed for
+     * @param code: the program, e.g. from `assemble` or `optimize`
+     */
+    stepped_program(const vm_state& vm, code_t code);
+    ~stepped_program();
+
+    stepped_program(stepped_program&& other) noexcept;
+    stepped_program& operator=(stepped_program&& other) noexcept;
+    stepped_program(const stepped_program&) = delete;
+    stepped_program& operator=(const stepped_program&) = delete;
+
+    /** the program that is run */
+    const code_t& code() const { return this->program; }
+
+    /**
+     * run the program from `vm.pc` like `run_steps`.
+     *
+     * @param vm: usually the vm it was decoded for. for a vm with another
+     *            instruction set, the program is decoded again first
+     */
+    step_result run(vm_state& vm, const run_budget& budget);
+
+private:
+    code_t program;
+
+    /** the instruction set the program was decoded for */
+    std::shared_ptr<const instruction_set> instructions;
+
+    std::unique_ptr<decoded_program> decoded;
+};
+
+} // namespace vm
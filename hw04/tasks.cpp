@@ -0,0 +1,494 @@
+#include "tasks.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+
+namespace vm {
+
+namespace {
+
+enum class task_status : uint8_t {
+    /** in a queue, until a worker or the JOIN claims it */
+    waiting,
+    running,
+    /** finished, or dropped before it ran */
+    done,
+};
+
+
+/**
+ * a child started by SPAWN.
+ */
+struct task {
+    std::atomic<task_status> status{task_status::waiting};
+
+    /** the task that spawned it, nullptr for children of the program itself */
+    std::shared_ptr<const task> parent;
+
+    /** where the child starts, past the SPAWN */
+    size_t pc = 0;
+    /** the items copied from the parent's stack */
+    std::vector<item_t> input;
+
+    /** only valid once the task is done */
+    item_t result = 0;
+    std::string output;
+    std::exception_ptr error;
+};
+
+
+/** the tasks spawned on a worker, the newest at the back */
+struct alignas(64) task_queue {
+    std::mutex lock;
+    std::deque<std::shared_ptr<task>> tasks;
+
+    /**
+     * the vms the worker ran tasks on, which no task runs on now.
+     * only used by the worker's thread, so they need no lock.
+     */
+    std::vector<std::unique_ptr<vm_state>> spare_vms;
+};
+
+
+/** the worker of the pool the thread is, while `run_parallel` runs */
+thread_local size_t current_worker = 0;
+
+
+/**
+ * was the task spawned by `ancestor`, or by one of its descendants?
+ * every task descends from the program itself, which is nullptr.
+ */
+bool descends_from(const task& job, const task* ancestor) {
+    if (ancestor == nullptr) {
+        return true;
+    }
+    for (const task* parent = job.parent.get(); parent != nullptr; parent = parent->parent.get()) {
+        if (parent == ancestor) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * the queues of all workers for one `run_parallel`, and what the
+ * tasks need to run.
+ *
+ * a worker runs its own tasks newest first, so it goes depth first like a
+ * sequential run would. idle workers steal the oldest task of another
+ * worker, which is the one closest to the root, so likely the biggest.
+ *
+ * a task that waits for a child running elsewhere only helps with tasks
+ * that descend from it, which it has to wait for anyway. so the tasks
+ * run on top of each other on a thread's stack go down the spawn tree,
+ * and nest no deeper than a sequential run would. when there are none,
+ * the thread sleeps until a task finishes or another one is queued.
+ */
+class task_scheduler {
+public:
+    task_scheduler(const code_t& code, const vm_state& root, size_t workers)
+        :
+        code{code},
+        instructions{root.instructions},
+        call_depth{root.calls.max_depth()} {
+
+        for (size_t i = 0; i < workers; i++) {
+            this->queues.push_back(std::make_unique<task_queue>());
+        }
+    }
+
+    /** make the task available on the queue of the current worker */
+    void push(std::shared_ptr<task> job);
+
+    /**
+     * wait until the child of the group is done, and run it here if no one
+     * else does.
+     */
+    void complete(const task_group& group, const std::shared_ptr<task>& job);
+
+    /** wait for the tasks of the group that run, drop the waiting ones */
+    void drop(task_group& group);
+
+    /** run waiting tasks until `finish` is called */
+    void serve();
+
+    /** stop the workers in `serve` */
+    void finish();
+
+private:
+    /** claim a waiting task to run it, false if it was claimed before */
+    static bool claim(task& job) {
+        task_status expected = task_status::waiting;
+        return job.status.compare_exchange_strong(expected, task_status::running,
+                                                  std::memory_order_acq_rel);
+    }
+
+    /** run a task that was claimed */
+    void run(const std::shared_ptr<task>& job);
+
+    /**
+     * get a spare vm of the current worker, or a new one if all of them run
+     * tasks, e.g. the ones waiting in a JOIN below this one.
+     */
+    std::unique_ptr<vm_state> acquire_vm();
+
+    /**
+     * claim the newest own task, or the oldest one of another worker.
+     * only tasks that descend from `ancestor` are taken, see `descends_from`.
+     */
+    std::shared_ptr<task> take(const task* ancestor);
+
+    /**
+     * wait until the task is done, meanwhile run the tasks that descend
+     * from `waiter`, the task that waits.
+     */
+    void wait(const task& job, const task* waiter);
+
+    const code_t& code;
+    std::shared_ptr<const instruction_set> instructions;
+    size_t call_depth;
+
+    std::vector<std::unique_ptr<task_queue>> queues;
+    /** entries in all queues, including the ones claimed by JOIN meanwhile */
+    std::atomic<size_t> queued{0};
+
+    /** tasks queued so far, so `wait` knows if there are new ones */
+    std::atomic<uint64_t> pushed{0};
+
+    std::mutex idle_lock;
+    std::condition_variable idle;
+    /** workers waiting in `serve` */
+    std::atomic<size_t> sleeping{0};
+    bool finished = false;
+
+    /** wakes the threads in `wait`, when a task is done or queued */
+    std::condition_variable progress;
+    /** threads sleeping in `wait` */
+    std::atomic<size_t> waiting{0};
+};
+
+} // namespace
+
+
+/**
+ * the children a vm has spawned, see `vm_state::tasks`.
+ */
+struct task_group {
+    task_group(task_scheduler* scheduler, std::shared_ptr<task> owner)
+        :
+        scheduler{scheduler},
+        owner{std::move(owner)} {}
+
+    task_scheduler* scheduler;
+
+    /** the task whose vm spawns the children, nullptr for the program itself */
+    std::shared_ptr<task> owner;
+
+    /** indexed by handle - 1, nullptr once joined */
+    std::vector<std::shared_ptr<task>> children;
+};
+
+
+namespace {
+
+void task_scheduler::push(std::shared_ptr<task> job) {
+    task_queue& own = *this->queues[current_worker];
+    {
+        std::lock_guard guard{own.lock};
+        own.tasks.push_back(std::move(job));
+    }
+
+    // a worker about to sleep sees either the task or the sleeper count
+    this->queued.fetch_add(1);
+    this->pushed.fetch_add(1);
+    const bool idle_workers = this->sleeping.load() > 0;
+    const bool waiters = this->waiting.load() > 0;
+    if (idle_workers or waiters) {
+        {
+            std::lock_guard guard{this->idle_lock};
+        }
+        if (idle_workers) {
+            this->idle.notify_one();
+        }
+        if (waiters) {
+            // it may descend from one of the waiting tasks
+            this->progress.notify_all();
+        }
+    }
+}
+
+
+void task_scheduler::complete(const task_group& group, const std::shared_ptr<task>& job) {
+    // a JOIN usually waits for the newest child, which is still queued
+    task_queue& own = *this->queues[current_worker];
+    bool unqueued = false;
+    {
+        std::lock_guard guard{own.lock};
+        if (not own.tasks.empty() and own.tasks.back() == job) {
+            own.tasks.pop_back();
+            unqueued = true;
+        }
+    }
+    if (unqueued) {
+        this->queued.fetch_sub(1);
+    }
+
+    if (claim(*job)) {
+        this->run(job);
+    }
+    else {
+        this->wait(*job, group.owner.get());
+    }
+}
+
+
+void task_scheduler::drop(task_group& group) {
+    for (const std::shared_ptr<task>& child : group.children) {
+        if (child == nullptr) {
+            continue;
+        }
+        task_status expected = task_status::waiting;
+        if (not child->status.compare_exchange_strong(expected, task_status::done,
+                                                      std::memory_order_acq_rel)) {
+            // it runs somewhere, and may still use the program
+            this->wait(*child, group.owner.get());
+        }
+    }
+    group.children.clear();
+}
+
+
+void task_scheduler::serve() {
+    while (true) {
+        if (std::shared_ptr<task> job = this->take(nullptr)) {
+            this->run(job);
+            continue;
+        }
+
+        std::unique_lock guard{this->idle_lock};
+        this->sleeping.fetch_add(1);
+        this->idle.wait(guard, [this] { return this->finished or this->queued.load() > 0; });
+        this->sleeping.fetch_sub(1);
+        if (this->finished) {
+            return;
+        }
+    }
+}
+
+
+void task_scheduler::finish() {
+    {
+        std::lock_guard guard{this->idle_lock};
+        this->finished = true;
+    }
+    this->idle.notify_all();
+}
+
+
+void task_scheduler::run(const std::shared_ptr<task>& job) {
+    std::unique_ptr<vm_state> vm = this->acquire_vm();
+    vm_state& child = *vm;
+    child.tasks->owner = job;
+    for (item_t item : job->input) {
+        child.stack.push(item);
+    }
+    child.stack.push(0);
+    child.pc = job->pc;
+
+    // the program was linked by the first run, see `basic_code::get_linked`
+    try {
+        job->result = std::get<0>(run_view(child, this->code));
+    }
+    catch (...) {
+        job->error = std::current_exception();
+    }
+    // also what it wrote before failing
+    job->output = child.output->view();
+
+    this->drop(*child.tasks);
+    child.tasks->owner.reset();
+    child.reset();
+    this->queues[current_worker]->spare_vms.push_back(std::move(vm));
+    job->input = {};
+
+    // a thread about to sleep in `wait` sees either the status or the waiter count
+    job->status.store(task_status::done);
+    if (this->waiting.load() > 0) {
+        {
+            std::lock_guard guard{this->idle_lock};
+        }
+        this->progress.notify_all();
+    }
+}
+
+
+std::unique_ptr<vm_state> task_scheduler::acquire_vm() {
+    std::vector<std::unique_ptr<vm_state>>& spare = this->queues[current_worker]->spare_vms;
+    if (not spare.empty()) {
+        std::unique_ptr<vm_state> vm = std::move(spare.back());
+        spare.pop_back();
+        return vm;
+    }
+
+    auto vm = std::make_unique<vm_state>(this->instructions);
+    vm->calls = call_stack{this->call_depth};
+    vm->tasks = std::make_shared<task_group>(this, nullptr);
+    return vm;
+}
+
+
+std::shared_ptr<task> task_scheduler::take(const task* ancestor) {
+    const size_t workers = this->queues.size();
+    for (size_t offset = 0; offset < workers; offset++) {
+        task_queue& queue = *this->queues[(current_worker + offset) % workers];
+        while (true) {
+            std::shared_ptr<task> job;
+            {
+                std::lock_guard guard{queue.lock};
+                if (queue.tasks.empty()) {
+                    break;
+                }
+                std::shared_ptr<task>& end = offset == 0 ? queue.tasks.back() : queue.tasks.front();
+                if (not descends_from(*end, ancestor)) {
+                    break;
+                }
+                job = std::move(end);
+                if (offset == 0) {
+                    queue.tasks.pop_back();
+                }
+                else {
+                    queue.tasks.pop_front();
+                }
+            }
+            this->queued.fetch_sub(1);
+
+            // otherwise it was joined or dropped meanwhile
+            if (claim(*job)) {
+                return job;
+            }
+        }
+    }
+    return nullptr;
+}
+
+
+void task_scheduler::wait(const task& job, const task* waiter) {
+    auto done = [&] { return job.status.load() == task_status::done; };
+
+    while (not done()) {
+        // tasks queued after this are worth another look
+        const uint64_t seen = this->pushed.load();
+        if (std::shared_ptr<task> other = this->take(waiter)) {
+            this->run(other);
+            continue;
+        }
+
+        std::unique_lock guard{this->idle_lock};
+        this->waiting.fetch_add(1);
+        this->progress.wait(guard, [&] { return done() or this->pushed.load() != seen; });
+        this->waiting.fetch_sub(1);
+    }
+}
+
+
+/** the tasks of the vm, if it is run by `run_parallel` */
+task_group& get_group(vm_state& vm) {
+    if (vm.tasks == nullptr) {
+        throw invalid_instruction{std::string{"SPAWN and JOIN need a vm run by run_parallel."}};
+    }
+    return *vm.tasks;
+}
+
+} // namespace
+
+
+void spawn_task(vm_state& vm, item_t count) {
+    task_group& group = get_group(vm);
+    if (count < 0 or static_cast<size_t>(count) > vm.stack.size()) {
+        throw vm_stackfail{"SPAWN can't copy " + std::to_string(count) + " items, the stack has " +
+                           std::to_string(vm.stack.size()) + "."};
+    }
+
+    auto job = std::make_shared<task>();
+    job->parent = group.owner;
+    job->pc = vm.pc;
+    const item_t* top = vm.stack.data() + vm.stack.size();
+    job->input.assign(top - count, top);
+
+    group.children.push_back(job);
+    vm.stack.push(static_cast<item_t>(group.children.size()));
+    group.scheduler->push(std::move(job));
+}
+
+
+void join_task(vm_state& vm) {
+    task_group& group = get_group(vm);
+    if (vm.stack.empty()) {
+        throw vm_stackfail{std::string{"The stack in empty."}};
+    }
+    const item_t handle = vm.stack.top();
+    vm.stack.pop();
+
+    if (handle < 1 or static_cast<size_t>(handle) > group.children.size() or
+        group.children[static_cast<size_t>(handle - 1)] == nullptr) {
+        throw vm_segfault{"Invalid task handle " + std::to_string(handle) + "."};
+    }
+    const std::shared_ptr<task> job = std::move(group.children[static_cast<size_t>(handle - 1)]);
+    group.scheduler->complete(group, job);
+
+    // as if the child ran right here
+    vm.output->write(job->output);
+    if (job->error) {
+        std::rethrow_exception(job->error);
+    }
+    vm.stack.push(job->result);
+}
+
+
+std::tuple<item_t, std::string> run_parallel(work_pool& pool, vm_state& vm, const code_t& code) {
+    task_scheduler scheduler{code, vm, pool.size()};
+    std::tuple<item_t, std::string> result;
+    std::exception_ptr error;
+
+    // one index per worker: the first runs the program, the others its tasks
+    pool.parallel_for(pool.size(), [&](size_t worker, size_t index) {
+        current_worker = worker;
+        if (index != 0) {
+            scheduler.serve();
+            return;
+        }
+
+        vm.tasks = std::make_shared<task_group>(&scheduler, nullptr);
+        try {
+            result = run(vm, code);
+        }
+        catch (...) {
+            error = std::current_exception();
+        }
+        scheduler.drop(*vm.tasks);
+        vm.tasks.reset();
+        scheduler.finish();
+    });
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return result;
+}
+
+
+std::tuple<item_t, std::string> run_parallel(vm_state& vm, const code_t& code, size_t threads) {
+    work_pool pool{threads};
+    return run_parallel(pool, vm, code);
+}
+
+} // namespace vm
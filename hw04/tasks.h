@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <tuple>
+
+#include "pool.h"
+#include "vm.h"
+
+
+namespace vm {
+
+/**
+ * run a program whose SPAWN and JOIN instructions fork and join tasks
+ * on the workers of the pool.
+ *
+ * `SPAWN k` starts a child task at the next instruction, with a copy of
+ * the top k items of the stack. the child then has a 0 on top, the
+ * parent the task's handle, which is never 0, so both can branch on it:
+ *
+ *   LOAD_CONST 10
+ *   SPAWN 1
+ *   DUP
+ *   JMPZ child
+ *   ...
+ *   JOIN
+ *
+ * the child runs until EXIT, with its own empty memory and calls.
+ * `JOIN` pops a handle of a child of the running task, waits for the
+ * child, and pushes the top item it exited with. if the child failed,
+ * JOIN throws its exception instead.
+ *
+ * children that are waiting to run are stolen by idle workers, or run by
+ * JOIN on the parent's thread. while a JOIN waits for a child that runs
+ * elsewhere, its thread runs other waiting tasks.
+ *
+ * the output stays the same for any number of workers: a child writes to
+ * its own buffer, which JOIN appends to the parent's output, as if the
+ * child ran there. children that are never joined have no effect.
+ *
+ * the pool runs only this program until it finishes, so this can't be
+ * called by a task, or while the pool is busy otherwise.
+ *
+ * @return the execution results, like `run`
+ */
+std::tuple<item_t, std::string> run_parallel(work_pool& pool, vm_state& vm, const code_t& code);
+
+
+/**
+ * run the program like above, on a pool that is only created for it.
+ *
+ * @param threads: number of threads to run on, 0 for one per hardware thread
+ */
+std::tuple<item_t, std::string> run_parallel(vm_state& vm, const code_t& code, size_t threads = 0);
+
+
+/**
+ * execute SPAWN, for the execution loops and the instruction handler.
+ * the vm's pc has to be past the instruction already.
+ * throws `invalid_instruction` if the vm isn't run by `run_parallel`.
+ */
+void spawn_task(vm_state& vm, item_t count);
+
+
+/**
+ * execute JOIN, see `spawn_task`.
+ */
+void join_task(vm_state& vm);
+
+} // namespace vm
@@ -0,0 +1,135 @@
+#include "trace.h"
+
+#include <limits>
+
+#include "analysis.h"
+#include "flushed.h"
+
+
+namespace vm {
+
+namespace {
+
+/** counter of a loop that is never traced */
+constexpr uint32_t never_hot = std::numeric_limits<uint32_t>::max();
+
+
+/**
+ * would the conditional jump at the top of the stack go to its target?
+ * false if the stack doesn't have its operands, then executing it fails.
+ */
+bool jump_taken(const vm_state& vm, opcode op) {
+    const size_t size = vm.stack.size();
+    const item_t* top = vm.stack.data() + size;
+    switch (op) {
+    case opcode::JMPZ:
+    case opcode::DUP_JMPZ:
+        return size >= 1 and top[-1] == 0;
+    case opcode::JMP_EQ:
+        return size >= 2 and top[-2] == top[-1];
+    case opcode::JMP_NEQ:
+        return size >= 2 and top[-2] != top[-1];
+    default:
+        return false;
+    }
+}
+
+} // namespace
+
+
+tracing_program::tracing_program(code_t code)
+    :
+    program{std::move(code)},
+    loop_counts(this->program.size(), 0) {}
+
+
+std::tuple<item_t, std::string> tracing_program::run(vm_state& vm) {
+    if (vm.debug) {
+        return vm::run(vm, this->program);
+    }
+
+    item_t result = run_flushed(vm, [&] {
+        while (true) {
+            std::optional<item_t> exited = run_until_hot(vm, this->program, this->loop_counts, hot_threshold);
+            if (exited) {
+                return *exited;
+            }
+
+            const jit_trace* trace = this->trace_at(vm);
+            if (trace != nullptr) {
+                trace->run(vm);
+            }
+        }
+    });
+    return {result, std::string{vm.output->view()}};
+}
+
+
+const jit_trace* tracing_program::trace_at(vm_state& vm) {
+    const size_t head = vm.pc;
+    auto found = this->traces.find(head);
+    if (found != std::end(this->traces)) {
+        return &found->second;
+    }
+
+    // from now on, the interpreter doesn't stop at this loop
+    // unless the trace is compiled
+    this->loop_counts[head] = never_hot;
+
+    std::optional<std::vector<trace_step>> steps = this->record(vm);
+    if (not steps) {
+        return nullptr;
+    }
+    std::optional<register_trace> translated = translate_trace(vm, this->program, *steps);
+    if (not translated) {
+        return nullptr;
+    }
+    jit_trace compiled{std::move(*translated)};
+    if (not compiled.is_native()) {
+        return nullptr;
+    }
+
+    this->loop_counts[head] = hot_threshold;
+    return &this->traces.emplace(head, std::move(compiled)).first->second;
+}
+
+
+std::optional<std::vector<trace_step>> tracing_program::record(vm_state& vm) const {
+    const code_analysis* analysis = usable_analysis(vm, this->program);
+    if (analysis == nullptr) {
+        return std::nullopt;
+    }
+
+    const size_t head = vm.pc;
+    std::vector<trace_step> steps;
+    size_t pc = head;
+    do {
+        const opcode op = analysis->opcodes[pc];
+        if (steps.size() == max_trace_length or op == opcode::EXIT or
+            op == opcode::PRINT or op == opcode::CUSTOM or accesses_memory(op) or is_call(op) or
+            is_task(op)) {
+            return std::nullopt;
+        }
+
+        // the built-in actions do exactly what the interpreter does
+        const auto& [op_id, arg] = this->program[pc];
+        const bool taken = jump_taken(vm, op);
+        vm.pc = pc + 1;
+        vm.instructions->actions.at(op_id)(vm, arg);
+        steps.push_back({pc, taken});
+
+        pc = vm.pc;
+        if (pc >= this->program.size()) {
+            throw vm_segfault{std::string{"Invalid instruction address."}};
+        }
+    } while (pc != head);
+
+    return steps;
+}
+
+
+std::tuple<item_t, std::string> run_tracing(vm_state& vm, const code_t& code) {
+    return tracing_program{code}.run(vm);
+}
+
+} // namespace vm
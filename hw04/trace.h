@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "jit.h"
+#include "vm.h"
+
+
+namespace vm {
+
+/**
+ * a program that is interpreted, with its hot loops compiled to native
+ * code while it runs.
+ *
+ * the interpreter counts how often each backward jump is taken. once a
+ * loop head is the target `hot_threshold` times, the next iteration is
+ * executed instruction by instruction and recorded, including which way
+ * each conditional jump went. the recorded iteration is translated to a
+ * `register_trace`, in which those jumps are guards, and compiled to a
+ * `jit_trace`. from then on, each time the interpreter reaches the loop
+ * head, the trace runs until a guard fails, e.g. when the loop ends, and
+ * the interpreter continues at that guard.
+ *
+ * loops whose iteration has EXIT, PRINT, custom, memory, subroutine or task
+ * instructions, or is longer than `max_trace_length`, are only interpreted.
+ * on platforms without native code, everything is interpreted.
+ */
+class tracing_program {
+public:
+    /** taken backward jumps to a loop head before its loop is traced */
+    static constexpr uint32_t hot_threshold = 64;
+
+    /** most instructions a trace records */
+    static constexpr size_t max_trace_length = 1024;
+
+    /**
+     * @param code: the program, e.g. from `assemble` or `optimize`
+     */
+    explicit tracing_program(code_t code);
+
+    /** the program that is run */
+    const code_t& code() const { return this->program; }
+
+    /** number of loops that were compiled so far */
+    size_t trace_count() const { return this->traces.size(); }
+
+    /**
+     * run the program from `vm.pc`, with the same results, output and
+     * exceptions as `vm::run`. the traces are kept for later runs.
+     */
+    std::tuple<item_t, std::string> run(vm_state& vm);
+
+private:
+    /**
+     * the trace of the loop at `vm.pc`, which is recorded and compiled
+     * first if needed. recording executes an iteration, so afterwards the
+     * vm may be anywhere. nullptr if the loop can't be traced.
+     */
+    const jit_trace* trace_at(vm_state& vm);
+
+    /** record an iteration from `vm.pc`, nothing if it can't be traced */
+    std::optional<std::vector<trace_step>> record(vm_state& vm) const;
+
+    code_t program;
+
+    /** taken backward jumps per target, `never_hot` for loops that aren't traced */
+    std::vector<uint32_t> loop_counts;
+
+    /** the compiled loops, by their head */
+    std::unordered_map<size_t, jit_trace> traces;
+};
+
+
+/**
+ * run the program with a `tracing_program`.
+ */
+std::tuple<item_t, std::string> run_tracing(vm_state& vm, const code_t& code);
+
+
+/**
+ * execute the program like `run`, but suspend it at the head of a hot
+ * loop: a backward jump target that was jumped to `threshold` times,
+ * according to the counters in `loop_counts`, one per pc.
+ * counters above `threshold` never suspend. the output isn't flushed.
+ *
+ * @return the top stack item once the program exited, nothing if it was
+ *         suspended, then the vm is at the loop head
+ */
+std::optional<item_t> run_until_hot(vm_state& vm, const code_t& code,
+                                    std::span<uint32_t> loop_counts, uint32_t threshold);
+
+} // namespace vm
@@ -0,0 +1,85 @@
+#include "vm.h"
+
+#include <iostream>
+#include <span>
+#include <string>
+#include <tuple>
+#include <type_traits>
+
+#include "flushed.h"
+#include "handlers.h"
+#include "static_set.h"
+
+
+namespace vm {
+
+namespace {
+
+/**
+ * run the program through the actions of the vm's instructions,
+ * for vms that don't have the built-in set, or debug their programs.
+ */
+template <typename T>
+std::tuple<T, std::string> run_actions(basic_vm_state<T>& vm, const basic_code<T>& code) {
+    const std::span<const basic_op<T>> program = code.instructions();
+    T result = run_flushed(vm, [&] {
+        while (true) {
+            if (vm.pc >= program.size()) [[unlikely]] {
+                throw vm_segfault{std::string{"Invalid instruction address."}};
+            }
+            const auto& [op_id, arg] = program[vm.pc];
+
+            if (vm.debug) {
+                auto name = vm.instructions->names.find(op_id);
+                std::cout << "-- exec "
+                          << (name != std::end(vm.instructions->names) ? name->second : "?")
+                          << " arg=" << arg << " at pc=" << vm.pc << std::endl;
+            }
+
+            // the action may overwrite the advanced pc
+            vm.pc += 1;
+            if (not run_extension(vm, op_id, arg)) {
+                break;
+            }
+        }
+        if (vm.stack.empty()) {
+            throw vm_stackfail{std::string{"The stack in empty."}};
+        }
+        return vm.stack.top();
+    });
+    return {result, std::string{vm.output->view()}};
+}
+
+} // namespace
+
+
+template <vm_item T>
+basic_vm_state<T> create_vm(bool debug) {
+    return create_vm<basic_builtin_set<T>>(debug);
+}
+
+
+template <vm_item T>
+std::tuple<T, std::string> run(basic_vm_state<T>& vm, const basic_code<T>& code) {
+    if constexpr (std::is_same_v<T, item_t>) {
+        // the default instantiation has its own tiers
+        return run(vm, code);
+    }
+    else {
+        if (not vm.debug and basic_builtin_set<T>::matches(*vm.instructions)) {
+            return run_static<basic_builtin_set<T>>(vm, code);
+        }
+        return run_actions(vm, code);
+    }
+}
+
+
+template basic_vm_state<int32_t> create_vm<int32_t>(bool);
+template basic_vm_state<int64_t> create_vm<int64_t>(bool);
+template basic_vm_state<double> create_vm<double>(bool);
+
+template std::tuple<int32_t, std::string> run<int32_t>(basic_vm_state<int32_t>&, const basic_code<int32_t>&);
+template std::tuple<int64_t, std::string> run<int64_t>(basic_vm_state<int64_t>&, const basic_code<int64_t>&);
+template std::tuple<double, std::string> run<double>(basic_vm_state<double>&, const basic_code<double>&);
+
+} // namespace vm
@@ -1,230 +1,1893 @@
 #include "vm.h"
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <limits>
+#include <optional>
+#include <span>
+#include <type_traits>
 
-#include "util.h"
+#include "analysis.h"
+#include "flushed.h"
+#include "handlers.h"
+#include "jit.h"
+#include "profile.h"
+#include "registers.h"
+#include "step.h"
+#include "tasks.h"
+#include "trace.h"
+
+#if defined(__x86_64__) or defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 
 namespace vm {
 
-item_t vm_state::pop_top()
-{
-    if (this->stack.size() == 0)
-    {
-        throw vm_stackfail{std::string{"The stack in empty."}};
+namespace {
+
+/**
+ * for the helper lambdas of the execution loops: if the compiler moved
+ * them out of line, the locals they capture would have to live in memory.
+ */
+#if defined(__GNUC__)
+#define VM_ALWAYS_INLINE __attribute__((always_inline))
+#else
+#define VM_ALWAYS_INLINE
+#endif
+
+
+/**
+ * dispatch codes of the execution loops, with and without stack checks.
+ * the checked code is used for instructions which have to check the stack
+ * for underflow and capacity, because the analysis couldn't prove them safe.
+ *
+ * the codes of an opcode are next to each other, so they can index a dense
+ * table, see `run_top_cached`.
+ */
+constexpr uint8_t unchecked(opcode op) {
+    return static_cast<uint8_t>(static_cast<uint8_t>(op) * 2);
+}
+
+constexpr uint8_t checked(opcode op) {
+    return static_cast<uint8_t>(static_cast<uint8_t>(op) * 2 + 1);
+}
+
+
+/**
+ * one instruction of the pre-decoded program.
+ */
+struct decoded_op {
+    item_t arg;
+    /** only set for `opcode::CUSTOM`, nullptr if the op id is unknown. */
+    const op_action_t* action;
+    /** the opcode, as `checked` or `unchecked` code */
+    uint8_t dispatch;
+};
+
+
+/**
+ * translate the code to a dense instruction stream for the execution loop.
+ *
+ * built-in instructions are resolved to their opcode, all others to a
+ * pointer to their registered action.
+ * if an analysis is given, instructions it proves stack-safe skip the checks.
+ */
+std::vector<decoded_op> decode(const vm_state& vm, const code_t& code,
+                               const code_analysis* analysis) {
+    std::vector<decoded_op> program;
+    program.reserve(code.size());
+
+    for (size_t pc = 0; pc < code.size(); pc++) {
+        const auto& [op_id, arg] = code[pc];
+
+        opcode op = opcode::CUSTOM;
+        if (op_id < vm.instructions->opcodes.size()) {
+            op = vm.instructions->opcodes[op_id];
+        }
+
+        const op_action_t* action = nullptr;
+        if (op == opcode::CUSTOM) {
+            auto find_action = vm.instructions->actions.find(op_id);
+            if (find_action != std::end(vm.instructions->actions)) {
+                action = &find_action->second;
+            }
+        }
+
+        uint8_t dispatch = checked(op);
+        if (analysis != nullptr and analysis->is_stack_safe(pc)) {
+            dispatch = unchecked(op);
+        }
+
+        program.push_back({arg, action, dispatch});
     }
-    item_t top = this->stack.top();
-    this->stack.pop();
 
-    return top;
+    return program;
 }
 
+} // namespace
 
-vm_state create_vm(bool debug) {
-    vm_state state;
 
-    // enable vm debugging
-    state.debug = debug;
+/**
+ * a program decoded for a vm's instruction set, see `decode`.
+ * a `stepped_program` keeps it between its runs.
+ */
+struct decoded_program {
+    /** the analysis the stack checks were left out by, nullptr if none */
+    const code_analysis* analysis = nullptr;
+    /** are the control flow edges verified? stays so without the analysis */
+    bool verified = false;
+    std::vector<decoded_op> ops;
+};
 
 
-    register_instruction(state, "PRINT", [](vm_state& vmstate, const item_t /*arg*/) {
-        std::cout << vmstate.stack.top() << std::endl;
-        return true;
-    });
+namespace {
 
-    register_instruction(state, "LOAD_CONST", [](vm_state& vmstate, const item_t number) {
-        vmstate.stack.push(number);
-        return true;
-    });
+/**
+ * decode the program, with its analysis if it fits the vm.
+ */
+decoded_program prepare(const vm_state& vm, const code_t& code) {
+    const code_analysis* analysis = usable_analysis(vm, code);
+    return {analysis, analysis != nullptr and analysis->verified, decode(vm, code, analysis)};
+}
+
+
+/**
+ * decode the program again with all stack checks, once the stack is in
+ * a state the analysis doesn't cover. this holds for all later runs.
+ */
+void drop_analysis(const vm_state& vm, const code_t& code, decoded_program& program) {
+    program.analysis = nullptr;
+    program.ops = decode(vm, code, nullptr);
+}
+
+
+/**
+ * the original execution loop, which looks up each instruction's action
+ * and prints every step. used when debugging is enabled.
+ */
+item_t run_traced(vm_state& vm, const code_t& code) {
+    // execution loop for the machine
+    while (true) {
+
+        auto& [op_id, arg] = code[vm.pc];
+
+        std::cout << "-- exec " << vm.instructions->names.at(op_id) << " arg=" << arg << " at pc=" << vm.pc << std::endl;
 
-    register_instruction(state, "EXIT", [](vm_state& vmstate, const item_t) {
-        if (vmstate.stack.size() == 0)
+        // increase the program counter here so its value can be overwritten
+        // by the instruction when it executes!
+        vm.pc += 1;
+
+        auto find_action = vm.instructions->actions.find(op_id);
+        if (find_action == std::end(vm.instructions->actions)) {
+            throw invalid_instruction{std::string{"unknown op id: "} + std::to_string(op_id)};
+        }
+
+        // execute instruction and stop if the action returns false.
+        if (!find_action->second(vm, arg))
         {
-            throw vm_stackfail{std::string{"The stack size is 0 on exit."}};
+            break;
         }
-        return false;
-    });
 
-    register_instruction(state, "POP", [](vm_state& vmstate, const item_t) {
-        vmstate.pop_top();
-        return true;
-    });
+        if (vm.pc >= code.size())
+        {
+            throw vm_segfault{std::string{"Invalid instruction address."}};
+        }
+    }
 
-    register_instruction(state, "ADD", [](vm_state& vmstate, const item_t) {
-        item_t tos = vmstate.pop_top();
-        item_t tos1 = vmstate.pop_top();
+    return vm.stack.top();
+}
 
-        vmstate.stack.push(tos1 + tos);
-        return true;
-    });
 
-    register_instruction(state, "DIV", [](vm_state& vmstate, const item_t) {
-        item_t tos = vmstate.pop_top();
-        item_t tos1 = vmstate.pop_top();
+/**
+ * throw the stack failure out of line, so the checks in the
+ * execution loop stay small.
+ */
+[[noreturn]] void stack_empty() {
+    throw vm_stackfail{std::string{"The stack in empty."}};
+}
 
-        if (tos == 0)
-        {
-            throw div_by_zero{std::string{"divide by 0 error."}};
+
+/** the pc left the program, out of line like `stack_empty` */
+[[noreturn]] void invalid_address() {
+    throw vm_segfault{std::string{"Invalid instruction address."}};
+}
+
+
+/** the failures of CALL and RET, out of line like `stack_empty` */
+[[noreturn]] void calls_full() {
+    throw vm_stackfail{std::string{"The call stack is full."}};
+}
+
+[[noreturn]] void calls_empty() {
+    throw vm_stackfail{std::string{"The call stack is empty."}};
+}
+
+
+/**
+ * profiler of the execution loop that measures nothing,
+ * all its hooks compile away.
+ */
+struct no_profiler {
+    void enter(size_t) {}
+    void taken(size_t) {}
+};
+
+
+/**
+ * counts the executed instructions and taken jumps per pc.
+ */
+struct count_profiler {
+    explicit count_profiler(execution_profile& profile)
+        :
+        hits{profile.hits.data()},
+        taken_jumps{profile.taken.data()} {}
+
+    void enter(size_t pc) { this->hits[pc] += 1; }
+    void taken(size_t pc) { this->taken_jumps[pc] += 1; }
+
+    uint64_t* hits;
+    uint64_t* taken_jumps;
+};
+
+
+/**
+ * read the cpu time stamp counter, or a clock where there is none.
+ */
+inline uint64_t read_cycles() {
+#if defined(__x86_64__) or defined(__i386__)
+    return __rdtsc();
+#else
+    return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+}
+
+
+/**
+ * counts like `count_profiler`, and also charges the cycles between
+ * entering two instructions to the first of them.
+ */
+struct cycle_profiler : count_profiler {
+    explicit cycle_profiler(execution_profile& profile)
+        :
+        count_profiler{profile},
+        cycles{profile.cycles.data()} {}
+
+    // the last instruction is charged when the execution stops for any reason
+    ~cycle_profiler() {
+        if (this->current != no_pc) {
+            this->cycles[this->current] += read_cycles() - this->start;
         }
+    }
 
-        vmstate.stack.push(tos1 / tos);
-        return true;
-    });
+    cycle_profiler(const cycle_profiler&) = delete;
+    cycle_profiler& operator=(const cycle_profiler&) = delete;
 
-    register_instruction(state, "EQ", [](vm_state& vmstate, const item_t) {
-        item_t tos = vmstate.pop_top();
-        item_t tos1 = vmstate.pop_top();
+    void enter(size_t pc) {
+        count_profiler::enter(pc);
+        uint64_t now = read_cycles();
+        if (this->current != no_pc) {
+            this->cycles[this->current] += now - this->start;
+        }
+        this->current = pc;
+        this->start = now;
+    }
 
-        vmstate.stack.push(static_cast<item_t>(tos1 == tos));
-        return true;
-    });
+    static constexpr size_t no_pc = std::numeric_limits<size_t>::max();
 
-    register_instruction(state, "NEQ", [](vm_state& vmstate, const item_t) {
-        item_t tos = vmstate.pop_top();
-        item_t tos1 = vmstate.pop_top();
+    uint64_t* cycles;
+    size_t current = no_pc;
+    uint64_t start = 0;
+};
 
-        vmstate.stack.push(static_cast<item_t>(tos1 != tos));
-        return true;
-    });
 
-    register_instruction(state, "DUP", [](vm_state& vmstate, const item_t) {
-        if (vmstate.stack.size() == 0)
-        {
-            throw vm_stackfail{std::string{"The stack size is 0."}};
+/**
+ * when the execution loop charges its budget.
+ */
+enum class charge {
+    /** never, the budget is unlimited */
+    never,
+    /** before each instruction, so the budget is never exceeded */
+    instruction,
+    /**
+     * on taken jumps and custom instructions, for the straight run of
+     * instructions before them. the budget can be exceeded by that run,
+     * which is at most as long as the program.
+     */
+    jump,
+    /**
+     * nothing is charged, but each taken backward jump is reported to the
+     * budget's `back_jump`, which can suspend the execution at its target.
+     */
+    loop,
+};
+
+
+/**
+ * budget of the execution loop that never runs out.
+ *
+ * the loop keeps the current slice of a budget in a local, hands back
+ * what's left of it with `next_slice` when it is used up, and gets the
+ * next one. once there is none, the execution is suspended. when the
+ * execution stops otherwise, the rest is handed back with `finish`.
+ */
+struct no_budget {
+    static constexpr charge charged = charge::never;
+
+    int64_t next_slice(int64_t) { return std::numeric_limits<int64_t>::max(); }
+    void finish(int64_t) {}
+};
+
+
+/**
+ * charges the executed instructions to some fuel and checks a deadline.
+ *
+ * the fuel is handed out in slices of `run_budget::deadline_interval`
+ * instructions, so the clock is only read once per slice.
+ */
+template <charge mode>
+class step_budget {
+public:
+    static constexpr charge charged = mode;
+
+    step_budget(uint64_t fuel, run_budget::clock::time_point deadline)
+        :
+        fuel{static_cast<int64_t>(std::min<uint64_t>(fuel, std::numeric_limits<int64_t>::max()))},
+        left{this->fuel},
+        deadline{deadline} {}
+
+    /**
+     * @param rest: what's left of the last slice, negative if it was exceeded
+     * @return the next slice, 0 if the budget is exhausted
+     */
+    int64_t next_slice(int64_t rest) {
+        this->left += rest;
+        if (this->left <= 0) {
+            this->suspended = true;
+            return 0;
         }
-        vmstate.stack.push(vmstate.stack.top());
-        return true;
-    });
+        if (this->deadline != run_budget::clock::time_point::max() and
+            run_budget::clock::now() >= this->deadline) {
+            this->suspended = true;
+            this->late = true;
+            return 0;
+        }
+        int64_t size = std::min<int64_t>(this->left, run_budget::deadline_interval);
+        this->left -= size;
+        return size;
+    }
 
-    register_instruction(state, "JMP", [](vm_state& vmstate, const item_t addr) {
-        vmstate.pc = addr;
-        return true;
-    });
+    void finish(int64_t rest) {
+        this->left += rest;
+    }
 
-    register_instruction(state, "JMPZ", [](vm_state& vmstate, const item_t addr) {
-        item_t tos = vmstate.pop_top();
-        if (tos == 0)
-        {
-            vmstate.pc = addr;
+    /** has the execution been suspended because of this budget? */
+    bool ran_out() const { return this->suspended; }
+
+    /** was it suspended because of the deadline? */
+    bool deadline_passed() const { return this->late; }
+
+    /** instructions charged so far */
+    uint64_t executed() const {
+        return static_cast<uint64_t>(this->fuel - this->left);
+    }
+
+private:
+    const int64_t fuel;
+    /** fuel not handed out yet */
+    int64_t left;
+    const run_budget::clock::time_point deadline;
+    bool suspended = false;
+    bool late = false;
+};
+
+
+/**
+ * counts the taken backward jumps per target, i.e. the iterations of
+ * each loop, and suspends the execution at the head of a hot loop.
+ */
+class loop_counter {
+public:
+    static constexpr charge charged = charge::loop;
+
+    loop_counter(std::span<uint32_t> counts, uint32_t threshold)
+        :
+        counts{counts},
+        threshold{threshold} {}
+
+    int64_t next_slice(int64_t) { return std::numeric_limits<int64_t>::max(); }
+    void finish(int64_t) {}
+
+    /** false if the execution is suspended at the target */
+    bool back_jump(size_t target) {
+        uint32_t& count = this->counts[target];
+        // most jumps go to loops that were marked to never suspend again
+        if (count > this->threshold) [[likely]] {
+            return true;
         }
-        return true;
-    });
+        if (count < this->threshold) {
+            count += 1;
+            return true;
+        }
+        this->hot = true;
+        return false;
+    }
 
-    register_instruction(state, "WRITE", [](vm_state& vmstate, const item_t) {
-        if (vmstate.stack.size() == 0)
-        {
-            throw vm_stackfail{std::string{"The stack size is 0."}};
+    /** has the execution been suspended at a hot loop? */
+    bool suspended() const { return this->hot; }
+
+private:
+    std::span<uint32_t> counts;
+    const uint32_t threshold;
+    bool hot = false;
+};
+
+
+/**
+ * execute the program decoded by `prepare`.
+ *
+ * built-in opcodes are dispatched through a switch (i.e. a jump table),
+ * custom instructions call their registered action.
+ * instructions the stack analysis proved safe run without underflow and
+ * capacity checks, the others enter through their checked case label.
+ *
+ * for `verified` code, the pc is only bounds checked on entry and after
+ * custom instructions, as no built-in one can leave the program.
+ *
+ * the `profiler` is told about each executed instruction and taken
+ * conditional jump, see `no_profiler` for the hooks.
+ * the `budget` is charged as its `charged` mode says, see `no_budget`.
+ * once it is exhausted, the execution is suspended: the state is synced
+ * to the vm and 0 is returned.
+ *
+ * the program counter and stack pointer are kept local and are only synced
+ * back to the vm state when custom actions run or the execution stops.
+ */
+template <bool verified, typename profiler_t = no_profiler, typename budget_t = no_budget>
+item_t run_decoded(vm_state& vm, const code_t& code, decoded_program& decoded,
+                   profiler_t&& profiler = {}, budget_t&& budget = {}) {
+    if (decoded.analysis != nullptr and not enter_analyzed(vm, *decoded.analysis, vm.pc)) {
+        drop_analysis(vm, code, decoded);
+    }
+
+    const decoded_op* program = decoded.ops.data();
+    const size_t program_size = decoded.ops.size();
+    size_t pc = vm.pc;
+    // instructions left in the current slice of the budget,
+    // and where the straight run of instructions since the last charge began
+    int64_t allowance = 0;
+    size_t run_start = pc;
+
+    // one past the top stack item
+    item_t* base = vm.stack.data();
+    item_t* sp = base + vm.stack.size();
+    item_t* limit = base + vm.stack.capacity();
+
+    auto sync_stack = [&] {
+        vm.stack.set_size(static_cast<size_t>(sp - base));
+    };
+    auto load_stack = [&] {
+        base = vm.stack.data();
+        sp = base + vm.stack.size();
+        limit = base + vm.stack.capacity();
+    };
+    auto require = [&](ptrdiff_t count) {
+        if (sp - base < count) [[unlikely]] {
+            // like popping one by one until the stack is empty
+            sp = base;
+            stack_empty();
         }
-        vmstate.output_stream << vmstate.stack.top();
-        return true;
-    });
+    };
+    auto make_room = [&] {
+        if (sp == limit) [[unlikely]] {
+            sync_stack();
+            vm.stack.reserve(vm.stack.capacity() * 2);
+            load_stack();
+        }
+    };
 
-    register_instruction(state, "WRITE_CHAR", [](vm_state& vmstate, const item_t) {
-        if (vmstate.stack.size() == 0)
-        {
-            throw vm_stackfail{std::string{"The stack size is 0."}};
+    constexpr charge charged = std::remove_cvref_t<budget_t>::charged;
+    // charge the straight run of instructions that ends before `end`,
+    // the next one starts at `next`
+    auto end_run = [&](size_t end, size_t next) {
+        if constexpr (charged == charge::jump) {
+            allowance -= static_cast<int64_t>(end - run_start);
+            run_start = next;
+        }
+    };
+    // false if the current slice is used up and the budget has no next one
+    auto keep_budget = [&] {
+        if constexpr (charged == charge::jump) {
+            if (allowance <= 0) [[unlikely]] {
+                allowance = budget.next_slice(allowance);
+                return allowance > 0;
+            }
         }
-        vmstate.output_stream << static_cast<char>(vmstate.stack.top());
         return true;
-    });
+    };
+    // continue at the jump target, false if the budget is exhausted
+    auto jump = [&](item_t target) {
+        if constexpr (charged == charge::loop) {
+            // the pc is past the jump already
+            const bool backward = static_cast<size_t>(target) < pc;
+            pc = static_cast<size_t>(target);
+            return not backward or budget.back_jump(pc);
+        }
+        end_run(pc, static_cast<size_t>(target));
+        pc = static_cast<size_t>(target);
+        return keep_budget();
+    };
+    auto suspend = [&] {
+        vm.pc = pc;
+        sync_stack();
+        return item_t{0};
+    };
+    // after RET: the return address may come from a call of another
+    // program, so check it like the pc after custom instructions.
+    // false if the analysis doesn't cover the stack there.
+    auto returned = [&] {
+        if constexpr (verified) {
+            if (pc >= program_size) {
+                throw vm_segfault{std::string{"Invalid instruction address."}};
+            }
+        }
+        if (decoded.analysis == nullptr or pc >= program_size) {
+            return true;
+        }
+        sync_stack();
+        const bool covered = enter_analyzed(vm, *decoded.analysis, pc);
+        load_stack();
+        return covered;
+    };
+    // run a task instruction on the vm state, the child of SPAWN starts at its pc
+    auto on_vm = [&](auto&& operation) {
+        vm.pc = pc;
+        sync_stack();
+        try {
+            operation();
+        }
+        catch (...) {
+            load_stack();
+            throw;
+        }
+        load_stack();
+    };
+    auto finish_budget = [&] {
+        end_run(pc, pc);
+        budget.finish(allowance);
+    };
 
+    try {
+        if (pc >= program_size) {
+            throw vm_segfault{std::string{"Invalid instruction address."}};
+        }
+        if (not keep_budget()) {
+            return suspend();
+        }
 
-    return state;
+        while (true) {
+            if constexpr (charged == charge::instruction) {
+                if (allowance <= 0) [[unlikely]] {
+                    allowance = budget.next_slice(allowance);
+                    if (allowance <= 0) {
+                        return suspend();
+                    }
+                }
+                allowance -= 1;
+            }
+
+            const decoded_op& ins = program[pc];
+            profiler.enter(pc);
+
+            // increase the program counter here so jumps can overwrite it.
+            pc += 1;
+
+            switch (ins.dispatch) {
+            case checked(opcode::PRINT):
+                require(1);
+                [[fallthrough]];
+            case unchecked(opcode::PRINT):
+                std::cout << sp[-1] << std::endl;
+                break;
+
+            case checked(opcode::LOAD_CONST):
+                make_room();
+                [[fallthrough]];
+            case unchecked(opcode::LOAD_CONST):
+                *sp++ = ins.arg;
+                break;
+
+            case checked(opcode::EXIT):
+                require(1);
+                [[fallthrough]];
+            case unchecked(opcode::EXIT):
+                vm.pc = pc;
+                sync_stack();
+                finish_budget();
+                return sp[-1];
+
+            case checked(opcode::POP):
+                require(1);
+                [[fallthrough]];
+            case unchecked(opcode::POP):
+                --sp;
+                break;
+
+            case checked(opcode::ADD):
+                require(2);
+                [[fallthrough]];
+            case unchecked(opcode::ADD):
+                sp[-2] = sp[-2] + sp[-1];
+                --sp;
+                break;
+
+            case checked(opcode::DIV):
+                require(2);
+                [[fallthrough]];
+            case unchecked(opcode::DIV):
+                if (sp[-1] == 0) {
+                    sp -= 2;
+                    throw div_by_zero{std::string{"divide by 0 error."}};
+                }
+                sp[-2] = sp[-2] / sp[-1];
+                --sp;
+                break;
+
+            case checked(opcode::EQ):
+                require(2);
+                [[fallthrough]];
+            case unchecked(opcode::EQ):
+                sp[-2] = static_cast<item_t>(sp[-2] == sp[-1]);
+                --sp;
+                break;
+
+            case checked(opcode::NEQ):
+                require(2);
+                [[fallthrough]];
+            case unchecked(opcode::NEQ):
+                sp[-2] = static_cast<item_t>(sp[-2] != sp[-1]);
+                --sp;
+                break;
+
+            case checked(opcode::DUP):
+                require(1);
+                make_room();
+                [[fallthrough]];
+            case unchecked(opcode::DUP):
+                *sp = sp[-1];
+                ++sp;
+                break;
+
+            case checked(opcode::JMP):
+            case unchecked(opcode::JMP):
+                if (not jump(ins.arg)) [[unlikely]] {
+                    return suspend();
+                }
+                break;
+
+            case checked(opcode::JMPZ):
+                require(1);
+                [[fallthrough]];
+            case unchecked(opcode::JMPZ):
+                --sp;
+                if (*sp == 0) {
+                    profiler.taken(pc - 1);
+                    if (not jump(ins.arg)) [[unlikely]] {
+                        return suspend();
+                    }
+                }
+                break;
+
+            case checked(opcode::WRITE):
+                require(1);
+                [[fallthrough]];
+            case unchecked(opcode::WRITE):
+                vm.output->write_number(sp[-1]);
+                break;
+
+            case checked(opcode::WRITE_CHAR):
+                require(1);
+                [[fallthrough]];
+            case unchecked(opcode::WRITE_CHAR):
+                vm.output->write_char(static_cast<char>(sp[-1]));
+                break;
+
+            case checked(opcode::LOAD):
+                require(1);
+                [[fallthrough]];
+            case unchecked(opcode::LOAD):
+                // popped first, like the stack is when the access fails
+                --sp;
+                *sp = vm.memory.load(*sp);
+                ++sp;
+                break;
+
+            case checked(opcode::STORE):
+                require(2);
+                [[fallthrough]];
+            case unchecked(opcode::STORE):
+                sp -= 2;
+                vm.memory.store(sp[1], sp[0]);
+                break;
+
+            case checked(opcode::MEMCPY):
+                require(3);
+                [[fallthrough]];
+            case unchecked(opcode::MEMCPY):
+                sp -= 3;
+                vm.memory.copy(sp[0], sp[1], sp[2]);
+                break;
+
+            case checked(opcode::MEMSET):
+                require(3);
+                [[fallthrough]];
+            case unchecked(opcode::MEMSET):
+                sp -= 3;
+                vm.memory.fill(sp[0], sp[1], sp[2]);
+                break;
+
+            case checked(opcode::MEMSUM):
+                require(2);
+                [[fallthrough]];
+            case unchecked(opcode::MEMSUM):
+                sp -= 2;
+                *sp = vm.memory.sum(sp[0], sp[1]);
+                ++sp;
+                break;
+
+            case checked(opcode::MEMGROW):
+                require(1);
+                [[fallthrough]];
+            case unchecked(opcode::MEMGROW):
+                sp[-1] = vm.memory.grow(sp[-1]);
+                break;
+
+            case checked(opcode::CALL):
+            case unchecked(opcode::CALL):
+                // the pc is past the call, where RET continues
+                if (not vm.calls.push(pc)) [[unlikely]] {
+                    calls_full();
+                }
+                if (not jump(ins.arg)) [[unlikely]] {
+                    return suspend();
+                }
+                break;
+
+            case checked(opcode::RET):
+            case unchecked(opcode::RET):
+                if (vm.calls.empty()) [[unlikely]] {
+                    calls_empty();
+                }
+                if (not jump(static_cast<item_t>(vm.calls.pop()))) [[unlikely]] {
+                    return suspend();
+                }
+                if (not returned()) [[unlikely]] {
+                    drop_analysis(vm, code, decoded);
+                    program = decoded.ops.data();
+                }
+                break;
+
+            case checked(opcode::TAIL_CALL):
+            case unchecked(opcode::TAIL_CALL):
+                if (not jump(ins.arg)) [[unlikely]] {
+                    return suspend();
+                }
+                break;
+
+            case checked(opcode::SPAWN):
+            case unchecked(opcode::SPAWN):
+                on_vm([&] { spawn_task(vm, ins.arg); });
+                break;
+
+            case checked(opcode::JOIN):
+            case unchecked(opcode::JOIN):
+                on_vm([&] { join_task(vm); });
+                break;
+
+            case checked(opcode::ADD_IMM):
+                require(1);
+                [[fallthrough]];
+            case unchecked(opcode::ADD_IMM):
+                sp[-1] = sp[-1] + ins.arg;
+                break;
+
+            case checked(opcode::DIV_IMM):
+                require(1);
+                [[fallthrough]];
+            case unchecked(opcode::DIV_IMM):
+                if (ins.arg == 0) {
+                    sp -= 1;
+                    throw div_by_zero{std::string{"divide by 0 error."}};
+                }
+                sp[-1] = sp[-1] / ins.arg;
+                break;
+
+            case checked(opcode::EQ_IMM):
+                require(1);
+                [[fallthrough]];
+            case unchecked(opcode::EQ_IMM):
+                sp[-1] = static_cast<item_t>(sp[-1] == ins.arg);
+                break;
+
+            case checked(opcode::NEQ_IMM):
+                require(1);
+                [[fallthrough]];
+            case unchecked(opcode::NEQ_IMM):
+                sp[-1] = static_cast<item_t>(sp[-1] != ins.arg);
+                break;
+
+            case checked(opcode::JMP_EQ):
+                require(2);
+                [[fallthrough]];
+            case unchecked(opcode::JMP_EQ):
+                sp -= 2;
+                if (sp[0] == sp[1]) {
+                    profiler.taken(pc - 1);
+                    if (not jump(ins.arg)) [[unlikely]] {
+                        return suspend();
+                    }
+                }
+                break;
+
+            case checked(opcode::JMP_NEQ):
+                require(2);
+                [[fallthrough]];
+            case unchecked(opcode::JMP_NEQ):
+                sp -= 2;
+                if (sp[0] != sp[1]) {
+                    profiler.taken(pc - 1);
+                    if (not jump(ins.arg)) [[unlikely]] {
+                        return suspend();
+                    }
+                }
+                break;
+
+            case checked(opcode::DUP_JMPZ):
+                require(1);
+                [[fallthrough]];
+            case unchecked(opcode::DUP_JMPZ):
+                if (sp[-1] == 0) {
+                    profiler.taken(pc - 1);
+                    if (not jump(ins.arg)) [[unlikely]] {
+                        return suspend();
+                    }
+                }
+                break;
+
+            case checked(opcode::WRITE_IMM):
+            case unchecked(opcode::WRITE_IMM):
+                vm.output->write_number(ins.arg);
+                break;
+
+            case checked(opcode::WRITE_CHAR_IMM):
+            case unchecked(opcode::WRITE_CHAR_IMM):
+                vm.output->write_char(static_cast<char>(ins.arg));
+                break;
+
+            case checked(opcode::CUSTOM):
+            case unchecked(opcode::CUSTOM): {
+                if (ins.action == nullptr) {
+                    throw invalid_instruction{std::string{"unknown instruction at pc="} + std::to_string(pc - 1)};
+                }
+
+                // custom actions work on the vm state, including its pc.
+                const size_t next = pc;
+                vm.pc = pc;
+                sync_stack();
+                bool keep_running;
+                try {
+                    keep_running = (*ins.action)(vm, ins.arg);
+                }
+                catch (...) {
+                    end_run(next, vm.pc);
+                    pc = vm.pc;
+                    load_stack();
+                    throw;
+                }
+                // the action may have jumped
+                end_run(next, vm.pc);
+                pc = vm.pc;
+                load_stack();
+
+                if (not keep_running) {
+                    finish_budget();
+                    require(1);
+                    return sp[-1];
+                }
+
+                if constexpr (verified) {
+                    if (pc >= program_size) {
+                        throw vm_segfault{std::string{"Invalid instruction address."}};
+                    }
+                }
+
+                // the action may have left the stack in a state the
+                // analysis doesn't cover, then check everything from now on.
+                if (decoded.analysis != nullptr and pc < program_size and
+                    not enter_analyzed(vm, *decoded.analysis, pc)) {
+                    drop_analysis(vm, code, decoded);
+                    program = decoded.ops.data();
+                }
+                load_stack();
+                if (not keep_budget()) [[unlikely]] {
+                    return suspend();
+                }
+                break;
+            }
+            }
+
+            if constexpr (not verified) {
+                if (pc >= program_size) {
+                    throw vm_segfault{std::string{"Invalid instruction address."}};
+                }
+            }
+        }
+    }
+    catch (...) {
+        // so the caller can inspect where the execution failed.
+        vm.pc = pc;
+        sync_stack();
+        finish_budget();
+        throw;
+    }
 }
 
 
-void register_instruction(vm_state& state, std::string_view name,
-                          const op_action_t& action) {
-    size_t op_id = state.next_op_id;
-    std::string inst_name{name.data(), name.size()};
+/**
+ * all opcodes in the order of their values, for the dispatch table of
+ * `run_top_cached`.
+ */
+#define VM_OPCODES(X)                                                       \
+    X(PRINT) X(LOAD_CONST) X(EXIT) X(POP) X(ADD) X(DIV) X(EQ) X(NEQ)         \
+    X(DUP) X(JMP) X(JMPZ) X(WRITE) X(WRITE_CHAR) X(LOAD) X(STORE)            \
+    X(MEMCPY) X(MEMSET) X(MEMSUM) X(MEMGROW) X(CALL) X(RET) X(TAIL_CALL)     \
+    X(SPAWN) X(JOIN) X(ADD_IMM) X(DIV_IMM) X(EQ_IMM) X(NEQ_IMM) X(JMP_EQ)    \
+    X(JMP_NEQ) X(DUP_JMPZ) X(WRITE_IMM) X(WRITE_CHAR_IMM) X(CUSTOM)
+
+#define VM_OPCODE_VALUE(name) opcode::name,
+constexpr opcode listed_opcodes[] = {VM_OPCODES(VM_OPCODE_VALUE)};
+#undef VM_OPCODE_VALUE
+
+constexpr bool opcodes_listed_in_order() {
+    for (size_t i = 0; i < std::size(listed_opcodes); i++) {
+        if (static_cast<size_t>(listed_opcodes[i]) != i) {
+            return false;
+        }
+    }
+    return std::size(listed_opcodes) == static_cast<size_t>(opcode::CUSTOM) + 1;
+}
+static_assert(opcodes_listed_in_order(), "VM_OPCODES has to list every opcode in order");
+
+
+/**
+ * how `run_top_cached` gets from one instruction to the next.
+ *
+ * with GCC and clang, it is threaded code: each instruction ends with its
+ * own indirect jump to the code of the next one, through a table of label
+ * addresses indexed by the dispatch code. so the branch predictor learns
+ * which instruction usually follows which, where the single jump of a
+ * switch mispredicts whenever the instruction differs from the last one.
+ * other compilers get the switch.
+ */
+#if defined(__GNUC__)
+#define VM_THREADED 1
+#endif
+
+/**
+ * GCC merges the copies of the dispatch back into a few shared jumps
+ * when it cross jumps, which undoes the threading.
+ */
+#if defined(__GNUC__) and not defined(__clang__)
+#define VM_KEEP_DISPATCH gnu::optimize("no-crossjumping")
+#else
+#define VM_KEEP_DISPATCH
+#endif
+
+#ifdef VM_THREADED
+#define VM_OP(name) op_##name:
+#define VM_CHECKED_OP(name) checked_##name:
+#define VM_FALLTHROUGH
+#define VM_TARGET(dispatch) targets[dispatch]
+#define VM_NEXT                                   \
+    if constexpr (not verified) {                 \
+        if (pc >= program_size) [[unlikely]] {    \
+            invalid_address();                    \
+        }                                         \
+    }                                             \
+    ins = &ops[pc];                               \
+    pc += 1;                                      \
+    goto *ins->target
+#else
+#define VM_OP(name) case unchecked(opcode::name):
+#define VM_CHECKED_OP(name) case checked(opcode::name):
+#define VM_FALLTHROUGH [[fallthrough]];
+#define VM_TARGET(dispatch) (dispatch)
+#define VM_NEXT break
+#endif
+
+
+/**
+ * an instruction of `run_top_cached`, with the address of its code, or
+ * the dispatch code for the switch. so the dispatch is a single load
+ * and jump, which GCC copies into each instruction's code, where it
+ * merges longer ones into a few shared jumps.
+ */
+struct threaded_op {
+#ifdef VM_THREADED
+    const void* target;
+#else
+    uint8_t target;
+#endif
+    item_t arg;
+};
+
+} // namespace
+
+
+/**
+ * a program decoded and linked for the dispatch table of one
+ * `run_top_cached` loop, which keeps it with the code for its next runs,
+ * see `basic_code::get_linked`.
+ *
+ * the forms for the other loops follow in `next`, all for the same
+ * instruction set, with or without the stack checks left out.
+ */
+struct linked_code {
+    /** the instruction set the custom actions belong to */
+    std::shared_ptr<const instruction_set> instructions;
+    /** the dispatch table the ops jump through, nullptr for the switch */
+    const void* const* targets;
+    /** are the stack checks left out where the analysis proves them unneeded? */
+    bool analyzed;
+    /** the decoded program, for the actions of the custom instructions */
+    std::vector<decoded_op> program;
+    std::vector<threaded_op> ops;
+    std::shared_ptr<const linked_code> next;
+};
 
-    state.instruction_ids[inst_name] = op_id;
-    state.instruction_names[op_id] = inst_name;
-    state.instruction_actions[op_id] = action;
-    state.next_op_id++;
+
+namespace {
+
+/**
+ * get the program linked for the dispatch table `targets`, with the stack
+ * checks the analysis proves unneeded left out if one is given.
+ * it is only decoded and linked if no earlier run of the code did so.
+ */
+std::shared_ptr<const linked_code> get_linked(const vm_state& vm, const code_t& code,
+                                              const code_analysis* analysis,
+                                              const void* const* targets) {
+    const bool analyzed = analysis != nullptr;
+    std::shared_ptr<const linked_code> first = code.get_linked();
+    if (first != nullptr and first->instructions != vm.instructions) {
+        // the forms of another instruction set are replaced
+        first.reset();
+    }
+    for (auto form = first; form != nullptr; form = form->next) {
+        if (form->targets == targets and form->analyzed == analyzed) {
+            return form;
+        }
+    }
+
+    auto linked = std::make_shared<linked_code>();
+    linked->instructions = vm.instructions;
+    linked->targets = targets;
+    linked->analyzed = analyzed;
+    linked->program = decode(vm, code, analysis);
+    linked->ops.resize(linked->program.size());
+    for (size_t i = 0; i < linked->program.size(); i++) {
+        linked->ops[i] = {VM_TARGET(linked->program[i].dispatch), linked->program[i].arg};
+    }
+    linked->next = std::move(first);
+
+    // a form linked by another thread meanwhile is dropped, it is linked again
+    code.set_linked(linked);
+    return linked;
 }
 
 
-code_t assemble(const vm_state& state, std::string_view input_program) {
-    code_t code;
+/**
+ * execute the pre-decoded program like `run_decoded`, but keep the top
+ * stack item in a local variable instead of its stack slot, and dispatch
+ * as threaded code, see `VM_THREADED`. this is the loop of `run`.
+ *
+ * so most instructions work on `tos` and at most one item in memory,
+ * and only write to the stack when its depth grows. `sp` points at the
+ * slot of the top item, whose content is stale while the item is in `tos`.
+ * when the stack is empty, that's the scratch slot below the bottom.
+ *
+ * the vm's stack is only synced when custom actions run or the execution
+ * stops. there is no profiler, see `run_decoded`, and the only budget
+ * that can suspend the execution is one that counts loops like
+ * `loop_counter`, for the tracing tier.
+ *
+ * the loop is kept out of line, inlined into its caller it lost the
+ * registers for `tos` and `sp` and ran slower than `run_decoded`.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+template <bool verified, typename budget_t = no_budget>
+[[gnu::noinline, VM_KEEP_DISPATCH]] item_t run_top_cached(vm_state& vm, const code_t& code, const code_analysis* analysis,
+                                                          budget_t&& budget = {}) {
+    constexpr charge charged = std::remove_cvref_t<budget_t>::charged;
+    static_assert(charged == charge::never or charged == charge::loop,
+                  "only loops are counted, the fuel is charged by run_decoded");
+
+    if (analysis != nullptr and not enter_analyzed(vm, *analysis, vm.pc)) {
+        analysis = nullptr;
+    }
+
+#ifdef VM_THREADED
+#define VM_TARGETS(name) &&op_##name, &&checked_##name,
+    static const void* const targets[] = {VM_OPCODES(VM_TARGETS)};
+#undef VM_TARGETS
+#else
+    static const void* const* const targets = nullptr;
+#endif
 
-    // convert each line separately
-    for (auto& line : util::split(input_program, '\n')) {
+    // the program as threaded code, the custom actions stay in its `program`
+    std::shared_ptr<const linked_code> linked = get_linked(vm, code, analysis, targets);
+    const size_t program_size = linked->ops.size();
+    const threaded_op* ops = linked->ops.data();
+    size_t pc = vm.pc;
 
-        auto line_words = util::split(line, ' ');
+    // once the stack is in a state the analysis doesn't cover
+    auto link_checked = [&] {
+        analysis = nullptr;
+        linked = get_linked(vm, code, nullptr, targets);
+        ops = linked->ops.data();
+    };
 
-        // only support instruction and one argument
-        if (line_words.size() >= 3) {
-            throw invalid_instruction{std::string{"more than one instruction argument: "} + line};
+    item_t* base = vm.stack.data();
+    item_t* sp = base + vm.stack.size() - 1;
+    item_t* limit = base + vm.stack.capacity();
+    item_t tos = *sp;
+
+    auto sync_stack = [&]() VM_ALWAYS_INLINE {
+        *sp = tos;
+        vm.stack.set_size(static_cast<size_t>(sp + 1 - base));
+    };
+    auto load_stack = [&]() VM_ALWAYS_INLINE {
+        base = vm.stack.data();
+        sp = base + vm.stack.size() - 1;
+        limit = base + vm.stack.capacity();
+        tos = *sp;
+    };
+    auto require = [&](ptrdiff_t count) VM_ALWAYS_INLINE {
+        if (sp + 1 - base < count) [[unlikely]] {
+            // like popping one by one until the stack is empty
+            sp = base - 1;
+            stack_empty();
+        }
+    };
+    auto make_room = [&]() VM_ALWAYS_INLINE {
+        if (sp + 1 == limit) [[unlikely]] {
+            sync_stack();
+            vm.stack.reserve(vm.stack.capacity() * 2);
+            load_stack();
         }
+    };
+    // the items below the top ones were popped, the next one is the top now
+    auto drop = [&](ptrdiff_t count) VM_ALWAYS_INLINE {
+        sp -= count;
+        tos = *sp;
+    };
+    // after RET, see `run_decoded`
+    auto returned = [&]() VM_ALWAYS_INLINE {
+        if constexpr (verified) {
+            if (pc >= program_size) {
+                invalid_address();
+            }
+        }
+        if (analysis == nullptr or pc >= program_size) {
+            return true;
+        }
+        sync_stack();
+        const bool covered = enter_analyzed(vm, *analysis, pc);
+        load_stack();
+        return covered;
+    };
 
-        // look up instruction id
-        auto& op_name = line_words[0];
-        auto find_op_id = state.instruction_ids.find(op_name);
-        if (find_op_id == std::end(state.instruction_ids)) {
-            throw invalid_instruction{std::string{"unknown instruction: "} + op_name};
+    // continue at the jump target, false if the budget suspends the
+    // execution there, see `run_decoded`
+    auto jump = [&](item_t target) VM_ALWAYS_INLINE {
+        // the pc is past the jump already
+        const bool backward = static_cast<size_t>(target) < pc;
+        pc = static_cast<size_t>(target);
+        if constexpr (charged == charge::loop) {
+            return not backward or budget.back_jump(pc);
         }
-        op_id_t op_id = find_op_id->second;
+        else {
+            (void)backward;
+            return true;
+        }
+    };
+    auto suspend = [&]() VM_ALWAYS_INLINE {
+        vm.pc = pc;
+        sync_stack();
+        return item_t{0};
+    };
 
-        // parse the argument
-        item_t argument{0};
-        if (line_words.size() == 2) {
-            argument = std::stoll(line_words[1]);
+    // see `run_decoded`
+    auto on_vm = [&](auto&& operation) VM_ALWAYS_INLINE {
+        vm.pc = pc;
+        sync_stack();
+        try {
+            operation();
+        }
+        catch (...) {
+            load_stack();
+            throw;
         }
+        load_stack();
+    };
+
+    try {
+        if (pc >= program_size) {
+            invalid_address();
+        }
+
+        const threaded_op* ins = &ops[pc];
+        pc += 1;
+
+#ifdef VM_THREADED
+        goto *ins->target;
+#else
+        while (true) {
+            switch (ins->target) {
+#endif
+
+            VM_CHECKED_OP(PRINT)
+                require(1);
+                VM_FALLTHROUGH
+            VM_OP(PRINT)
+                std::cout << tos << std::endl;
+                VM_NEXT;
+
+            VM_CHECKED_OP(LOAD_CONST)
+                make_room();
+                VM_FALLTHROUGH
+            VM_OP(LOAD_CONST)
+                *sp++ = tos;
+                tos = ins->arg;
+                VM_NEXT;
+
+            VM_CHECKED_OP(EXIT)
+                require(1);
+                VM_FALLTHROUGH
+            VM_OP(EXIT)
+                vm.pc = pc;
+                sync_stack();
+                return tos;
+
+            VM_CHECKED_OP(POP)
+                require(1);
+                VM_FALLTHROUGH
+            VM_OP(POP)
+                drop(1);
+                VM_NEXT;
+
+            VM_CHECKED_OP(ADD)
+                require(2);
+                VM_FALLTHROUGH
+            VM_OP(ADD)
+                tos = sp[-1] + tos;
+                --sp;
+                VM_NEXT;
 
-        // and save the instruction to the code store
-        code.emplace_back(op_id, argument);
+            VM_CHECKED_OP(DIV)
+                require(2);
+                VM_FALLTHROUGH
+            VM_OP(DIV)
+                if (tos == 0) {
+                    drop(2);
+                    throw div_by_zero{std::string{"divide by 0 error."}};
+                }
+                tos = sp[-1] / tos;
+                --sp;
+                VM_NEXT;
+
+            VM_CHECKED_OP(EQ)
+                require(2);
+                VM_FALLTHROUGH
+            VM_OP(EQ)
+                tos = static_cast<item_t>(sp[-1] == tos);
+                --sp;
+                VM_NEXT;
+
+            VM_CHECKED_OP(NEQ)
+                require(2);
+                VM_FALLTHROUGH
+            VM_OP(NEQ)
+                tos = static_cast<item_t>(sp[-1] != tos);
+                --sp;
+                VM_NEXT;
+
+            VM_CHECKED_OP(DUP)
+                require(1);
+                make_room();
+                VM_FALLTHROUGH
+            VM_OP(DUP)
+                *sp++ = tos;
+                VM_NEXT;
+
+            VM_CHECKED_OP(JMP)
+            VM_OP(JMP)
+                if (not jump(ins->arg)) [[unlikely]] {
+                    return suspend();
+                }
+                VM_NEXT;
+
+            VM_CHECKED_OP(JMPZ)
+                require(1);
+                VM_FALLTHROUGH
+            VM_OP(JMPZ) {
+                const item_t condition = tos;
+                drop(1);
+                if (condition == 0 and not jump(ins->arg)) [[unlikely]] {
+                    return suspend();
+                }
+                VM_NEXT;
+            }
+
+            VM_CHECKED_OP(WRITE)
+                require(1);
+                VM_FALLTHROUGH
+            VM_OP(WRITE)
+                vm.output->write_number(tos);
+                VM_NEXT;
+
+            VM_CHECKED_OP(WRITE_CHAR)
+                require(1);
+                VM_FALLTHROUGH
+            VM_OP(WRITE_CHAR)
+                vm.output->write_char(static_cast<char>(tos));
+                VM_NEXT;
+
+            VM_CHECKED_OP(LOAD)
+                require(1);
+                VM_FALLTHROUGH
+            VM_OP(LOAD) {
+                // popped first, like the stack is when the access fails
+                const item_t address = tos;
+                drop(1);
+                const item_t item = vm.memory.load(address);
+                *sp++ = tos;
+                tos = item;
+                VM_NEXT;
+            }
+
+            VM_CHECKED_OP(STORE)
+                require(2);
+                VM_FALLTHROUGH
+            VM_OP(STORE) {
+                const item_t address = tos;
+                const item_t item = sp[-1];
+                drop(2);
+                vm.memory.store(address, item);
+                VM_NEXT;
+            }
+
+            VM_CHECKED_OP(MEMCPY)
+                require(3);
+                VM_FALLTHROUGH
+            VM_OP(MEMCPY) {
+                const item_t count = tos;
+                const item_t source = sp[-1];
+                const item_t target = sp[-2];
+                drop(3);
+                vm.memory.copy(target, source, count);
+                VM_NEXT;
+            }
+
+            VM_CHECKED_OP(MEMSET)
+                require(3);
+                VM_FALLTHROUGH
+            VM_OP(MEMSET) {
+                const item_t count = tos;
+                const item_t item = sp[-1];
+                const item_t target = sp[-2];
+                drop(3);
+                vm.memory.fill(target, item, count);
+                VM_NEXT;
+            }
+
+            VM_CHECKED_OP(MEMSUM)
+                require(2);
+                VM_FALLTHROUGH
+            VM_OP(MEMSUM) {
+                const item_t count = tos;
+                const item_t address = sp[-1];
+                drop(2);
+                const item_t sum = vm.memory.sum(address, count);
+                *sp++ = tos;
+                tos = sum;
+                VM_NEXT;
+            }
+
+            VM_CHECKED_OP(MEMGROW)
+                require(1);
+                VM_FALLTHROUGH
+            VM_OP(MEMGROW)
+                tos = vm.memory.grow(tos);
+                VM_NEXT;
+
+            VM_CHECKED_OP(CALL)
+            VM_OP(CALL)
+                // the pc is past the call, where RET continues
+                if (not vm.calls.push(pc)) [[unlikely]] {
+                    calls_full();
+                }
+                if (not jump(ins->arg)) [[unlikely]] {
+                    return suspend();
+                }
+                VM_NEXT;
+
+            VM_CHECKED_OP(RET)
+            VM_OP(RET)
+                if (vm.calls.empty()) [[unlikely]] {
+                    calls_empty();
+                }
+                if (not jump(static_cast<item_t>(vm.calls.pop()))) [[unlikely]] {
+                    return suspend();
+                }
+                if (not returned()) [[unlikely]] {
+                    link_checked();
+                }
+                VM_NEXT;
+
+            VM_CHECKED_OP(TAIL_CALL)
+            VM_OP(TAIL_CALL)
+                if (not jump(ins->arg)) [[unlikely]] {
+                    return suspend();
+                }
+                VM_NEXT;
+
+            VM_CHECKED_OP(SPAWN)
+            VM_OP(SPAWN)
+                on_vm([&] { spawn_task(vm, ins->arg); });
+                VM_NEXT;
+
+            VM_CHECKED_OP(JOIN)
+            VM_OP(JOIN)
+                on_vm([&] { join_task(vm); });
+                VM_NEXT;
+
+            VM_CHECKED_OP(ADD_IMM)
+                require(1);
+                VM_FALLTHROUGH
+            VM_OP(ADD_IMM)
+                tos = tos + ins->arg;
+                VM_NEXT;
+
+            VM_CHECKED_OP(DIV_IMM)
+                require(1);
+                VM_FALLTHROUGH
+            VM_OP(DIV_IMM)
+                if (ins->arg == 0) {
+                    drop(1);
+                    throw div_by_zero{std::string{"divide by 0 error."}};
+                }
+                tos = tos / ins->arg;
+                VM_NEXT;
+
+            VM_CHECKED_OP(EQ_IMM)
+                require(1);
+                VM_FALLTHROUGH
+            VM_OP(EQ_IMM)
+                tos = static_cast<item_t>(tos == ins->arg);
+                VM_NEXT;
+
+            VM_CHECKED_OP(NEQ_IMM)
+                require(1);
+                VM_FALLTHROUGH
+            VM_OP(NEQ_IMM)
+                tos = static_cast<item_t>(tos != ins->arg);
+                VM_NEXT;
+
+            VM_CHECKED_OP(JMP_EQ)
+                require(2);
+                VM_FALLTHROUGH
+            VM_OP(JMP_EQ) {
+                const bool equal = sp[-1] == tos;
+                drop(2);
+                if (equal and not jump(ins->arg)) [[unlikely]] {
+                    return suspend();
+                }
+                VM_NEXT;
+            }
+
+            VM_CHECKED_OP(JMP_NEQ)
+                require(2);
+                VM_FALLTHROUGH
+            VM_OP(JMP_NEQ) {
+                const bool equal = sp[-1] == tos;
+                drop(2);
+                if (not equal and not jump(ins->arg)) [[unlikely]] {
+                    return suspend();
+                }
+                VM_NEXT;
+            }
+
+            VM_CHECKED_OP(DUP_JMPZ)
+                require(1);
+                VM_FALLTHROUGH
+            VM_OP(DUP_JMPZ)
+                if (tos == 0 and not jump(ins->arg)) [[unlikely]] {
+                    return suspend();
+                }
+                VM_NEXT;
+
+            VM_CHECKED_OP(WRITE_IMM)
+            VM_OP(WRITE_IMM)
+                vm.output->write_number(ins->arg);
+                VM_NEXT;
+
+            VM_CHECKED_OP(WRITE_CHAR_IMM)
+            VM_OP(WRITE_CHAR_IMM)
+                vm.output->write_char(static_cast<char>(ins->arg));
+                VM_NEXT;
+
+            VM_CHECKED_OP(CUSTOM)
+            VM_OP(CUSTOM) {
+                const op_action_t* action = linked->program[pc - 1].action;
+                if (action == nullptr) {
+                    throw invalid_instruction{std::string{"unknown instruction at pc="} + std::to_string(pc - 1)};
+                }
+
+                // custom actions work on the vm state, including its pc.
+                vm.pc = pc;
+                sync_stack();
+                bool keep_running;
+                try {
+                    keep_running = (*action)(vm, ins->arg);
+                }
+                catch (...) {
+                    pc = vm.pc;
+                    load_stack();
+                    throw;
+                }
+                pc = vm.pc;
+                load_stack();
+
+                if (not keep_running) {
+                    require(1);
+                    return tos;
+                }
+
+                if constexpr (verified) {
+                    if (pc >= program_size) {
+                        invalid_address();
+                    }
+                }
+
+                // the action may have left the stack in a state the
+                // analysis doesn't cover, then check everything from now on.
+                if (analysis != nullptr and pc < program_size and
+                    not enter_analyzed(vm, *analysis, pc)) {
+                    link_checked();
+                }
+                load_stack();
+                VM_NEXT;
+            }
+
+#ifndef VM_THREADED
+            }
+
+            if constexpr (not verified) {
+                if (pc >= program_size) [[unlikely]] {
+                    invalid_address();
+                }
+            }
+            ins = &ops[pc];
+            pc += 1;
+        }
+#endif
+    }
+    catch (...) {
+        // so the caller can inspect where the execution failed.
+        vm.pc = pc;
+        sync_stack();
+        throw;
     }
+}
+#pragma GCC diagnostic pop
+
+#undef VM_OP
+#undef VM_CHECKED_OP
+#undef VM_FALLTHROUGH
+#undef VM_TARGET
+#undef VM_NEXT
+
+} // namespace
 
-    return code;
+
+std::shared_ptr<const instruction_set> builtin_instructions() {
+    // built on first use, then shared by all vms
+    return builtin_set::instructions();
 }
 
 
-std::tuple<item_t, std::string> run(vm_state& vm, const code_t& code) {
+vm_state create_vm(bool debug) {
+    return create_vm(builtin_instructions(), debug);
+}
+
+
+vm_state create_vm(std::shared_ptr<const instruction_set> instructions, bool debug) {
+    vm_state state{std::move(instructions)};
+
+    // enable vm debugging
+    state.debug = debug;
+
+    return state;
+}
+
+
+template <vm_item T>
+void register_instruction(basic_vm_state<T>& state, std::string_view name,
+                          const std::type_identity_t<basic_op_action<T>>& action) {
+    // other vms may share the set, so only this vm gets the new one
+    auto instructions = std::make_shared<basic_instruction_set<T>>(*state.instructions);
+    register_instruction<T>(*instructions, name, action);
+    state.instructions = std::move(instructions);
+}
+
+
+template <vm_item T>
+void register_instruction(basic_instruction_set<T>& instructions, std::string_view name,
+                          const std::type_identity_t<basic_op_action<T>>& action) {
+    size_t op_id = instructions.next_op_id;
+    std::string inst_name{name.data(), name.size()};
+
+    instructions.ids[inst_name] = op_id;
+    instructions.names[op_id] = inst_name;
+    instructions.actions[op_id] = action;
+    if (instructions.opcodes.size() <= op_id) {
+        instructions.opcodes.resize(op_id + 1, opcode::CUSTOM);
+    }
+    instructions.opcodes[op_id] = opcode::CUSTOM;
+    instructions.next_op_id++;
+}
+
+template void register_instruction<int32_t>(basic_vm_state<int32_t>&, std::string_view,
+                                            const basic_op_action<int32_t>&);
+template void register_instruction<int64_t>(basic_vm_state<int64_t>&, std::string_view,
+                                            const basic_op_action<int64_t>&);
+template void register_instruction<double>(basic_vm_state<double>&, std::string_view,
+                                           const basic_op_action<double>&);
+template void register_instruction<int32_t>(basic_instruction_set<int32_t>&, std::string_view,
+                                            const basic_op_action<int32_t>&);
+template void register_instruction<int64_t>(basic_instruction_set<int64_t>&, std::string_view,
+                                            const basic_op_action<int64_t>&);
+template void register_instruction<double>(basic_instruction_set<double>&, std::string_view,
+                                           const basic_op_action<double>&);
+
+
+void register_instruction(vm_state& state, std::string_view name,
+                          const op_action_t& action) {
+    register_instruction<item_t>(state, name, action);
+}
+
+
+void register_instruction(instruction_set& instructions, std::string_view name,
+                          const op_action_t& action) {
+    register_instruction<item_t>(instructions, name, action);
+}
+
+
+namespace {
+
+/**
+ * print the disassembly before a debugging run.
+ * turns debugging off if the code can't be disassembled.
+ */
+void print_disassembly(vm_state& vm, const code_t& code) {
     // to help you debugging the code!
-    if (vm.debug) {
-        std::cout << "=== running vm ======================" << std::endl;
-        std::cout << "disassembly of run code:" << std::endl;
-        for (const auto &[op_id, arg] : code) {
-            if (not vm.instruction_names.contains(op_id)) {
-                std::cout << "could not disassemble - op_id unknown..." << std::endl;
-                std::cout << "turning off debug mode." << std::endl;
-                vm.debug = false;
-                break;
-            }
-            std::cout << vm.instruction_names[op_id] << " " << arg << std::endl;
+    std::cout << "=== running vm ======================" << std::endl;
+    std::cout << "disassembly of run code:" << std::endl;
+    for (const auto &[op_id, arg] : code) {
+        if (not vm.instructions->names.contains(op_id)) {
+            std::cout << "could not disassemble - op_id unknown..." << std::endl;
+            std::cout << "turning off debug mode." << std::endl;
+            vm.debug = false;
+            break;
         }
-        std::cout << "=== end of disassembly" << std::endl << std::endl;
+        std::cout << vm.instructions->names.at(op_id) << " " << arg << std::endl;
     }
+    std::cout << "=== end of disassembly" << std::endl << std::endl;
+}
 
-    // execution loop for the machine
-    while (true) {
 
-        auto& [op_id, arg] = code[vm.pc];
+/**
+ * execute the program with the fastest loop, see `run_top_cached`.
+ */
+item_t execute(vm_state& vm, const code_t& code) {
+    if (vm.debug) {
+        print_disassembly(vm, code);
+    }
+    if (vm.debug) {
+        return run_traced(vm, code);
+    }
+
+    const code_analysis* analysis = usable_analysis(vm, code);
+    if (analysis != nullptr and analysis->verified) {
+        return run_top_cached<true>(vm, code, analysis);
+    }
+    return run_top_cached<false>(vm, code, analysis);
+}
+
+
+/**
+ * execute the program with the plain loop of `run_decoded`,
+ * which keeps all stack items in memory and dispatches through a switch.
+ * debugging runs like `execute`.
+ */
+item_t execute_plain(vm_state& vm, const code_t& code) {
+    if (vm.debug) {
+        print_disassembly(vm, code);
+    }
+    if (vm.debug) {
+        return run_traced(vm, code);
+    }
+
+    decoded_program decoded = prepare(vm, code);
+    if (decoded.verified) {
+        return run_decoded<true>(vm, code, decoded);
+    }
+    return run_decoded<false>(vm, code, decoded);
+}
+
+} // namespace
+
+
+std::tuple<item_t, std::string> run(vm_state& vm, const code_t& code) {
+    item_t result = run_flushed(vm, [&] { return execute(vm, code); });
+    return {result, std::string{vm.output->view()}};
+}
 
-        if (vm.debug) {
-            std::cout << "-- exec " << vm.instruction_names[op_id] << " arg=" << arg << " at pc=" << vm.pc << std::endl;
+
+std::tuple<item_t, std::string_view> run_view(vm_state& vm, const code_t& code) {
+    item_t result = run_flushed(vm, [&] { return execute(vm, code); });
+    return {result, vm.output->view()};
+}
+
+
+std::tuple<item_t, std::string> run(vm_state& vm, const code_t& code, tier execution_tier) {
+    switch (execution_tier) {
+    case tier::stack: {
+        item_t result = run_flushed(vm, [&] { return execute_plain(vm, code); });
+        return {result, std::string{vm.output->view()}};
+    }
+    case tier::registers:
+        return run_registers(vm, code);
+    case tier::native:
+        return run_jit(vm, code);
+    case tier::tracing:
+        return run_tracing(vm, code);
+    case tier::top_cached:
+        break;
+    }
+    return run(vm, code);
+}
+
+
+std::tuple<item_t, std::string> run_profiled(vm_state& vm, const code_t& code,
+                                             execution_profile& profile) {
+    profile.hits.resize(code.size());
+    profile.taken.resize(code.size());
+    if (profile.measure_cycles) {
+        profile.cycles.resize(code.size());
+    }
+
+    decoded_program decoded = prepare(vm, code);
+    item_t result = run_flushed(vm, [&] {
+        if (profile.measure_cycles) {
+            if (decoded.verified) {
+                return run_decoded<true>(vm, code, decoded, cycle_profiler{profile});
+            }
+            return run_decoded<false>(vm, code, decoded, cycle_profiler{profile});
+        }
+        if (decoded.verified) {
+            return run_decoded<true>(vm, code, decoded, count_profiler{profile});
         }
+        return run_decoded<false>(vm, code, decoded, count_profiler{profile});
+    });
+    return {result, std::string{vm.output->view()}};
+}
 
-        // increase the program counter here so its value can be overwritten
-        // by the instruction when it executes!
-        vm.pc += 1;
 
-        // TODO execute instruction and stop if the action returns false.
-        if (!vm.instruction_actions[op_id](vm, arg))
-        {
-            break;
+namespace {
+
+/**
+ * run the decoded program until it exits or the budget is used up,
+ * see `run_steps`.
+ */
+step_result run_budgeted(vm_state& vm, const code_t& code, decoded_program& decoded,
+                         const run_budget& budget) {
+    // most of the fuel is charged per jump, which is much cheaper, but
+    // can exceed it by a straight run of instructions, so by the program
+    // size at most. the rest is then charged per instruction.
+    uint64_t executed = 0;
+    if (budget.fuel > code.size()) {
+        step_budget<charge::jump> coarse{budget.fuel - code.size(), budget.deadline};
+        item_t result = run_flushed(vm, [&] {
+            if (decoded.verified) {
+                return run_decoded<true>(vm, code, decoded, no_profiler{}, coarse);
+            }
+            return run_decoded<false>(vm, code, decoded, no_profiler{}, coarse);
+        });
+
+        executed = coarse.executed();
+        if (not coarse.ran_out()) {
+            return {run_status::exited, result, executed};
+        }
+        if (coarse.deadline_passed()) {
+            return {run_status::suspended, 0, executed};
         }
+    }
 
-        if (vm.pc >= code.size())
-        {
-            throw vm_segfault{std::string{"Invalid instruction address."}};
+    step_budget<charge::instruction> exact{budget.fuel - executed, budget.deadline};
+    item_t result = run_flushed(vm, [&] {
+        if (decoded.verified) {
+            return run_decoded<true>(vm, code, decoded, no_profiler{}, exact);
         }
+        return run_decoded<false>(vm, code, decoded, no_profiler{}, exact);
+    });
+
+    executed += exact.executed();
+    if (exact.ran_out()) {
+        return {run_status::suspended, 0, executed};
     }
+    return {run_status::exited, result, executed};
+}
+
+} // namespace
+
 
-    return {vm.stack.top(), vm.output_stream.str()};
+step_result run_steps(vm_state& vm, const code_t& code, const run_budget& budget) {
+    decoded_program decoded = prepare(vm, code);
+    return run_budgeted(vm, code, decoded, budget);
 }
 
 
+stepped_program::stepped_program(const vm_state& vm, code_t code)
+    :
+    program{std::move(code)},
+    instructions{vm.instructions},
+    decoded{std::make_unique<decoded_program>(prepare(vm, this->program))} {}
+
+stepped_program::~stepped_program() = default;
+stepped_program::stepped_program(stepped_program&& other) noexcept = default;
+stepped_program& stepped_program::operator=(stepped_program&& other) noexcept = default;
+
+
+step_result stepped_program::run(vm_state& vm, const run_budget& budget) {
+    // the decoded actions belong to the instruction set it was prepared for
+    if (vm.instructions != this->instructions) {
+        this->instructions = vm.instructions;
+        *this->decoded = prepare(vm, this->program);
+    }
+    return run_budgeted(vm, this->program, *this->decoded, budget);
+}
+
+
+std::optional<item_t> run_until_hot(vm_state& vm, const code_t& code,
+                                    std::span<uint32_t> loop_counts, uint32_t threshold) {
+    loop_counter counter{loop_counts, threshold};
+
+    // the output is flushed by the caller, once the program has finished
+    item_t result;
+    const code_analysis* analysis = usable_analysis(vm, code);
+    if (analysis != nullptr and analysis->verified) {
+        result = run_top_cached<true>(vm, code, analysis, counter);
+    }
+    else {
+        result = run_top_cached<false>(vm, code, analysis, counter);
+    }
+    if (counter.suspended()) {
+        return std::nullopt;
+    }
+    return result;
+}
+
 } // namespace vm
@@ -1,15 +1,24 @@
 #pragma once
 
+#include <atomic>
+#include <concepts>
 #include <cstdint>
 #include <functional>
-#include <stack>
+#include <initializer_list>
+#include <memory>
 #include <stdexcept>
 #include <string>
 #include <string_view>
-#include <sstream>
+#include <span>
 #include <tuple>
+#include <type_traits>
 #include <unordered_map>
 #include <utility>
+#include <vector>
+
+#include "memory.h"
+#include "sink.h"
+#include "stack.h"
 
 namespace vm {
 
@@ -19,9 +28,21 @@ namespace vm {
 
 /**
  * type used for storing data in one slot on the stack.
+ *
+ * the vm core is a template over the item type, see `basic_vm_state`.
+ * this is the type of the default instantiation, which all the names
+ * without `basic_` refer to.
  */
 using item_t = int64_t;
 
+/**
+ * the item types the vm core is instantiated for.
+ * the other execution tiers, the optimizer and the analysis only work on
+ * the default `item_t` instantiation.
+ */
+template <typename T>
+concept vm_item = std::same_as<T, int32_t> or std::same_as<T, int64_t> or std::same_as<T, double>;
+
 /**
  * type used for identifying assembled opcodes.
  */
@@ -29,11 +50,15 @@ using op_id_t = size_t;
 
 
 /** single instruction with its argument */
-using op_t = std::pair<op_id_t, item_t>;
+template <typename T>
+using basic_op = std::pair<op_id_t, T>;
+
+using op_t = basic_op<item_t>;
 
 
 // forward declaration
-struct vm_state;
+template <typename T>
+struct basic_vm_state;
 
 /**
  * if an instruction is executed, what should be done?
@@ -41,45 +66,280 @@ struct vm_state;
  * function args: the vmstate and the operation argument.
  * return value: true if the VM should keep running on after the instruction.
  */
-using op_action_t = std::function<bool(vm_state&, const item_t)>;
+template <typename T>
+using basic_op_action = std::function<bool(basic_vm_state<T>&, const T)>;
+
+using op_action_t = basic_op_action<item_t>;
+
+
+// forward declaration, see analysis.h
+struct code_analysis;
+
+// forward declaration, see tasks.h
+struct task_group;
+
+// forward declaration, see vm.cpp
+struct linked_code;
+
+
+/**
+ * a shared pointer which threads can read and replace at the same time.
+ * a copy points to what the original pointed to when it was copied.
+ */
+template <typename T>
+class atomic_shared_ptr {
+public:
+    atomic_shared_ptr() = default;
+    atomic_shared_ptr(const atomic_shared_ptr& other) : ptr{other.load()} {}
+    atomic_shared_ptr(atomic_shared_ptr&& other) noexcept : ptr{other.ptr.exchange(nullptr)} {}
+
+    atomic_shared_ptr& operator=(const atomic_shared_ptr& other) {
+        this->store(other.load());
+        return *this;
+    }
+
+    atomic_shared_ptr& operator=(atomic_shared_ptr&& other) noexcept {
+        this->ptr.store(other.ptr.exchange(nullptr));
+        return *this;
+    }
+
+    std::shared_ptr<T> load() const { return this->ptr.load(std::memory_order_acquire); }
+    void store(std::shared_ptr<T> value) { this->ptr.store(std::move(value), std::memory_order_release); }
+    void reset() { this->store(nullptr); }
+
+private:
+    std::atomic<std::shared_ptr<T>> ptr;
+};
 
 
-/** stores all the assembled instructions, i.e. this is our running program */
-using code_t = std::vector<op_t>;
+/**
+ * stores all the assembled instructions, i.e. this is our running program.
+ *
+ * it is accessed like a `std::vector<op_t>`, and additionally carries the
+ * analysis results that `assemble` computed for the instructions, and the
+ * form `run` decoded them to. modifying the instructions drops both.
+ *
+ * the instructions can also live in memory the code doesn't own, e.g. a
+ * mapped bytecode file, which is kept alive by a shared storage handle.
+ * they are copied when the code is modified.
+ */
+template <typename T>
+class basic_code {
+public:
+    using op_type = basic_op<T>;
+    using value_type = op_type;
+    using const_iterator = const op_type*;
 
+    basic_code() = default;
+    basic_code(std::initializer_list<op_type> ops) : ops{ops} {}
+    explicit basic_code(std::vector<op_type> ops) : ops{std::move(ops)} {}
 
-/** all vm execution state information is stored in here */
-struct vm_state {
     /**
-     * where in the program code are we?
+     * refer to instructions in memory owned by `storage`, without copying them.
      */
-    size_t pc = 0;
+    basic_code(std::shared_ptr<const void> storage, std::span<const op_type> ops)
+        : storage{std::move(storage)}, external{ops} {}
+
+    size_t size() const { return this->instructions().size(); }
+    bool empty() const { return this->instructions().empty(); }
+    const op_type& operator[](size_t idx) const { return this->instructions()[idx]; }
+    const_iterator begin() const { return this->instructions().data(); }
+    const_iterator end() const { return this->begin() + this->size(); }
+
+    /** the plain instruction list */
+    std::span<const op_type> instructions() const {
+        if (this->storage) {
+            return this->external;
+        }
+        return this->ops;
+    }
+
+    void reserve(size_t count) {
+        this->own();
+        this->ops.reserve(count);
+    }
+
+    void push_back(const op_type& op) {
+        this->own();
+        this->analysis.reset();
+        this->linked.reset();
+        this->ops.push_back(op);
+    }
+
+    template <typename... Args>
+    op_type& emplace_back(Args&&... args) {
+        this->own();
+        this->analysis.reset();
+        this->linked.reset();
+        return this->ops.emplace_back(std::forward<Args>(args)...);
+    }
+
+    /** analysis results for these instructions, nullptr if not analyzed */
+    const std::shared_ptr<const code_analysis>& get_analysis() const { return this->analysis; }
+    void set_analysis(std::shared_ptr<const code_analysis> result) {
+        this->analysis = std::move(result);
+        this->linked.reset();
+    }
 
     /**
-     * stores which id is given the next instruction that is registered.
+     * the instructions as decoded and linked by the last runs, so the next
+     * ones skip that. nullptr before the first run, see `linked_code`.
+     * runs on several threads may replace them at the same time.
      */
-    size_t next_op_id = 0;
+    std::shared_ptr<const linked_code> get_linked() const { return this->linked.load(); }
+    void set_linked(std::shared_ptr<const linked_code> forms) const { this->linked.store(std::move(forms)); }
+
+private:
+    /** copy external instructions, so they can be modified */
+    void own() {
+        if (this->storage) {
+            this->ops.assign(this->external.begin(), this->external.end());
+            this->storage.reset();
+            this->external = {};
+        }
+    }
+
+    std::vector<op_type> ops;
+    std::shared_ptr<const void> storage;
+    std::span<const op_type> external;
+    std::shared_ptr<const code_analysis> analysis;
+    mutable atomic_shared_ptr<const linked_code> linked;
+};
+
+using code_t = basic_code<item_t>;
+
+
+/**
+ * the instructions built into every vm by `create_vm`.
+ *
+ * `run` dispatches these directly in its execution loop, all other
+ * registered instructions are `CUSTOM` and go through their action.
+ *
+ * LOAD to MEMGROW work on the vm's linear memory, see `vm_state::memory`.
+ * CALL and RET enter and leave subroutines, see `vm_state::calls`.
+ * SPAWN and JOIN fork and join tasks, see `run_parallel`.
+ * the ones after JOIN are superinstructions, which `optimize`
+ * creates from common instruction sequences.
+ */
+enum class opcode : uint8_t {
+    PRINT,
+    LOAD_CONST,
+    EXIT,
+    POP,
+    ADD,
+    DIV,
+    EQ,
+    NEQ,
+    DUP,
+    JMP,
+    JMPZ,
+    WRITE,
+    WRITE_CHAR,
+    LOAD,            // addr -> memory[addr]
+    STORE,           // value addr ->
+    MEMCPY,          // target source count ->
+    MEMSET,          // target value count ->
+    MEMSUM,          // addr count -> sum
+    MEMGROW,         // pages -> previous pages, or -1
+    CALL,            // push the next pc as return address, jump to addr
+    RET,             // pop the return address and jump there
+    TAIL_CALL,       // jump to addr, the subroutine returns for the caller
+    SPAWN,           // start a child with the top k items -> handle, the child gets 0
+    JOIN,            // handle -> the child's result
+    ADD_IMM,         // LOAD_CONST x; ADD
+    DIV_IMM,         // LOAD_CONST x; DIV
+    EQ_IMM,          // LOAD_CONST x; EQ
+    NEQ_IMM,         // LOAD_CONST x; NEQ
+    JMP_EQ,          // NEQ; JMPZ addr
+    JMP_NEQ,         // EQ; JMPZ addr
+    DUP_JMPZ,        // DUP; JMPZ addr
+    WRITE_IMM,       // LOAD_CONST x; WRITE; POP
+    WRITE_CHAR_IMM,  // LOAD_CONST x; WRITE_CHAR; POP
+    CUSTOM,
+};
+
+
+/**
+ * string hash that also accepts `std::string_view`, so maps with string
+ * keys can be searched without creating a temporary `std::string`.
+ */
+struct string_hash {
+    using is_transparent = void;
+
+    size_t operator()(std::string_view text) const {
+        return std::hash<std::string_view>{}(text);
+    }
+};
 
+
+/**
+ * the instructions a vm knows.
+ *
+ * vms share their instruction set through a `std::shared_ptr`, so creating
+ * one is cheap. a set is never modified while vms use it: registering an
+ * instruction to a vm gives the vm a modified copy of its set.
+ */
+template <typename T>
+struct basic_instruction_set {
     /**
-     * the main execution state stack.
+     * stores which id is given the next instruction that is registered.
      */
-    std::stack<item_t> stack;
+    size_t next_op_id = 0;
 
     /**
      * mapping of instruction name to operation id.
      */
-    std::unordered_map<std::string, op_id_t> instruction_ids;
+    std::unordered_map<std::string, op_id_t, string_hash, std::equal_to<>> ids;
 
     /**
      * mapping of operation ids back to instruction names.
      * used for debugging -> so we can resolve an op_id back to a name.
      */
-    std::unordered_map<op_id_t, std::string> instruction_names;
+    std::unordered_map<op_id_t, std::string> names;
 
     /**
      * mapping of operation id to action.
      */
-    std::unordered_map<op_id_t, op_action_t> instruction_actions;
+    std::unordered_map<op_id_t, basic_op_action<T>> actions;
+
+    /**
+     * mapping of operation id to the built-in opcode it implements.
+     * indexed by op_id, everything not built-in is `opcode::CUSTOM`.
+     */
+    std::vector<opcode> opcodes;
+};
+
+using instruction_set = basic_instruction_set<item_t>;
+
+
+/**
+ * all vm execution state information is stored in here.
+ * besides the shared instruction set, that's only the state of one run.
+ */
+template <typename T>
+struct basic_vm_state {
+    using item_type = T;
+
+    basic_vm_state() = default;
+
+    explicit basic_vm_state(std::shared_ptr<const basic_instruction_set<T>> instructions)
+        : instructions{std::move(instructions)} {}
+
+    /**
+     * where in the program code are we?
+     */
+    size_t pc = 0;
+
+    /**
+     * the main execution state stack.
+     */
+    operand_stack<T> stack;
+
+    /**
+     * the instructions this vm knows, shared with other vms.
+     */
+    std::shared_ptr<const basic_instruction_set<T>> instructions =
+        std::make_shared<const basic_instruction_set<T>>();
 
     /**
      * activate vm debugging.
@@ -87,16 +347,53 @@ struct vm_state {
     bool debug = false;
 
     // if you need to store more vm state, add it here!
-    std::ostringstream output_stream;
+
+    /**
+     * where the program output goes, all of it is kept in memory by default.
+     */
+    std::unique_ptr<output_sink> output = std::make_unique<memory_sink>();
+
+    /**
+     * the linear memory of LOAD, STORE and the bulk memory instructions.
+     * it has no pages until the program grows it with MEMGROW.
+     */
+    linear_memory<T> memory;
+
+    /**
+     * the return addresses of CALL, with a fixed maximum depth.
+     * replace it with a `call_stack` of another depth to change that.
+     */
+    call_stack calls;
+
+    /**
+     * the children started by SPAWN, only set while `run_parallel` runs
+     * the vm. vms of other item types can't spawn tasks.
+     */
+    std::shared_ptr<task_group> tasks;
 
     /**
      * @brief  return the top item on the stack and pop it as well.
      * 
      * @return the item on the top of the stack 
      */
-    item_t pop_top();
+    T pop_top();
+
+    /**
+     * prepare for running another program: reset the pc, the stack, the
+     * output, the memory and the calls, but keep their buffers and the
+     * instruction set.
+     */
+    void reset() {
+        this->pc = 0;
+        this->stack.clear();
+        this->output->clear();
+        this->memory.clear();
+        this->calls.clear();
+    }
 };
 
+using vm_state = basic_vm_state<item_t>;
+
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -116,12 +413,42 @@ struct vm_state {
 vm_state create_vm(bool debug = false);
 
 
+/**
+ * create a fresh vm that shares an existing instruction set.
+ *
+ * @param instructions: the instructions of the vm, e.g. from `builtin_instructions`
+ * @param debug: enable debug output for when running the VM.
+ */
+vm_state create_vm(std::shared_ptr<const instruction_set> instructions, bool debug = false);
+
+
+/**
+ * the instruction set of vms made by `create_vm`.
+ * it's created once and then shared by all these vms.
+ */
+std::shared_ptr<const instruction_set> builtin_instructions();
+
+
 /**
  * convert the given instruction string to executable vm code.
  *
  * the code is just a list of instructions.
  * after assembling, the code is given to the `run` function to execute.
  *
+ * a line may start with a label, `name:`, which stands for the address of
+ * the next instruction. a label can be used as argument instead of the
+ * number, before or after its line, e.g.
+ *
+ *   LOAD_CONST 4
+ *   CALL square
+ *   EXIT
+ *   square: DUP
+ *   ...
+ *   RET
+ *
+ * label names start with a letter, `_` or `.`, so they can't be confused
+ * with numbers. for floating point items, `inf` and `nan` are numbers.
+ *
  * @param vm: which vm to use for assembling instructions
  * @param input_program: the program text to convert to executable instructions
  *
@@ -141,14 +468,109 @@ void register_instruction(vm_state& vm, std::string_view name,
                           const op_action_t &action);
 
 
+/**
+ * register a new instruction to an instruction set that isn't shared yet.
+ */
+void register_instruction(instruction_set& instructions, std::string_view name,
+                          const op_action_t &action);
+
+
 /**
  * execute the given vm instructions.
+ * they are interpreted as threaded code with the top stack item kept
+ * in a register, see `tier::top_cached`.
  *
  * @return the execution results: {last TOS item, result string from WRITE instructions}
  */
 std::tuple<item_t, std::string> run(vm_state& vm, const code_t &code);
 
 
+/**
+ * execute the given vm instructions like `run`, without copying the output.
+ *
+ * @return the execution results: {last TOS item, output kept by `vm.output`}.
+ *         the output is only valid until the vm runs or is reset again.
+ */
+std::tuple<item_t, std::string_view> run_view(vm_state& vm, const code_t &code);
+
+
+/**
+ * how `run` executes a program.
+ */
+enum class tier {
+    /** interpret the stack instructions, dispatched through a switch */
+    stack,
+    /**
+     * interpret them as threaded code, with the top stack item kept in a
+     * local variable. this is what `run` does without a tier.
+     */
+    top_cached,
+    /** translate to register instructions first, see `register_program` */
+    registers,
+    /** compile to native code first, see `jit_program` */
+    native,
+    /** interpret, and compile hot loops to native code, see `tracing_program` */
+    tracing,
+};
+
+
+/**
+ * execute the given vm instructions with the chosen tier.
+ * all tiers produce the same results, output and exceptions.
+ * a tier that can't handle the program falls back to interpreting it.
+ */
+std::tuple<item_t, std::string> run(vm_state& vm, const code_t &code, tier execution_tier);
+
+
+///////////////////////////////////////////////////////////////////////////////
+// the vm core for other item types, see `vm_item`.
+// the functions above are the ones used for the default `item_t`.
+
+
+/**
+ * create a fresh vm with items of type T and all built-in instructions,
+ * see `basic_builtin_set`.
+ */
+template <vm_item T>
+basic_vm_state<T> create_vm(bool debug = false);
+
+
+/**
+ * convert the program text to code with arguments of type T,
+ * e.g. `LOAD_CONST 2.5` for a vm of `double`.
+ */
+template <vm_item T>
+basic_code<T> assemble(const basic_vm_state<T>& vm, std::string_view input_program);
+
+
+/**
+ * register a new instruction to a vm with items of type T.
+ */
+template <vm_item T>
+void register_instruction(basic_vm_state<T>& vm, std::string_view name,
+                          const std::type_identity_t<basic_op_action<T>>& action);
+
+
+/**
+ * register a new instruction to an instruction set for items of type T.
+ */
+template <vm_item T>
+void register_instruction(basic_instruction_set<T>& instructions, std::string_view name,
+                          const std::type_identity_t<basic_op_action<T>>& action);
+
+
+/**
+ * execute the given vm instructions of a vm with items of type T,
+ * with the loop of `run_static` if it was made by `create_vm<T>`.
+ * arithmetic is done in T, e.g. `DIV` divides doubles, but still throws
+ * `div_by_zero` for a zero divisor. addresses are converted to integers.
+ *
+ * @return the execution results: {last TOS item, result string from WRITE instructions}
+ */
+template <vm_item T>
+std::tuple<T, std::string> run(basic_vm_state<T>& vm, const basic_code<T>& code);
+
+
 //// exception types, thrown in various error situations.
 
 /**
@@ -183,4 +605,38 @@ struct invalid_instruction : std::runtime_error {
 };
 
 
+/**
+ * exception thrown when a program text can't be assembled.
+ * line and column of the error start at 1.
+ */
+struct assembly_error : invalid_instruction {
+    assembly_error(const std::string& message, size_t line, size_t column)
+        : invalid_instruction{"line " + std::to_string(line) + ", column " +
+                              std::to_string(column) + ": " + message},
+          line{line},
+          column{column} {}
+
+    size_t line;
+    size_t column;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// definitions of the vm templates
+
+
+template <typename T>
+T basic_vm_state<T>::pop_top()
+{
+    if (this->stack.size() == 0)
+    {
+        throw vm_stackfail{std::string{"The stack in empty."}};
+    }
+    T top = this->stack.top();
+    this->stack.pop();
+
+    return top;
+}
+
+
 } // namespace vm
@@ -203,3 +203,63 @@ TEST_CASE("sort_contacts") {
 
     test_formatting(s, nrs_sorted);
 }
+
+
+TEST_CASE("contact_index") {
+    contact_list::storage s;
+    fill_contacts(s);
+
+    // numbers may be shared, the first contact with it is found
+    CHECK_EQ(contact_list::add(s, "Y", 12), true);
+    CHECK_EQ(contact_list::add(s, "E", 12), true);
+    CHECK_EQ(contact_list::get_name_by_number(s, 12), "C");
+
+    // lookup by a name that is only a part of a longer string
+    std::string_view names = "JYZ";
+    CHECK_EQ(contact_list::get_number_by_name(s, names.substr(1, 1)), 12);
+    CHECK_EQ(contact_list::get_number_by_name(s, names.substr(0, 2)), -1);
+
+    // the contacts behind a removed one keep their order, and are still found
+    CHECK_EQ(contact_list::remove(s, "D"), true);
+    std::vector<std::pair<std::string, int>> nrs = {
+        {"A", 10},
+        {"C", 12},
+        {"F", 11},
+        {"B", 13},
+        {"Z", 19},
+        {"J", 42},
+        {"Y", 12},
+        {"E", 12},
+    };
+    test_formatting(s, nrs);
+    CHECK_EQ(contact_list::get_number_by_name(s, "J"), 42);
+    CHECK_EQ(contact_list::get_name_by_number(s, 19), "Z");
+    CHECK_EQ(contact_list::get_name_by_number(s, 14), "");
+
+    // the number then leads to the next contact with it
+    CHECK_EQ(contact_list::remove(s, "C"), true);
+    CHECK_EQ(contact_list::get_name_by_number(s, 12), "Y");
+    CHECK_EQ(contact_list::remove(s, "Y"), true);
+    CHECK_EQ(contact_list::get_name_by_number(s, 12), "E");
+    CHECK_EQ(contact_list::remove(s, "E"), true);
+    CHECK_EQ(contact_list::get_name_by_number(s, 12), "");
+    CHECK_EQ(contact_list::add(s, "C", 12), true);
+
+    // sorting moves the first contact of a shared number
+    CHECK_EQ(contact_list::add(s, "B2", 42), true);
+    CHECK_EQ(contact_list::get_name_by_number(s, 42), "J");
+    contact_list::sort(s);
+    CHECK_EQ(contact_list::get_name_by_number(s, 42), "B2");
+    CHECK_EQ(contact_list::size(s), 7);
+    for (std::string_view name : {"A", "B", "B2", "C", "F", "J", "X", "Z"}) {
+        if (name == "X") {
+            CHECK_EQ(contact_list::get_number_by_name(s, name), -1);
+            continue;
+        }
+        CHECK_EQ(contact_list::remove(s, name), true);
+        CHECK_EQ(contact_list::get_number_by_name(s, name), -1);
+    }
+    CHECK_EQ(contact_list::size(s), 0);
+    CHECK(s.name_slots.empty());
+    CHECK(s.number_slots.empty());
+}
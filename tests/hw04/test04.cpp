@@ -10,8 +10,26 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include <doctest/doctest.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iterator>
+#include <numeric>
 #include <sstream>
+#include <system_error>
+#include <type_traits>
+
+#if defined(__unix__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 
 #include "hw04.h"
@@ -241,6 +259,30 @@ TEST_CASE("vm_dup") {
         CHECK_EQ(topstack, 40);
         CHECK_EQ(output_string, "");
     }
+    SUBCASE("grows") {
+        // the duplicated item is read from the storage the stack replaces
+        std::string program = "LOAD_CONST 3\n";
+        for (int i = 0; i < 300; i++) {
+            program += "DUP\n";
+        }
+        for (int i = 0; i < 300; i++) {
+            program += "ADD\n";
+        }
+        program += "EXIT\n";
+
+        vm::vm_state fast = vm::create_vm<vm::builtin_set>();
+        CHECK_EQ(std::get<0>(vm::run_static<vm::builtin_set>(fast, vm::assemble(fast, program))), 903);
+        vm::vm_state debugged = vm::create_vm(true);
+        CHECK_EQ(std::get<0>(vm::run(debugged, vm::assemble(debugged, program))), 903);
+
+        vm::operand_stack<vm::item_t> stack;
+        stack.push(1);
+        for (size_t i = 1; i <= vm::operand_stack<vm::item_t>::initial_capacity; i++) {
+            stack.push(stack.top());
+        }
+        CHECK_EQ(stack.size(), vm::operand_stack<vm::item_t>::initial_capacity + 1);
+        CHECK_EQ(stack.top(), 1);
+    }
 }
 
 
@@ -448,6 +490,45 @@ TEST_CASE("vm_illegal_instruction") {
 }
 
 
+TEST_CASE("vm_assemble") {
+    SUBCASE("whitespace") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state,
+                                 "  LOAD_CONST\t+40 \r\n"
+                                 "\n"
+                                 "LOAD_CONST -2\n"
+                                 "\tADD\n"
+                                 "EXIT");
+        REQUIRE_EQ(code.size(), 4);
+        CHECK_EQ(code[0].second, 40);
+        CHECK_EQ(code[1].second, -2);
+
+        const auto& [topstack, output_string] = vm::run(state, code);
+        CHECK_EQ(topstack, 38);
+    }
+    SUBCASE("error_positions") {
+        vm::vm_state state = vm::create_vm();
+
+        auto error_at = [&](std::string_view program) {
+            try {
+                vm::assemble(state, program);
+            }
+            catch (vm::assembly_error& err) {
+                return std::to_string(err.line) + ":" + std::to_string(err.column);
+            }
+            return std::string{"no error"};
+        };
+
+        CHECK_EQ(error_at("LOAD_CONST 1\n  MUL\n"), "2:3");
+        CHECK_EQ(error_at("LOAD_CONST 1\nLOAD_CONST 13 37\n"), "2:15");
+        CHECK_EQ(error_at("\n\nLOAD_CONST 12x\n"), "3:12");
+        CHECK_EQ(error_at("LOAD_CONST 99999999999999999999\n"), "1:12");
+        CHECK_EQ(error_at("LOAD_CONST -\n"), "1:12");
+        CHECK_EQ(error_at("LOAD_CONST 9223372036854775807\n"), "no error");
+    }
+}
+
+
 TEST_CASE("vm_custom_instructions") {
     SUBCASE("mul_instruction") {
         vm::vm_state state = vm::create_vm();
@@ -497,6 +578,47 @@ TEST_CASE("vm_custom_instructions") {
 }
 
 
+TEST_CASE("vm_instruction_set") {
+    SUBCASE("shared_between_vms") {
+        vm::vm_state first = vm::create_vm();
+        vm::vm_state second = vm::create_vm();
+        CHECK_EQ(first.instructions, second.instructions);
+        CHECK_EQ(first.instructions, vm::builtin_instructions());
+    }
+    SUBCASE("registering_copies_the_set") {
+        vm::vm_state first = vm::create_vm();
+        vm::vm_state second = vm::create_vm();
+
+        register_instruction(first, "NOP", [](vm::vm_state&, const vm::item_t) {
+            return true;
+        });
+
+        CHECK_NE(first.instructions, second.instructions);
+        CHECK(first.instructions->ids.contains("NOP"));
+        CHECK_FALSE(second.instructions->ids.contains("NOP"));
+        CHECK_FALSE(vm::builtin_instructions()->ids.contains("NOP"));
+        CHECK_THROWS_AS(vm::assemble(second, "NOP\n"), vm::invalid_instruction);
+    }
+    SUBCASE("custom_set") {
+        auto instructions = std::make_shared<vm::instruction_set>(*vm::builtin_instructions());
+        register_instruction(*instructions, "TWICE", [](vm::vm_state& vmstate, const vm::item_t) {
+            vmstate.stack.top() *= 2;
+            return true;
+        });
+        std::shared_ptr<const vm::instruction_set> shared = std::move(instructions);
+
+        for (int i = 0; i < 3; i++) {
+            vm::vm_state state = vm::create_vm(shared);
+            CHECK_EQ(state.instructions, shared);
+
+            auto code = vm::assemble(state, "LOAD_CONST 21\nTWICE\nEXIT\n");
+            const auto& [topstack, output_string] = vm::run(state, code);
+            CHECK_EQ(topstack, 42);
+        }
+    }
+}
+
+
 TEST_CASE("vm_stack_failure") {
     SUBCASE("exit") {
         vm::vm_state state = vm::create_vm();
@@ -611,3 +733,2284 @@ TEST_CASE("vm_segfault") {
         REQUIRE_THROWS_AS(vm::run(state, code), vm::vm_segfault);
     }
 }
+
+
+TEST_CASE("vm_stack_analysis") {
+    SUBCASE("max_depth") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state,
+                                 "LOAD_CONST 1\n"
+                                 "LOAD_CONST 2\n"
+                                 "DUP\n"
+                                 "ADD\n"
+                                 "ADD\n"
+                                 "EXIT\n");
+        auto analysis = vm::analyze(state, code);
+        CHECK(analysis.stack_bounded);
+        CHECK_EQ(analysis.max_stack_depth, 3);
+        for (size_t pc = 0; pc < code.size(); pc++) {
+            CHECK(analysis.is_stack_safe(pc));
+        }
+    }
+    SUBCASE("unbounded_growth") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state,
+                                 "LOAD_CONST 1000\n"
+                                 "DUP\n"
+                                 "JMPZ 7\n"
+                                 "DUP\n"
+                                 "LOAD_CONST -1\n"
+                                 "ADD\n"
+                                 "JMP 1\n"
+                                 "EXIT\n");
+        auto analysis = vm::analyze(state, code);
+        CHECK_FALSE(analysis.stack_bounded);
+
+        const auto& [topstack, output_string] = vm::run(state, code);
+        CHECK_EQ(topstack, 0);
+        CHECK_EQ(state.stack.size(), 1001);
+    }
+    SUBCASE("large_loop") {
+        // a loop that pushes an item per instruction, the analysis must not
+        // go around it once per instruction
+        vm::vm_state state = vm::create_vm();
+        std::string program = "loop: ";
+        for (int i = 0; i < 32000; i++) {
+            program += "LOAD_CONST 1\n";
+        }
+        program += "JMP loop\n";
+
+        auto start = std::chrono::steady_clock::now();
+        auto code = vm::assemble(state, program);
+        auto analysis = vm::analyze(state, code);
+        CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds{1});
+        CHECK_FALSE(analysis.stack_bounded);
+        CHECK_FALSE(analysis.is_stack_safe(0));
+    }
+    SUBCASE("underflow_in_loop") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state,
+                                 "LOAD_CONST 1\n"
+                                 "LOAD_CONST 2\n"
+                                 "ADD\n"
+                                 "JMP 2\n");
+        auto analysis = vm::analyze(state, code);
+        CHECK(analysis.is_stack_safe(1));
+        CHECK_FALSE(analysis.is_stack_safe(2));
+        REQUIRE_THROWS_AS(vm::run(state, code), vm::vm_stackfail);
+    }
+    SUBCASE("custom_instruction_pops") {
+        vm::vm_state state = vm::create_vm();
+
+        register_instruction(state, "CLEAR", [](vm::vm_state& vmstate, const vm::item_t) {
+            while (not vmstate.stack.empty()) {
+                vmstate.stack.pop();
+            }
+            return true;
+        });
+
+        auto code = vm::assemble(state,
+                                 "LOAD_CONST 1\n"
+                                 "LOAD_CONST 2\n"
+                                 "CLEAR\n"
+                                 "ADD\n"
+                                 "EXIT\n");
+        REQUIRE_THROWS_AS(vm::run(state, code), vm::vm_stackfail);
+    }
+}
+
+
+TEST_CASE("vm_verify") {
+    SUBCASE("verified") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state,
+                                 "LOAD_CONST 3\n"
+                                 "DUP\n"
+                                 "JMPZ 6\n"
+                                 "LOAD_CONST -1\n"
+                                 "ADD\n"
+                                 "JMP 1\n"
+                                 "EXIT\n");
+        REQUIRE(code.get_analysis() != nullptr);
+        CHECK(code.get_analysis()->verified);
+
+        const auto& [topstack, output_string] = vm::run(state, code);
+        CHECK_EQ(topstack, 0);
+    }
+    SUBCASE("negative_jump") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state,
+                                 "LOAD_CONST 0\n"
+                                 "JMPZ -1\n"
+                                 "EXIT\n");
+        CHECK_FALSE(code.get_analysis()->verified);
+        REQUIRE_THROWS_AS(vm::run(state, code), vm::vm_segfault);
+    }
+    SUBCASE("falls_off_end") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state,
+                                 "LOAD_CONST 1\n"
+                                 "LOAD_CONST 2\n");
+        CHECK_FALSE(code.get_analysis()->verified);
+        REQUIRE_THROWS_AS(vm::run(state, code), vm::vm_segfault);
+    }
+    SUBCASE("custom_jump") {
+        vm::vm_state state = vm::create_vm();
+
+        register_instruction(state, "FAR_JMP", [](vm::vm_state& vmstate, const vm::item_t) {
+            vmstate.pc = 1000;
+            return true;
+        });
+
+        auto code = vm::assemble(state,
+                                 "LOAD_CONST 1\n"
+                                 "FAR_JMP\n"
+                                 "EXIT\n");
+        CHECK(code.get_analysis()->verified);
+        REQUIRE_THROWS_AS(vm::run(state, code), vm::vm_segfault);
+        CHECK_EQ(state.pc, 1000);
+    }
+    SUBCASE("modified_code") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state,
+                                 "LOAD_CONST 1\n"
+                                 "EXIT\n");
+        CHECK(code.get_analysis() != nullptr);
+        code.emplace_back(state.instructions->ids.at("JMP"), -3);
+        CHECK(code.get_analysis() == nullptr);
+    }
+}
+
+
+/**
+ * run a program and describe how it ended, so runs can be compared.
+ */
+static std::string run_outcome(const vm::code_t& code, vm::tier execution_tier = vm::tier::stack) {
+    vm::vm_state state = vm::create_vm();
+    try {
+        const auto& [topstack, output_string] = vm::run(state, code, execution_tier);
+        return std::to_string(topstack) + "|" + output_string;
+    }
+    catch (vm::div_by_zero&) {
+        return "div_by_zero";
+    }
+    catch (vm::vm_segfault&) {
+        return "vm_segfault";
+    }
+    catch (vm::vm_stackfail&) {
+        return "vm_stackfail";
+    }
+}
+
+
+TEST_CASE("vm_optimize") {
+    SUBCASE("equivalence") {
+        const char* programs[] = {
+            // folding and superinstructions
+            "LOAD_CONST 3\nLOAD_CONST 4\nADD\nLOAD_CONST 2\nDIV\nEXIT\n",
+            "LOAD_CONST 7\nLOAD_CONST 7\nEQ\nLOAD_CONST 1\nNEQ\nEXIT\n",
+            "LOAD_CONST 9\nDUP\nADD\nLOAD_CONST 3\nADD\nLOAD_CONST 4\nADD\nEXIT\n",
+            "LOAD_CONST 5\nLOAD_CONST 1\nPOP\nLOAD_CONST 10\nLOAD_CONST 5\nEQ\nJMPZ 9\nLOAD_CONST 1\nEXIT\nLOAD_CONST 2\nEXIT\n",
+            "LOAD_CONST 72\nWRITE_CHAR\nPOP\nLOAD_CONST 105\nWRITE_CHAR\nPOP\nLOAD_CONST 42\nWRITE\nPOP\nLOAD_CONST 0\nEXIT\n",
+            // countdown loop with output
+            "LOAD_CONST 10\nDUP\nJMPZ 8\nWRITE\nLOAD_CONST -1\nADD\nJMP 1\nLOAD_CONST 99\nEXIT\n",
+            // loop with comparison
+            "LOAD_CONST 0\nDUP\nLOAD_CONST 5\nEQ\nJMPZ 6\nEXIT\nLOAD_CONST 1\nADD\nJMP 1\n",
+            "LOAD_CONST 0\nDUP\nLOAD_CONST 5\nNEQ\nJMPZ 8\nLOAD_CONST 1\nADD\nJMP 1\nEXIT\n",
+            // dead code and jump chains
+            "JMP 3\nLOAD_CONST 1\nEXIT\nJMP 5\nLOAD_CONST 2\nLOAD_CONST 3\nEXIT\nLOAD_CONST 4\nEXIT\n",
+            "LOAD_CONST 0\nJMPZ 3\nLOAD_CONST 1\nLOAD_CONST 2\nEXIT\n",
+            "LOAD_CONST 1\nJMPZ 3\nLOAD_CONST 1\nLOAD_CONST 2\nEXIT\n",
+            "LOAD_CONST 1\nJMP 2\nEXIT\n",
+            // jump into a foldable sequence
+            "LOAD_CONST 1\nJMP 3\nLOAD_CONST 2\nLOAD_CONST 3\nADD\nEXIT\n",
+            // failures
+            "LOAD_CONST 1\nLOAD_CONST 0\nDIV\nEXIT\n",
+            "LOAD_CONST 0\nDIV\nEXIT\n",
+            "LOAD_CONST 1\nADD\nEXIT\n",
+            "LOAD_CONST 1\nEQ\nJMPZ 0\nEXIT\n",
+            "DUP\nJMPZ 0\nEXIT\n",
+            "LOAD_CONST 0\nJMPZ 7\nEXIT\n",
+            "LOAD_CONST 3\nJMP -2\nEXIT\n",
+            "LOAD_CONST 1\nLOAD_CONST 2\n",
+            "LOAD_CONST 4\nWRITE\nPOP\nPOP\nEXIT\n",
+        };
+
+        for (const char* program : programs) {
+            vm::vm_state state = vm::create_vm();
+            auto code = vm::assemble(state, program);
+            auto optimized = vm::optimize(state, code);
+
+            CHECK_LE(optimized.size(), code.size());
+            CHECK_EQ(run_outcome(optimized), run_outcome(code));
+        }
+    }
+    SUBCASE("superinstructions") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state,
+                                 "LOAD_CONST 10\n"
+                                 "DUP\n"
+                                 "JMPZ 9\n"
+                                 "LOAD_CONST 33\n"
+                                 "WRITE_CHAR\n"
+                                 "POP\n"
+                                 "LOAD_CONST -1\n"
+                                 "ADD\n"
+                                 "JMP 1\n"
+                                 "EXIT\n");
+        auto optimized = vm::optimize(state, code);
+
+        REQUIRE_EQ(optimized.size(), 6);
+        CHECK_EQ(optimized[1].first, state.instructions->ids.at("DUP_JMPZ"));
+        CHECK_EQ(optimized[1].second, 5);
+        CHECK_EQ(optimized[2].first, state.instructions->ids.at("WRITE_CHAR_IMM"));
+        CHECK_EQ(optimized[3].first, state.instructions->ids.at("ADD_IMM"));
+        CHECK_EQ(run_outcome(optimized), run_outcome(code));
+    }
+    SUBCASE("constant_folding") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state,
+                                 "LOAD_CONST 2\n"
+                                 "LOAD_CONST 3\n"
+                                 "ADD\n"
+                                 "LOAD_CONST 5\n"
+                                 "EQ\n"
+                                 "EXIT\n");
+        auto optimized = vm::optimize(state, code);
+        REQUIRE_EQ(optimized.size(), 2);
+        CHECK_EQ(optimized[0].second, 1);
+    }
+    SUBCASE("custom_instructions_unchanged") {
+        vm::vm_state state = vm::create_vm();
+
+        register_instruction(state, "NOP", [](vm::vm_state&, const vm::item_t) {
+            return true;
+        });
+
+        auto code = vm::assemble(state,
+                                 "LOAD_CONST 2\n"
+                                 "LOAD_CONST 3\n"
+                                 "ADD\n"
+                                 "NOP\n"
+                                 "EXIT\n");
+        auto optimized = vm::optimize(state, code);
+        CHECK_EQ(optimized.size(), code.size());
+    }
+}
+
+
+TEST_CASE("vm_jit") {
+    SUBCASE("equivalence") {
+        const char* programs[] = {
+            "LOAD_CONST 3\nLOAD_CONST 4\nADD\nLOAD_CONST 2\nDIV\nEXIT\n",
+            "LOAD_CONST -7\nLOAD_CONST 2\nDIV\nEXIT\n",
+            "LOAD_CONST 7\nLOAD_CONST 7\nEQ\nLOAD_CONST 1\nNEQ\nEXIT\n",
+            "LOAD_CONST 9\nDUP\nADD\nPOP\nLOAD_CONST 3000000000\nLOAD_CONST 3000000000\nADD\nEXIT\n",
+            "LOAD_CONST 72\nWRITE_CHAR\nPOP\nLOAD_CONST 105\nWRITE_CHAR\nPOP\nLOAD_CONST -42\nWRITE\nEXIT\n",
+            "LOAD_CONST 10\nDUP\nJMPZ 8\nWRITE\nLOAD_CONST -1\nADD\nJMP 1\nLOAD_CONST 99\nEXIT\n",
+            "LOAD_CONST 0\nDUP\nLOAD_CONST 5\nNEQ\nJMPZ 8\nLOAD_CONST 1\nADD\nJMP 1\nEXIT\n",
+            "LOAD_CONST 5\nPRINT\nLOAD_CONST 6\nEXIT\n",
+            // grows the stack beyond its initial capacity
+            "LOAD_CONST 0\nDUP\nLOAD_CONST 1\nADD\nDUP\nLOAD_CONST 1000\nEQ\nJMPZ 1\nEXIT\n",
+            // failures
+            "LOAD_CONST 1\nLOAD_CONST 0\nDIV\nEXIT\n",
+            "LOAD_CONST 0\nDIV\nEXIT\n",
+            "LOAD_CONST 1\nADD\nEXIT\n",
+            "LOAD_CONST 1\nEQ\nJMPZ 0\nEXIT\n",
+            "DUP\nJMPZ 0\nEXIT\n",
+            "POP\nEXIT\n",
+            "EXIT\n",
+            "LOAD_CONST 3\nJMP -2\nEXIT\n",
+            "LOAD_CONST 1\nLOAD_CONST 2\n",
+        };
+
+        for (const char* program : programs) {
+            vm::vm_state state = vm::create_vm();
+            auto code = vm::assemble(state, program);
+            auto optimized = vm::optimize(state, code);
+
+            CHECK_EQ(run_outcome(code, vm::tier::native), run_outcome(code));
+            CHECK_EQ(run_outcome(optimized, vm::tier::native), run_outcome(code));
+        }
+    }
+    SUBCASE("stack_after_failure") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state, "LOAD_CONST 4\nLOAD_CONST 8\nLOAD_CONST 0\nDIV\nEXIT\n");
+        vm::jit_program program{state, code};
+
+        CHECK_THROWS_AS(program.run(state), vm::div_by_zero);
+        CHECK_EQ(state.stack.size(), 1);
+        CHECK_EQ(state.stack.top(), 4);
+        CHECK_EQ(state.pc, 4);
+    }
+    SUBCASE("custom_instructions") {
+        vm::vm_state state = vm::create_vm();
+
+        // skips the next instruction and leaves a marker on the stack
+        register_instruction(state, "SKIP", [](vm::vm_state& vmstate, const vm::item_t) {
+            vmstate.pc += 1;
+            vmstate.stack.push(7);
+            return true;
+        });
+        register_instruction(state, "STOP", [](vm::vm_state&, const vm::item_t) {
+            return false;
+        });
+
+        auto code = vm::assemble(state,
+                                 "LOAD_CONST 1\n"
+                                 "WRITE\n"
+                                 "SKIP\n"
+                                 "EXIT\n"
+                                 "ADD\n"
+                                 "WRITE\n"
+                                 "STOP\n");
+        vm::jit_program program{state, code};
+        const auto& [result, output] = program.run(state);
+        CHECK_EQ(result, 8);
+        CHECK_EQ(output, "18");
+    }
+    SUBCASE("unverified_code_is_interpreted") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state, "LOAD_CONST 3\nJMP -2\nEXIT\n");
+        vm::jit_program program{state, code};
+
+        CHECK_FALSE(program.is_native());
+        CHECK_THROWS_AS(program.run(state), vm::vm_segfault);
+    }
+}
+
+
+TEST_CASE("vm_bytecode") {
+    const char* program = (
+        "LOAD_CONST 10\n"
+        "DUP\n"
+        "JMPZ 8\n"
+        "WRITE\n"
+        "LOAD_CONST -1\n"
+        "ADD\n"
+        "JMP 1\n"
+        "EXIT\n"
+        "LOAD_CONST 9223372036854775807\n"
+        "EXIT\n");
+
+    SUBCASE("stream_round_trip") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state, program);
+
+        std::stringstream file;
+        vm::save_code(state, code, file);
+        auto loaded = vm::load_code(state, file);
+
+        REQUIRE_EQ(loaded.size(), code.size());
+        CHECK(std::equal(loaded.begin(), loaded.end(), code.begin()));
+        CHECK(loaded.get_analysis() != nullptr);
+        CHECK_EQ(run_outcome(loaded), run_outcome(code));
+    }
+    SUBCASE("mapped_file") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state, program);
+
+        std::string path = (std::filesystem::temp_directory_path() / "test04_bytecode.vmbc").string();
+        vm::save_code(state, code, path);
+        CHECK(vm::is_bytecode_file(path));
+
+        auto loaded = vm::load_code(state, path);
+        std::filesystem::remove(path);
+
+        REQUIRE_EQ(loaded.size(), code.size());
+        CHECK(std::equal(loaded.begin(), loaded.end(), code.begin()));
+        CHECK_EQ(run_outcome(loaded), run_outcome(code));
+
+        // modifying copies the instructions out of the mapping
+        loaded.emplace_back(state.instructions->ids.at("EXIT"), 0);
+        CHECK_EQ(loaded.size(), code.size() + 1);
+        CHECK(loaded[0] == code[0]);
+    }
+    SUBCASE("op_ids_are_resolved_by_name") {
+        vm::vm_state saver = vm::create_vm();
+        register_instruction(saver, "NOP", [](vm::vm_state&, const vm::item_t) {
+            return true;
+        });
+        auto code = vm::assemble(saver, "LOAD_CONST 3\nNOP\nEXIT\n");
+
+        std::stringstream file;
+        vm::save_code(saver, code, file);
+
+        vm::vm_state loader = vm::create_vm();
+        register_instruction(loader, "OTHER", [](vm::vm_state&, const vm::item_t) {
+            return false;
+        });
+        register_instruction(loader, "NOP", [](vm::vm_state&, const vm::item_t) {
+            return true;
+        });
+        auto loaded = vm::load_code(loader, file);
+
+        REQUIRE_EQ(loaded.size(), 3);
+        CHECK_EQ(loaded[1].first, loader.instructions->ids.at("NOP"));
+        CHECK_NE(loaded[1].first, code[1].first);
+
+        const auto& [result, output] = vm::run(loader, loaded);
+        CHECK_EQ(result, 3);
+    }
+    SUBCASE("invalid_files") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state, program);
+        std::stringstream file;
+        vm::save_code(state, code, file);
+        std::string data = file.str();
+
+        std::stringstream truncated{data.substr(0, data.size() - 3)};
+        CHECK_THROWS_AS(vm::load_code(state, truncated), vm::bytecode_error);
+
+        std::stringstream text{std::string{program}};
+        CHECK_THROWS_AS(vm::load_code(state, text), vm::bytecode_error);
+
+        vm::vm_state saver = vm::create_vm();
+        register_instruction(saver, "NOP", [](vm::vm_state&, const vm::item_t) {
+            return true;
+        });
+        std::stringstream custom;
+        vm::save_code(saver, vm::assemble(saver, "NOP\n"), custom);
+        CHECK_THROWS_AS(vm::load_code(state, custom), vm::invalid_instruction);
+    }
+}
+
+
+TEST_CASE("vm_batch") {
+    SUBCASE("pool_runs_each_index_once") {
+        vm::work_pool pool{4};
+        std::vector<std::atomic<int>> runs(1000);
+        std::atomic<bool> workers_valid = true;
+
+        for (int round = 0; round < 3; round++) {
+            pool.parallel_for(runs.size(), [&](size_t worker, size_t index) {
+                if (worker >= pool.size()) {
+                    workers_valid = false;
+                }
+                runs[index]++;
+            });
+        }
+        CHECK(workers_valid);
+        CHECK(std::all_of(runs.begin(), runs.end(), [](auto& count) { return count == 3; }));
+    }
+    SUBCASE("pool_rethrows") {
+        vm::work_pool pool{3};
+        std::atomic<int> runs = 0;
+
+        CHECK_THROWS_AS(pool.parallel_for(100, [&](size_t, size_t index) {
+            runs++;
+            if (index == 42) {
+                throw std::runtime_error{"fail"};
+            }
+        }), std::runtime_error);
+        CHECK_EQ(runs, 100);
+    }
+    SUBCASE("results_in_job_order") {
+        vm::vm_state state = vm::create_vm();
+        auto sum = vm::assemble(state, "ADD\nWRITE\nEXIT\n");
+        auto divide = vm::assemble(state, "DIV\nEXIT\n");
+
+        std::vector<vm::batch_job> jobs;
+        for (vm::item_t i = 0; i < 200; i++) {
+            jobs.push_back({sum, {i, 1000}});
+            jobs.push_back({divide, {i, i % 3}});
+        }
+
+        auto results = vm::run_batch(jobs, vm::builtin_instructions(), 4);
+        REQUIRE_EQ(results.size(), jobs.size());
+
+        for (vm::item_t i = 0; i < 200; i++) {
+            const auto& added = results[2 * i];
+            CHECK_EQ(added.get(), i + 1000);
+            CHECK_EQ(added.output, std::to_string(i + 1000));
+
+            const auto& divided = results[2 * i + 1];
+            if (i % 3 == 0) {
+                CHECK_THROWS_AS(divided.get(), vm::div_by_zero);
+            }
+            else {
+                CHECK_EQ(divided.get(), i / (i % 3));
+                CHECK_EQ(divided.output, "");
+            }
+        }
+    }
+}
+
+
+TEST_CASE("vm_profile") {
+    auto code = vm::assemble(vm::create_vm(),
+        "LOAD_CONST 3\n"
+        "DUP\n"
+        "JMPZ 6\n"
+        "LOAD_CONST -1\n"
+        "ADD\n"
+        "JMP 1\n"
+        "EXIT\n");
+
+    SUBCASE("counts") {
+        vm::vm_state state = vm::create_vm();
+        vm::execution_profile profile;
+        auto [result, output] = vm::run_profiled(state, code, profile);
+        CHECK_EQ(result, 0);
+
+        CHECK((profile.hits == std::vector<uint64_t>{1, 4, 4, 3, 3, 3, 1}));
+        CHECK((profile.taken == std::vector<uint64_t>{0, 0, 1, 0, 0, 0, 0}));
+        CHECK(profile.cycles.empty());
+
+        // a second run accumulates
+        state.reset();
+        vm::run_profiled(state, code, profile);
+        CHECK_EQ(profile.hits[1], 8);
+        CHECK_EQ(profile.taken[2], 2);
+    }
+    SUBCASE("cycles") {
+        vm::vm_state state = vm::create_vm();
+        vm::execution_profile profile;
+        profile.measure_cycles = true;
+        vm::run_profiled(state, code, profile);
+
+        CHECK((profile.hits == std::vector<uint64_t>{1, 4, 4, 3, 3, 3, 1}));
+        REQUIRE_EQ(profile.cycles.size(), code.size());
+        CHECK(std::all_of(profile.cycles.begin(), profile.cycles.end(), [](auto c) { return c > 0; }));
+    }
+    SUBCASE("failing_run_keeps_counts") {
+        vm::vm_state state = vm::create_vm();
+        auto divide = vm::assemble(state, "LOAD_CONST 1\nLOAD_CONST 0\nDIV\nEXIT\n");
+        vm::execution_profile profile;
+        CHECK_THROWS_AS(vm::run_profiled(state, divide, profile), vm::div_by_zero);
+        CHECK((profile.hits == std::vector<uint64_t>{1, 1, 1, 0}));
+    }
+    SUBCASE("reports") {
+        vm::vm_state state = vm::create_vm();
+        vm::execution_profile profile;
+        vm::run_profiled(state, code, profile);
+
+        auto loops = vm::find_hot_loops(state, code, profile);
+        REQUIRE_EQ(loops.size(), 1);
+        CHECK_EQ(loops[0].start, 1);
+        CHECK_EQ(loops[0].end, 5);
+        CHECK_EQ(loops[0].iterations, 3);
+        CHECK_EQ(loops[0].instructions, 17);
+
+        std::ostringstream csv;
+        vm::write_profile_csv(csv, state, code, profile);
+        CHECK_EQ(csv.str(),
+                 "pc,instruction,arg,hits,taken,not_taken,cycles\n"
+                 "0,LOAD_CONST,3,1,,,\n"
+                 "1,DUP,0,4,,,\n"
+                 "2,JMPZ,6,4,1,3,\n"
+                 "3,LOAD_CONST,-1,3,,,\n"
+                 "4,ADD,0,3,,,\n"
+                 "5,JMP,1,3,,,\n"
+                 "6,EXIT,0,1,,,\n");
+
+        std::ostringstream json;
+        vm::write_profile_json(json, state, code, profile);
+        CHECK_NE(json.str().find("\"executed\": 19"), std::string::npos);
+        CHECK_NE(json.str().find("{\"name\": \"DUP\", \"count\": 4}"), std::string::npos);
+        CHECK_NE(json.str().find("{\"pc\": 2, \"target\": 6, \"taken\": 1, \"not_taken\": 3}"), std::string::npos);
+        CHECK_NE(json.str().find("{\"start\": 1, \"end\": 5, \"iterations\": 3, \"instructions\": 17}"), std::string::npos);
+
+        auto summary = vm::profile_summary(state, code, profile);
+        CHECK_NE(summary.find("pc 1-5: 3 iterations"), std::string::npos);
+    }
+}
+
+
+TEST_CASE("vm_output_sink") {
+    auto code = vm::assemble(vm::create_vm(),
+        "LOAD_CONST 1000\n"
+        "DUP\n"
+        "JMPZ 9\n"
+        "WRITE\n"
+        "LOAD_CONST 44\n"
+        "WRITE_CHAR\n"
+        "POP\n"
+        "ADD_IMM -1\n"
+        "JMP 1\n"
+        "EXIT\n");
+
+    std::string expected;
+    for (int i = 1000; i > 0; i--) {
+        expected += std::to_string(i) + ",";
+    }
+
+    SUBCASE("memory") {
+        vm::vm_state state = vm::create_vm();
+        auto [result, output] = vm::run(state, code);
+        CHECK_EQ(result, 0);
+        CHECK_EQ(output, expected);
+
+        state.reset();
+        auto [view_result, view] = vm::run_view(state, code);
+        CHECK_EQ(view_result, 0);
+        CHECK_EQ(view, expected);
+        CHECK(view.data() == state.output->view().data());
+    }
+    SUBCASE("preallocated") {
+        vm::vm_state state = vm::create_vm();
+        state.output = std::make_unique<vm::memory_sink>(expected.size());
+        const char* buffer = state.output->view().data();
+        auto [result, output] = vm::run_view(state, code);
+        CHECK_EQ(output, expected);
+        CHECK(output.data() == buffer);
+    }
+    SUBCASE("discard") {
+        vm::vm_state state = vm::create_vm();
+        state.output = std::make_unique<vm::discard_sink>();
+        auto [result, output] = vm::run(state, code);
+        CHECK_EQ(result, 0);
+        CHECK_EQ(output, "");
+    }
+    SUBCASE("fd") {
+        std::FILE* file = std::tmpfile();
+        REQUIRE(file != nullptr);
+
+        vm::vm_state state = vm::create_vm();
+        state.output = std::make_unique<vm::fd_sink>(fileno(file), 100);
+        auto [result, output] = vm::run(state, code);
+        CHECK_EQ(result, 0);
+        CHECK_EQ(output, "");
+
+        std::rewind(file);
+        std::string written(expected.size() + 1, '\0');
+        written.resize(std::fread(written.data(), 1, written.size(), file));
+        CHECK_EQ(written, expected);
+        std::fclose(file);
+    }
+    SUBCASE("flushed_on_error") {
+        // every tier passes the output of a failed run on
+        const vm::code_t failing = vm::assemble(vm::create_vm(), "LOAD_CONST 7\nWRITE\nLOAD_CONST 0\nDIV\nEXIT\n");
+        auto written_by = [&](const std::function<void(vm::vm_state&)>& run_failing) {
+            std::FILE* file = std::tmpfile();
+            REQUIRE(file != nullptr);
+
+            vm::vm_state state = vm::create_vm();
+            state.output = std::make_unique<vm::fd_sink>(fileno(file));
+            CHECK_THROWS_AS(run_failing(state), vm::div_by_zero);
+
+            std::rewind(file);
+            char written[8] = {};
+            std::string text(written, std::fread(written, 1, sizeof(written), file));
+            std::fclose(file);
+            return text;
+        };
+
+        CHECK_EQ(written_by([&](vm::vm_state& state) { vm::run(state, failing); }), "7");
+        for (auto execution_tier : {vm::tier::stack, vm::tier::top_cached, vm::tier::registers,
+                                    vm::tier::native, vm::tier::tracing}) {
+            CHECK_EQ(written_by([&](vm::vm_state& state) { vm::run(state, failing, execution_tier); }), "7");
+        }
+        CHECK_EQ(written_by([&](vm::vm_state& state) { vm::run_static<vm::builtin_set>(state, failing); }), "7");
+    }
+}
+
+
+TEST_CASE("vm_run_steps") {
+    // counts down from 3 and writes each number, 19 instructions in total
+    auto code = vm::assemble(vm::create_vm(),
+        "LOAD_CONST 3\n"
+        "DUP\n"
+        "JMPZ 7\n"
+        "WRITE\n"
+        "ADD_IMM -1\n"
+        "JMP 1\n"
+        "EXIT\n"
+        "EXIT\n");
+    const uint64_t total = 1 + 4 * 2 + 3 * 3 + 1;
+
+    SUBCASE("unlimited") {
+        vm::vm_state state = vm::create_vm();
+        auto result = vm::run_steps(state, code, {});
+        CHECK(result.status == vm::run_status::exited);
+        CHECK_EQ(result.value, 0);
+        CHECK_EQ(result.executed, total);
+        CHECK_EQ(state.output->view(), "321");
+    }
+    SUBCASE("resume") {
+        for (uint64_t fuel : {1, 2, 5, 18, 19}) {
+            vm::vm_state state = vm::create_vm();
+            uint64_t executed = 0;
+            size_t calls = 0;
+
+            vm::step_result result;
+            do {
+                result = vm::run_steps(state, code, {.fuel = fuel});
+                CHECK_LE(result.executed, fuel);
+                executed += result.executed;
+                calls++;
+            } while (result.status == vm::run_status::suspended);
+
+            CHECK_EQ(result.value, 0);
+            CHECK_EQ(executed, total);
+            CHECK_EQ(calls, (total + fuel - 1) / fuel);
+            CHECK_EQ(state.output->view(), "321");
+        }
+    }
+    SUBCASE("no_fuel") {
+        vm::vm_state state = vm::create_vm();
+        auto result = vm::run_steps(state, code, {.fuel = 0});
+        CHECK(result.status == vm::run_status::suspended);
+        CHECK_EQ(result.executed, 0);
+        CHECK_EQ(state.pc, 0);
+    }
+    SUBCASE("deadline") {
+        vm::vm_state state = vm::create_vm();
+        auto endless = vm::assemble(state, "LOAD_CONST 1\nJMP 0\n");
+
+        auto result = vm::run_steps(state, endless, {.deadline = vm::run_budget::clock::now()});
+        CHECK(result.status == vm::run_status::suspended);
+        CHECK_EQ(result.executed, 0);
+
+        result = vm::run_steps(state, endless, {
+            .deadline = vm::run_budget::clock::now() + std::chrono::milliseconds{5},
+        });
+        CHECK(result.status == vm::run_status::suspended);
+        CHECK_GT(result.executed, 0);
+        CHECK_EQ(state.stack.size(), result.executed / 2);
+    }
+    SUBCASE("interleaved") {
+        vm::vm_state first = vm::create_vm();
+        vm::vm_state second = vm::create_vm();
+        auto other = vm::assemble(first, "LOAD_CONST 7\nWRITE\nLOAD_CONST 8\nWRITE\nEXIT\n");
+
+        bool first_done = false, second_done = false;
+        while (not first_done or not second_done) {
+            if (not first_done) {
+                first_done = vm::run_steps(first, code, {.fuel = 3}).status == vm::run_status::exited;
+            }
+            if (not second_done) {
+                second_done = vm::run_steps(second, other, {.fuel = 3}).status == vm::run_status::exited;
+            }
+        }
+        CHECK_EQ(first.output->view(), "321");
+        CHECK_EQ(second.output->view(), "78");
+    }
+    SUBCASE("custom_jump") {
+        // GOTO jumps like JMP, but is a custom instruction
+        vm::vm_state state = vm::create_vm();
+        register_instruction(state, "GOTO", [](vm::vm_state& vmstate, const vm::item_t arg) {
+            vmstate.pc = static_cast<size_t>(arg);
+            return true;
+        });
+        auto loop = vm::assemble(state, "LOAD_CONST 1000\nADD_IMM -1\nDUP_JMPZ 4\nGOTO 1\nEXIT\n");
+
+        uint64_t executed = 0;
+        vm::step_result result;
+        do {
+            result = vm::run_steps(state, loop, {.fuel = 100});
+            CHECK_LE(result.executed, 100);
+            executed += result.executed;
+        } while (result.status == vm::run_status::suspended);
+        CHECK_EQ(result.value, 0);
+        CHECK_EQ(executed, 1 + 1000 * 2 + 999 + 1);
+    }
+    SUBCASE("errors_keep_the_state") {
+        vm::vm_state state = vm::create_vm();
+        auto divide = vm::assemble(state, "LOAD_CONST 1\nLOAD_CONST 0\nDIV\nEXIT\n");
+        CHECK(vm::run_steps(state, divide, {.fuel = 2}).status == vm::run_status::suspended);
+        CHECK_EQ(state.pc, 2);
+        CHECK_THROWS_AS(vm::run_steps(state, divide, {.fuel = 2}), vm::div_by_zero);
+    }
+    SUBCASE("stepped_program") {
+        // 200002 instructions, continued after each of them. if each call
+        // decoded the program again, this would take minutes.
+        std::string source = "LOAD_CONST 0\n";
+        for (int i = 0; i < 100000; i++) {
+            source += "LOAD_CONST 1\nADD\n";
+        }
+        source += "EXIT\n";
+        vm::vm_state state = vm::create_vm();
+        vm::stepped_program program{state, vm::assemble(state, source)};
+
+        uint64_t executed = 0;
+        uint64_t most = 0;
+        size_t calls = 0;
+        vm::step_result result;
+        do {
+            result = program.run(state, {.fuel = 1});
+            executed += result.executed;
+            most = std::max(most, result.executed);
+            calls++;
+        } while (result.status == vm::run_status::suspended);
+
+        CHECK_EQ(result.value, 100000);
+        CHECK_EQ(executed, 200002);
+        CHECK_EQ(calls, 200002);
+        CHECK_EQ(most, 1);
+    }
+    SUBCASE("stepped_program_custom") {
+        auto go_to = [](vm::vm_state& vmstate, const vm::item_t arg) {
+            vmstate.pc = static_cast<size_t>(arg);
+            return true;
+        };
+        vm::vm_state state = vm::create_vm();
+        register_instruction(state, "GOTO", go_to);
+        vm::stepped_program program{state, vm::assemble(state, "LOAD_CONST 1000\nADD_IMM -1\nDUP_JMPZ 4\nGOTO 1\nEXIT\n")};
+
+        // the custom jump leaves what the analysis covers for the rest of the run
+        uint64_t executed = 0;
+        vm::step_result result;
+        do {
+            result = program.run(state, {.fuel = 100});
+            CHECK_LE(result.executed, 100);
+            executed += result.executed;
+        } while (result.status == vm::run_status::suspended);
+        CHECK_EQ(result.value, 0);
+        CHECK_EQ(executed, 1 + 1000 * 2 + 999 + 1);
+
+        // another instruction set, with the same op ids
+        vm::vm_state other = vm::create_vm();
+        register_instruction(other, "GOTO", go_to);
+        result = program.run(other, {});
+        CHECK(result.status == vm::run_status::exited);
+        CHECK_EQ(result.executed, executed);
+    }
+}
+
+
+TEST_CASE("vm_registers") {
+    SUBCASE("equivalence") {
+        const char* programs[] = {
+            "LOAD_CONST 3\nLOAD_CONST 4\nADD\nLOAD_CONST 2\nDIV\nEXIT\n",
+            "LOAD_CONST -7\nLOAD_CONST 2\nDIV\nEXIT\n",
+            "LOAD_CONST 7\nLOAD_CONST 7\nEQ\nLOAD_CONST 1\nNEQ\nEXIT\n",
+            "LOAD_CONST 9\nDUP\nADD\nPOP\nLOAD_CONST 3000000000\nLOAD_CONST 3000000000\nADD\nEXIT\n",
+            "LOAD_CONST 72\nWRITE_CHAR\nPOP\nLOAD_CONST 105\nWRITE_CHAR\nPOP\nLOAD_CONST -42\nWRITE\nEXIT\n",
+            "LOAD_CONST 10\nDUP\nJMPZ 8\nWRITE\nLOAD_CONST -1\nADD\nJMP 1\nLOAD_CONST 99\nEXIT\n",
+            "LOAD_CONST 0\nDUP\nLOAD_CONST 5\nNEQ\nJMPZ 8\nLOAD_CONST 1\nADD\nJMP 1\nEXIT\n",
+            "LOAD_CONST 5\nPRINT\nLOAD_CONST 6\nEXIT\n",
+            "LOAD_CONST 0\nDUP\nLOAD_CONST 1\nADD\nDUP\nLOAD_CONST 1000\nEQ\nJMPZ 1\nEXIT\n",
+            // copies of items that are overwritten later
+            "LOAD_CONST 5\nDUP\nDUP\nADD\nADD\nDUP\nWRITE\nPOP\nLOAD_CONST 3\nDIV\nEXIT\n",
+            "LOAD_CONST 2\nLOAD_CONST 3\nDUP\nJMPZ 6\nADD\nEXIT\nEXIT\n",
+            // failures
+            "LOAD_CONST 1\nLOAD_CONST 0\nDIV\nEXIT\n",
+            "LOAD_CONST 0\nDIV\nEXIT\n",
+            "LOAD_CONST 1\nADD\nEXIT\n",
+            "LOAD_CONST 1\nEQ\nJMPZ 0\nEXIT\n",
+            "DUP\nJMPZ 0\nEXIT\n",
+            "POP\nEXIT\n",
+            "EXIT\n",
+            "LOAD_CONST 3\nJMP -2\nEXIT\n",
+            "LOAD_CONST 1\nLOAD_CONST 2\n",
+        };
+
+        for (const char* program : programs) {
+            vm::vm_state state = vm::create_vm();
+            auto code = vm::assemble(state, program);
+            auto optimized = vm::optimize(state, code);
+
+            CHECK_EQ(run_outcome(code, vm::tier::registers), run_outcome(code));
+            CHECK_EQ(run_outcome(optimized, vm::tier::registers), run_outcome(code));
+        }
+    }
+    SUBCASE("translation") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state,
+                                 "LOAD_CONST 10\n"
+                                 "DUP\n"
+                                 "JMPZ 8\n"
+                                 "WRITE\n"
+                                 "LOAD_CONST -1\n"
+                                 "ADD\n"
+                                 "JMP 1\n"
+                                 "EXIT\n"
+                                 "LOAD_CONST 99\n"
+                                 "EXIT\n");
+        vm::register_program program{state, code};
+
+        CHECK(program.is_translated());
+        // the constants become operands
+        CHECK_LT(program.size(), code.size());
+
+        auto [result, output] = program.run(state);
+        CHECK_EQ(result, 99);
+        CHECK_EQ(output, "10987654321");
+        CHECK_EQ(state.stack.size(), 2);
+        CHECK_EQ(state.pc, 10);
+    }
+    SUBCASE("stack_after_failure") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state, "LOAD_CONST 4\nLOAD_CONST 8\nLOAD_CONST 0\nDIV\nEXIT\n");
+        vm::register_program program{state, code};
+
+        vm::vm_state interpreted = vm::create_vm();
+        CHECK_THROWS_AS(vm::run(interpreted, code), vm::div_by_zero);
+
+        CHECK_THROWS_AS(program.run(state), vm::div_by_zero);
+        CHECK_EQ(state.stack.size(), interpreted.stack.size());
+        CHECK_EQ(state.stack.top(), interpreted.stack.top());
+        CHECK_EQ(state.pc, interpreted.pc);
+    }
+    SUBCASE("items_from_before") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state, "LOAD_CONST 2\nADD\nDUP\nWRITE\nPOP\nEXIT\n");
+        vm::register_program program{state, code};
+
+        state.stack.push(40);
+        auto [result, output] = program.run(state);
+        CHECK_EQ(result, 42);
+        CHECK_EQ(output, "42");
+
+        // too few items, which the interpreter reports
+        state.reset();
+        CHECK_THROWS_AS(program.run(state), vm::vm_stackfail);
+    }
+    SUBCASE("custom_instructions") {
+        vm::vm_state state = vm::create_vm();
+        register_instruction(state, "STOP", [](vm::vm_state&, const vm::item_t) {
+            return false;
+        });
+        auto code = vm::assemble(state, "LOAD_CONST 1\nWRITE\nSTOP\n");
+        vm::register_program program{state, code};
+
+        CHECK_FALSE(program.is_translated());
+        auto [result, output] = program.run(state);
+        CHECK_EQ(result, 1);
+        CHECK_EQ(output, "1");
+    }
+}
+
+
+namespace {
+
+/** squares the top item, as an instruction that is only known to the static set */
+struct square {
+    static constexpr std::string_view name = "SQUARE";
+
+    static bool execute(vm::vm_state& vmstate, const vm::item_t) {
+        vm::item_t tos = vm::handlers::pop(vmstate);
+        vmstate.stack.push(tos * tos);
+        return true;
+    }
+};
+
+using square_set = vm::static_instruction_set<vm::handlers::load_const, square,
+                                              vm::handlers::add, vm::handlers::exit>;
+
+} // namespace
+
+
+TEST_CASE("vm_static_set") {
+    SUBCASE("ids") {
+        static_assert(square_set::id_of("LOAD_CONST") == 0);
+        static_assert(square_set::id_of("SQUARE") == 1);
+        static_assert(square_set::id_of("DIV") == square_set::size);
+        static_assert(vm::builtin_set::id_of("EXIT") == 2);
+
+        vm::vm_state state = vm::create_vm<square_set>();
+        CHECK_EQ(state.instructions->ids.at("SQUARE"), square_set::id_of("SQUARE"));
+        CHECK(state.instructions->opcodes[0] == vm::opcode::LOAD_CONST);
+        CHECK(state.instructions->opcodes[1] == vm::opcode::CUSTOM);
+    }
+    SUBCASE("builtin_equivalence") {
+        const char* programs[] = {
+            "LOAD_CONST 3\nLOAD_CONST 4\nADD\nLOAD_CONST 2\nDIV\nEXIT\n",
+            "LOAD_CONST 10\nDUP\nJMPZ 8\nWRITE\nLOAD_CONST -1\nADD\nJMP 1\nLOAD_CONST 99\nEXIT\n",
+            "LOAD_CONST 72\nWRITE_CHAR\nPOP\nLOAD_CONST 105\nWRITE_CHAR\nPOP\nLOAD_CONST -42\nWRITE\nEXIT\n",
+            "LOAD_CONST 1\nLOAD_CONST 0\nDIV\nEXIT\n",
+            "POP\nEXIT\n",
+            "PRINT\nLOAD_CONST 1\nEXIT\n",
+            "LOAD_CONST 1\nLOAD_CONST 2\n",
+        };
+
+        for (const char* program : programs) {
+            vm::vm_state state = vm::create_vm<vm::builtin_set>();
+            auto code = vm::optimize(state, vm::assemble(state, program));
+
+            std::string expected = run_outcome(code);
+            std::string outcome;
+            try {
+                const auto& [topstack, output_string] = vm::run_static<vm::builtin_set>(state, code);
+                outcome = std::to_string(topstack) + "|" + output_string;
+            }
+            catch (vm::div_by_zero&) {
+                outcome = "div_by_zero";
+            }
+            catch (vm::vm_segfault&) {
+                outcome = "vm_segfault";
+            }
+            catch (vm::vm_stackfail&) {
+                outcome = "vm_stackfail";
+            }
+            CHECK_EQ(outcome, expected);
+        }
+
+        // debugging runs the same handlers
+        vm::vm_state debugged = vm::create_vm(true);
+        CHECK_THROWS_AS(vm::run(debugged, vm::assemble(debugged, "PRINT\nLOAD_CONST 1\nEXIT\n")), vm::vm_stackfail);
+    }
+    SUBCASE("custom_handler") {
+        vm::vm_state state = vm::create_vm<square_set>();
+        auto code = vm::assemble(state, "LOAD_CONST 7\nSQUARE\nLOAD_CONST 1\nADD\nEXIT\n");
+
+        auto [result, output] = vm::run_static<square_set>(state, code);
+        CHECK_EQ(result, 50);
+
+        // the interpreter runs the same instructions through their actions
+        state.reset();
+        CHECK_EQ(std::get<0>(vm::run(state, code)), 50);
+    }
+    SUBCASE("runtime_extension") {
+        vm::vm_state state = vm::create_vm<square_set>();
+        register_instruction(state, "NEGATE", [](vm::vm_state& vmstate, const vm::item_t) {
+            vmstate.stack.push(-vmstate.pop_top());
+            return true;
+        });
+        auto code = vm::assemble(state, "LOAD_CONST 3\nSQUARE\nNEGATE\nEXIT\n");
+
+        auto [result, output] = vm::run_static<square_set>(state, code);
+        CHECK_EQ(result, -9);
+
+        // ids nothing knows about
+        state.reset();
+        vm::code_t unknown{{7, 0}};
+        CHECK_THROWS_AS(vm::run_static<square_set>(state, unknown), vm::invalid_instruction);
+    }
+    SUBCASE("other_vm") {
+        // the op ids of the builtin vm mean something else, so it is interpreted
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state, "LOAD_CONST 5\nLOAD_CONST 6\nADD\nEXIT\n");
+
+        auto [result, output] = vm::run_static<square_set>(state, code);
+        CHECK_EQ(result, 11);
+    }
+}
+
+
+TEST_CASE("vm_snapshot") {
+    // counts down, then continues at pc 7 with an item pushed by the test
+    const char* program =
+        "LOAD_CONST 5\nDUP\nJMPZ 6\nLOAD_CONST -1\nADD\nJMP 1\nEXIT\nADD\nWRITE\nEXIT\n";
+
+    SUBCASE("restore") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state, program);
+        state.output->write("warm ");
+        run(state, code);
+
+        vm::vm_snapshot warm{state};
+        CHECK_EQ(warm.pc(), 7);
+        CHECK_EQ(warm.stack().size(), 1);
+        CHECK_EQ(warm.output(), "warm ");
+
+        for (vm::item_t variant : {3, 8}) {
+            warm.restore(state);
+            state.stack.push(variant);
+            auto [result, output] = run(state, code);
+            CHECK_EQ(result, variant);
+            CHECK_EQ(output, "warm " + std::to_string(variant));
+        }
+    }
+    SUBCASE("fork") {
+        vm::vm_state state = vm::create_vm();
+        register_instruction(state, "TRIPLE", [](vm::vm_state& vmstate, const vm::item_t) {
+            vmstate.stack.push(3 * vmstate.pop_top());
+            return true;
+        });
+        auto code = vm::assemble(state, "LOAD_CONST 4\nLOAD_CONST 2\nEXIT\nTRIPLE\nADD\nEXIT\n");
+        run(state, code);
+
+        vm::vm_snapshot warm{state};
+        vm::vm_state first = warm.fork();
+        vm::vm_state second = warm.fork();
+
+        // the forks have their own stacks, and the custom instructions
+        CHECK(first.instructions == state.instructions);
+        first.stack.push(1);
+        CHECK_EQ(std::get<0>(run(first, code)), 5);
+        CHECK_EQ(std::get<0>(run(second, code)), 10);
+
+        // a copied snapshot still has the state it captured
+        vm::vm_snapshot copy = warm;
+        CHECK_EQ(copy.stack().size(), 2);
+        CHECK_EQ(copy.stack()[1], 2);
+    }
+    SUBCASE("empty") {
+        vm::vm_state state = vm::create_vm();
+        vm::vm_snapshot fresh{state};
+        state.stack.push(1);
+        state.pc = 3;
+
+        fresh.restore(state);
+        CHECK_EQ(state.stack.size(), 0);
+        CHECK_EQ(state.pc, 0);
+        CHECK_EQ(state.output->view(), "");
+    }
+}
+
+
+TEST_CASE("vm_tracing") {
+    // long enough for the loops to get hot
+    const char* countdown = "LOAD_CONST 1000\nDUP\nJMPZ 8\nWRITE\nLOAD_CONST -1\nADD\nJMP 1\nLOAD_CONST 99\nEXIT\n";
+    const char* nested =
+        "LOAD_CONST 0\nLOAD_CONST 50\nDUP\nJMPZ 17\nLOAD_CONST 100\nDUP\nJMPZ 13\n"
+        "LOAD_CONST -1\nADD\nLOAD_CONST 46\nWRITE_CHAR\nPOP\nJMP 5\n"
+        "POP\nLOAD_CONST -1\nADD\nJMP 2\nPOP\nWRITE\nEXIT\n";
+    // writes a or b depending on the parity, so the guard fails every other iteration
+    const char* parity =
+        "LOAD_CONST 0\nDUP\nDUP\nLOAD_CONST 2\nDIV\nDUP\nADD\nEQ\nJMPZ 13\n"
+        "LOAD_CONST 97\nWRITE_CHAR\nPOP\nJMP 16\nLOAD_CONST 98\nWRITE_CHAR\nPOP\n"
+        "LOAD_CONST 1\nADD\nDUP\nLOAD_CONST 1000\nNEQ\nJMPZ 23\nJMP 1\nEXIT\n";
+    // divides by i - 50 while counting down from 200
+    const char* divides =
+        "LOAD_CONST 200\nDUP\nDUP\nLOAD_CONST -50\nADD\nDIV\nWRITE\nPOP\nLOAD_CONST -1\nADD\nJMP 1\n";
+
+    SUBCASE("equivalence") {
+        // adds up the items until the stack underflows
+        std::string shrinks;
+        for (int i = 0; i < 100; i++) {
+            shrinks += "LOAD_CONST 1\n";
+        }
+        shrinks += "ADD\nJMP 100\n";
+
+        const char* programs[] = {
+            countdown,
+            nested,
+            parity,
+            divides,
+            // grows the stack beyond its initial capacity
+            "LOAD_CONST 0\nDUP\nLOAD_CONST 1\nADD\nDUP\nLOAD_CONST 1000\nEQ\nJMPZ 1\nEXIT\n",
+            shrinks.c_str(),
+            "LOAD_CONST 3\nLOAD_CONST 4\nADD\nEXIT\n",
+            "POP\nEXIT\n",
+            // loops that aren't traced, the second one is left by RET
+            "LOAD_CONST 1\nMEMGROW\nPOP\nLOAD_CONST 300\n"
+            "loop: DUP\nJMPZ done\nDUP\nDUP\nSTORE\nLOAD_CONST -1\nADD\nJMP loop\n"
+            "done: LOAD_CONST 0\nLOAD_CONST 301\nMEMSUM\nEXIT\n",
+            "LOAD_CONST 200\nloop: DUP\nJMPZ done\nCALL dec\nJMP loop\ndone: EXIT\n"
+            "dec: LOAD_CONST -1\nADD\nRET\n",
+        };
+
+        for (const char* program : programs) {
+            vm::vm_state state = vm::create_vm();
+            auto code = vm::assemble(state, program);
+            auto optimized = vm::optimize(state, code);
+
+            CHECK_EQ(run_outcome(code, vm::tier::tracing), run_outcome(code));
+            CHECK_EQ(run_outcome(optimized, vm::tier::tracing), run_outcome(code));
+        }
+    }
+    SUBCASE("traces") {
+        vm::vm_state state = vm::create_vm();
+        vm::tracing_program program{vm::optimize(state, vm::assemble(state, nested))};
+
+        auto [result, output] = program.run(state);
+        CHECK_EQ(result, 0);
+        CHECK_EQ(output, std::string(5000, '.') + "0");
+        // the inner loop, the outer one runs too few times to get hot
+        CHECK_EQ(program.trace_count(), 1);
+
+        // the traces and counts are kept for the next run, in which the outer
+        // loop gets hot. its trace runs through all iterations of the inner loop.
+        state.reset();
+        auto [again, again_output] = program.run(state);
+        CHECK_EQ(again_output, output);
+        CHECK_EQ(program.trace_count(), 2);
+    }
+    SUBCASE("stack_after_failure") {
+        vm::vm_state interpreted = vm::create_vm();
+        auto code = vm::assemble(interpreted, divides);
+        CHECK_THROWS_AS(vm::run(interpreted, code), vm::div_by_zero);
+
+        vm::vm_state state = vm::create_vm();
+        vm::tracing_program program{code};
+        CHECK_THROWS_AS(program.run(state), vm::div_by_zero);
+        CHECK_EQ(state.stack.size(), interpreted.stack.size());
+        CHECK_EQ(state.stack.top(), interpreted.stack.top());
+        CHECK_EQ(state.pc, interpreted.pc);
+        CHECK_EQ(state.output->view(), interpreted.output->view());
+    }
+    SUBCASE("custom_instructions") {
+        vm::vm_state state = vm::create_vm();
+        register_instruction(state, "DEC", [](vm::vm_state& vmstate, const vm::item_t) {
+            vmstate.stack.push(vmstate.pop_top() - 1);
+            return true;
+        });
+        vm::tracing_program program{vm::assemble(state, "LOAD_CONST 500\nDUP\nJMPZ 5\nDEC\nJMP 1\nEXIT\n")};
+
+        auto [result, output] = program.run(state);
+        CHECK_EQ(result, 0);
+        CHECK_EQ(program.trace_count(), 0);
+    }
+}
+
+
+TEST_CASE("vm_memory") {
+    // stores 0..99 at 0..99, copies them to 200..299 and sums them up
+    const char* array_program =
+        "LOAD_CONST 1\nMEMGROW\nPOP\n"
+        "LOAD_CONST 0\n"
+        "DUP\nDUP\nSTORE\nLOAD_CONST 1\nADD\nDUP\nLOAD_CONST 100\nEQ\nJMPZ 4\n"
+        "POP\n"
+        "LOAD_CONST 200\nLOAD_CONST 0\nLOAD_CONST 100\nMEMCPY\n"
+        "LOAD_CONST 200\nLOAD_CONST 100\nMEMSUM\n"
+        "EXIT\n";
+
+    SUBCASE("load_store") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state,
+                                 "LOAD_CONST 2\nMEMGROW\nWRITE\nPOP\n"
+                                 "LOAD_CONST 42\nLOAD_CONST 1000\nSTORE\n"
+                                 "LOAD_CONST 1000\nLOAD\nLOAD_CONST 1001\nLOAD\nADD\n"
+                                 "EXIT\n");
+        const auto& [topstack, output_string] = vm::run(state, code);
+        CHECK_EQ(topstack, 42);
+        CHECK_EQ(output_string, "0");
+        CHECK_EQ(state.memory.pages(), 2);
+        CHECK_EQ(state.memory.size(), 2 * vm::linear_memory<vm::item_t>::page_size);
+        CHECK_EQ(state.memory.load(1000), 42);
+    }
+    SUBCASE("bulk") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state, array_program);
+        CHECK_EQ(std::get<0>(vm::run(state, code)), 4950);
+        CHECK_EQ(state.memory.load(299), 99);
+
+        // overlapping copies move the items like memmove
+        state.memory.copy(1, 0, 10);
+        CHECK_EQ(state.memory.load(1), 0);
+        CHECK_EQ(state.memory.load(10), 9);
+        state.memory.fill(0, 7, 10);
+        CHECK_EQ(state.memory.sum(0, 10), 70);
+        CHECK_EQ(state.memory.sum(0, 0), 0);
+        CHECK_EQ(state.memory.sum(5, 3), 21);
+
+        code = vm::assemble(state, "LOAD_CONST 3\nLOAD_CONST -1\nLOAD_CONST 4\nMEMSET\n"
+                                   "LOAD_CONST 2\nLOAD_CONST 3\nMEMSUM\nEXIT\n");
+        state.reset();
+        state.memory.grow(1);
+        CHECK_EQ(std::get<0>(vm::run(state, code)), -2);
+    }
+    SUBCASE("bounds") {
+        auto outcome = [](const char* program) {
+            vm::vm_state state = vm::create_vm();
+            return run_outcome(vm::assemble(state, program));
+        };
+        const std::string grown = "LOAD_CONST 1\nMEMGROW\nPOP\n";
+
+        CHECK_EQ(outcome("LOAD_CONST 0\nLOAD\nEXIT\n"), "vm_segfault");
+        CHECK_EQ(outcome((grown + "LOAD_CONST 512\nLOAD\nEXIT\n").c_str()), "vm_segfault");
+        CHECK_EQ(outcome((grown + "LOAD_CONST 511\nLOAD\nEXIT\n").c_str()), "0|");
+        CHECK_EQ(outcome((grown + "LOAD_CONST 1\nLOAD_CONST -1\nSTORE\nEXIT\n").c_str()), "vm_segfault");
+        CHECK_EQ(outcome((grown + "LOAD_CONST 0\nLOAD_CONST 1\nLOAD_CONST 512\nMEMCPY\nEXIT\n").c_str()), "vm_segfault");
+        CHECK_EQ(outcome((grown + "LOAD_CONST 0\nLOAD_CONST 1\nLOAD_CONST -1\nMEMSET\nEXIT\n").c_str()), "vm_segfault");
+        CHECK_EQ(outcome((grown + "LOAD_CONST 9223372036854775807\nLOAD_CONST 2\nMEMSUM\nEXIT\n").c_str()), "vm_segfault");
+        CHECK_EQ(outcome((grown + "LOAD_CONST 512\nLOAD_CONST 0\nMEMSUM\nEXIT\n").c_str()), "0|");
+        CHECK_EQ(outcome("LOAD_CONST 1\nSTORE\nEXIT\n"), "vm_stackfail");
+
+        // the operands are popped when the access fails
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state, "LOAD_CONST 5\nLOAD_CONST 1\nLOAD_CONST 2\nSTORE\nEXIT\n");
+        CHECK_THROWS_AS(vm::run(state, code), vm::vm_segfault);
+        CHECK_EQ(state.stack.size(), 1);
+        CHECK_EQ(state.pc, 4);
+    }
+    SUBCASE("grow") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state, "LOAD_CONST 3\nMEMGROW\nPOP\nLOAD_CONST 65534\nMEMGROW\nEXIT\n");
+        CHECK_EQ(std::get<0>(vm::run(state, code)), -1);
+        CHECK_EQ(state.memory.pages(), 3);
+        CHECK_EQ(state.memory.grow(-1), -1);
+        CHECK_EQ(state.memory.grow(0), 3);
+
+        // another program starts without memory
+        state.reset();
+        CHECK_EQ(state.memory.pages(), 0);
+    }
+    SUBCASE("tiers") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state, array_program);
+        CHECK_EQ(run_outcome(code), "4950|");
+        CHECK_EQ(run_outcome(vm::optimize(state, code)), "4950|");
+        for (auto execution_tier : {vm::tier::registers, vm::tier::native, vm::tier::tracing}) {
+            CHECK_EQ(run_outcome(code, execution_tier), "4950|");
+        }
+
+        vm::vm_state fast = vm::create_vm<vm::builtin_set>();
+        CHECK_EQ(std::get<0>(vm::run_static<vm::builtin_set>(fast, code)), 4950);
+    }
+    SUBCASE("pages") {
+        // the bulk operations across pages, against the same ones on a vector
+        using memory_t = vm::linear_memory<vm::item_t>;
+        memory_t memory;
+        memory.grow(4);
+        std::vector<vm::item_t> expected(memory.size());
+        for (size_t i = 0; i < expected.size(); i++) {
+            memory.store(static_cast<int64_t>(i), static_cast<vm::item_t>(i));
+            expected[i] = static_cast<vm::item_t>(i);
+        }
+        auto same = [&] {
+            for (size_t i = 0; i < expected.size(); i++) {
+                if (memory.load(static_cast<int64_t>(i)) != expected[i]) {
+                    return false;
+                }
+            }
+            return true;
+        };
+
+        for (auto [target, source, count] : {std::array<int64_t, 3>{10, 500, 1100},
+                                             {500, 10, 1100},
+                                             {511, 512, 513},
+                                             {1023, 1000, 1000},
+                                             {0, 2047, 1}}) {
+            memory.copy(target, source, count);
+            std::memmove(expected.data() + target, expected.data() + source,
+                         static_cast<size_t>(count) * sizeof(vm::item_t));
+            CHECK(same());
+        }
+        memory.fill(300, -2, 1000);
+        std::fill_n(expected.begin() + 300, 1000, -2);
+        CHECK(same());
+        CHECK_EQ(memory.sum(100, 1900), std::accumulate(expected.begin() + 100, expected.begin() + 2000, vm::item_t{0}));
+
+        // copies share the pages until they write to them
+        memory_t copy = memory;
+        copy.store(600, 1);
+        copy.grow(100);
+        copy.fill(0, 3, 100);
+        CHECK(same());
+        CHECK_EQ(copy.load(600), 1);
+        CHECK_EQ(copy.load(50), 3);
+        CHECK_EQ(copy.load(1000), expected[1000]);
+        CHECK_EQ(copy.sum(2048, 51200), 0);
+        CHECK_EQ(memory.pages(), 4);
+        CHECK_EQ(copy.pages(), 104);
+    }
+    SUBCASE("snapshot") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state, "LOAD_CONST 1\nMEMGROW\nLOAD_CONST 7\nLOAD_CONST 3\nSTORE\nEXIT\n"
+                                        "LOAD_CONST 3\nLOAD\nEXIT\n");
+        vm::run(state, code);
+        vm::vm_snapshot warm{state};
+        CHECK_EQ(warm.memory().size(), vm::linear_memory<vm::item_t>::page_size);
+
+        vm::vm_state fork = warm.fork();
+        state.memory.store(3, 8);
+        CHECK_EQ(std::get<0>(vm::run(fork, code)), 7);
+        CHECK_EQ(std::get<0>(vm::run(state, code)), 8);
+    }
+    SUBCASE("native") {
+        // the native code accesses the pages itself, and fails like the interpreter
+        const std::string grown = "LOAD_CONST 2\nMEMGROW\nPOP\n";
+        for (const std::string& program : {grown + "LOAD_CONST 1024\nLOAD\nEXIT\n",
+                                           grown + "LOAD_CONST -1\nLOAD\nEXIT\n",
+                                           grown + "LOAD_CONST 5\nLOAD_CONST 1023\nSTORE\nLOAD_CONST 1023\nLOAD\nEXIT\n",
+                                           grown + "LOAD_CONST 5\nLOAD_CONST 1024\nSTORE\nEXIT\n",
+                                           grown + "LOAD_CONST 600\nLOAD_CONST 3\nLOAD_CONST 100\nMEMSET\n"
+                                                   "LOAD_CONST 500\nLOAD_CONST 600\nLOAD_CONST 50\nMEMCPY\n"
+                                                   "LOAD_CONST 0\nLOAD_CONST 1024\nMEMSUM\nEXIT\n",
+                                           grown + "LOAD_CONST 1000\nLOAD_CONST 100\nMEMSUM\nEXIT\n"}) {
+            auto code = vm::assemble(vm::create_vm(), program);
+            CHECK_EQ(run_outcome(code, vm::tier::native), run_outcome(code));
+        }
+
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state, "LOAD_CONST 5\nLOAD_CONST 1\nLOAD_CONST 2\nSTORE\nEXIT\n");
+        CHECK_THROWS_AS(vm::run(state, code, vm::tier::native), vm::vm_segfault);
+        CHECK_EQ(state.stack.size(), 1);
+        CHECK_EQ(state.pc, 4);
+
+        // stores to pages shared with a snapshot copy them first
+        state.reset();
+        code = vm::assemble(state, "LOAD_CONST 9\nLOAD_CONST 3\nSTORE\nLOAD_CONST 1\nLOAD_CONST 700\nSTORE\n"
+                                   "LOAD_CONST 3\nLOAD\nLOAD_CONST 700\nLOAD\nADD\nEXIT\n");
+        state.memory.grow(2);
+        state.memory.store(3, 4);
+        vm::vm_snapshot warm{state};
+        CHECK_EQ(std::get<0>(vm::run(state, code, vm::tier::native)), 10);
+        CHECK_EQ(warm.memory().load(3), 4);
+        CHECK_EQ(warm.memory().load(700), 0);
+    }
+}
+
+
+TEST_CASE("vm_code_cache") {
+    const std::string program = "LOAD_CONST 3\nLOAD_CONST 4\nADD\nEXIT\n";
+
+    SUBCASE("hits") {
+        vm::vm_state state = vm::create_vm();
+        vm::code_cache cache{8};
+
+        auto first = cache.get(state, program);
+        auto second = cache.get(state, program);
+        CHECK(first == second);
+        CHECK_EQ(cache.hits(), 1);
+        CHECK_EQ(cache.misses(), 1);
+        CHECK_EQ(cache.size(), 1);
+        CHECK_EQ(std::get<0>(vm::run(state, *first)), 7);
+
+        // vms with the same instruction set share the code
+        vm::vm_state other = vm::create_vm();
+        CHECK(cache.get(other, program) == first);
+        CHECK_EQ(cache.hits(), 2);
+    }
+    SUBCASE("instruction_sets") {
+        vm::vm_state state = vm::create_vm();
+        vm::vm_state custom = vm::create_vm();
+        register_instruction(custom, "NOP", [](vm::vm_state&, const vm::item_t) { return true; });
+        vm::code_cache cache{8, 1};
+
+        auto plain = cache.get(state, program);
+        auto extended = cache.get(custom, program);
+        CHECK(plain != extended);
+        CHECK_EQ(cache.misses(), 2);
+
+        CHECK_EQ(std::get<0>(vm::run(custom, *cache.get(custom, "NOP\nLOAD_CONST 1\nEXIT\n"))), 1);
+        CHECK_THROWS_AS(cache.get(state, "NOP\nLOAD_CONST 1\nEXIT\n"), vm::invalid_instruction);
+        // failed assemblies aren't cached
+        CHECK_THROWS_AS(cache.get(state, "NOP\nLOAD_CONST 1\nEXIT\n"), vm::invalid_instruction);
+        CHECK_EQ(cache.size(), 3);
+    }
+    SUBCASE("eviction") {
+        vm::vm_state state = vm::create_vm();
+        vm::code_cache cache{2, 1};
+        CHECK_EQ(cache.capacity(), 2);
+
+        auto one = cache.get(state, "LOAD_CONST 1\nEXIT\n");
+        cache.get(state, "LOAD_CONST 2\nEXIT\n");
+        // using the first makes the second the oldest one
+        cache.get(state, "LOAD_CONST 1\nEXIT\n");
+        cache.get(state, "LOAD_CONST 3\nEXIT\n");
+        CHECK_EQ(cache.size(), 2);
+        CHECK_EQ(cache.misses(), 3);
+
+        CHECK(cache.get(state, "LOAD_CONST 1\nEXIT\n") == one);
+        cache.get(state, "LOAD_CONST 2\nEXIT\n");
+        CHECK_EQ(cache.misses(), 4);
+
+        // dropped code stays usable
+        cache.clear();
+        CHECK_EQ(cache.size(), 0);
+        CHECK_EQ(std::get<0>(vm::run(state, *one)), 1);
+    }
+    SUBCASE("capacity") {
+        // the shares of the shards add up to the requested capacity
+        vm::vm_state state = vm::create_vm();
+        for (size_t capacity : {1, 5, 16, 17, 100}) {
+            vm::code_cache cache{capacity};
+            CHECK_EQ(cache.capacity(), capacity);
+            for (int i = 0; i < 200; i++) {
+                cache.get(state, "LOAD_CONST " + std::to_string(i) + "\nEXIT\n");
+            }
+            CHECK(cache.size() <= capacity);
+        }
+        CHECK_EQ(vm::code_cache{0}.capacity(), 1);
+        CHECK_EQ((vm::code_cache{7, 3}.capacity()), 7);
+    }
+    SUBCASE("threads") {
+        vm::code_cache cache{256, 4};
+        std::vector<std::thread> threads;
+        std::atomic<int> wrong{0};
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([&] {
+                vm::vm_state state = vm::create_vm();
+                for (int i = 0; i < 1000; i++) {
+                    const vm::item_t value = i % 32;
+                    auto code = cache.get(state, "LOAD_CONST " + std::to_string(value) + "\nEXIT\n");
+                    state.reset();
+                    if (std::get<0>(vm::run(state, *code)) != value) {
+                        wrong += 1;
+                    }
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        CHECK_EQ(wrong.load(), 0);
+        CHECK_EQ(cache.hits() + cache.misses(), 4000);
+        CHECK_EQ(cache.size(), 32);
+        CHECK(cache.misses() >= 32);
+    }
+}
+
+
+TEST_CASE("vm_top_cached") {
+    // run with both loops, and compare the outcome and the state they leave
+    auto compare = [](const char* program, std::vector<vm::item_t> input = {}) {
+        vm::vm_state plain = vm::create_vm();
+        vm::vm_state cached = vm::create_vm();
+        auto code = vm::optimize(plain, vm::assemble(plain, program));
+        for (vm::item_t item : input) {
+            plain.stack.push(item);
+            cached.stack.push(item);
+        }
+
+        std::string plain_outcome = run_outcome(code);
+        std::string cached_outcome = run_outcome(code, vm::tier::top_cached);
+        CHECK_EQ(cached_outcome, plain_outcome);
+
+        for (vm::vm_state* state : {&plain, &cached}) {
+            try {
+                vm::run(*state, code, state == &plain ? vm::tier::stack : vm::tier::top_cached);
+            }
+            catch (std::runtime_error&) {
+            }
+        }
+        CHECK_EQ(cached.pc, plain.pc);
+        REQUIRE_EQ(cached.stack.size(), plain.stack.size());
+        for (size_t i = 0; i < plain.stack.size(); i++) {
+            CHECK_EQ(cached.stack.data()[i], plain.stack.data()[i]);
+        }
+        CHECK_EQ(cached.output->view(), plain.output->view());
+    };
+
+    SUBCASE("equivalence") {
+        const char* programs[] = {
+            "LOAD_CONST 3\nLOAD_CONST 4\nADD\nLOAD_CONST 2\nDIV\nEXIT\n",
+            "LOAD_CONST 7\nLOAD_CONST 7\nEQ\nLOAD_CONST 1\nNEQ\nEXIT\n",
+            "LOAD_CONST 72\nWRITE_CHAR\nPOP\nLOAD_CONST -42\nWRITE\nEXIT\n",
+            "LOAD_CONST 10\nDUP\nJMPZ 8\nWRITE\nLOAD_CONST -1\nADD\nJMP 1\nLOAD_CONST 99\nEXIT\n",
+            "LOAD_CONST 0\nDUP\nLOAD_CONST 5\nNEQ\nJMPZ 8\nLOAD_CONST 1\nADD\nJMP 1\nEXIT\n",
+            // grows the stack beyond its initial capacity
+            "LOAD_CONST 0\nDUP\nLOAD_CONST 1\nADD\nDUP\nLOAD_CONST 1000\nEQ\nJMPZ 1\nEXIT\n",
+            "LOAD_CONST 1\nMEMGROW\nLOAD_CONST 7\nLOAD_CONST 3\nSTORE\nLOAD_CONST 3\nLOAD\n"
+            "LOAD_CONST 0\nLOAD_CONST 10\nMEMSUM\nADD\nEXIT\n",
+            // failures
+            "LOAD_CONST 1\nLOAD_CONST 0\nDIV\nEXIT\n",
+            "LOAD_CONST 4\nLOAD_CONST 1\nLOAD_CONST 0\nDIV\nEXIT\n",
+            "LOAD_CONST 1\nADD\nEXIT\n",
+            "DUP\nJMPZ 0\nEXIT\n",
+            "POP\nEXIT\n",
+            "EXIT\n",
+            "LOAD_CONST 3\nJMP -2\nEXIT\n",
+            "LOAD_CONST 5\nLOAD_CONST 1\nLOAD\nEXIT\n",
+            "LOAD_CONST 5\nLOAD_CONST 1\nLOAD_CONST 2\nSTORE\nEXIT\n",
+        };
+        for (const char* program : programs) {
+            compare(program);
+        }
+    }
+    SUBCASE("input") {
+        // items that were on the stack before the program started
+        compare("ADD\nLOAD_CONST 2\nDIV\nEXIT\n", {8, 6});
+        compare("ADD\nADD\nEXIT\n", {1, 2});
+        compare("JMP_EQ 0\nEXIT\n", {4, 4, 4, 5});
+    }
+    SUBCASE("custom_instructions") {
+        vm::vm_state state = vm::create_vm();
+        register_instruction(state, "SQUARE", [](vm::vm_state& vmstate, const vm::item_t) {
+            vm::item_t top = vmstate.pop_top();
+            vmstate.stack.push(top * top);
+            return true;
+        });
+        auto code = vm::assemble(state, "LOAD_CONST 2\nSQUARE\nDUP\nSQUARE\nADD\nWRITE\nEXIT\n");
+        auto [result, output] = vm::run(state, code, vm::tier::top_cached);
+        CHECK_EQ(result, 20);
+        CHECK_EQ(output, "20");
+        CHECK_EQ(state.stack.size(), 1);
+    }
+    SUBCASE("linked") {
+        // the code is decoded and linked by its first run only
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state, "LOAD_CONST 3\nLOAD_CONST 4\nADD\nEXIT\n");
+        CHECK(code.get_linked() == nullptr);
+        CHECK_EQ(std::get<0>(vm::run(state, code)), 7);
+        auto linked = code.get_linked();
+        REQUIRE(linked != nullptr);
+
+        vm::vm_state other = vm::create_vm();
+        CHECK_EQ(std::get<0>(vm::run(other, code)), 7);
+        CHECK(code.get_linked() == linked);
+
+        // copies share it, until they are modified
+        vm::code_t copy = code;
+        CHECK(copy.get_linked() == linked);
+        copy.emplace_back(state.instructions->ids.at("EXIT"), 0);
+        CHECK(copy.get_linked() == nullptr);
+        CHECK(code.get_linked() == linked);
+
+        // another instruction set resolves the custom actions anew
+        vm::vm_state custom = vm::create_vm();
+        register_instruction(custom, "SQUARE", [](vm::vm_state& vmstate, const vm::item_t) {
+            vm::item_t top = vmstate.pop_top();
+            vmstate.stack.push(top * top);
+            return true;
+        });
+        auto squared = vm::assemble(custom, "LOAD_CONST 3\nSQUARE\nEXIT\n");
+        CHECK_EQ(std::get<0>(vm::run(custom, squared)), 9);
+        vm::vm_state plain = vm::create_vm();
+        CHECK_THROWS_AS(vm::run(plain, squared), vm::invalid_instruction);
+        custom.pc = 0;
+        CHECK_EQ(std::get<0>(vm::run(custom, squared)), 9);
+    }
+}
+
+
+TEST_CASE("vm_typed") {
+    SUBCASE("int32") {
+        vm::basic_vm_state<int32_t> state = vm::create_vm<int32_t>();
+        auto code = vm::assemble(state, "LOAD_CONST 7\nLOAD_CONST -2\nDIV\nWRITE\nEXIT\n");
+        auto [result, output] = vm::run(state, code);
+        static_assert(std::is_same_v<decltype(result), int32_t>);
+        CHECK_EQ(result, -3);
+        CHECK_EQ(output, "-3");
+
+        // the arguments have to fit into the item type
+        CHECK_THROWS_AS(vm::assemble(state, "LOAD_CONST 3000000000\nEXIT\n"), vm::assembly_error);
+        CHECK_THROWS_AS(vm::assemble(state, "LOAD_CONST 1.5\nEXIT\n"), vm::assembly_error);
+    }
+    SUBCASE("double") {
+        vm::basic_vm_state<double> state = vm::create_vm<double>();
+        auto code = vm::assemble(state, "LOAD_CONST 7\nLOAD_CONST 2\nDIV\nWRITE\n"
+                                        "LOAD_CONST +0.25\nADD\nEXIT\n");
+        auto [result, output] = vm::run(state, code);
+        CHECK_EQ(result, 3.75);
+        CHECK_EQ(output, "3.5");
+
+        state.reset();
+        code = vm::assemble(state, "LOAD_CONST 1\nLOAD_CONST 0\nDIV\nEXIT\n");
+        CHECK_THROWS_AS(vm::run(state, code), vm::div_by_zero);
+
+        // inf and nan are numbers, not labels, words starting like them are labels
+        state.reset();
+        code = vm::assemble(state, "LOAD_CONST inf\nLOAD_CONST -inf\nADD\nJMP info\ninfo: EXIT\n");
+        CHECK_EQ(code[3].second, 4.0);
+        CHECK(std::isnan(std::get<0>(vm::run(state, code))));
+        state.reset();
+        CHECK(std::isinf(std::get<0>(vm::run(state, vm::assemble(state, "LOAD_CONST infinity\nEXIT\n")))));
+        CHECK_THROWS_AS(vm::assemble(state, "nan: EXIT\n"), vm::assembly_error);
+    }
+    SUBCASE("control_flow") {
+        // sum 1..10 in each item type
+        const char* program = "LOAD_CONST 0\nLOAD_CONST 10\n"
+                              "DUP\nJMPZ 10\nDUP\nLOAD_CONST -1\nADD\nJMP 2\n"
+                              "EXIT\nEXIT\n"
+                              "POP\nADD\nADD\nADD\nADD\nADD\nADD\nADD\nADD\nADD\nADD\nWRITE\nEXIT\n";
+        vm::basic_vm_state<int32_t> narrow = vm::create_vm<int32_t>();
+        vm::basic_vm_state<double> real = vm::create_vm<double>();
+        vm::vm_state wide = vm::create_vm();
+        CHECK_EQ(std::get<0>(vm::run(narrow, vm::assemble(narrow, program))), 55);
+        CHECK_EQ(std::get<0>(vm::run(real, vm::assemble(real, program))), 55.0);
+        CHECK_EQ(std::get<0>(vm::run(wide, vm::assemble(wide, program))), 55);
+    }
+    SUBCASE("memory") {
+        vm::basic_vm_state<int32_t> state = vm::create_vm<int32_t>();
+        auto code = vm::assemble(state, "LOAD_CONST 1\nMEMGROW\nPOP\n"
+                                        "LOAD_CONST 0\nLOAD_CONST 3\nLOAD_CONST 512\nMEMSET\n"
+                                        "LOAD_CONST 0\nLOAD_CONST 512\nMEMSUM\nEXIT\n");
+        auto [result, output] = vm::run(state, code);
+        CHECK_EQ(result, 1536);
+        CHECK_EQ(state.memory.size(), 512);
+        // the narrower items take half the memory
+        static_assert(sizeof(decltype(state.memory)::value_type) == 4);
+
+        // reset drops the pages
+        state.reset();
+        code = vm::assemble(state, "LOAD_CONST 0\nLOAD\nEXIT\n");
+        CHECK_THROWS_AS(vm::run(state, code), vm::vm_segfault);
+    }
+    SUBCASE("custom_instructions") {
+        vm::basic_vm_state<double> state = vm::create_vm<double>();
+        vm::register_instruction(state, "SQRT", [](vm::basic_vm_state<double>& vmstate, const double) {
+            double top = vmstate.pop_top();
+            vmstate.stack.push(std::sqrt(top));
+            return true;
+        });
+        auto code = vm::assemble(state, "LOAD_CONST 2.25\nSQRT\nWRITE\nEXIT\n");
+        auto [result, output] = vm::run(state, code);
+        CHECK_EQ(result, 1.5);
+        CHECK_EQ(output, "1.5");
+    }
+    SUBCASE("debug") {
+        vm::basic_vm_state<int32_t> state = vm::create_vm<int32_t>(true);
+        auto code = vm::assemble(state, "LOAD_CONST 4\nLOAD_CONST 5\nADD\nEXIT\n");
+        auto [result, output] = vm::run(state, code);
+        CHECK_EQ(result, 9);
+        state.reset();
+        CHECK_THROWS_AS(vm::run(state, vm::assemble(state, "POP\nEXIT\n")), vm::vm_stackfail);
+    }
+    SUBCASE("default_instantiation") {
+        // the int64 names are the same types as the templates
+        static_assert(std::is_same_v<vm::vm_state, vm::basic_vm_state<int64_t>>);
+        static_assert(std::is_same_v<vm::code_t, vm::basic_code<int64_t>>);
+        vm::vm_state state = vm::create_vm<int64_t>();
+        auto code = vm::assemble(state, "LOAD_CONST 4000000000\nLOAD_CONST 2\nDIV\nEXIT\n");
+        CHECK(code.get_analysis() != nullptr);
+        CHECK_EQ(std::get<0>(vm::run<int64_t>(state, code)), 2000000000);
+    }
+}
+
+
+TEST_CASE("vm_calls") {
+    // n + (n - 1) + ... + 0, recursively
+    const char* recursive_sum =
+        "LOAD_CONST 10\n"
+        "CALL sum\n"
+        "WRITE\n"
+        "EXIT\n"
+        "sum: DUP\n"
+        "JMPZ base\n"
+        "DUP\n"
+        "LOAD_CONST -1\n"
+        "ADD\n"
+        "CALL sum\n"
+        "ADD\n"
+        "RET\n"
+        "base:\n"
+        "RET\n";
+    // counts down to zero in a subroutine that calls itself for the rest
+    auto tail_countdown = [](int count, const char* call) {
+        return "LOAD_CONST " + std::to_string(count) + "\n" +
+               "CALL loop\nWRITE\nEXIT\n"
+               "loop: DUP\nJMPZ done\nLOAD_CONST -1\nADD\n" +
+               std::string{call} + " loop\nRET\n"
+               "done: LOAD_CONST 1\nADD\nRET\n";
+    };
+
+    SUBCASE("labels") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state, "start: LOAD_CONST 2\n"
+                                        "JMP forward\n"
+                                        "back:\n"
+                                        "\n"
+                                        "WRITE\n"
+                                        "EXIT\n"
+                                        "forward: LOAD_CONST 3\n"
+                                        "ADD\n"
+                                        "JMP back\n");
+        REQUIRE_EQ(code.size(), 7);
+        CHECK_EQ(code[1].second, 4);
+        CHECK_EQ(code[6].second, 2);
+        auto [result, output] = vm::run(state, code);
+        CHECK_EQ(result, 5);
+        CHECK_EQ(output, "5");
+    }
+    SUBCASE("label_errors") {
+        vm::vm_state state = vm::create_vm();
+        try {
+            vm::assemble(state, "LOAD_CONST 1\nJMP nowhere\n");
+            CHECK(false);
+        }
+        catch (vm::assembly_error& error) {
+            CHECK_EQ(error.line, 2);
+            CHECK_EQ(error.column, 5);
+        }
+        try {
+            vm::assemble(state, "a: LOAD_CONST 1\n  a: EXIT\n");
+            CHECK(false);
+        }
+        catch (vm::assembly_error& error) {
+            CHECK_EQ(error.line, 2);
+            CHECK_EQ(error.column, 3);
+        }
+        CHECK_THROWS_AS(vm::assemble(state, "1a: EXIT\n"), vm::assembly_error);
+        CHECK_THROWS_AS(vm::assemble(state, ": EXIT\n"), vm::assembly_error);
+        CHECK_THROWS_AS(vm::assemble(state, "JMP a b\na: EXIT\n"), vm::assembly_error);
+    }
+    SUBCASE("call_ret") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state, recursive_sum);
+        auto [result, output] = vm::run(state, code);
+        CHECK_EQ(result, 55);
+        CHECK_EQ(output, "55");
+        CHECK(state.calls.empty());
+    }
+    SUBCASE("tiers") {
+        const std::string programs[] = {
+            recursive_sum,
+            tail_countdown(500, "TAIL_CALL"),
+            tail_countdown(500, "CALL"),
+            // a subroutine called in a loop
+            "LOAD_CONST 300\nloop: DUP\nJMPZ end\nCALL dot\nLOAD_CONST -1\nADD\nJMP loop\n"
+            "end: EXIT\ndot: LOAD_CONST 46\nWRITE_CHAR\nPOP\nRET\n",
+            // failures
+            "RET\nEXIT\n",
+            "CALL f\nEXIT\nf: LOAD_CONST 1\nLOAD_CONST 0\nDIV\nRET\n",
+            "f: CALL f\n",
+            "LOAD_CONST 1\nCALL 7\nEXIT\n",
+            // returns past the end of the program
+            "JMP start\nf: RET\nstart: LOAD_CONST 1\nCALL f\n",
+        };
+        const vm::tier tiers[] = {vm::tier::top_cached, vm::tier::registers, vm::tier::native,
+                                  vm::tier::tracing};
+        for (const std::string& program : programs) {
+            vm::vm_state state = vm::create_vm();
+            auto code = vm::assemble(state, program);
+            const std::string expected = run_outcome(code);
+            CHECK_EQ(run_outcome(vm::optimize(state, code)), expected);
+            for (vm::tier execution_tier : tiers) {
+                CHECK_EQ(run_outcome(code, execution_tier), expected);
+            }
+        }
+        CHECK_EQ(run_outcome(vm::assemble(vm::create_vm(), recursive_sum)), "55|55");
+        CHECK_EQ(run_outcome(vm::assemble(vm::create_vm(), "RET\nEXIT\n")), "vm_stackfail");
+        CHECK_EQ(run_outcome(vm::assemble(vm::create_vm(), "f: CALL f\n")), "vm_stackfail");
+        CHECK_EQ(run_outcome(vm::assemble(vm::create_vm(), "JMP start\nf: RET\nstart: LOAD_CONST 1\nCALL f\n")),
+                 "vm_segfault");
+    }
+    SUBCASE("tail_call") {
+        vm::vm_state state = vm::create_vm();
+        // far deeper than the call stack
+        auto code = vm::assemble(state, tail_countdown(100000, "TAIL_CALL"));
+        auto [result, output] = vm::run(state, code);
+        CHECK_EQ(result, 1);
+        CHECK_EQ(output, "1");
+
+        state.reset();
+        code = vm::assemble(state, tail_countdown(100000, "CALL"));
+        CHECK_THROWS_AS(vm::run(state, code), vm::vm_stackfail);
+        CHECK_EQ(state.calls.size(), vm::call_stack::default_depth);
+
+        // reset leaves all calls
+        state.reset();
+        CHECK(state.calls.empty());
+    }
+    SUBCASE("depth_limit") {
+        vm::vm_state state = vm::create_vm();
+        state.calls = vm::call_stack{8};
+        // one frame for the first call, one for each step
+        auto code = vm::assemble(state, tail_countdown(7, "CALL"));
+        CHECK_EQ(std::get<1>(vm::run(state, code)), "1");
+
+        state.reset();
+        code = vm::assemble(state, tail_countdown(8, "CALL"));
+        CHECK_THROWS_AS(vm::run(state, code), vm::vm_stackfail);
+        CHECK_EQ(state.calls.max_depth(), 8);
+    }
+    SUBCASE("other_program") {
+        // the failed program leaves its call behind
+        vm::vm_state state = vm::create_vm();
+        auto failing = vm::assemble(state, "LOAD_CONST 1\nCALL f\nPOP\nPOP\nEXIT\nf: LOAD_CONST 0\nDIV\n");
+        CHECK_THROWS_AS(vm::run(state, failing), vm::div_by_zero);
+        REQUIRE_EQ(state.calls.size(), 1);
+
+        // which returns to an instruction the analysis doesn't cover
+        auto other = vm::assemble(state, "RET\nEXIT\nPOP\nPOP\nEXIT\n");
+        for (vm::tier execution_tier : {vm::tier::stack, vm::tier::top_cached, vm::tier::native}) {
+            state.pc = 0;
+            state.stack.clear();
+            state.calls.clear();
+            state.calls.push(2);
+            CHECK_THROWS_AS(vm::run(state, other, execution_tier), vm::vm_stackfail);
+        }
+    }
+    SUBCASE("run_steps") {
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state, recursive_sum);
+        vm::step_result result;
+        do {
+            result = vm::run_steps(state, code, {.fuel = 7});
+        } while (result.status == vm::run_status::suspended);
+        CHECK_EQ(result.value, 55);
+    }
+    SUBCASE("snapshot") {
+        vm::vm_state state = vm::create_vm();
+        state.calls = vm::call_stack{64};
+        auto code = vm::assemble(state, recursive_sum);
+        // stops in the middle of the recursion
+        vm::run_steps(state, code, {.fuel = 30});
+        REQUIRE(not state.calls.empty());
+
+        vm::vm_snapshot middle{state};
+        CHECK_EQ(middle.calls().size(), state.calls.size());
+        vm::vm_state forked = middle.fork();
+        CHECK_EQ(forked.calls.max_depth(), 64);
+        CHECK_EQ(vm::run_steps(forked, code, {}).value, 55);
+
+        vm::vm_state restored = vm::create_vm();
+        middle.restore(restored);
+        CHECK_EQ(vm::run_steps(restored, code, {}).value, 55);
+    }
+    SUBCASE("typed") {
+        vm::basic_vm_state<double> state = vm::create_vm<double>();
+        auto code = vm::assemble(state, "LOAD_CONST 1.5\nCALL twice\nCALL twice\nEXIT\n"
+                                        "twice: DUP\nADD\nRET\n");
+        CHECK_EQ(std::get<0>(vm::run(state, code)), 6.0);
+    }
+}
+
+
+TEST_CASE("vm_tasks") {
+    // fib(n) with both recursive calls in child tasks, writes the leaves.
+    // a task's handles count from 1, so the parent drops them and joins
+    // its children by number.
+    auto fib_program = [](int n) {
+        return "LOAD_CONST " + std::to_string(n) + "\n"
+               "CALL fib\n"
+               "EXIT\n"
+               "fib: DUP\n"
+               "JMPZ leaf\n"
+               "DUP\n"
+               "LOAD_CONST 1\n"
+               "EQ\n"
+               "JMPZ split\n"
+               "leaf: WRITE\n"
+               "RET\n"
+               "split: SPAWN 1\n"
+               "JMPZ first\n"
+               "SPAWN 1\n"
+               "JMPZ second\n"
+               "POP\n"
+               "LOAD_CONST 1\n"
+               "JOIN\n"
+               "LOAD_CONST 2\n"
+               "JOIN\n"
+               "ADD\n"
+               "RET\n"
+               "first: LOAD_CONST -1\n"
+               "ADD\n"
+               "CALL fib\n"
+               "EXIT\n"
+               "second: LOAD_CONST -2\n"
+               "ADD\n"
+               "CALL fib\n"
+               "EXIT\n";
+    };
+    std::function<std::string(int)> fib_leaves = [&](int n) {
+        return n < 2 ? std::to_string(n) : fib_leaves(n - 1) + fib_leaves(n - 2);
+    };
+
+    SUBCASE("spawn_join") {
+        vm::work_pool pool{4};
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state, "WRITE_CHAR_IMM 97\n"
+                                        "LOAD_CONST 40\n"
+                                        "LOAD_CONST 2\n"
+                                        "SPAWN 2\n"
+                                        "DUP\n"
+                                        "JMPZ child\n"
+                                        "WRITE_CHAR_IMM 99\n"
+                                        "JOIN\n"
+                                        "WRITE_CHAR_IMM 100\n"
+                                        "EXIT\n"
+                                        "child: POP\n"
+                                        "ADD\n"
+                                        "WRITE_CHAR_IMM 98\n"
+                                        "EXIT\n");
+        auto [result, output] = vm::run_parallel(pool, state, code);
+        CHECK_EQ(result, 42);
+        // the child's output comes at the JOIN
+        CHECK_EQ(output, "acbd");
+        // the parent still has the items the child got copies of
+        CHECK_EQ(state.stack.size(), 3);
+        CHECK(state.tasks == nullptr);
+    }
+    SUBCASE("divide_and_conquer") {
+        const std::string program = fib_program(15);
+        const std::string leaves = fib_leaves(15);
+        for (size_t threads : {1, 2, 4, 8}) {
+            vm::work_pool pool{threads};
+            // the pool can run several programs after each other
+            for (int repeat = 0; repeat < 3; repeat++) {
+                vm::vm_state state = vm::create_vm();
+                auto code = vm::assemble(state, program);
+                auto [result, output] = vm::run_parallel(pool, state, code);
+                CHECK_EQ(result, 610);
+                CHECK_EQ(output, leaves);
+            }
+        }
+
+        vm::vm_state state = vm::create_vm();
+        auto optimized = vm::optimize(state, vm::assemble(state, program));
+        auto [result, output] = vm::run_parallel(state, optimized, 3);
+        CHECK_EQ(result, 610);
+        CHECK_EQ(output, leaves);
+    }
+    SUBCASE("chain") {
+        // each task joins the one it spawned, the waits nest 1000 deep
+        vm::work_pool pool{4};
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state, "LOAD_CONST 1000\n"
+                                        "chain: DUP\n"
+                                        "JMPZ end\n"
+                                        "LOAD_CONST -1\n"
+                                        "ADD\n"
+                                        "SPAWN 1\n"
+                                        "DUP\n"
+                                        "JMPZ child\n"
+                                        "JOIN\n"
+                                        "LOAD_CONST 1\n"
+                                        "ADD\n"
+                                        "end: EXIT\n"
+                                        "child: POP\n"
+                                        "JMP chain\n");
+        for (int repeat = 0; repeat < 5; repeat++) {
+            state.reset();
+            auto [result, output] = vm::run_parallel(pool, state, code);
+            CHECK_EQ(result, 1000);
+        }
+    }
+    SUBCASE("reused_vms") {
+        // one worker runs both children on the same vm, the second one
+        // must not see the memory, calls or output the first one left
+        vm::work_pool pool{1};
+        vm::vm_state state = vm::create_vm();
+        state.calls = vm::call_stack{1};
+        auto code = vm::assemble(state, "SPAWN 0\n"
+                                        "DUP\n"
+                                        "JMPZ child\n"
+                                        "JOIN\n"
+                                        "SPAWN 0\n"
+                                        "DUP\n"
+                                        "JMPZ child\n"
+                                        "JOIN\n"
+                                        "ADD\n"
+                                        "EXIT\n"
+                                        "child: CALL grow\n"
+                                        "EXIT\n"
+                                        "grow: LOAD_CONST 1\n"
+                                        "MEMGROW\n"
+                                        "WRITE\n"
+                                        "EXIT\n");
+        for (int repeat = 0; repeat < 3; repeat++) {
+            state.reset();
+            auto [result, output] = vm::run_parallel(pool, state, code);
+            CHECK_EQ(result, 0);
+            CHECK_EQ(output, "00");
+        }
+    }
+    SUBCASE("not_joined") {
+        vm::work_pool pool{4};
+        vm::vm_state state = vm::create_vm();
+        // the children write and fail, but are never joined
+        auto code = vm::assemble(state, "LOAD_CONST 0\n"
+                                        "SPAWN 1\n"
+                                        "JMPZ child\n"
+                                        "SPAWN 0\n"
+                                        "JMPZ child\n"
+                                        "WRITE_IMM 7\n"
+                                        "LOAD_CONST 1\n"
+                                        "EXIT\n"
+                                        "child: WRITE_IMM 5\n"
+                                        "LOAD_CONST 0\n"
+                                        "DIV\n"
+                                        "EXIT\n");
+        for (int repeat = 0; repeat < 10; repeat++) {
+            state.reset();
+            auto [result, output] = vm::run_parallel(pool, state, code);
+            CHECK_EQ(result, 1);
+            CHECK_EQ(output, "7");
+        }
+    }
+    SUBCASE("errors") {
+        vm::work_pool pool{4};
+        vm::vm_state state = vm::create_vm();
+
+        // the child's exception is thrown by JOIN, after its output
+        auto code = vm::assemble(state, "LOAD_CONST 3\n"
+                                        "SPAWN 1\n"
+                                        "DUP\n"
+                                        "JMPZ child\n"
+                                        "JOIN\n"
+                                        "WRITE_IMM 9\n"
+                                        "EXIT\n"
+                                        "child: POP\n"
+                                        "WRITE\n"
+                                        "LOAD_CONST 0\n"
+                                        "DIV\n"
+                                        "EXIT\n");
+        CHECK_THROWS_AS(vm::run_parallel(pool, state, code), vm::div_by_zero);
+        CHECK_EQ(state.output->view(), "3");
+        CHECK_EQ(state.pc, 5);
+
+        // the child has no memory and no calls of the parent
+        state.reset();
+        code = vm::assemble(state, "LOAD_CONST 1\nMEMGROW\nSPAWN 0\nDUP\nJMPZ child\nJOIN\nEXIT\n"
+                                   "child: LOAD_CONST 0\nLOAD\nEXIT\n");
+        CHECK_THROWS_AS(vm::run_parallel(pool, state, code), vm::vm_segfault);
+        state.reset();
+        code = vm::assemble(state, "CALL f\nEXIT\nf: SPAWN 0\nDUP\nJMPZ child\nJOIN\nRET\nchild: RET\n");
+        CHECK_THROWS_AS(vm::run_parallel(pool, state, code), vm::vm_stackfail);
+
+        // unknown and joined handles
+        const char* bad_joins[] = {
+            "LOAD_CONST 1\nJOIN\nEXIT\n",
+            "SPAWN 0\nDUP\nJMPZ child\nLOAD_CONST 0\nJOIN\nEXIT\nchild: EXIT\n",
+            "SPAWN 0\nDUP\nJMPZ child\nJOIN\nLOAD_CONST 1\nJOIN\nEXIT\nchild: EXIT\n",
+        };
+        for (const char* program : bad_joins) {
+            state.reset();
+            CHECK_THROWS_AS(vm::run_parallel(pool, state, vm::assemble(state, program)), vm::vm_segfault);
+        }
+        state.reset();
+        CHECK_THROWS_AS(vm::run_parallel(pool, state, vm::assemble(state, "JOIN\n")), vm::vm_stackfail);
+        state.reset();
+        CHECK_THROWS_AS(vm::run_parallel(pool, state, vm::assemble(state, "LOAD_CONST 1\nSPAWN 2\nEXIT\n")),
+                        vm::vm_stackfail);
+        state.reset();
+        CHECK_THROWS_AS(vm::run_parallel(pool, state, vm::assemble(state, "LOAD_CONST 1\nSPAWN -1\nEXIT\n")),
+                        vm::vm_stackfail);
+    }
+    SUBCASE("tiers") {
+        // tasks need run_parallel, all tiers fail the same without it
+        vm::vm_state state = vm::create_vm();
+        auto code = vm::assemble(state, fib_program(5));
+        const vm::tier tiers[] = {vm::tier::stack, vm::tier::top_cached, vm::tier::registers,
+                                  vm::tier::native, vm::tier::tracing};
+        for (vm::tier execution_tier : tiers) {
+            state.reset();
+            CHECK_THROWS_AS(vm::run(state, code, execution_tier), vm::invalid_instruction);
+        }
+        state.reset();
+        CHECK_THROWS_AS(vm::run_static<vm::builtin_set>(state, code), vm::invalid_instruction);
+
+        vm::basic_vm_state<double> typed = vm::create_vm<double>();
+        CHECK_THROWS_AS(vm::run(typed, vm::assemble(typed, "SPAWN 0\nEXIT\n")), vm::invalid_instruction);
+    }
+}
+
+
+TEST_CASE("vm_assemble_stream") {
+    const std::string program = "  LOAD_CONST 10\r\n"
+                                "loop: DUP\n"
+                                "JMPZ end\n"
+                                "\n"
+                                "\tLOAD_CONST -1\n"
+                                "ADD\n"
+                                "JMP loop\n"
+                                "end:\n"
+                                "WRITE\n"
+                                "EXIT";
+
+    SUBCASE("chunks") {
+        vm::vm_state state = vm::create_vm();
+        auto expected = vm::assemble(state, program);
+        REQUIRE_EQ(expected.size(), 8);
+
+        // every way to split the text, with lines straddling the chunks
+        for (size_t chunk_size = 1; chunk_size <= program.size(); chunk_size++) {
+            vm::program_assembler assembler{state};
+            for (size_t pos = 0; pos < program.size(); pos += chunk_size) {
+                assembler.feed(std::string_view{program}.substr(pos, chunk_size));
+            }
+            auto code = assembler.finish();
+            CHECK(std::equal(code.begin(), code.end(), expected.begin(), expected.end()));
+            CHECK(code.get_analysis() != nullptr);
+            CHECK_EQ(std::get<1>(vm::run(state, code)), "0");
+            state.reset();
+
+            // the assembler starts over after finishing
+            CHECK_EQ(assembler.size(), 0);
+            assembler.feed("LOAD_CONST 3\nEXIT");
+            CHECK_EQ(assembler.finish().size(), 2);
+        }
+    }
+    SUBCASE("stream") {
+        vm::vm_state state = vm::create_vm();
+        auto expected = vm::assemble(state, program);
+        for (size_t chunk_size : {1, 3, 4096}) {
+            std::istringstream input{program};
+            auto code = vm::assemble(state, input, chunk_size);
+            CHECK(std::equal(code.begin(), code.end(), expected.begin(), expected.end()));
+        }
+
+        std::istringstream empty;
+        CHECK(vm::assemble(state, empty).empty());
+
+        // a large program, in chunks much smaller than it
+        std::string large;
+        for (int i = 0; i < 20000; i++) {
+            large += "LOAD_CONST " + std::to_string(i) + "\nPOP\n";
+        }
+        large += "LOAD_CONST 7\nEXIT\n";
+        std::istringstream input{large};
+        auto code = vm::assemble(state, input, 100);
+        REQUIRE_EQ(code.size(), 40002);
+        CHECK_EQ(code[39998].second, 19999);
+        CHECK_EQ(std::get<0>(vm::run(state, code)), 7);
+
+        // analyzed like an assembled string, so it can be compiled
+        std::istringstream streamed{program};
+        code = vm::assemble(state, streamed);
+        REQUIRE(code.get_analysis() != nullptr);
+        CHECK(code.get_analysis()->verified);
+#if defined(__x86_64__) and defined(__unix__)
+        CHECK(vm::jit_program{state, code}.is_native());
+#endif
+        state.reset();
+        CHECK_EQ(std::get<1>(vm::run(state, code, vm::tier::native)), "0");
+
+        std::istringstream unanalyzed{program};
+        CHECK(vm::assemble(state, unanalyzed, 64 * 1024, false).get_analysis() == nullptr);
+    }
+    SUBCASE("errors") {
+        vm::vm_state state = vm::create_vm();
+        // the error is located in the whole line, also if it straddles chunks
+        const std::string invalid = "LOAD_CONST 1\nEXIT\n   LOAD_CONST 12x\nEXIT\n";
+        for (size_t chunk_size = 1; chunk_size <= invalid.size(); chunk_size++) {
+            std::istringstream input{invalid};
+            try {
+                vm::assemble(state, input, chunk_size);
+                CHECK(false);
+            }
+            catch (vm::assembly_error& error) {
+                CHECK_EQ(error.line, 3);
+                CHECK_EQ(error.column, 15);
+            }
+        }
+
+        std::istringstream unknown_label{"JMP nowhere\nEXIT"};
+        CHECK_THROWS_AS(vm::assemble(state, unknown_label, 2), vm::assembly_error);
+    }
+#if defined(__unix__)
+    SUBCASE("fd") {
+        vm::vm_state state = vm::create_vm();
+        std::string path = (std::filesystem::temp_directory_path() / "test04_stream.asm").string();
+        {
+            std::ofstream out{path, std::ios::binary};
+            out << program;
+        }
+        int fd = ::open(path.c_str(), O_RDONLY);
+        REQUIRE(fd >= 0);
+        auto code = vm::assemble_fd(state, fd, 5);
+        ::close(fd);
+        std::filesystem::remove(path);
+
+        auto expected = vm::assemble(state, program);
+        CHECK(std::equal(code.begin(), code.end(), expected.begin(), expected.end()));
+        CHECK(code.get_analysis() != nullptr);
+
+        CHECK_THROWS_AS(vm::assemble_fd(state, -1), std::system_error);
+    }
+#endif
+#if defined(__GLIBC__) and not defined(__SANITIZE_ADDRESS__) and not defined(__SANITIZE_THREAD__)
+    SUBCASE("peak_memory") {
+        // glibc grows large buffers with mremap, sanitizers copy them
+
+        // the text is generated line by line, so only the code is in memory
+        struct generated_program : std::streambuf {
+            int lines = 0;
+            int line = 0;
+            std::string text;
+
+            int_type underflow() override {
+                if (this->line == this->lines) {
+                    return traits_type::eof();
+                }
+                this->text = "LOAD_CONST " + std::to_string(this->line++) + "\nPOP\n";
+                this->setg(this->text.data(), this->text.data(), this->text.data() + this->text.size());
+                return traits_type::to_int_type(this->text.front());
+            }
+        };
+        auto peak_kib = [] {
+            std::ifstream status{"/proc/self/status"};
+            std::string line;
+            while (std::getline(status, line)) {
+                if (line.starts_with("VmHWM:")) {
+                    return std::stol(line.substr(6));
+                }
+            }
+            return 0L;
+        };
+
+        // start measuring the peak from here
+        std::ofstream{"/proc/self/clear_refs"} << "5";
+        const long before = peak_kib();
+        REQUIRE(before > 0);
+
+        vm::vm_state state = vm::create_vm();
+        generated_program text;
+        text.lines = 1 << 20;
+        std::istream input{&text};
+        auto code = vm::assemble(state, input, 64 * 1024, false);
+        REQUIRE_EQ(code.size(), 2 << 20);
+        CHECK(code.get_analysis() == nullptr);
+
+        const long code_kib = static_cast<long>(code.size() * sizeof(vm::op_t) / 1024);
+        CHECK(peak_kib() - before < code_kib * 5 / 4);
+    }
+#endif
+}